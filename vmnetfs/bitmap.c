@@ -228,6 +228,17 @@ void _vmnetfs_bit_set(struct bitmap *map, uint64_t bit)
     }
 }
 
+/* Clearing is not reported to stream readers, which only learn about
+   bits being set. */
+void _vmnetfs_bit_clear(struct bitmap *map, uint64_t bit)
+{
+    g_mutex_lock(map->mgrp->lock);
+    if (bit < map->mgrp->nbits) {
+        map->bits[bit / 8] &= ~(1 << (bit % 8));
+    }
+    g_mutex_unlock(map->mgrp->lock);
+}
+
 /* Testing an out-of-range bit returns true to simplify resize races */
 bool _vmnetfs_bit_test(struct bitmap *map, uint64_t bit)
 {
@@ -0,0 +1,846 @@
+/*
+ * vmnetfs - virtual machine network execution virtual filesystem
+ *
+ * Copyright (C) 2006-2014 Carnegie Mellon University
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of version 2 of the GNU General Public License as published
+ * by the Free Software Foundation.  A copy of the GNU General Public License
+ * should have been distributed along with this program in the file
+ * COPYING.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ */
+
+/* Cache management.
+
+   Every pristine cache directory contains an "access" file recording, for
+   each chunk, the last time it was used and the number of vmnetfs
+   sessions that have used it.  While an image is open, vmnetfs holds a
+   shared flock() on the access file, which prevents other processes from
+   evicting chunks from it.
+
+   If a cache budget is configured, a background thread periodically
+   measures the total size of all pristine caches under the cache root,
+   plus the content store, and evicts chunks until the total is back
+   under the budget.  Eviction is segmented LRU: chunks used in only one
+   session are evicted, oldest first, before chunks used in several.
+   Caches locked by other processes are skipped entirely.  In our own
+   caches, chunks accessed during this session by any image using the
+   cache are kept, and other chunks are only evicted if their chunk lock
+   is free in every such image, so reads never wait for the evictor.
+   Chunks fetched by the background fill are recorded as used now, but
+   not as used in this session, so they are evicted after older chunks
+   and before chunks the guest has used.
+
+   The caches of the cache proxy count against the budget too.  Each
+   pass first has the proxy drop the resources it isn't serving, so that
+   their caches are no longer locked. */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+#include "vmnetfs-private.h"
+
+#define ACCESS_FILE "access"
+#define SCAN_INTERVAL 600  /* seconds */
+#define MAX_DEPTH 4
+/* After eviction, the cache is reduced to this fraction of the budget */
+#define LOW_WATER_NUM 9
+#define LOW_WATER_DENOM 10
+/* Caches of other processes are locked for at most this many evictions
+   at a time, so a vmnetfs starting on one doesn't wait for the whole
+   pass */
+#define EVICT_BATCH 64
+
+struct cache_manager {
+    struct vmnetfs *fs;
+    GThread *thread;
+    GMutex *lock;
+    GCond *cond;
+    uint64_t usage;  /* estimated */
+    uint64_t wake_at;
+    bool wake;
+    bool stop;
+};
+
+struct access_record {
+    uint32_t last;  /* seconds since the epoch, little-endian */
+    uint32_t sessions;  /* little-endian */
+};
+
+struct cache_dir {
+    char *path;
+    GSList *imgs;  /* our images using the cache */
+    bool busy;  /* used by another process */
+    int lock_fd;  /* during an eviction batch */
+};
+
+struct candidate {
+    struct cache_dir *dir;
+    uint64_t dir_num;
+    uint64_t chunk;
+    uint64_t bytes;
+    uint32_t last;
+    bool frequent;
+    bool compressed;
+};
+
+struct scan {
+    struct cache_manager *cm;
+    GSList *imgs;  /* held for the pass */
+    GPtrArray *dirs;
+    GArray *candidates;
+    uint64_t usage;
+};
+
+static uint64_t pristine_chunks(struct vmnetfs_image *img)
+{
+    return (img->initial_size + img->chunk_size - 1) / img->chunk_size;
+}
+
+static char *get_access_file(const char *dir)
+{
+    return g_strdup_printf("%s/%s", dir, ACCESS_FILE);
+}
+
+static bool is_numeric(const char *name)
+{
+    char *endptr;
+
+    g_ascii_strtoull(name, &endptr, 10);
+    return *name != 0 && *endptr == 0;
+}
+
+/* Chunk files are named by chunk number, with a suffix if compressed. */
+static bool is_chunk_file(const char *name, bool *compressed)
+{
+    char *endptr;
+
+    g_ascii_strtoull(name, &endptr, 10);
+    if (endptr == name) {
+        return false;
+    }
+    *compressed = !strcmp(endptr, VMNETFS_COMPRESSED_SUFFIX);
+    return *endptr == 0 || *compressed;
+}
+
+/* Record the chunks first accessed since the last call.  Each chunk is
+   counted once per session.  Chunks filled since the last call only have
+   their time updated. */
+static void flush_access(struct vmnetfs_image *img)
+{
+    struct access_record *records;
+    uint64_t chunks = pristine_chunks(img);
+    uint64_t chunk;
+    uint32_t now = time(NULL);
+    ssize_t count;
+    bool dirty = false;
+    GError *err = NULL;
+
+    g_mutex_lock(img->access_lock);
+    records = g_new0(struct access_record, chunks);
+    /* A short or failed read leaves the remaining records zeroed */
+    count = pread(img->access_fd, records, chunks * sizeof(*records), 0);
+    if (count == -1) {
+        g_warning("Couldn't read access records for %s: %s",
+                img->read_base, strerror(errno));
+    }
+    for (chunk = 0; chunk < chunks; chunk++) {
+        if (img->access_recorded[chunk / 8] & (1 << (chunk % 8))) {
+            continue;
+        }
+        if (!_vmnetfs_bit_test(img->accessed_map, chunk)) {
+            if (img->access_filled[chunk / 8] & (1 << (chunk % 8))) {
+                img->access_filled[chunk / 8] &= ~(1 << (chunk % 8));
+                records[chunk].last = GUINT32_TO_LE(now);
+                dirty = true;
+            }
+            continue;
+        }
+        img->access_recorded[chunk / 8] |= 1 << (chunk % 8);
+        records[chunk].last = GUINT32_TO_LE(now);
+        records[chunk].sessions = GUINT32_TO_LE(
+                GUINT32_FROM_LE(records[chunk].sessions) + 1);
+        dirty = true;
+    }
+    if (dirty && !_vmnetfs_safe_pwrite(ACCESS_FILE, img->access_fd,
+            records, chunks * sizeof(*records), 0, &err)) {
+        g_warning("%s", err->message);
+        g_clear_error(&err);
+    }
+    g_free(records);
+    g_mutex_unlock(img->access_lock);
+}
+
+/* Take a shared lock on the pristine cache, blocking until any eviction
+   pass in another process has finished with it.  Must be called before
+   the cache directory is scanned. */
+bool _vmnetfs_cache_open_image(struct vmnetfs_image *img, GError **err)
+{
+    struct stat st;
+    char *path;
+
+    if (g_mkdir_with_parents(img->read_base, 0700)) {
+        g_set_error(err, G_FILE_ERROR, g_file_error_from_errno(errno),
+                "Couldn't create %s: %s", img->read_base, strerror(errno));
+        return false;
+    }
+    path = get_access_file(img->read_base);
+    img->access_fd = open(path, O_RDWR | O_CREAT, 0600);
+    if (img->access_fd == -1) {
+        g_set_error(err, G_FILE_ERROR, g_file_error_from_errno(errno),
+                "Couldn't open %s: %s", path, strerror(errno));
+        g_free(path);
+        return false;
+    }
+    while (flock(img->access_fd, LOCK_SH)) {
+        if (errno != EINTR) {
+            g_set_error(err, G_FILE_ERROR, g_file_error_from_errno(errno),
+                    "Couldn't lock %s: %s", path, strerror(errno));
+            close(img->access_fd);
+            g_free(path);
+            return false;
+        }
+    }
+    g_free(path);
+    if (fstat(img->access_fd, &st) == 0) {
+        img->access_dev = st.st_dev;
+        img->access_ino = st.st_ino;
+    }
+    img->access_recorded = g_malloc0((pristine_chunks(img) + 7) / 8);
+    img->access_filled = g_malloc0((pristine_chunks(img) + 7) / 8);
+    img->access_lock = g_mutex_new();
+    return true;
+}
+
+/* Must be called before the accessed map is freed. */
+void _vmnetfs_cache_close_image(struct vmnetfs_image *img)
+{
+    if (img->accessed_map != NULL) {
+        flush_access(img);
+    }
+    g_mutex_free(img->access_lock);
+    g_free(img->access_recorded);
+    g_free(img->access_filled);
+    close(img->access_fd);
+}
+
+struct used_chunk {
+    uint64_t chunk;
+    uint32_t sessions;
+};
+
+static int compare_used_chunks(const void *a, const void *b)
+{
+    const struct used_chunk *ua = a;
+    const struct used_chunk *ub = b;
+
+    if (ua->sessions != ub->sessions) {
+        return ua->sessions > ub->sessions ? -1 : 1;
+    }
+    return ua->chunk < ub->chunk ? -1 : ua->chunk > ub->chunk;
+}
+
+/* Return a GArray of the chunk numbers that earlier sessions used, those
+   used in the most sessions first.  The array is empty if the access
+   records can't be read. */
+GArray *_vmnetfs_cache_get_used_chunks(struct vmnetfs_image *img)
+{
+    struct access_record *records;
+    struct used_chunk used;
+    GArray *candidates;
+    GArray *chunks;
+    uint64_t count = pristine_chunks(img);
+    uint64_t chunk;
+    ssize_t ret;
+
+    chunks = g_array_new(FALSE, FALSE, sizeof(uint64_t));
+    candidates = g_array_new(FALSE, FALSE, sizeof(struct used_chunk));
+    records = g_new0(struct access_record, count);
+    g_mutex_lock(img->access_lock);
+    ret = pread(img->access_fd, records, count * sizeof(*records), 0);
+    g_mutex_unlock(img->access_lock);
+    if (ret == -1) {
+        g_warning("Couldn't read access records for %s: %s",
+                img->read_base, strerror(errno));
+    }
+    for (chunk = 0; chunk < count; chunk++) {
+        used.chunk = chunk;
+        used.sessions = GUINT32_FROM_LE(records[chunk].sessions);
+        if (used.sessions > 0) {
+            g_array_append_val(candidates, used);
+        }
+    }
+    g_array_sort(candidates, compare_used_chunks);
+    for (chunk = 0; chunk < candidates->len; chunk++) {
+        g_array_append_val(chunks, g_array_index(candidates,
+                struct used_chunk, chunk).chunk);
+    }
+    g_array_free(candidates, TRUE);
+    g_free(records);
+    return chunks;
+}
+
+static void unlock_dir(struct cache_dir *dir)
+{
+    if (dir->lock_fd != -1) {
+        flock(dir->lock_fd, LOCK_UN);
+        close(dir->lock_fd);
+        dir->lock_fd = -1;
+    }
+}
+
+static void free_dir(void *data)
+{
+    struct cache_dir *dir = data;
+
+    unlock_dir(dir);
+    g_slist_free(dir->imgs);
+    g_free(dir->path);
+    g_slice_free(struct cache_dir, dir);
+}
+
+static void find_own_images(struct scan *scan, struct cache_dir *dir)
+{
+    struct vmnetfs_image *img;
+    struct stat st;
+    GSList *cur;
+    char *path;
+
+    path = get_access_file(dir->path);
+    if (stat(path, &st) == 0) {
+        for (cur = scan->imgs; cur != NULL; cur = cur->next) {
+            img = cur->data;
+            if (st.st_dev == img->access_dev &&
+                    st.st_ino == img->access_ino) {
+                dir->imgs = g_slist_prepend(dir->imgs, img);
+            }
+        }
+    }
+    g_free(path);
+}
+
+/* Returns false if the cache is locked by another process. */
+static bool try_lock_dir(struct cache_dir *dir, bool hold)
+{
+    char *path;
+    int fd;
+
+    path = get_access_file(dir->path);
+    fd = open(path, O_RDWR | O_CREAT, 0600);
+    g_free(path);
+    if (fd == -1) {
+        return false;
+    }
+    if (flock(fd, LOCK_EX | LOCK_NB)) {
+        close(fd);
+        return false;
+    }
+    if (hold) {
+        dir->lock_fd = fd;
+    } else {
+        flock(fd, LOCK_UN);
+        close(fd);
+    }
+    return true;
+}
+
+static void scan_chunk_dir(struct scan *scan, struct cache_dir *dir,
+        uint64_t dir_num, const struct access_record *records,
+        uint64_t nrecords)
+{
+    struct candidate cand;
+    struct stat st;
+    GDir *gdir;
+    const char *name;
+    char *path;
+    char *file;
+    uint64_t bytes;
+    bool compressed;
+
+    path = g_strdup_printf("%s/%"G_GUINT64_FORMAT, dir->path, dir_num);
+    gdir = g_dir_open(path, 0, NULL);
+    if (gdir == NULL) {
+        g_free(path);
+        return;
+    }
+    while ((name = g_dir_read_name(gdir)) != NULL) {
+        if (!is_chunk_file(name, &compressed)) {
+            continue;
+        }
+        file = g_strdup_printf("%s/%s", path, name);
+        if (lstat(file, &st) || !S_ISREG(st.st_mode)) {
+            g_free(file);
+            continue;
+        }
+        g_free(file);
+        bytes = (uint64_t) st.st_blocks * 512;
+        if (st.st_nlink > 1 && scan->cm->fs->cache_store != NULL) {
+            /* Accounted to the content store.  Evicting it only frees
+               space if this is the last image using the store entry. */
+            if (st.st_nlink > 2) {
+                continue;
+            }
+        } else {
+            scan->usage += bytes;
+        }
+        if (dir->busy || bytes == 0) {
+            continue;
+        }
+        cand.dir = dir;
+        cand.dir_num = dir_num;
+        cand.chunk = g_ascii_strtoull(name, NULL, 10);
+        cand.bytes = bytes;
+        cand.compressed = compressed;
+        if (cand.chunk < nrecords) {
+            cand.last = GUINT32_FROM_LE(records[cand.chunk].last);
+            cand.frequent = GUINT32_FROM_LE(records[cand.chunk].sessions)
+                    > 1;
+        } else {
+            cand.last = 0;
+            cand.frequent = false;
+        }
+        g_array_append_val(scan->candidates, cand);
+    }
+    g_dir_close(gdir);
+    g_free(path);
+}
+
+static void scan_cache_dir(struct scan *scan, const char *path)
+{
+    struct cache_dir *dir;
+    GSList *cur;
+    GDir *gdir;
+    const char *name;
+    char *access;
+    gchar *records = NULL;
+    gsize len = 0;
+
+    dir = g_slice_new0(struct cache_dir);
+    dir->path = g_strdup(path);
+    dir->lock_fd = -1;
+    g_ptr_array_add(scan->dirs, dir);
+    find_own_images(scan, dir);
+    if (dir->imgs != NULL) {
+        for (cur = dir->imgs; cur != NULL; cur = cur->next) {
+            flush_access(cur->data);
+        }
+    } else {
+        dir->busy = !try_lock_dir(dir, false);
+    }
+
+    access = get_access_file(path);
+    g_file_get_contents(access, &records, &len, NULL);
+    g_free(access);
+
+    gdir = g_dir_open(path, 0, NULL);
+    if (gdir != NULL) {
+        while ((name = g_dir_read_name(gdir)) != NULL) {
+            if (is_numeric(name)) {
+                scan_chunk_dir(scan, dir, g_ascii_strtoull(name, NULL, 10),
+                        (struct access_record *) records,
+                        len / sizeof(struct access_record));
+            }
+        }
+        g_dir_close(gdir);
+    }
+    g_free(records);
+}
+
+/* A pristine cache contains an access file or, if it predates them,
+   numbered directories of numbered chunk files. */
+static bool is_cache_dir(const char *path)
+{
+    GDir *gdir;
+    GDir *subgdir;
+    const char *name;
+    const char *subname;
+    char *file;
+    char *subdir;
+    bool compressed;
+    bool ret = false;
+
+    file = get_access_file(path);
+    ret = g_file_test(file, G_FILE_TEST_IS_REGULAR);
+    g_free(file);
+    if (ret) {
+        return true;
+    }
+
+    gdir = g_dir_open(path, 0, NULL);
+    if (gdir == NULL) {
+        return false;
+    }
+    while (!ret && (name = g_dir_read_name(gdir)) != NULL) {
+        if (!is_numeric(name)) {
+            continue;
+        }
+        subdir = g_strdup_printf("%s/%s", path, name);
+        subgdir = g_dir_open(subdir, 0, NULL);
+        if (subgdir != NULL) {
+            while ((subname = g_dir_read_name(subgdir)) != NULL) {
+                if (is_chunk_file(subname, &compressed)) {
+                    file = g_strdup_printf("%s/%s", subdir, subname);
+                    ret = g_file_test(file, G_FILE_TEST_IS_REGULAR);
+                    g_free(file);
+                    break;
+                }
+            }
+            g_dir_close(subgdir);
+        }
+        g_free(subdir);
+    }
+    g_dir_close(gdir);
+    return ret;
+}
+
+static bool path_is_within(const char *path, const char *dir)
+{
+    size_t len = strlen(dir);
+
+    return !strncmp(path, dir, len) && (path[len] == 0 || path[len] == '/');
+}
+
+static void find_caches(struct scan *scan, const char *path, int depth)
+{
+    GDir *gdir;
+    const char *name;
+    char *subdir;
+
+    if (is_cache_dir(path)) {
+        scan_cache_dir(scan, path);
+        return;
+    }
+    if (depth >= MAX_DEPTH) {
+        return;
+    }
+    gdir = g_dir_open(path, 0, NULL);
+    if (gdir == NULL) {
+        return;
+    }
+    while ((name = g_dir_read_name(gdir)) != NULL) {
+        subdir = g_strdup_printf("%s/%s", path, name);
+        if (g_file_test(subdir, G_FILE_TEST_IS_DIR) &&
+                !g_file_test(subdir, G_FILE_TEST_IS_SYMLINK)) {
+            find_caches(scan, subdir, depth + 1);
+        }
+        g_free(subdir);
+    }
+    g_dir_close(gdir);
+}
+
+/* Deletes store entries no longer referenced by any cache, and returns
+   the size of the rest. */
+static uint64_t scan_store(struct cache_manager *cm)
+{
+    struct stat st;
+    GDir *gdir;
+    GDir *subgdir;
+    const char *name;
+    const char *subname;
+    char *subdir;
+    char *file;
+    uint64_t usage = 0;
+
+    if (cm->fs->cache_store == NULL) {
+        return 0;
+    }
+    gdir = g_dir_open(cm->fs->cache_store, 0, NULL);
+    if (gdir == NULL) {
+        return 0;
+    }
+    while ((name = g_dir_read_name(gdir)) != NULL) {
+        subdir = g_strdup_printf("%s/%s", cm->fs->cache_store, name);
+        subgdir = g_dir_open(subdir, 0, NULL);
+        if (subgdir != NULL) {
+            while ((subname = g_dir_read_name(subgdir)) != NULL) {
+                file = g_strdup_printf("%s/%s", subdir, subname);
+                if (lstat(file, &st) == 0 && S_ISREG(st.st_mode)) {
+                    if (st.st_nlink == 1) {
+                        unlink(file);
+                    } else {
+                        usage += (uint64_t) st.st_blocks * 512;
+                    }
+                }
+                g_free(file);
+            }
+            g_dir_close(subgdir);
+        }
+        g_free(subdir);
+    }
+    g_dir_close(gdir);
+    return usage;
+}
+
+static int compare_candidates(const void *a, const void *b)
+{
+    const struct candidate *ca = a;
+    const struct candidate *cb = b;
+
+    if (ca->frequent != cb->frequent) {
+        return ca->frequent ? 1 : -1;
+    }
+    if (ca->last != cb->last) {
+        return ca->last < cb->last ? -1 : 1;
+    }
+    return 0;
+}
+
+static bool evict_candidate(struct candidate *cand)
+{
+    struct cache_dir *dir = cand->dir;
+    char *file;
+    bool ret;
+
+    if (dir->imgs != NULL) {
+        return _vmnetfs_io_evict_chunk(dir->imgs, cand->chunk);
+    }
+    /* Another process may have opened the cache since we scanned it */
+    if (dir->busy || (dir->lock_fd == -1 && !try_lock_dir(dir, true))) {
+        dir->busy = true;
+        return false;
+    }
+    file = g_strdup_printf("%s/%"G_GUINT64_FORMAT"/%"G_GUINT64_FORMAT"%s",
+            dir->path, cand->dir_num, cand->chunk,
+            cand->compressed ? VMNETFS_COMPRESSED_SUFFIX : "");
+    ret = unlink(file) == 0;
+    g_free(file);
+    return ret;
+}
+
+static void run_pass(struct cache_manager *cm)
+{
+    struct vmnetfs *fs = cm->fs;
+    struct scan scan = {
+        .cm = cm,
+    };
+    struct candidate *cand;
+    uint64_t low_water;
+    uint64_t freed = 0;
+    uint64_t usage;
+    guint i;
+    guint j;
+
+    _vmnetfs_proxy_prune(fs);
+    /* Keep images from being destroyed during the pass, without blocking
+       attach, detach, or statfs */
+    scan.imgs = _vmnetfs_images_hold(fs);
+    scan.dirs = g_ptr_array_new();
+    scan.candidates = g_array_new(FALSE, FALSE, sizeof(struct candidate));
+    find_caches(&scan, fs->cache_root, 0);
+    if (fs->proxy_path != NULL && !path_is_within(fs->proxy_path,
+            fs->cache_root)) {
+        find_caches(&scan, fs->proxy_path, 0);
+    }
+    scan.usage += scan_store(cm);
+
+    low_water = fs->cache_limit / LOW_WATER_DENOM * LOW_WATER_NUM;
+    if (scan.usage > fs->cache_limit) {
+        g_array_sort(scan.candidates, compare_candidates);
+        for (i = 0; i < scan.candidates->len &&
+                scan.usage - freed > low_water; i++) {
+            g_mutex_lock(cm->lock);
+            if (cm->stop) {
+                g_mutex_unlock(cm->lock);
+                break;
+            }
+            g_mutex_unlock(cm->lock);
+            if (i % EVICT_BATCH == 0) {
+                for (j = 0; j < scan.dirs->len; j++) {
+                    unlock_dir(g_ptr_array_index(scan.dirs, j));
+                }
+            }
+            cand = &g_array_index(scan.candidates, struct candidate, i);
+            if (evict_candidate(cand)) {
+                freed += cand->bytes;
+                _vmnetfs_u64_stat_increment(fs->cache_evictions, 1);
+                _vmnetfs_u64_stat_increment(fs->cache_bytes_evicted,
+                        cand->bytes);
+            }
+        }
+        if (freed > 0) {
+            /* Release store entries orphaned by the evictions */
+            scan_store(cm);
+        }
+    }
+    usage = scan.usage - freed;
+
+    for (i = 0; i < scan.dirs->len; i++) {
+        free_dir(g_ptr_array_index(scan.dirs, i));
+    }
+    g_ptr_array_free(scan.dirs, TRUE);
+    g_array_free(scan.candidates, TRUE);
+    _vmnetfs_images_release(fs, scan.imgs);
+
+    g_mutex_lock(cm->lock);
+    cm->usage = usage;
+    /* If we couldn't get below the limit, don't try again right away */
+    cm->wake_at = MAX(usage, fs->cache_limit) + fs->cache_limit / 16;
+    g_mutex_unlock(cm->lock);
+    _vmnetfs_u64_stat_set(fs->cache_bytes, usage);
+}
+
+static void *evict_thread(void *data)
+{
+    struct cache_manager *cm = data;
+    GTimeVal deadline;
+
+    g_mutex_lock(cm->lock);
+    while (!cm->stop) {
+        cm->wake = false;
+        g_mutex_unlock(cm->lock);
+        run_pass(cm);
+        g_mutex_lock(cm->lock);
+        g_get_current_time(&deadline);
+        g_time_val_add(&deadline, SCAN_INTERVAL * G_USEC_PER_SEC);
+        while (!cm->stop && !cm->wake) {
+            if (!g_cond_timed_wait(cm->cond, cm->lock, &deadline)) {
+                break;
+            }
+        }
+    }
+    g_mutex_unlock(cm->lock);
+    return NULL;
+}
+
+static void set_image_manager(void *key G_GNUC_UNUSED, void *value,
+        void *data)
+{
+    struct vmnetfs_image *img = value;
+
+    img->cache = data;
+}
+
+bool _vmnetfs_cache_init(struct vmnetfs *fs, GError **err)
+{
+    struct cache_manager *cm;
+
+    if (fs->cache_root == NULL) {
+        return true;
+    }
+    fs->cache_bytes = _vmnetfs_stat_new();
+    fs->cache_evictions = _vmnetfs_stat_new();
+    fs->cache_bytes_evicted = _vmnetfs_stat_new();
+
+    cm = g_slice_new0(struct cache_manager);
+    cm->fs = fs;
+    cm->lock = g_mutex_new();
+    cm->cond = g_cond_new();
+    cm->wake_at = fs->cache_limit;
+    cm->thread = g_thread_create(evict_thread, cm, TRUE, err);
+    if (cm->thread == NULL) {
+        g_cond_free(cm->cond);
+        g_mutex_free(cm->lock);
+        g_slice_free(struct cache_manager, cm);
+        return false;
+    }
+    fs->cache = cm;
+    g_mutex_lock(fs->images_lock);
+    _vmnetfs_images_foreach(fs, set_image_manager, cm);
+    g_mutex_unlock(fs->images_lock);
+    return true;
+}
+
+void _vmnetfs_cache_close(struct vmnetfs *fs)
+{
+    if (fs->cache == NULL) {
+        return;
+    }
+    _vmnetfs_stat_close(fs->cache_bytes);
+    _vmnetfs_stat_close(fs->cache_evictions);
+    _vmnetfs_stat_close(fs->cache_bytes_evicted);
+}
+
+/* Stop the evictor.  Must be called before the cache proxy is
+   destroyed. */
+void _vmnetfs_cache_stop(struct vmnetfs *fs)
+{
+    struct cache_manager *cm = fs->cache;
+
+    if (cm == NULL || cm->thread == NULL) {
+        return;
+    }
+    g_mutex_lock(cm->lock);
+    cm->stop = true;
+    g_cond_signal(cm->cond);
+    g_mutex_unlock(cm->lock);
+    g_thread_join(cm->thread);
+    cm->thread = NULL;
+}
+
+/* Must be called before the images are destroyed, and after any attached
+   through the control socket have been. */
+void _vmnetfs_cache_destroy(struct vmnetfs *fs)
+{
+    struct cache_manager *cm = fs->cache;
+
+    if (cm == NULL) {
+        return;
+    }
+    _vmnetfs_cache_stop(fs);
+    g_mutex_lock(fs->images_lock);
+    _vmnetfs_images_foreach(fs, set_image_manager, NULL);
+    g_mutex_unlock(fs->images_lock);
+    g_cond_free(cm->cond);
+    g_mutex_free(cm->lock);
+    g_slice_free(struct cache_manager, cm);
+    fs->cache = NULL;
+    _vmnetfs_stat_free(fs->cache_bytes);
+    _vmnetfs_stat_free(fs->cache_evictions);
+    _vmnetfs_stat_free(fs->cache_bytes_evicted);
+}
+
+/* Account for a chunk added to the pristine cache, and wake the evictor
+   if we're over budget. */
+void _vmnetfs_cache_note_write(struct vmnetfs_image *img, uint64_t bytes)
+{
+    struct cache_manager *cm = img->cache;
+
+    if (cm == NULL) {
+        return;
+    }
+    g_mutex_lock(cm->lock);
+    cm->usage += bytes;
+    if (cm->usage >= cm->wake_at && !cm->wake) {
+        cm->wake = true;
+        g_cond_signal(cm->cond);
+    }
+    g_mutex_unlock(cm->lock);
+    _vmnetfs_u64_stat_increment(cm->fs->cache_bytes, bytes);
+}
+
+/* Record that the background fill is fetching the chunk, so that the
+   evictor doesn't treat it as unused. */
+void _vmnetfs_cache_note_fill(struct vmnetfs_image *img, uint64_t chunk)
+{
+    g_mutex_lock(img->access_lock);
+    img->access_filled[chunk / 8] |= 1 << (chunk % 8);
+    g_mutex_unlock(img->access_lock);
+}
+
+/* Return true if the caches have reached the level to which eviction
+   reduces them, so that fetching more data would only displace chunks
+   already cached. */
+bool _vmnetfs_cache_is_full(struct vmnetfs_image *img)
+{
+    struct cache_manager *cm = img->cache;
+    bool ret;
+
+    if (cm == NULL) {
+        return false;
+    }
+    g_mutex_lock(cm->lock);
+    ret = cm->usage >= cm->fs->cache_limit / LOW_WATER_DENOM *
+            LOW_WATER_NUM;
+    g_mutex_unlock(cm->lock);
+    return ret;
+}
@@ -15,7 +15,7 @@
  * for more details.
  */
 
-/* When a FUSE filesystem operation is interrupted, FUSE delivers SIGUSR1
+/* When a FUSE filesystem operation is interrupted, fuse.c delivers SIGUSR1
    to the specific thread performing the operation.  If the FS operation is
    a blocking read on a stream, the signal handler must be able to
    interrupt it.  However, if the blocking read is implemented using GCond
@@ -27,7 +27,7 @@
    handler can't use it to terminate the wait.
 
    We therefore implement our own condition variables on top of SIGUSR1.
-   libfuse will have already installed a no-op SIGUSR1 handler. */
+   fuse.c will have already installed a no-op SIGUSR1 handler. */
 
 #include <signal.h>
 #include <pthread.h>
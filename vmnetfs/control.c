@@ -0,0 +1,340 @@
+/*
+ * vmnetfs - virtual machine network execution virtual filesystem
+ *
+ * Copyright (C) 2006-2014 Carnegie Mellon University
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of version 2 of the GNU General Public License as published
+ * by the Free Software Foundation.  A copy of the GNU General Public License
+ * should have been distributed along with this program in the file
+ * COPYING.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ */
+
+/* Control socket, letting one long-running vmnetfs serve many VMs.
+   Clients connect to a UNIX socket and send commands, one per line:
+
+       attach <name>
+       <length of config document>
+       <config document>
+
+   attaches the images in the config document in a new directory <name>
+   under the mountpoint.  Images sharing a cache directory with images
+   already attached share their pristine cache, content store, fetches
+   and connection pool; each keeps its own modified state.  Settings
+   other than the images are taken from the daemon's own config.  The
+   reply is an empty line followed by the path of the new directory.
+
+       detach <name>
+
+   closes the images and removes their directory.  They are destroyed
+   once their open files are closed.  The reply is an empty line.
+
+   Errors are reported with a line containing the error message.
+   Commands from all connections are executed one at a time. */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include "vmnetfs-private.h"
+
+struct control_state {
+    char *path;
+    int listen_fd;
+    GThread *thread;
+    GMutex *lock;
+    GList *conns;
+    bool closed;  /* protected by both locks */
+    GMutex *command_lock;
+};
+
+struct control_conn {
+    struct vmnetfs *fs;
+    int fd;
+    GThread *thread;
+    bool finished;  /* protected by control_state lock */
+};
+
+static bool send_all(int fd, const void *buf, size_t count)
+{
+    ssize_t ret;
+
+    while (count > 0) {
+        ret = send(fd, buf, count, MSG_NOSIGNAL);
+        if (ret == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        buf += ret;
+        count -= ret;
+    }
+    return true;
+}
+
+static bool send_reply(struct control_conn *conn, const char *fmt, ...)
+{
+    va_list ap;
+    char *str;
+    bool ret;
+
+    va_start(ap, fmt);
+    str = g_strdup_vprintf(fmt, ap);
+    va_end(ap);
+    ret = send_all(conn->fd, str, strlen(str));
+    g_free(str);
+    return ret;
+}
+
+/* Returns false if the connection should be dropped. */
+static bool handle_command(struct control_conn *conn, GIOChannel *chan,
+        const char *command, const char *name)
+{
+    struct control_state *cs = conn->fs->control;
+    char *path = NULL;
+    bool ok = false;
+    bool ret;
+    GError *err = NULL;
+
+    g_mutex_lock(cs->command_lock);
+    if (cs->closed) {
+        g_mutex_unlock(cs->command_lock);
+        send_reply(conn, "vmnetfs is shutting down\n");
+        return false;
+    }
+    if (!strcmp(command, "attach")) {
+        path = _vmnetfs_attach(conn->fs, name, chan, &err);
+        ok = path != NULL;
+    } else if (!strcmp(command, "detach")) {
+        ok = _vmnetfs_detach(conn->fs, name, &err);
+    } else {
+        g_set_error(&err, VMNETFS_CONFIG_ERROR,
+                VMNETFS_CONFIG_ERROR_INVALID_CONFIG,
+                "Unknown command %s", command);
+    }
+    g_mutex_unlock(cs->command_lock);
+
+    if (path != NULL) {
+        ret = send_reply(conn, "\n%s\n", path);
+    } else if (ok) {
+        ret = send_reply(conn, "\n");
+    } else {
+        /* Keep the reply to one line */
+        g_strdelimit(err->message, "\n", ' ');
+        ret = send_reply(conn, "%s\n", err->message);
+        g_clear_error(&err);
+    }
+    g_free(path);
+    return ret;
+}
+
+static void *conn_thread(void *data)
+{
+    struct control_conn *conn = data;
+    struct control_state *cs = conn->fs->control;
+    GIOChannel *chan;
+    char *line;
+    char *name;
+    gsize terminator_pos;
+
+    chan = g_io_channel_unix_new(conn->fd);
+    g_io_channel_set_encoding(chan, NULL, NULL);
+    while (g_io_channel_read_line(chan, &line, NULL, &terminator_pos,
+            NULL) == G_IO_STATUS_NORMAL) {
+        line[terminator_pos] = 0;
+        name = strchr(line, ' ');
+        if (name == NULL) {
+            send_reply(conn, "Missing instance name\n");
+            g_free(line);
+            break;
+        }
+        *name++ = 0;
+        if (!handle_command(conn, chan, line, name)) {
+            g_free(line);
+            break;
+        }
+        g_free(line);
+    }
+    g_io_channel_unref(chan);
+
+    g_mutex_lock(cs->lock);
+    conn->finished = true;
+    g_mutex_unlock(cs->lock);
+    return NULL;
+}
+
+static void conn_free(struct control_conn *conn)
+{
+    g_thread_join(conn->thread);
+    close(conn->fd);
+    g_slice_free(struct control_conn, conn);
+}
+
+/* control_state lock must be held. */
+static void reap_conns(struct control_state *cs)
+{
+    struct control_conn *conn;
+    GList *cur;
+    GList *next;
+
+    for (cur = cs->conns; cur != NULL; cur = next) {
+        next = cur->next;
+        conn = cur->data;
+        if (conn->finished) {
+            cs->conns = g_list_delete_link(cs->conns, cur);
+            conn_free(conn);
+        }
+    }
+}
+
+static void *accept_thread(void *data)
+{
+    struct vmnetfs *fs = data;
+    struct control_state *cs = fs->control;
+    struct control_conn *conn;
+    GError *err = NULL;
+    int fd;
+
+    while (true) {
+        fd = accept4(cs->listen_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (fd == -1) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            break;
+        }
+        g_mutex_lock(cs->lock);
+        reap_conns(cs);
+        if (cs->closed) {
+            g_mutex_unlock(cs->lock);
+            close(fd);
+            break;
+        }
+        conn = g_slice_new0(struct control_conn);
+        conn->fs = fs;
+        conn->fd = fd;
+        conn->thread = g_thread_create(conn_thread, conn, TRUE, &err);
+        if (conn->thread == NULL) {
+            g_warning("Couldn't start control connection: %s",
+                    err->message);
+            g_clear_error(&err);
+            close(fd);
+            g_slice_free(struct control_conn, conn);
+        } else {
+            cs->conns = g_list_prepend(cs->conns, conn);
+        }
+        g_mutex_unlock(cs->lock);
+    }
+    return NULL;
+}
+
+bool _vmnetfs_control_init(struct vmnetfs *fs, GError **err)
+{
+    struct control_state *cs;
+    struct sockaddr_un addr = {
+        .sun_family = AF_UNIX,
+    };
+
+    if (fs->control_socket == NULL) {
+        return true;
+    }
+    if (strlen(fs->control_socket) >= sizeof(addr.sun_path)) {
+        g_set_error(err, VMNETFS_CONFIG_ERROR,
+                VMNETFS_CONFIG_ERROR_INVALID_CONFIG,
+                "Control socket path too long: %s", fs->control_socket);
+        return false;
+    }
+    strcpy(addr.sun_path, fs->control_socket);
+
+    cs = g_slice_new0(struct control_state);
+    cs->listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (cs->listen_fd == -1) {
+        g_set_error(err, G_FILE_ERROR, g_file_error_from_errno(errno),
+                "Couldn't create control socket: %s", strerror(errno));
+        goto bad_free;
+    }
+    unlink(fs->control_socket);
+    if (bind(cs->listen_fd, (struct sockaddr *) &addr, sizeof(addr)) ||
+            listen(cs->listen_fd, 16)) {
+        g_set_error(err, G_FILE_ERROR, g_file_error_from_errno(errno),
+                "Couldn't listen on %s: %s", fs->control_socket,
+                strerror(errno));
+        goto bad_close;
+    }
+    cs->path = g_strdup(fs->control_socket);
+    cs->lock = g_mutex_new();
+    cs->command_lock = g_mutex_new();
+    fs->control = cs;
+    cs->thread = g_thread_create(accept_thread, fs, TRUE, err);
+    if (cs->thread == NULL) {
+        fs->control = NULL;
+        g_mutex_free(cs->command_lock);
+        g_mutex_free(cs->lock);
+        g_free(cs->path);
+        unlink(fs->control_socket);
+        goto bad_close;
+    }
+    return true;
+
+bad_close:
+    close(cs->listen_fd);
+bad_free:
+    g_slice_free(struct control_state, cs);
+    return false;
+}
+
+/* Stop accepting commands, disconnect clients, and wait for any command
+   in progress to finish. */
+void _vmnetfs_control_close(struct vmnetfs *fs)
+{
+    struct control_state *cs = fs->control;
+    struct control_conn *conn;
+    GList *cur;
+
+    if (cs == NULL) {
+        return;
+    }
+    /* Unblock an attach waiting for its config document before taking
+       the command lock */
+    g_mutex_lock(cs->lock);
+    shutdown(cs->listen_fd, SHUT_RDWR);
+    for (cur = cs->conns; cur != NULL; cur = cur->next) {
+        conn = cur->data;
+        shutdown(conn->fd, SHUT_RDWR);
+    }
+    g_mutex_lock(cs->command_lock);
+    cs->closed = true;
+    g_mutex_unlock(cs->command_lock);
+    g_mutex_unlock(cs->lock);
+}
+
+void _vmnetfs_control_destroy(struct vmnetfs *fs)
+{
+    struct control_state *cs = fs->control;
+
+    if (cs == NULL) {
+        return;
+    }
+    _vmnetfs_control_close(fs);
+    g_thread_join(cs->thread);
+    while (cs->conns != NULL) {
+        conn_free(cs->conns->data);
+        cs->conns = g_list_delete_link(cs->conns, cs->conns);
+    }
+    close(cs->listen_fd);
+    unlink(cs->path);
+    g_free(cs->path);
+    g_mutex_free(cs->command_lock);
+    g_mutex_free(cs->lock);
+    g_slice_free(struct control_state, cs);
+    fs->control = NULL;
+}
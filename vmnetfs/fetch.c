@@ -0,0 +1,391 @@
+/*
+ * vmnetfs - virtual machine network execution virtual filesystem
+ *
+ * Copyright (C) 2006-2014 Carnegie Mellon University
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of version 2 of the GNU General Public License as published
+ * by the Free Software Foundation.  A copy of the GNU General Public License
+ * should have been distributed along with this program in the file
+ * COPYING.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ */
+
+/* Demand fetches run in a pool of worker threads rather than in the FUSE
+   thread that needs the data.  If the FUSE request is interrupted, only
+   the waiter gives up; the transfer runs to completion and the chunk is
+   handed to the writeback queue, so the inevitable retry of the read
+   finds the data locally (or joins the transfer still in progress).
+
+   A fetch can also be started without waiting for it, in which case the
+   caller is called back once the chunk has been queued for writeback.
+
+   Before transferring a chunk, the worker takes the chunk's lease in
+   the shared present map, waiting for any other vmnetfs process that is
+   fetching it into the same pristine cache.  If that process wrote the
+   chunk, the worker reads it from the cache instead.  Otherwise the
+   lease passes to the writeback queue with the data.
+
+   Chunks are requested first from any peers that have them, then from
+   the image's cache proxy if it names one.  When the proxy fails, we
+   fetch from the origin and leave the proxy alone for a while. */
+
+#include <string.h>
+#include <time.h>
+#include "vmnetfs-private.h"
+
+#define FETCH_MAX_THREADS 16
+#define PROXY_RETRY_DELAY 60  /* seconds */
+
+struct fetch_state {
+    struct vmnetfs_image *img;  /* owner, which may be shared */
+    GMutex *lock;
+    GHashTable *jobs;  /* chunk -> struct fetch_job, until handed off */
+    /* Jobs not yet started, by priority.  The pool is given one token per
+       job, and each worker takes the most urgent job. */
+    GQueue *queued[FETCH_PRIORITIES];
+    GThreadPool *pool;
+    gint stop;  /* atomic operations only */
+    char *proxy_url;
+    time_t proxy_retry_at;
+};
+
+struct fetch_job {
+    uint64_t chunk;
+    enum fetch_priority priority;
+    GList *link;  /* in its queue, until started */
+    void *buf;
+    uint32_t length;
+    GError *err;
+    struct vmnetfs_cond *done;
+    GCond *drained;
+    GSList *callbacks;
+    uint32_t waiters;
+    bool finished;
+    bool abandoned;
+    bool adopted;  /* already in the pristine cache */
+};
+
+struct fetch_callback {
+    void (*ready)(void *arg);
+    void *arg;
+};
+
+static bool fetch_should_stop(void *arg)
+{
+    struct vmnetfs_image *img = arg;
+
+    return g_atomic_int_get(&img->fetch->stop);
+}
+
+/* Runs the job's callbacks, which must not take the fetch lock. */
+static void job_free(struct vmnetfs_image *img, struct fetch_job *job)
+{
+    struct fetch_callback *cb;
+    GSList *cur;
+
+    g_assert(job->waiters == 0);
+    for (cur = job->callbacks; cur != NULL; cur = cur->next) {
+        cb = cur->data;
+        cb->ready(cb->arg);
+        g_slice_free(struct fetch_callback, cb);
+    }
+    g_slist_free(job->callbacks);
+    _vmnetfs_pool_put(img, job->buf);
+    g_clear_error(&job->err);
+    _vmnetfs_cond_free(job->done);
+    g_cond_free(job->drained);
+    g_slice_free(struct fetch_job, job);
+}
+
+/* Fetch from a peer, through the cache proxy if we have one and it's
+   working, or from the origin. */
+static bool fetch_remote(struct vmnetfs_image *img, struct fetch_job *job,
+        GError **err)
+{
+    struct fetch_state *fs = img->fetch;
+    uint64_t start = job->chunk * img->chunk_size + img->fetch_offset;
+    GError *my_err = NULL;
+    bool use_proxy;
+
+    if (img->peer != NULL && _vmnetfs_peer_fetch(img, job->buf,
+            job->chunk, job->length, fetch_should_stop, img)) {
+        _vmnetfs_u64_stat_increment(img->bytes_fetched_peer, job->length);
+        return true;
+    }
+
+    g_mutex_lock(fs->lock);
+    use_proxy = fs->proxy_url != NULL && time(NULL) >= fs->proxy_retry_at;
+    g_mutex_unlock(fs->lock);
+    if (use_proxy) {
+        /* Don't retry; the origin is the fallback */
+        if (_vmnetfs_transport_fetch_once(img->cpool, fs->proxy_url, NULL,
+                NULL, img->etag, img->last_modified, job->buf, start,
+                job->length, fetch_should_stop, img, &my_err)) {
+            _vmnetfs_u64_stat_increment(img->bytes_fetched_origin,
+                    job->length);
+            return true;
+        }
+        if (g_error_matches(my_err, VMNETFS_IO_ERROR,
+                VMNETFS_IO_ERROR_INTERRUPTED)) {
+            g_propagate_error(err, my_err);
+            return false;
+        }
+        g_warning("Couldn't fetch chunk %"G_GUINT64_FORMAT" from cache "
+                "proxy: %s", job->chunk, my_err->message);
+        g_clear_error(&my_err);
+        g_mutex_lock(fs->lock);
+        fs->proxy_retry_at = time(NULL) + PROXY_RETRY_DELAY;
+        g_mutex_unlock(fs->lock);
+    }
+    if (!_vmnetfs_transport_fetch(img->cpool, img->url, img->username,
+            img->password, img->etag, img->last_modified, job->buf, start,
+            job->length, fetch_should_stop, img, err)) {
+        return false;
+    }
+    _vmnetfs_u64_stat_increment(img->bytes_fetched_origin, job->length);
+    return true;
+}
+
+static void fetch_worker(void *data G_GNUC_UNUSED, void *user_data)
+{
+    struct vmnetfs_image *img = user_data;
+    struct fetch_state *fs = img->fetch;
+    struct fetch_job *job = NULL;
+    GError *err = NULL;
+    int i;
+
+    g_mutex_lock(fs->lock);
+    for (i = 0; job == NULL && i < FETCH_PRIORITIES; i++) {
+        job = g_queue_pop_head(fs->queued[i]);
+    }
+    g_assert(job != NULL);
+    job->link = NULL;
+    g_mutex_unlock(fs->lock);
+
+    if (!_vmnetfs_shared_map_lease(img, job->chunk, fetch_should_stop,
+            img)) {
+        g_set_error(&err, VMNETFS_IO_ERROR, VMNETFS_IO_ERROR_INTERRUPTED,
+                "Operation interrupted");
+    } else if (_vmnetfs_ll_pristine_adopt_chunk(img, job->chunk) &&
+            _vmnetfs_ll_pristine_read_chunk(img, job->buf, job->chunk, 0,
+            job->length, NULL)) {
+        /* Another process fetched it while we waited for the lease */
+        job->adopted = true;
+        _vmnetfs_shared_map_release(img, job->chunk);
+    } else if (fetch_remote(img, job, &err)) {
+        _vmnetfs_bit_set(img->fetched_map, job->chunk);
+        /* Apply backpressure before taking the lock */
+        _vmnetfs_writeback_throttle(img);
+    } else {
+        _vmnetfs_shared_map_release(img, job->chunk);
+    }
+
+    g_mutex_lock(fs->lock);
+    job->err = err;
+    job->finished = true;
+    _vmnetfs_cond_broadcast(job->done);
+    /* Let current waiters copy out of the buffer before we give it away */
+    while (job->waiters > 0) {
+        g_cond_wait(job->drained, fs->lock);
+    }
+    if (job->err) {
+        if (job->abandoned && !g_error_matches(job->err, VMNETFS_IO_ERROR,
+                VMNETFS_IO_ERROR_INTERRUPTED)) {
+            /* Nobody was waiting to report this */
+            g_warning("Background fetch of chunk %"G_GUINT64_FORMAT
+                    " failed: %s", job->chunk, job->err->message);
+        }
+    } else if (!job->adopted) {
+        if (job->abandoned) {
+            _vmnetfs_u64_stat_increment(img->bytes_salvaged, job->length);
+        }
+        /* Hand off the buffer while holding the lock, so that readers
+           always find the chunk either here or in the writeback queue */
+        _vmnetfs_writeback_queue(img, job->buf, job->chunk, job->length);
+        job->buf = NULL;
+    }
+    g_hash_table_remove(fs->jobs, &job->chunk);
+    g_mutex_unlock(fs->lock);
+    job_free(img, job);
+}
+
+static void free_unstarted_job(void *key G_GNUC_UNUSED, void *value,
+        void *data)
+{
+    job_free(data, value);
+}
+
+bool _vmnetfs_fetch_init(struct vmnetfs_image *img, GError **err)
+{
+    struct fetch_state *fs;
+    int i;
+
+    fs = g_slice_new0(struct fetch_state);
+    fs->img = img;
+    fs->lock = g_mutex_new();
+    fs->jobs = g_hash_table_new(g_int64_hash, g_int64_equal);
+    for (i = 0; i < FETCH_PRIORITIES; i++) {
+        fs->queued[i] = g_queue_new();
+    }
+    /* The proxy can't authenticate to the origin on our behalf */
+    if (img->proxy_url != NULL && img->username == NULL &&
+            img->cookies == NULL) {
+        /* The proxy takes the origin URL as its path */
+        fs->proxy_url = g_strdup_printf("%.*s/%s",
+                (int) (strlen(img->proxy_url) -
+                g_str_has_suffix(img->proxy_url, "/")), img->proxy_url,
+                img->url);
+    }
+    fs->pool = g_thread_pool_new(fetch_worker, img, FETCH_MAX_THREADS,
+            FALSE, err);
+    if (fs->pool == NULL) {
+        for (i = 0; i < FETCH_PRIORITIES; i++) {
+            g_queue_free(fs->queued[i]);
+        }
+        g_free(fs->proxy_url);
+        g_hash_table_destroy(fs->jobs);
+        g_mutex_free(fs->lock);
+        g_slice_free(struct fetch_state, fs);
+        return false;
+    }
+    img->fetch = fs;
+    return true;
+}
+
+/* Cancels transfers in progress and discards jobs that have not
+   started.  Must be called before the writeback queue is destroyed. */
+void _vmnetfs_fetch_destroy(struct vmnetfs_image *img)
+{
+    struct fetch_state *fs = img->fetch;
+    int i;
+
+    g_atomic_int_set(&fs->stop, 1);
+    g_thread_pool_free(fs->pool, TRUE, TRUE);
+    /* Jobs that never ran are still in the table */
+    g_hash_table_foreach(fs->jobs, free_unstarted_job, img);
+    g_hash_table_destroy(fs->jobs);
+    for (i = 0; i < FETCH_PRIORITIES; i++) {
+        g_queue_free(fs->queued[i]);
+    }
+    g_free(fs->proxy_url);
+    g_mutex_free(fs->lock);
+    g_slice_free(struct fetch_state, fs);
+}
+
+/* fetch lock must be held.  The buffer comes from the owner's pool,
+   since the owner's fetch thread will give it back. */
+static struct fetch_job *start_job(struct vmnetfs_image *img, uint64_t chunk,
+        enum fetch_priority priority)
+{
+    struct fetch_state *fs = img->fetch;
+    struct fetch_job *job;
+    uint64_t start = chunk * img->chunk_size;
+
+    job = g_slice_new0(struct fetch_job);
+    job->chunk = chunk;
+    job->priority = priority;
+    job->length = MIN(img->initial_size - start, img->chunk_size);
+    job->buf = _vmnetfs_pool_get(fs->img);
+    job->done = _vmnetfs_cond_new();
+    job->drained = g_cond_new();
+    g_hash_table_replace(fs->jobs, &job->chunk, job);
+    _vmnetfs_u64_stat_increment(img->chunk_fetches, 1);
+    g_queue_push_tail(fs->queued[priority], job);
+    job->link = g_queue_peek_tail_link(fs->queued[priority]);
+    /* The worker finds its job in the queues */
+    g_thread_pool_push(fs->pool, fs, NULL);
+    return job;
+}
+
+/* Move a job that hasn't started behind others of a more urgent
+   @priority.  fetch lock must be held. */
+static void raise_priority(struct fetch_state *fs, struct fetch_job *job,
+        enum fetch_priority priority)
+{
+    if (job->link == NULL || priority >= job->priority) {
+        return;
+    }
+    g_queue_delete_link(fs->queued[job->priority], job->link);
+    job->priority = priority;
+    g_queue_push_tail(fs->queued[priority], job);
+    job->link = g_queue_peek_tail_link(fs->queued[priority]);
+}
+
+/* Fetch the chunk at @priority, or join a fetch already in progress, and
+   copy the requested range into @data.  Returns false with
+   VMNETFS_IO_ERROR_INTERRUPTED if the FUSE request is interrupted; the
+   fetch continues in the background and its result is queued for
+   writeback.  Chunk lock must be held. */
+bool _vmnetfs_fetch_chunk(struct vmnetfs_image *img, void *data,
+        uint64_t chunk, uint32_t offset, uint32_t length,
+        enum fetch_priority priority, GError **err)
+{
+    struct fetch_state *fs = img->fetch;
+    struct fetch_job *job;
+    bool ret = false;
+
+    g_mutex_lock(fs->lock);
+    job = g_hash_table_lookup(fs->jobs, &chunk);
+    if (job == NULL) {
+        job = start_job(img, chunk, priority);
+    } else {
+        raise_priority(fs, job, priority);
+    }
+
+    job->waiters++;
+    while (!job->finished && !_vmnetfs_cond_wait(job->done, fs->lock)) {}
+    if (!job->finished) {
+        /* Interrupted.  Leave the transfer running. */
+        job->abandoned = true;
+        g_set_error(err, VMNETFS_IO_ERROR, VMNETFS_IO_ERROR_INTERRUPTED,
+                "Operation interrupted");
+    } else if (job->err) {
+        g_set_error(err, job->err->domain, job->err->code, "%s",
+                job->err->message);
+    } else {
+        g_assert(offset + length <= job->length);
+        memcpy(data, job->buf + offset, length);
+        ret = true;
+    }
+    if (--job->waiters == 0) {
+        g_cond_signal(job->drained);
+    }
+    g_mutex_unlock(fs->lock);
+    return ret;
+}
+
+/* Fetch the chunk in the background, or join a fetch already in
+   progress, and call @ready with @arg from a fetch thread once the chunk
+   has been queued for writeback or the fetch has failed.  Returns false
+   without arranging a callback if a fetch of the chunk has just
+   finished, in which case its data is available locally.  Chunk lock
+   must be held. */
+bool _vmnetfs_fetch_chunk_async(struct vmnetfs_image *img, uint64_t chunk,
+        enum fetch_priority priority, void (*ready)(void *arg), void *arg)
+{
+    struct fetch_state *fs = img->fetch;
+    struct fetch_job *job;
+    struct fetch_callback *cb;
+
+    g_mutex_lock(fs->lock);
+    job = g_hash_table_lookup(fs->jobs, &chunk);
+    if (job == NULL) {
+        job = start_job(img, chunk, priority);
+    } else if (job->finished) {
+        g_mutex_unlock(fs->lock);
+        return false;
+    } else {
+        raise_priority(fs, job, priority);
+    }
+    cb = g_slice_new(struct fetch_callback);
+    cb->ready = ready;
+    cb->arg = arg;
+    job->callbacks = g_slist_prepend(job->callbacks, cb);
+    g_mutex_unlock(fs->lock);
+    return true;
+}
@@ -0,0 +1,259 @@
+/*
+ * vmnetfs - virtual machine network execution virtual filesystem
+ *
+ * Copyright (C) 2006-2014 Carnegie Mellon University
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of version 2 of the GNU General Public License as published
+ * by the Free Software Foundation.  A copy of the GNU General Public License
+ * should have been distributed along with this program in the file
+ * COPYING.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ */
+
+/* Background fill copies the rest of a demand-fetched image into the
+   pristine cache while the link is otherwise idle, so that a later
+   session does not stall on chunks this one never touched.  Chunks used
+   by earlier sessions are fetched first, most frequently used first,
+   and then the rest of the image in order.
+
+   The fill thread hands small windows of chunks to the fetch threads
+   and waits for each to complete.  Before each window it checks whether
+   the guest has missed in the cache since the last one.  If so, it backs
+   off, and resumes only after an interval in which demand fetches stayed
+   under the configured threshold.  It also yields to prefetch requests
+   from the control file, and its fetches queue behind all others.  It
+   stops once the caches reach the cache budget's low-water mark, since
+   going further would only evict chunks that have been used. */
+
+#include <time.h>
+#include "vmnetfs-private.h"
+
+#define FILL_WINDOW 4  /* chunks */
+#define FILL_BACKOFF 1  /* seconds */
+
+struct fill_state {
+    GMutex *lock;
+    GCond *changed;
+    GThread *thread;
+    uint64_t demand_bytes;  /* since the fill thread last looked */
+    int pending;  /* may briefly go negative */
+    bool stopped;
+
+    /* Private to fill thread */
+    GArray *used_chunks;
+    uint64_t used_pos;
+    uint64_t next_chunk;
+    uint64_t rate_bytes;
+    time_t rate_start;
+};
+
+static void fetch_ready(void *arg)
+{
+    struct fill_state *fs = arg;
+
+    g_mutex_lock(fs->lock);
+    if (--fs->pending == 0) {
+        g_cond_broadcast(fs->changed);
+    }
+    g_mutex_unlock(fs->lock);
+}
+
+/* Wait @seconds or until stopped.  lock must be held. */
+static void fill_sleep(struct fill_state *fs, unsigned seconds)
+{
+    GTimeVal deadline;
+
+    g_get_current_time(&deadline);
+    g_time_val_add(&deadline, seconds * G_USEC_PER_SEC);
+    while (!fs->stopped) {
+        if (!g_cond_timed_wait(fs->changed, fs->lock, &deadline)) {
+            break;
+        }
+    }
+}
+
+/* Returns false once every chunk has been tried. */
+static bool next_chunk(struct vmnetfs_image *img, uint64_t *chunk)
+{
+    struct fill_state *fs = img->fill;
+    uint64_t chunks = (img->initial_size + img->chunk_size - 1) /
+            img->chunk_size;
+
+    if (fs->used_pos < fs->used_chunks->len) {
+        *chunk = g_array_index(fs->used_chunks, uint64_t, fs->used_pos++);
+        return true;
+    }
+    if (fs->next_chunk < chunks) {
+        *chunk = fs->next_chunk++;
+        return true;
+    }
+    return false;
+}
+
+/* Fetch the next window of missing chunks.  Returns false when the
+   image is complete. */
+static bool fill_window(struct vmnetfs_image *img)
+{
+    struct fill_state *fs = img->fill;
+    uint64_t chunk;
+    int pending = 0;
+    int tried = 0;
+    int queued;
+    bool ret = true;
+
+    /* Chunks we already have cost nearly nothing to skip, but bound the
+       time between checks for demand misses */
+    while (pending < FILL_WINDOW && tried < 64 * FILL_WINDOW) {
+        if (!next_chunk(img, &chunk)) {
+            ret = false;
+            break;
+        }
+        queued = _vmnetfs_io_fetch_async(img, chunk * img->chunk_size,
+                img->chunk_size, FETCH_PRIORITY_FILL, fetch_ready, fs);
+        if (queued > 0) {
+            _vmnetfs_cache_note_fill(img, chunk);
+        }
+        pending += queued;
+        tried++;
+    }
+
+    g_mutex_lock(fs->lock);
+    fs->pending += pending;
+    while (fs->pending > 0) {
+        g_cond_wait(fs->changed, fs->lock);
+    }
+    g_mutex_unlock(fs->lock);
+
+    fs->rate_bytes += (uint64_t) pending * img->chunk_size;
+    return ret;
+}
+
+static void update_rate(struct vmnetfs_image *img, bool idle)
+{
+    struct fill_state *fs = img->fill;
+    time_t now = time(NULL);
+
+    if (idle) {
+        fs->rate_bytes = 0;
+        fs->rate_start = now;
+        _vmnetfs_u64_stat_set(img->fill_rate, 0);
+    } else if (now > fs->rate_start) {
+        _vmnetfs_u64_stat_set(img->fill_rate, fs->rate_bytes /
+                (now - fs->rate_start));
+        fs->rate_bytes = 0;
+        fs->rate_start = now;
+    }
+}
+
+static void *fill_thread(void *data)
+{
+    struct vmnetfs_image *img = data;
+    struct fill_state *fs = img->fill;
+    bool more = true;
+
+    fs->used_chunks = _vmnetfs_cache_get_used_chunks(img);
+    fs->rate_start = time(NULL);
+
+    g_mutex_lock(fs->lock);
+    while (more && !fs->stopped) {
+        if (fs->demand_bytes > 0 || !_vmnetfs_prefetch_is_idle(img)) {
+            /* The guest is waiting on the network, or someone asked for
+               specific data.  Stay out of the way until things calm
+               down. */
+            update_rate(img, true);
+            do {
+                fs->demand_bytes = 0;
+                fill_sleep(fs, FILL_BACKOFF);
+            } while (!fs->stopped && (fs->demand_bytes > FILL_BACKOFF *
+                    img->fill_threshold ||
+                    !_vmnetfs_prefetch_is_idle(img)));
+            fs->demand_bytes = 0;
+            continue;
+        }
+        g_mutex_unlock(fs->lock);
+
+        if (_vmnetfs_cache_is_full(img)) {
+            more = false;
+        } else {
+            more = fill_window(img);
+            update_rate(img, false);
+        }
+
+        g_mutex_lock(fs->lock);
+    }
+    g_mutex_unlock(fs->lock);
+
+    update_rate(img, true);
+    g_array_free(fs->used_chunks, TRUE);
+    fs->used_chunks = NULL;
+    return NULL;
+}
+
+/* Record a demand miss, which pauses the fill. */
+void _vmnetfs_fill_note_demand(struct vmnetfs_image *img, uint64_t bytes)
+{
+    struct fill_state *fs = img->fill;
+
+    if (fs == NULL) {
+        return;
+    }
+    g_mutex_lock(fs->lock);
+    fs->demand_bytes += bytes;
+    g_mutex_unlock(fs->lock);
+}
+
+/* Cannot be called after _vmnetfs_fill_stop(). */
+bool _vmnetfs_fill_start(struct vmnetfs_image *img, GError **err)
+{
+    struct fill_state *fs;
+
+    g_assert(!img->fill);
+
+    fs = g_slice_new0(struct fill_state);
+    fs->lock = g_mutex_new();
+    fs->changed = g_cond_new();
+    img->fill = fs;
+    fs->thread = g_thread_create(fill_thread, img, TRUE, err);
+    if (fs->thread == NULL) {
+        img->fill = NULL;
+        g_cond_free(fs->changed);
+        g_mutex_free(fs->lock);
+        g_slice_free(struct fill_state, fs);
+        return false;
+    }
+    return true;
+}
+
+/* Stop after the current window. */
+void _vmnetfs_fill_stop(struct vmnetfs_image *img)
+{
+    struct fill_state *fs = img->fill;
+
+    if (fs == NULL) {
+        return;
+    }
+    g_mutex_lock(fs->lock);
+    fs->stopped = true;
+    g_cond_broadcast(fs->changed);
+    g_mutex_unlock(fs->lock);
+}
+
+void _vmnetfs_fill_destroy(struct vmnetfs_image *img)
+{
+    struct fill_state *fs = img->fill;
+
+    if (fs == NULL) {
+        return;
+    }
+    _vmnetfs_fill_stop(img);
+    g_thread_join(fs->thread);
+    g_cond_free(fs->changed);
+    g_mutex_free(fs->lock);
+    g_slice_free(struct fill_state, fs);
+    img->fill = NULL;
+}
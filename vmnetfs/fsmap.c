@@ -0,0 +1,1372 @@
+/*
+ * vmnetfs - virtual machine network execution virtual filesystem
+ *
+ * Copyright (C) 2006-2014 Carnegie Mellon University
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of version 2 of the GNU General Public License as published
+ * by the Free Software Foundation.  A copy of the GNU General Public License
+ * should have been distributed along with this program in the file
+ * COPYING.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ */
+
+/* The filesystem map reads the guest's filesystem metadata out of a disk
+   image and learns where the guest's large files are stored.  When the
+   guest reads the chunk holding the start of such a file, the rest of the
+   file is queued for prefetch, rather than being fetched as a long series
+   of scattered misses.
+
+   The analyzer thread understands qcow2 images (without backing files)
+   and raw images, MBR and GPT partition tables, ext4 filesystems using
+   extents, and NTFS.  It only parses filesystem metadata that is already
+   available locally, so it never costs bandwidth beyond the qcow2
+   header and mapping tables; inode tables and MFT records that the guest
+   hasn't touched are skipped and retried on later passes.  Recently read image
+   chunks are kept in a small cache of its own.  Its reads don't mark
+   chunks accessed or go through the RAM cache, since they aren't guest
+   use.  Prefetches are capped at a configured number of bytes per
+   session. */
+
+#include <string.h>
+#include <time.h>
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+#include "vmnetfs-private.h"
+
+#define FSMAP_DEFAULT_LIMIT (256 << 20)  /* bytes */
+#define FSMAP_RESCAN_INTERVAL 30  /* seconds */
+#define FSMAP_CACHE_CHUNKS 32
+#define FSMAP_MAX_FILES 65536
+/* Ignore files that fit in a couple of chunks */
+#define FSMAP_MIN_FILE_CHUNKS 2
+/* Above explicit requests at the default priority, since the guest is
+   reading the file now */
+#define FSMAP_PRIORITY 1
+
+#define QCOW_MAGIC 0x514649fb
+#define QCOW_OFLAG_COMPRESSED (1ULL << 62)
+#define QCOW_OFLAG_ZERO 1ULL
+#define QCOW_OFFSET_MASK 0x00fffffffffffe00ULL
+#define QCOW_INCOMPAT_DIRTY 1ULL
+
+#define EXT4_MAGIC 0xef53
+#define EXT4_INCOMPAT_EXTENTS 0x40
+#define EXT4_INCOMPAT_64BIT 0x80
+#define EXT4_INCOMPAT_META_BG 0x10
+#define EXT4_RO_COMPAT_GDT_CSUM 0x10
+#define EXT4_RO_COMPAT_METADATA_CSUM 0x400
+#define EXT4_BG_INODE_UNINIT 0x1
+#define EXT4_EXTENTS_FL 0x80000
+#define EXT4_EXTENT_MAGIC 0xf30a
+#define EXT4_MAX_DEPTH 5
+/* Files needing more than this are dropped rather than mapped, since a
+   corrupt tree could otherwise have us read the whole disk */
+#define EXT4_MAX_FILE_EXTENTS 4096
+#define EXT4_MAX_FILE_NODES 64  /* extent tree blocks read */
+
+#define NTFS_RECORD_IN_USE 0x1
+#define NTFS_RECORD_DIRECTORY 0x2
+#define NTFS_ATTR_DATA 0x80
+#define NTFS_ATTR_END 0xffffffff
+#define NTFS_FIXUP_STRIDE 512
+#define NTFS_FIRST_USER_RECORD 16
+
+/* Probe results */
+#define PROBE_FOUND 1
+#define PROBE_ABSENT 0
+#define PROBE_RETRY -1  /* needed metadata isn't available locally */
+
+enum fs_type {
+    FS_EXT4,
+    FS_NTFS,
+};
+
+/* A byte range of the guest disk, or of the image */
+struct fsmap_extent {
+    uint64_t start;
+    uint64_t count;
+};
+
+struct fsmap_file {
+    uint64_t trigger;  /* image chunk holding the start of the file */
+    GArray *extents;  /* guest disk ranges, in file order */
+    bool triggered;
+};
+
+struct ext4_group {
+    uint64_t inode_table;  /* block number */
+    uint32_t used_inodes;
+};
+
+struct guest_fs {
+    enum fs_type type;
+    uint64_t offset;  /* of the partition on the guest disk */
+    uint32_t block_size;  /* cluster size for NTFS */
+
+    /* ext4 */
+    uint32_t inode_size;
+    uint32_t inodes_per_group;
+    uint32_t itable_blocks;  /* per group */
+    uint32_t first_ino;
+    struct ext4_group *groups;
+
+    /* NTFS */
+    uint32_t record_size;
+    GArray *mft;  /* guest disk ranges holding the MFT */
+
+    /* Scanning progress, in inode table blocks or MFT records */
+    uint64_t units;
+    uint8_t *scanned;
+};
+
+struct cached_chunk {
+    uint64_t chunk;
+    uint32_t length;
+    char *data;
+};
+
+enum mapping_type {
+    MAP_DATA,
+    MAP_ZERO,
+    MAP_COMPRESSED,
+};
+
+/* Where a piece of the guest disk lives in the image */
+struct mapping {
+    enum mapping_type type;
+    uint64_t host;
+    uint64_t length;  /* of the guest range */
+    uint64_t compressed_length;
+    uint64_t cluster_offset;  /* of the guest offset, if compressed */
+};
+
+struct fsmap_state {
+    struct vmnetfs_image *img;
+    GMutex *lock;
+    GCond *changed;
+    GThread *thread;
+    GHashTable *triggers;  /* chunk -> struct fsmap_file */
+    GQueue *ready;  /* triggered files awaiting prefetch */
+    bool stopped;
+
+    /* Private to analyzer thread */
+    uint64_t budget;
+    bool probed;
+    GSList *filesystems;
+    uint64_t guest_size;
+    bool qcow;
+    uint32_t cluster_bits;
+    uint32_t l1_size;
+    uint64_t *l1;
+    GHashTable *chunks;  /* chunk -> struct cached_chunk */
+    GQueue *chunk_order;
+    char *inflated;  /* most recent compressed cluster */
+    uint64_t inflated_host;
+};
+
+static uint64_t get_le(const void *buf, int bytes)
+{
+    const uint8_t *p = buf;
+    uint64_t val = 0;
+
+    while (bytes-- > 0) {
+        val = val << 8 | p[bytes];
+    }
+    return val;
+}
+
+static uint64_t get_be(const void *buf, int bytes)
+{
+    const uint8_t *p = buf;
+    uint64_t val = 0;
+
+    while (bytes-- > 0) {
+        val = val << 8 | *p++;
+    }
+    return val;
+}
+
+static void file_free(void *data)
+{
+    struct fsmap_file *file = data;
+
+    g_array_free(file->extents, TRUE);
+    g_slice_free(struct fsmap_file, file);
+}
+
+static void guest_fs_free(struct guest_fs *gfs)
+{
+    g_free(gfs->groups);
+    if (gfs->mft) {
+        g_array_free(gfs->mft, TRUE);
+    }
+    g_free(gfs->scanned);
+    g_slice_free(struct guest_fs, gfs);
+}
+
+static void cached_chunk_free(void *data)
+{
+    struct cached_chunk *cc = data;
+
+    g_free(cc->data);
+    g_slice_free(struct cached_chunk, cc);
+}
+
+static void free_filesystems(struct fsmap_state *fsm)
+{
+    while (fsm->filesystems) {
+        guest_fs_free(fsm->filesystems->data);
+        fsm->filesystems = g_slist_delete_link(fsm->filesystems,
+                fsm->filesystems);
+    }
+    g_free(fsm->l1);
+    fsm->l1 = NULL;
+}
+
+static bool fsmap_should_stop(struct fsmap_state *fsm)
+{
+    bool ret;
+
+    g_mutex_lock(fsm->lock);
+    ret = fsm->stopped;
+    g_mutex_unlock(fsm->lock);
+    return ret;
+}
+
+/**** Image access ****/
+
+static bool chunk_is_local(struct vmnetfs_image *img, uint64_t chunk)
+{
+    return _vmnetfs_bit_test(img->modified_map, chunk) ||
+            _vmnetfs_bit_test(img->present_map, chunk) ||
+            _vmnetfs_bit_test(img->zero_map, chunk) ||
+            _vmnetfs_writeback_contains(img, chunk);
+}
+
+/* Returns NULL if the chunk isn't available without fetching it, unless
+   @fetch is set. */
+static struct cached_chunk *get_chunk(struct fsmap_state *fsm,
+        uint64_t chunk, bool fetch)
+{
+    struct vmnetfs_image *img = fsm->img;
+    struct cached_chunk *cc;
+    struct cached_chunk *old;
+    uint64_t image_size;
+    uint64_t read;
+    GError *err = NULL;
+
+    cc = g_hash_table_lookup(fsm->chunks, &chunk);
+    if (cc != NULL) {
+        return cc;
+    }
+    image_size = _vmnetfs_io_get_image_size(img, NULL);
+    if (chunk * img->chunk_size >= image_size) {
+        return NULL;
+    }
+    if (!fetch && !chunk_is_local(img, chunk)) {
+        return NULL;
+    }
+
+    cc = g_slice_new0(struct cached_chunk);
+    cc->chunk = chunk;
+    cc->length = MIN(img->chunk_size, image_size - chunk * img->chunk_size);
+    cc->data = g_malloc(cc->length);
+    read = _vmnetfs_io_peek_chunk(img, cc->data, chunk, 0, cc->length,
+            &err);
+    if (err) {
+        g_clear_error(&err);
+    }
+    if (read < cc->length) {
+        cached_chunk_free(cc);
+        return NULL;
+    }
+
+    g_hash_table_replace(fsm->chunks, &cc->chunk, cc);
+    g_queue_push_tail(fsm->chunk_order, cc);
+    if (g_queue_get_length(fsm->chunk_order) > FSMAP_CACHE_CHUNKS) {
+        old = g_queue_pop_head(fsm->chunk_order);
+        g_hash_table_remove(fsm->chunks, &old->chunk);
+    }
+    return cc;
+}
+
+/* Forget cached chunks, which the guest may have rewritten since. */
+static void flush_chunks(struct fsmap_state *fsm)
+{
+    g_queue_clear(fsm->chunk_order);
+    g_hash_table_remove_all(fsm->chunks);
+    fsm->inflated_host = G_MAXUINT64;
+}
+
+static bool read_image(struct fsmap_state *fsm, void *buf, uint64_t start,
+        uint64_t count, bool fetch)
+{
+    struct vmnetfs_image *img = fsm->img;
+    struct cached_chunk *cc;
+    uint64_t offset;
+    uint64_t cur;
+
+    while (count > 0) {
+        cc = get_chunk(fsm, start / img->chunk_size, fetch);
+        offset = start % img->chunk_size;
+        if (cc == NULL || offset >= cc->length) {
+            return false;
+        }
+        cur = MIN(count, cc->length - offset);
+        memcpy(buf, cc->data + offset, cur);
+        buf += cur;
+        start += cur;
+        count -= cur;
+    }
+    return true;
+}
+
+/**** Guest disk mapping ****/
+
+/* Only qcow2 metadata may be fetched, since it is small and the guest
+   disk can't be interpreted without it.  Returns PROBE_ABSENT if the
+   image is in a format we don't understand. */
+static int probe_qcow(struct fsmap_state *fsm)
+{
+    struct vmnetfs_image *img = fsm->img;
+    uint8_t hdr[104];
+    uint8_t *l1;
+    uint32_t version;
+    uint32_t i;
+
+    fsm->qcow = false;
+    fsm->guest_size = img->initial_size;
+    if (!read_image(fsm, hdr, 0, sizeof(hdr), true)) {
+        return PROBE_RETRY;
+    }
+    if (get_be(hdr, 4) != QCOW_MAGIC) {
+        return PROBE_FOUND;
+    }
+    version = get_be(hdr + 4, 4);
+    if (version < 2 || version > 3) {
+        return PROBE_ABSENT;
+    }
+    if (get_be(hdr + 8, 8) != 0) {
+        /* Unallocated clusters come from the backing file */
+        return PROBE_ABSENT;
+    }
+    if (get_be(hdr + 32, 4) != 0) {
+        /* Encrypted */
+        return PROBE_ABSENT;
+    }
+    if (version >= 3 && (get_be(hdr + 72, 8) & ~QCOW_INCOMPAT_DIRTY)) {
+        return PROBE_ABSENT;
+    }
+    fsm->cluster_bits = get_be(hdr + 20, 4);
+    if (fsm->cluster_bits < 9 || fsm->cluster_bits > 21) {
+        return PROBE_ABSENT;
+    }
+    fsm->guest_size = get_be(hdr + 24, 8);
+    fsm->l1_size = get_be(hdr + 36, 4);
+    if (fsm->l1_size > (1 << 24)) {
+        return PROBE_ABSENT;
+    }
+    l1 = g_malloc(fsm->l1_size * 8 + 1);
+    if (!read_image(fsm, l1, get_be(hdr + 40, 8), fsm->l1_size * 8,
+            true)) {
+        g_free(l1);
+        return PROBE_RETRY;
+    }
+    fsm->l1 = g_new(uint64_t, fsm->l1_size + 1);
+    for (i = 0; i < fsm->l1_size; i++) {
+        fsm->l1[i] = get_be(l1 + 8 * i, 8);
+    }
+    g_free(l1);
+    fsm->qcow = true;
+    return PROBE_FOUND;
+}
+
+/* Returns false if the mapping can't be determined. */
+static bool map_guest(struct fsmap_state *fsm, uint64_t guest,
+        struct mapping *map)
+{
+    uint64_t cluster_size = 1ULL << fsm->cluster_bits;
+    uint32_t l2_bits = fsm->cluster_bits - 3;
+    uint64_t l1_index;
+    uint64_t l2_offset;
+    uint64_t entry;
+    uint8_t buf[8];
+    uint32_t csize_shift;
+
+    if (guest >= fsm->guest_size) {
+        return false;
+    }
+    if (!fsm->qcow) {
+        map->type = MAP_DATA;
+        map->host = guest;
+        map->length = fsm->guest_size - guest;
+        return true;
+    }
+
+    map->length = cluster_size - (guest & (cluster_size - 1));
+    l1_index = guest >> (fsm->cluster_bits + l2_bits);
+    if (l1_index >= fsm->l1_size ||
+            !(l2_offset = fsm->l1[l1_index] & QCOW_OFFSET_MASK)) {
+        map->type = MAP_ZERO;
+        return true;
+    }
+    if (!read_image(fsm, buf, l2_offset + 8 * ((guest >> fsm->cluster_bits) &
+            ((1ULL << l2_bits) - 1)), sizeof(buf), true)) {
+        return false;
+    }
+    entry = get_be(buf, 8);
+    if (entry & QCOW_OFLAG_COMPRESSED) {
+        csize_shift = 62 - (fsm->cluster_bits - 8);
+        map->type = MAP_COMPRESSED;
+        map->host = entry & ((1ULL << csize_shift) - 1);
+        map->compressed_length = (((entry >> csize_shift) &
+                ((1ULL << (fsm->cluster_bits - 8)) - 1)) + 1) * 512 -
+                (map->host & 511);
+        map->cluster_offset = guest & (cluster_size - 1);
+    } else if ((entry & QCOW_OFLAG_ZERO) ||
+            !(entry & QCOW_OFFSET_MASK)) {
+        map->type = MAP_ZERO;
+    } else {
+        map->type = MAP_DATA;
+        map->host = (entry & QCOW_OFFSET_MASK) +
+                (guest & (cluster_size - 1));
+    }
+    return true;
+}
+
+#ifdef HAVE_ZLIB
+static bool read_compressed(struct fsmap_state *fsm, void *buf,
+        struct mapping *map, uint64_t count)
+{
+    uint64_t cluster_size = 1ULL << fsm->cluster_bits;
+    z_stream strm;
+    uint64_t image_size;
+    uint64_t in_len;
+    char *in;
+    int ret;
+
+    if (fsm->inflated_host != map->host) {
+        /* The compressed length is rounded up and may run past the end
+           of the image */
+        image_size = _vmnetfs_io_get_image_size(fsm->img, NULL);
+        in_len = MIN(map->compressed_length,
+                image_size - MIN(map->host, image_size));
+        in = g_malloc(in_len + 1);
+        if (!read_image(fsm, in, map->host, in_len, false)) {
+            g_free(in);
+            return false;
+        }
+        fsm->inflated_host = G_MAXUINT64;
+        if (fsm->inflated == NULL) {
+            fsm->inflated = g_malloc(cluster_size);
+        }
+        memset(&strm, 0, sizeof(strm));
+        if (inflateInit2(&strm, -12) != Z_OK) {
+            g_free(in);
+            return false;
+        }
+        strm.next_in = (Bytef *) in;
+        strm.avail_in = in_len;
+        strm.next_out = (Bytef *) fsm->inflated;
+        strm.avail_out = cluster_size;
+        ret = inflate(&strm, Z_FINISH);
+        inflateEnd(&strm);
+        g_free(in);
+        if ((ret != Z_STREAM_END && ret != Z_BUF_ERROR) ||
+                strm.avail_out != 0) {
+            return false;
+        }
+        fsm->inflated_host = map->host;
+    }
+    memcpy(buf, fsm->inflated + map->cluster_offset, count);
+    return true;
+}
+#endif
+
+/* Read guest disk data that is available locally. */
+static bool read_guest(struct fsmap_state *fsm, void *buf, uint64_t start,
+        uint64_t count)
+{
+    struct mapping map;
+    uint64_t cur;
+
+    while (count > 0) {
+        if (!map_guest(fsm, start, &map)) {
+            return false;
+        }
+        cur = MIN(count, map.length);
+        switch (map.type) {
+        case MAP_ZERO:
+            memset(buf, 0, cur);
+            break;
+        case MAP_DATA:
+            if (!read_image(fsm, buf, map.host, cur, false)) {
+                return false;
+            }
+            break;
+        case MAP_COMPRESSED:
+#ifdef HAVE_ZLIB
+            if (!read_compressed(fsm, buf, &map, cur)) {
+                return false;
+            }
+            break;
+#else
+            /* We can't read it */
+            return false;
+#endif
+        }
+        buf += cur;
+        start += cur;
+        count -= cur;
+    }
+    return true;
+}
+
+/* Append the image ranges holding the guest range to @ranges, merging
+   with the last range where possible.  Returns the number of bytes
+   added. */
+static uint64_t add_image_ranges(struct fsmap_state *fsm, GArray *ranges,
+        uint64_t start, uint64_t count)
+{
+    struct fsmap_extent *last;
+    struct fsmap_extent ext;
+    struct mapping map;
+    uint64_t added = 0;
+    uint64_t cur;
+
+    for (; count > 0; start += cur, count -= cur) {
+        if (!map_guest(fsm, start, &map)) {
+            break;
+        }
+        cur = MIN(count, map.length);
+        if (map.type == MAP_ZERO) {
+            continue;
+        }
+        ext.start = map.host;
+        ext.count = map.type == MAP_COMPRESSED ? map.compressed_length :
+                cur;
+        if (map.type == MAP_COMPRESSED && ranges->len > 0 &&
+                g_array_index(ranges, struct fsmap_extent,
+                ranges->len - 1).start == ext.start) {
+            /* Another piece of the same compressed cluster */
+            continue;
+        }
+        added += ext.count;
+        if (ranges->len > 0) {
+            last = &g_array_index(ranges, struct fsmap_extent,
+                    ranges->len - 1);
+            if (last->start + last->count == ext.start) {
+                last->count += ext.count;
+                continue;
+            }
+        }
+        g_array_append_val(ranges, ext);
+    }
+    return added;
+}
+
+/**** Index ****/
+
+/* Takes ownership of @extents. */
+static void add_file(struct fsmap_state *fsm, GArray *extents,
+        uint64_t size)
+{
+    struct vmnetfs_image *img = fsm->img;
+    struct fsmap_file *file;
+    struct mapping map;
+    uint64_t start;
+
+    if (extents->len == 0 ||
+            size < FSMAP_MIN_FILE_CHUNKS * (uint64_t) img->chunk_size) {
+        goto out;
+    }
+    start = g_array_index(extents, struct fsmap_extent, 0).start;
+    if (!map_guest(fsm, start, &map) || map.type == MAP_ZERO) {
+        goto out;
+    }
+
+    file = g_slice_new0(struct fsmap_file);
+    file->trigger = map.host / img->chunk_size;
+    file->extents = extents;
+    g_mutex_lock(fsm->lock);
+    if (g_hash_table_size(fsm->triggers) < FSMAP_MAX_FILES &&
+            !g_hash_table_lookup(fsm->triggers, &file->trigger)) {
+        g_hash_table_replace(fsm->triggers, &file->trigger, file);
+        file = NULL;
+    }
+    g_mutex_unlock(fsm->lock);
+    if (file != NULL) {
+        file_free(file);
+    }
+    return;
+
+out:
+    g_array_free(extents, TRUE);
+}
+
+static void mark_scanned(struct guest_fs *gfs, uint64_t unit)
+{
+    gfs->scanned[unit / 8] |= 1 << (unit % 8);
+}
+
+static bool is_scanned(struct guest_fs *gfs, uint64_t unit)
+{
+    return gfs->scanned[unit / 8] & (1 << (unit % 8));
+}
+
+/**** ext4 ****/
+
+static int probe_ext4(struct fsmap_state *fsm, uint64_t offset)
+{
+    struct guest_fs *gfs;
+    uint8_t sb[1024];
+    uint8_t *descs;
+    uint8_t *desc;
+    uint64_t blocks;
+    uint32_t first_block;
+    uint32_t blocks_per_group;
+    uint32_t incompat;
+    uint32_t desc_size;
+    uint64_t groups;
+    uint32_t unused;
+    uint64_t i;
+    bool csum;
+    bool is_64bit;
+    int ret;
+
+    if (!read_guest(fsm, sb, offset + 1024, sizeof(sb))) {
+        return PROBE_RETRY;
+    }
+    if (get_le(sb + 0x38, 2) != EXT4_MAGIC) {
+        return PROBE_ABSENT;
+    }
+    incompat = get_le(sb + 0x60, 4);
+    if (!(incompat & EXT4_INCOMPAT_EXTENTS) ||
+            (incompat & EXT4_INCOMPAT_META_BG)) {
+        /* ext2/3 files map their blocks indirectly; not supported */
+        return PROBE_ABSENT;
+    }
+    is_64bit = incompat & EXT4_INCOMPAT_64BIT;
+    csum = get_le(sb + 0x64, 4) & (EXT4_RO_COMPAT_GDT_CSUM |
+            EXT4_RO_COMPAT_METADATA_CSUM);
+    if (get_le(sb + 0x18, 4) > 6) {
+        return PROBE_ABSENT;
+    }
+
+    gfs = g_slice_new0(struct guest_fs);
+    gfs->type = FS_EXT4;
+    gfs->offset = offset;
+    gfs->block_size = 1024 << get_le(sb + 0x18, 4);
+    gfs->inodes_per_group = get_le(sb + 0x28, 4);
+    gfs->inode_size = get_le(sb + 0x4c, 4) >= 1 ? get_le(sb + 0x58, 2) :
+            128;
+    gfs->first_ino = get_le(sb + 0x4c, 4) >= 1 ? get_le(sb + 0x54, 4) : 11;
+    first_block = get_le(sb + 0x14, 4);
+    blocks_per_group = get_le(sb + 0x20, 4);
+    blocks = get_le(sb + 0x4, 4);
+    desc_size = 32;
+    if (is_64bit) {
+        blocks |= get_le(sb + 0x150, 4) << 32;
+        desc_size = MAX(get_le(sb + 0xfe, 2), 32);
+    }
+    if (gfs->inode_size < 128 || gfs->inode_size > gfs->block_size ||
+            blocks_per_group == 0 || gfs->inodes_per_group == 0 ||
+            blocks <= first_block || offset >= fsm->guest_size ||
+            blocks > (fsm->guest_size - offset) / gfs->block_size) {
+        ret = PROBE_ABSENT;
+        goto bad;
+    }
+    groups = (blocks - first_block + blocks_per_group - 1) /
+            blocks_per_group;
+    gfs->itable_blocks = ((uint64_t) gfs->inodes_per_group *
+            gfs->inode_size + gfs->block_size - 1) / gfs->block_size;
+    /* The descriptors and inode tables must fit on the disk */
+    if (groups > fsm->guest_size / desc_size || gfs->itable_blocks >
+            fsm->guest_size / gfs->block_size / groups) {
+        ret = PROBE_ABSENT;
+        goto bad;
+    }
+
+    descs = g_malloc(groups * desc_size);
+    if (!read_guest(fsm, descs, offset + (uint64_t) (first_block + 1) *
+            gfs->block_size, groups * desc_size)) {
+        g_free(descs);
+        ret = PROBE_RETRY;
+        goto bad;
+    }
+    gfs->groups = g_new0(struct ext4_group, groups);
+    for (i = 0; i < groups; i++) {
+        desc = descs + i * desc_size;
+        gfs->groups[i].inode_table = get_le(desc + 0x8, 4);
+        unused = 0;
+        if (desc_size >= 64) {
+            gfs->groups[i].inode_table |= get_le(desc + 0x28, 4) << 32;
+        }
+        if (csum) {
+            unused = get_le(desc + 0x1c, 2);
+            if (desc_size >= 64) {
+                unused |= get_le(desc + 0x32, 2) << 16;
+            }
+            if (get_le(desc + 0x12, 2) & EXT4_BG_INODE_UNINIT) {
+                unused = gfs->inodes_per_group;
+            }
+        }
+        gfs->groups[i].used_inodes = gfs->inodes_per_group -
+                MIN(unused, gfs->inodes_per_group);
+    }
+    g_free(descs);
+
+    gfs->units = groups * gfs->itable_blocks;
+    gfs->scanned = g_malloc0((gfs->units + 7) / 8);
+    fsm->filesystems = g_slist_prepend(fsm->filesystems, gfs);
+    return PROBE_FOUND;
+
+bad:
+    guest_fs_free(gfs);
+    return ret;
+}
+
+static bool ext4_file_too_large(GArray *extents, uint32_t nodes)
+{
+    return extents->len > EXT4_MAX_FILE_EXTENTS ||
+            nodes > EXT4_MAX_FILE_NODES;
+}
+
+/* Collect the extents under an extent tree node, counting the tree
+   blocks read in @nodes and stopping once the file is too large.
+   Returns false if part of the tree isn't available. */
+static bool ext4_walk_extents(struct fsmap_state *fsm, struct guest_fs *gfs,
+        const uint8_t *node, uint32_t node_size, int depth, GArray *extents,
+        uint32_t *nodes)
+{
+    struct fsmap_extent ext;
+    const uint8_t *entry;
+    uint8_t *child;
+    uint64_t block;
+    uint32_t entries;
+    uint32_t len;
+    uint32_t i;
+    bool ret = true;
+
+    if (get_le(node, 2) != EXT4_EXTENT_MAGIC ||
+            get_le(node + 6, 2) != (uint32_t) depth) {
+        return true;  /* corrupt; give up on the file quietly */
+    }
+    entries = MIN(get_le(node + 2, 2), (node_size - 12) / 12);
+    for (i = 0; i < entries && !ext4_file_too_large(extents, *nodes);
+            i++) {
+        entry = node + 12 + 12 * i;
+        if (depth == 0) {
+            len = get_le(entry + 4, 2);
+            if (len > 32768) {
+                /* Uninitialized; reads as zeroes */
+                continue;
+            }
+            block = get_le(entry + 8, 4) | get_le(entry + 6, 2) << 32;
+            ext.start = gfs->offset + block * gfs->block_size;
+            ext.count = (uint64_t) len * gfs->block_size;
+            g_array_append_val(extents, ext);
+        } else {
+            block = get_le(entry + 4, 4) | get_le(entry + 8, 2) << 32;
+            child = g_malloc(gfs->block_size);
+            ++*nodes;
+            if (read_guest(fsm, child, gfs->offset + block *
+                    gfs->block_size, gfs->block_size)) {
+                ret = ext4_walk_extents(fsm, gfs, child, gfs->block_size,
+                        depth - 1, extents, nodes) && ret;
+            } else {
+                ret = false;
+            }
+            g_free(child);
+        }
+    }
+    return ret;
+}
+
+/* Returns false if the unit must be retried. */
+static bool ext4_scan_unit(struct fsmap_state *fsm, struct guest_fs *gfs,
+        uint64_t unit)
+{
+    struct ext4_group *group = &gfs->groups[unit / gfs->itable_blocks];
+    uint32_t per_block = gfs->block_size / gfs->inode_size;
+    uint32_t first = (unit % gfs->itable_blocks) * per_block;
+    uint64_t ino;
+    uint64_t size;
+    uint32_t depth;
+    uint32_t nodes;
+    uint8_t *block;
+    uint8_t *inode;
+    GArray *extents;
+    uint32_t i;
+    bool ok;
+    bool ret = true;
+
+    if (first >= group->used_inodes) {
+        return true;
+    }
+    block = g_malloc(gfs->block_size);
+    if (!read_guest(fsm, block, gfs->offset + (group->inode_table +
+            unit % gfs->itable_blocks) * gfs->block_size,
+            gfs->block_size)) {
+        g_free(block);
+        return false;
+    }
+    for (i = 0; i < per_block && first + i < group->used_inodes; i++) {
+        inode = block + i * gfs->inode_size;
+        ino = (unit / gfs->itable_blocks) * gfs->inodes_per_group +
+                first + i + 1;
+        if (ino < gfs->first_ino ||
+                (get_le(inode, 2) & 0xf000) != 0x8000 ||
+                !(get_le(inode + 0x20, 4) & EXT4_EXTENTS_FL) ||
+                get_le(inode + 0x1a, 2) == 0) {
+            continue;
+        }
+        size = get_le(inode + 0x4, 4) | get_le(inode + 0x6c, 4) << 32;
+        depth = get_le(inode + 0x28 + 6, 2);
+        if (depth > EXT4_MAX_DEPTH) {
+            continue;
+        }
+        extents = g_array_new(FALSE, FALSE, sizeof(struct fsmap_extent));
+        nodes = 0;
+        ok = ext4_walk_extents(fsm, gfs, inode + 0x28, 60, depth, extents,
+                &nodes);
+        if (ext4_file_too_large(extents, nodes)) {
+            /* Drop it, and don't retry */
+            g_array_set_size(extents, 0);
+        } else if (!ok) {
+            ret = false;
+        }
+        add_file(fsm, extents, size);
+    }
+    g_free(block);
+    return ret;
+}
+
+/**** NTFS ****/
+
+/* Apply the update sequence array.  Returns false if the record is
+   torn or invalid. */
+static bool ntfs_fixup(uint8_t *rec, uint32_t size)
+{
+    uint32_t usa_offset = get_le(rec + 4, 2);
+    uint32_t usa_count = get_le(rec + 6, 2);
+    uint32_t i;
+    uint8_t *end;
+
+    if (memcmp(rec, "FILE", 4) || usa_count == 0 ||
+            usa_count - 1 > size / NTFS_FIXUP_STRIDE ||
+            usa_offset + 2 * usa_count > size) {
+        return false;
+    }
+    for (i = 1; i < usa_count; i++) {
+        end = rec + i * NTFS_FIXUP_STRIDE - 2;
+        if (memcmp(end, rec + usa_offset, 2)) {
+            return false;
+        }
+        memcpy(end, rec + usa_offset + 2 * i, 2);
+    }
+    return true;
+}
+
+/* Find the unnamed $DATA attribute of a base record and decode its runs
+   into guest disk ranges.  Returns false if there is none. */
+static bool ntfs_data_runs(struct guest_fs *gfs, const uint8_t *rec,
+        uint32_t size, GArray *extents, uint64_t *data_size)
+{
+    struct fsmap_extent ext;
+    const uint8_t *attr = NULL;
+    const uint8_t *run;
+    const uint8_t *end;
+    uint32_t offset = get_le(rec + 0x14, 2);
+    uint32_t len = 0;
+    int64_t lcn = 0;
+    int64_t delta;
+    int len_bytes;
+    int off_bytes;
+
+    while (offset + 16 <= size) {
+        attr = rec + offset;
+        if (get_le(attr, 4) == NTFS_ATTR_END) {
+            return false;
+        }
+        len = get_le(attr + 4, 4);
+        if (len < 16 || offset + len > size) {
+            return false;
+        }
+        if (get_le(attr, 4) == NTFS_ATTR_DATA && attr[9] == 0) {
+            break;
+        }
+        offset += len;
+    }
+    if (offset + 16 > size || attr[8] == 0 || len < 0x40 ||
+            get_le(attr + 0x10, 8) != 0) {
+        /* Missing, resident, or a continuation */
+        return false;
+    }
+    *data_size = get_le(attr + 0x30, 8);
+
+    end = attr + len;
+    for (run = attr + get_le(attr + 0x20, 2); run < end && *run;
+            run += 1 + len_bytes + off_bytes) {
+        len_bytes = *run & 0xf;
+        off_bytes = *run >> 4;
+        if (len_bytes == 0 || len_bytes > 8 || off_bytes > 8 ||
+                run + 1 + len_bytes + off_bytes > end) {
+            break;
+        }
+        if (off_bytes == 0) {
+            /* Sparse */
+            continue;
+        }
+        delta = get_le(run + 1 + len_bytes, off_bytes);
+        if (off_bytes < 8 && (run[len_bytes + off_bytes] & 0x80)) {
+            delta -= 1LL << (8 * off_bytes);
+        }
+        lcn += delta;
+        if (lcn < 0) {
+            break;
+        }
+        ext.start = gfs->offset + (uint64_t) lcn * gfs->block_size;
+        ext.count = get_le(run + 1, len_bytes) * gfs->block_size;
+        g_array_append_val(extents, ext);
+    }
+    return true;
+}
+
+/* Map a byte offset within the MFT to the guest disk. */
+static bool ntfs_mft_offset(struct guest_fs *gfs, uint64_t offset,
+        uint64_t *guest)
+{
+    struct fsmap_extent *ext;
+    uint32_t i;
+
+    for (i = 0; i < gfs->mft->len; i++) {
+        ext = &g_array_index(gfs->mft, struct fsmap_extent, i);
+        if (offset < ext->count) {
+            *guest = ext->start + offset;
+            return true;
+        }
+        offset -= ext->count;
+    }
+    return false;
+}
+
+static int probe_ntfs(struct fsmap_state *fsm, uint64_t offset)
+{
+    struct guest_fs *gfs;
+    uint8_t boot[512];
+    uint8_t *rec;
+    uint64_t data_size;
+    uint32_t sector_size;
+    uint32_t per_cluster;
+    int8_t per_record;
+    int ret = PROBE_ABSENT;
+
+    if (!read_guest(fsm, boot, offset, sizeof(boot))) {
+        return PROBE_RETRY;
+    }
+    if (memcmp(boot + 3, "NTFS    ", 8)) {
+        return PROBE_ABSENT;
+    }
+    sector_size = get_le(boot + 0xb, 2);
+    per_cluster = boot[0xd];
+    if (per_cluster > 0x80) {
+        /* A power of two; anything past 2^12 is rejected below */
+        if (256 - per_cluster > 12) {
+            return PROBE_ABSENT;
+        }
+        per_cluster = 1 << (256 - per_cluster);
+    }
+    per_record = boot[0x40];
+    if (sector_size < 512 || sector_size > 4096 || per_cluster == 0 ||
+            per_cluster > 4096) {
+        return PROBE_ABSENT;
+    }
+
+    gfs = g_slice_new0(struct guest_fs);
+    gfs->type = FS_NTFS;
+    gfs->offset = offset;
+    gfs->block_size = sector_size * per_cluster;
+    if (per_record > 0) {
+        gfs->record_size = per_record * gfs->block_size;
+    } else if (per_record > -31) {
+        gfs->record_size = 1 << -per_record;
+    }
+    if (gfs->record_size < 1024 || gfs->record_size > 65536) {
+        goto bad;
+    }
+
+    /* The MFT describes itself in record 0 */
+    rec = g_malloc(gfs->record_size);
+    gfs->mft = g_array_new(FALSE, FALSE, sizeof(struct fsmap_extent));
+    if (!read_guest(fsm, rec, offset + get_le(boot + 0x30, 8) *
+            gfs->block_size, gfs->record_size)) {
+        g_free(rec);
+        ret = PROBE_RETRY;
+        goto bad;
+    }
+    if (!ntfs_fixup(rec, gfs->record_size) ||
+            !ntfs_data_runs(gfs, rec, gfs->record_size, gfs->mft,
+            &data_size) || gfs->mft->len == 0) {
+        g_free(rec);
+        goto bad;
+    }
+    g_free(rec);
+    /* The MFT must fit on the disk */
+    if (data_size > fsm->guest_size) {
+        goto bad;
+    }
+
+    gfs->units = data_size / gfs->record_size;
+    gfs->scanned = g_malloc0((gfs->units + 7) / 8);
+    fsm->filesystems = g_slist_prepend(fsm->filesystems, gfs);
+    return PROBE_FOUND;
+
+bad:
+    guest_fs_free(gfs);
+    return ret;
+}
+
+static bool ntfs_scan_unit(struct fsmap_state *fsm, struct guest_fs *gfs,
+        uint64_t unit)
+{
+    uint8_t *rec;
+    uint64_t guest;
+    uint64_t data_size;
+    uint32_t flags;
+    GArray *extents;
+
+    if (unit < NTFS_FIRST_USER_RECORD ||
+            !ntfs_mft_offset(gfs, unit * gfs->record_size, &guest)) {
+        return true;
+    }
+    rec = g_malloc(gfs->record_size);
+    if (!read_guest(fsm, rec, guest, gfs->record_size)) {
+        g_free(rec);
+        return false;
+    }
+    if (!ntfs_fixup(rec, gfs->record_size)) {
+        /* Torn or unused */
+        g_free(rec);
+        return true;
+    }
+    flags = get_le(rec + 0x16, 2);
+    if ((flags & NTFS_RECORD_IN_USE) &&
+            !(flags & NTFS_RECORD_DIRECTORY) &&
+            get_le(rec + 0x20, 8) == 0) {
+        extents = g_array_new(FALSE, FALSE, sizeof(struct fsmap_extent));
+        if (ntfs_data_runs(gfs, rec, gfs->record_size, extents,
+                &data_size)) {
+            add_file(fsm, extents, data_size);
+        } else {
+            g_array_free(extents, TRUE);
+        }
+    }
+    g_free(rec);
+    return true;
+}
+
+/**** Analyzer ****/
+
+static int probe_fs(struct fsmap_state *fsm, uint64_t offset)
+{
+    int ret;
+
+    ret = probe_ext4(fsm, offset);
+    if (ret == PROBE_ABSENT) {
+        ret = probe_ntfs(fsm, offset);
+    }
+    return ret;
+}
+
+/* Returns PROBE_RETRY if the partition table or a filesystem couldn't
+   be read. */
+static int probe_partitions(struct fsmap_state *fsm)
+{
+    uint8_t mbr[512];
+    uint8_t gpt[92];
+    uint8_t *entries;
+    uint8_t *entry;
+    uint64_t lba;
+    uint32_t count;
+    uint32_t size;
+    uint32_t i;
+    uint8_t type;
+    bool is_gpt = false;
+    int ret;
+
+    if (!read_guest(fsm, mbr, 0, sizeof(mbr))) {
+        return PROBE_RETRY;
+    }
+    ret = probe_fs(fsm, 0);
+    if (ret != PROBE_ABSENT) {
+        /* Unpartitioned, or we need to try again */
+        return ret;
+    }
+    if (mbr[510] != 0x55 || mbr[511] != 0xaa) {
+        return PROBE_ABSENT;
+    }
+    for (i = 0; i < 4; i++) {
+        if (mbr[446 + 16 * i + 4] == 0xee) {
+            is_gpt = true;
+        }
+    }
+
+    if (!is_gpt) {
+        /* Logical partitions aren't examined */
+        for (i = 0; i < 4; i++) {
+            entry = mbr + 446 + 16 * i;
+            type = entry[4];
+            lba = get_le(entry + 8, 4);
+            if (type != 0 && type != 0x05 && type != 0x0f &&
+                    type != 0x85 && lba != 0 &&
+                    probe_fs(fsm, lba * 512) == PROBE_RETRY) {
+                return PROBE_RETRY;
+            }
+        }
+        return PROBE_FOUND;
+    }
+
+    if (!read_guest(fsm, gpt, 512, sizeof(gpt))) {
+        return PROBE_RETRY;
+    }
+    if (memcmp(gpt, "EFI PART", 8)) {
+        return PROBE_ABSENT;
+    }
+    lba = get_le(gpt + 0x48, 8);
+    count = MIN(get_le(gpt + 0x50, 4), 256);
+    size = get_le(gpt + 0x54, 4);
+    if (size < 128 || size > 4096) {
+        return PROBE_ABSENT;
+    }
+    entries = g_malloc((uint64_t) count * size);
+    if (!read_guest(fsm, entries, lba * 512, (uint64_t) count * size)) {
+        g_free(entries);
+        return PROBE_RETRY;
+    }
+    ret = PROBE_FOUND;
+    for (i = 0; i < count && ret != PROBE_RETRY; i++) {
+        entry = entries + (uint64_t) i * size;
+        if (get_le(entry, 8) == 0 && get_le(entry + 8, 8) == 0) {
+            continue;
+        }
+        if (probe_fs(fsm, get_le(entry + 0x20, 8) * 512) == PROBE_RETRY) {
+            ret = PROBE_RETRY;
+        }
+    }
+    g_free(entries);
+    return ret;
+}
+
+/* Queue prefetches for a triggered file, within the budget. */
+static void prefetch_file(struct fsmap_state *fsm, struct fsmap_file *file)
+{
+    struct fsmap_extent *ext;
+    GArray *ranges;
+    GError *err = NULL;
+    uint32_t id;
+    uint32_t i;
+
+    ranges = g_array_new(FALSE, FALSE, sizeof(struct fsmap_extent));
+    for (i = 0; i < file->extents->len && fsm->budget > 0; i++) {
+        ext = &g_array_index(file->extents, struct fsmap_extent, i);
+        fsm->budget -= MIN(fsm->budget, add_image_ranges(fsm, ranges,
+                ext->start, MIN(ext->count, fsm->budget)));
+    }
+    for (i = 0; i < ranges->len; i++) {
+        ext = &g_array_index(ranges, struct fsmap_extent, i);
+        if (!_vmnetfs_prefetch_queue(fsm->img, ext->start, ext->count,
+                FSMAP_PRIORITY, &id, &err)) {
+            g_clear_error(&err);
+            break;
+        }
+    }
+    g_array_free(ranges, TRUE);
+}
+
+static void process_ready(struct fsmap_state *fsm)
+{
+    struct fsmap_file *file;
+
+    while (true) {
+        g_mutex_lock(fsm->lock);
+        file = g_queue_pop_head(fsm->ready);
+        g_mutex_unlock(fsm->lock);
+        if (file == NULL) {
+            return;
+        }
+        if (fsm->budget > 0) {
+            prefetch_file(fsm, file);
+        }
+    }
+}
+
+static void scan(struct fsmap_state *fsm)
+{
+    struct guest_fs *gfs;
+    GSList *cur;
+    uint64_t unit;
+    bool done;
+    int ret;
+
+    flush_chunks(fsm);
+    if (!fsm->probed) {
+        ret = probe_qcow(fsm);
+        if (ret == PROBE_FOUND) {
+            ret = probe_partitions(fsm);
+        }
+        if (ret == PROBE_RETRY) {
+            /* Try again once the guest has read more of its disk */
+            free_filesystems(fsm);
+            return;
+        }
+        fsm->probed = true;
+    }
+
+    for (cur = fsm->filesystems; cur != NULL; cur = cur->next) {
+        gfs = cur->data;
+        for (unit = 0; unit < gfs->units; unit++) {
+            if (is_scanned(gfs, unit)) {
+                continue;
+            }
+            if (gfs->type == FS_EXT4) {
+                done = ext4_scan_unit(fsm, gfs, unit);
+            } else {
+                done = ntfs_scan_unit(fsm, gfs, unit);
+            }
+            if (done) {
+                mark_scanned(gfs, unit);
+            }
+            if (unit % 256 == 0) {
+                /* Don't delay triggered files for the whole pass */
+                process_ready(fsm);
+                if (fsmap_should_stop(fsm)) {
+                    return;
+                }
+            }
+        }
+    }
+}
+
+static void *fsmap_thread(void *data)
+{
+    struct fsmap_state *fsm = data;
+    GTimeVal deadline;
+    bool timed_out;
+
+    while (!fsmap_should_stop(fsm)) {
+        scan(fsm);
+        g_get_current_time(&deadline);
+        g_time_val_add(&deadline, FSMAP_RESCAN_INTERVAL * G_USEC_PER_SEC);
+        do {
+            process_ready(fsm);
+            g_mutex_lock(fsm->lock);
+            timed_out = false;
+            while (!fsm->stopped && g_queue_is_empty(fsm->ready) &&
+                    !timed_out) {
+                timed_out = !g_cond_timed_wait(fsm->changed, fsm->lock,
+                        &deadline);
+            }
+            g_mutex_unlock(fsm->lock);
+        } while (!timed_out && !fsmap_should_stop(fsm));
+    }
+    return NULL;
+}
+
+/* Called for guest reads.  Never blocks on the analyzer. */
+void _vmnetfs_fsmap_note_read(struct vmnetfs_image *img, uint64_t start,
+        uint64_t count)
+{
+    struct fsmap_state *fsm = img->fsmap;
+    struct fsmap_file *file;
+    uint64_t chunk;
+
+    if (fsm == NULL || count == 0) {
+        return;
+    }
+    g_mutex_lock(fsm->lock);
+    for (chunk = start / img->chunk_size;
+            chunk <= (start + count - 1) / img->chunk_size; chunk++) {
+        file = g_hash_table_lookup(fsm->triggers, &chunk);
+        if (file != NULL && !file->triggered) {
+            file->triggered = true;
+            g_queue_push_tail(fsm->ready, file);
+            g_cond_broadcast(fsm->changed);
+        }
+    }
+    g_mutex_unlock(fsm->lock);
+}
+
+bool _vmnetfs_fsmap_start(struct vmnetfs_image *img, GError **err)
+{
+    struct fsmap_state *fsm;
+
+    g_assert(!img->fsmap);
+
+    fsm = g_slice_new0(struct fsmap_state);
+    fsm->img = img;
+    fsm->lock = g_mutex_new();
+    fsm->changed = g_cond_new();
+    fsm->triggers = g_hash_table_new_full(g_int64_hash, g_int64_equal,
+            NULL, file_free);
+    fsm->ready = g_queue_new();
+    fsm->budget = img->fs_prefetch_limit ?: FSMAP_DEFAULT_LIMIT;
+    fsm->chunks = g_hash_table_new_full(g_int64_hash, g_int64_equal,
+            NULL, cached_chunk_free);
+    fsm->chunk_order = g_queue_new();
+    fsm->inflated_host = G_MAXUINT64;
+    img->fsmap = fsm;
+    fsm->thread = g_thread_create(fsmap_thread, fsm, TRUE, err);
+    if (fsm->thread == NULL) {
+        img->fsmap = NULL;
+        g_queue_free(fsm->chunk_order);
+        g_hash_table_destroy(fsm->chunks);
+        g_queue_free(fsm->ready);
+        g_hash_table_destroy(fsm->triggers);
+        g_cond_free(fsm->changed);
+        g_mutex_free(fsm->lock);
+        g_slice_free(struct fsmap_state, fsm);
+        return false;
+    }
+    return true;
+}
+
+void _vmnetfs_fsmap_stop(struct vmnetfs_image *img)
+{
+    struct fsmap_state *fsm = img->fsmap;
+
+    if (fsm == NULL) {
+        return;
+    }
+    g_mutex_lock(fsm->lock);
+    fsm->stopped = true;
+    g_cond_broadcast(fsm->changed);
+    g_mutex_unlock(fsm->lock);
+}
+
+void _vmnetfs_fsmap_destroy(struct vmnetfs_image *img)
+{
+    struct fsmap_state *fsm = img->fsmap;
+
+    if (fsm == NULL) {
+        return;
+    }
+    _vmnetfs_fsmap_stop(img);
+    g_thread_join(fsm->thread);
+    free_filesystems(fsm);
+    g_free(fsm->inflated);
+    g_queue_free(fsm->chunk_order);
+    g_hash_table_destroy(fsm->chunks);
+    g_queue_free(fsm->ready);
+    g_hash_table_destroy(fsm->triggers);
+    g_cond_free(fsm->changed);
+    g_mutex_free(fsm->lock);
+    g_slice_free(struct fsmap_state, fsm);
+    img->fsmap = NULL;
+}
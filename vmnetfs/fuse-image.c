@@ -15,9 +15,11 @@
  * for more details.
  */
 
+#include <fcntl.h>
 #include <string.h>
 #include <inttypes.h>
 #include <errno.h>
+#include <time.h>
 #include "vmnetfs-private.h"
 
 static int image_getattr(void *dentry_ctx, struct stat *st)
@@ -26,6 +28,11 @@ static int image_getattr(void *dentry_ctx, struct stat *st)
 
     st->st_mode = S_IFREG | 0600;
     st->st_size = _vmnetfs_io_get_image_size(img, NULL);
+    if (img->kernel_cache) {
+        /* A changed mtime could cause the kernel to drop its cached
+           pages */
+        st->st_atime = st->st_mtime = st->st_ctime = img->mtime;
+    }
     return 0;
 }
 
@@ -54,85 +61,332 @@ static int image_open(void *dentry_ctx, struct vmnetfs_fuse_fh *fh)
     struct vmnetfs_image *img = dentry_ctx;
 
     fh->data = img;
+    /* The kernel keeps its page cache coherent across write, truncate,
+       and discard through this file.  Other writers go through
+       _vmnetfs_io_notify_changed(). */
+    fh->kernel_cache = img->kernel_cache;
+    if (img->kernel_cache) {
+        g_atomic_pointer_set(&img->fuse_ino,
+                GSIZE_TO_POINTER(fh->ino));
+    }
     return 0;
 }
 
+/* Convert the result of a read into a FUSE return value.  Frees @err. */
+static int read_result(struct vmnetfs_fuse_fh *fh, uint64_t read,
+        GError *err)
+{
+    struct vmnetfs_image *img = fh->data;
+
+    _vmnetfs_u64_stat_increment(img->bytes_read, read);
+    if (err && fh->kernel_cache && !g_error_matches(err, VMNETFS_IO_ERROR,
+            VMNETFS_IO_ERROR_EOF)) {
+        /* The page cache treats a short read as end of file and would
+           cache zeroes for the rest of the page, so fail the whole
+           read instead. */
+        read = 0;
+    }
+    if (err) {
+        if (g_error_matches(err, VMNETFS_IO_ERROR,
+                VMNETFS_IO_ERROR_INTERRUPTED)) {
+            g_clear_error(&err);
+            return (int) read ?: -EINTR;
+        } else if (g_error_matches(err, VMNETFS_IO_ERROR,
+                VMNETFS_IO_ERROR_EOF)) {
+            g_clear_error(&err);
+            return read;
+        } else {
+            g_warning("%s", err->message);
+            g_clear_error(&err);
+            _vmnetfs_u64_stat_increment(img->io_errors, 1);
+            return (int) read ?: -EIO;
+        }
+    }
+    return read;
+}
+
 static int image_read(struct vmnetfs_fuse_fh *fh, void *buf, uint64_t start,
         uint64_t count)
 {
     struct vmnetfs_image *img = fh->data;
-    struct vmnetfs_cursor cur;
     GError *err = NULL;
-    uint64_t read = 0;
+    uint64_t read;
+
+    _vmnetfs_stream_group_write(img->io_stream, "read %"PRIu64"+%"PRIu64"\n",
+            start, count);
+    _vmnetfs_fsmap_note_read(img, start, count);
+    read = _vmnetfs_io_read(img, buf, start, count, &err);
+    return read_result(fh, read, err);
+}
+
+static int image_read_segments(struct vmnetfs_fuse_fh *fh, GArray *segs,
+        uint64_t start, uint64_t count)
+{
+    struct vmnetfs_image *img = fh->data;
+    GError *err = NULL;
+    uint64_t read;
 
     _vmnetfs_stream_group_write(img->io_stream, "read %"PRIu64"+%"PRIu64"\n",
             start, count);
+    _vmnetfs_fsmap_note_read(img, start, count);
+    read = _vmnetfs_io_read_segments(img, segs, start, count, &err);
+    return read_result(fh, read, err);
+}
+
+static void image_release_segments(struct vmnetfs_fuse_fh *fh, GArray *segs)
+{
+    _vmnetfs_io_release_segments(fh->data, segs);
+}
+
+/* Start fetching whatever the read will need from the network, so the
+   FUSE thread need not wait for it. */
+static int image_read_defer(struct vmnetfs_fuse_fh *fh, uint64_t start,
+        uint64_t count, void (*ready)(void *arg), void *arg)
+{
+    struct vmnetfs_image *img = fh->data;
+    int pending;
+
+    pending = _vmnetfs_io_fetch_async(img, start, count,
+            FETCH_PRIORITY_DEMAND, ready, arg);
+    if (pending > 0) {
+        _vmnetfs_fill_note_demand(img, count);
+    }
+    return pending;
+}
+
+static int image_write(struct vmnetfs_fuse_fh *fh, const void *buf,
+        uint64_t start, uint64_t count)
+{
+    struct vmnetfs_image *img = fh->data;
+    struct vmnetfs_cursor cur;
+    GError *err = NULL;
+    uint64_t written = 0;
+
+    _vmnetfs_stream_group_write(img->io_stream, "write %"PRIu64"+%"PRIu64"\n",
+            start, count);
     for (_vmnetfs_cursor_start(img, &cur, start, count);
-            _vmnetfs_cursor_chunk(&cur, read); ) {
-        read = _vmnetfs_io_read_chunk(img, buf + cur.io_offset, cur.chunk,
+            _vmnetfs_cursor_chunk(&cur, written); ) {
+        written = _vmnetfs_io_write_chunk(img, buf + cur.io_offset, cur.chunk,
                 cur.offset, cur.length, &err);
         if (err) {
             if (g_error_matches(err, VMNETFS_IO_ERROR,
                     VMNETFS_IO_ERROR_INTERRUPTED)) {
                 g_clear_error(&err);
-                return (int) (cur.io_offset + read) ?: -EINTR;
-            } else if (g_error_matches(err, VMNETFS_IO_ERROR,
-                    VMNETFS_IO_ERROR_EOF)) {
-                g_clear_error(&err);
-                return cur.io_offset + read;
+                return (int) (cur.io_offset + written) ?: -EINTR;
             } else {
                 g_warning("%s", err->message);
                 g_clear_error(&err);
                 _vmnetfs_u64_stat_increment(img->io_errors, 1);
-                return (int) (cur.io_offset + read) ?: -EIO;
+                return (int) (cur.io_offset + written) ?: -EIO;
             }
         }
-        _vmnetfs_u64_stat_increment(img->bytes_read, cur.length);
+        _vmnetfs_u64_stat_increment(img->bytes_written, cur.length);
     }
     return cur.io_offset;
 }
 
-static int image_write(struct vmnetfs_fuse_fh *fh, const void *buf,
+static int image_fallocate(struct vmnetfs_fuse_fh *fh, int mode,
         uint64_t start, uint64_t count)
 {
     struct vmnetfs_image *img = fh->data;
     struct vmnetfs_cursor cur;
     GError *err = NULL;
-    uint64_t written = 0;
 
-    _vmnetfs_stream_group_write(img->io_stream, "write %"PRIu64"+%"PRIu64"\n",
-            start, count);
+    /* Only support discard */
+    if (mode != (FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE)) {
+        return -EOPNOTSUPP;
+    }
+
+    _vmnetfs_stream_group_write(img->io_stream,
+            "discard %"PRIu64"+%"PRIu64"\n", start, count);
     for (_vmnetfs_cursor_start(img, &cur, start, count);
-            _vmnetfs_cursor_chunk(&cur, written); ) {
-        written = _vmnetfs_io_write_chunk(img, buf + cur.io_offset, cur.chunk,
-                cur.offset, cur.length, &err);
-        if (err) {
+            _vmnetfs_cursor_chunk(&cur, cur.length); ) {
+        if (!_vmnetfs_io_discard_chunk(img, cur.chunk, cur.offset,
+                cur.length, &err)) {
             if (g_error_matches(err, VMNETFS_IO_ERROR,
                     VMNETFS_IO_ERROR_INTERRUPTED)) {
                 g_clear_error(&err);
-                return (int) (cur.io_offset + written) ?: -EINTR;
+                return -EINTR;
             } else {
                 g_warning("%s", err->message);
                 g_clear_error(&err);
                 _vmnetfs_u64_stat_increment(img->io_errors, 1);
-                return (int) (cur.io_offset + written) ?: -EIO;
+                return -EIO;
             }
         }
-        _vmnetfs_u64_stat_increment(img->bytes_written, cur.length);
     }
-    return cur.io_offset;
+    return 0;
 }
 
+/* For images with a RAM cache, whose reads are copied through it.
+   Multi-chunk reads from the cache files go through io_uring if
+   available. */
 static const struct vmnetfs_fuse_ops image_ops = {
     .getattr = image_getattr,
     .truncate = image_truncate,
     .open = image_open,
     .read = image_read,
+    .read_defer = image_read_defer,
+    .write = image_write,
+    .fallocate = image_fallocate,
+};
+
+/* For images without one, whose cached data is spliced to the kernel. */
+static const struct vmnetfs_fuse_ops image_splice_ops = {
+    .getattr = image_getattr,
+    .truncate = image_truncate,
+    .open = image_open,
+    .read = image_read,
+    .read_defer = image_read_defer,
+    .read_segments = image_read_segments,
+    .release_segments = image_release_segments,
     .write = image_write,
+    .fallocate = image_fallocate,
+};
+
+static int control_getattr(void *dentry_ctx G_GNUC_UNUSED, struct stat *st)
+{
+    st->st_mode = S_IFREG | 0200;
+    return 0;
+}
+
+/* Allow opening with O_TRUNC. */
+static int control_truncate(void *dentry_ctx G_GNUC_UNUSED,
+        uint64_t size G_GNUC_UNUSED)
+{
+    return 0;
+}
+
+static int control_open(void *dentry_ctx, struct vmnetfs_fuse_fh *fh)
+{
+    fh->data = dentry_ctx;
+    return 0;
+}
+
+/* Parse "<offset>+<length>". */
+static bool parse_range(const char *str, uint64_t *start, uint64_t *count)
+{
+    char *end;
+
+    if (str == NULL || !g_ascii_isdigit(*str)) {
+        return false;
+    }
+    *start = g_ascii_strtoull(str, &end, 10);
+    if (*end != '+' || !g_ascii_isdigit(end[1])) {
+        return false;
+    }
+    *count = g_ascii_strtoull(end + 1, &end, 10);
+    return *end == 0 && *start + *count >= *start;
+}
+
+static bool parse_int(const char *str, int *value)
+{
+    char *end;
+    gint64 val;
+
+    if (str == NULL || *str == 0) {
+        return false;
+    }
+    val = g_ascii_strtoll(str, &end, 10);
+    if (*end != 0 || val < G_MININT || val > G_MAXINT) {
+        return false;
+    }
+    *value = val;
+    return true;
+}
+
+/* Returns 0 or a negative errno. */
+static int control_command(struct vmnetfs_image *img, char **args)
+{
+    GError *err = NULL;
+    uint64_t start;
+    uint64_t count;
+    uint32_t id;
+    int priority = 0;
+    int cancel_id;
+
+    if (!strcmp(args[0], "prefetch")) {
+        if (!parse_range(args[1], &start, &count) || (args[2] != NULL &&
+                (!parse_int(args[2], &priority) || args[3] != NULL))) {
+            return -EINVAL;
+        }
+        if (!_vmnetfs_prefetch_queue(img, start, count, priority, &id,
+                &err)) {
+            g_warning("Couldn't queue prefetch: %s", err->message);
+            g_clear_error(&err);
+            return -EIO;
+        }
+    } else if (!strcmp(args[0], "pin") || !strcmp(args[0], "unpin")) {
+        if (!parse_range(args[1], &start, &count) || args[2] != NULL) {
+            return -EINVAL;
+        }
+        _vmnetfs_prefetch_pin(img, start, count, !strcmp(args[0], "pin"));
+    } else if (!strcmp(args[0], "cancel")) {
+        if (args[1] == NULL) {
+            _vmnetfs_prefetch_cancel_all(img);
+        } else if (!parse_int(args[1], &cancel_id) || cancel_id <= 0 ||
+                args[2] != NULL) {
+            return -EINVAL;
+        } else if (!_vmnetfs_prefetch_cancel(img, cancel_id)) {
+            return -ENOENT;
+        }
+    } else {
+        return -EINVAL;
+    }
+    return 0;
+}
+
+/* Each write must contain whole commands, one per line. */
+static int control_write(struct vmnetfs_fuse_fh *fh, const void *buf,
+        uint64_t start G_GNUC_UNUSED, uint64_t count)
+{
+    struct vmnetfs_image *img = fh->data;
+    char *str;
+    char **lines;
+    char **line;
+    char **args;
+    int ret = count;
+
+    str = g_strndup(buf, count);
+    lines = g_strsplit(str, "\n", 0);
+    g_free(str);
+    for (line = lines; *line != NULL && ret >= 0; line++) {
+        args = g_strsplit(g_strstrip(*line), " ", 0);
+        if (args[0] != NULL && args[0][0] != 0) {
+            ret = control_command(img, args) ?: ret;
+        }
+        g_strfreev(args);
+    }
+    g_strfreev(lines);
+    return ret;
+}
+
+static const struct vmnetfs_fuse_ops control_ops = {
+    .getattr = control_getattr,
+    .truncate = control_truncate,
+    .open = control_open,
+    .write = control_write,
+    .nonseekable = true,
 };
 
+/* Drop the kernel's cached copy of a byte range of the image, which has
+   been changed other than through the image file. */
+void _vmnetfs_fuse_image_invalidate(struct vmnetfs_image *img,
+        uint64_t start, uint64_t count)
+{
+    void *ino = g_atomic_pointer_get(&img->fuse_ino);
+
+    /* If the file was never opened, the kernel caches nothing */
+    if (ino != NULL) {
+        _vmnetfs_fuse_invalidate(GPOINTER_TO_SIZE(ino), start, count);
+    }
+}
+
 void _vmnetfs_fuse_image_populate(struct vmnetfs_fuse_dentry *dir,
         struct vmnetfs_image *img)
 {
-    _vmnetfs_fuse_add_file(dir, "image", &image_ops, img);
+    img->mtime = time(NULL);
+    _vmnetfs_fuse_add_file(dir, "image", _vmnetfs_ramcache_enabled(img) ?
+            &image_ops : &image_splice_ops, img);
+    _vmnetfs_fuse_add_file(dir, "control", &control_ops, img);
 }
@@ -121,6 +121,29 @@ void _vmnetfs_fuse_stats_populate(struct vmnetfs_fuse_dentry *dir,
     add_stat(chunk_fetches);
     add_stat(chunk_dirties);
     add_stat(io_errors);
+    add_stat(bytes_salvaged);
+    add_stat(buffer_pool_used);
+    add_stat(buffer_pool_misses);
+    add_stat(chunk_copies_reflink);
+    add_stat(chunk_copies_kernel);
+    add_stat(chunk_copies_user);
+    add_stat(chunk_discards);
+    add_stat(chunks_zero);
+    add_stat(chunk_store_hits);
+    add_stat(chunk_shared_hits);
+    add_stat(bytes_fetched_peer);
+    add_stat(bytes_fetched_origin);
+    add_stat(compressed_bytes_raw);
+    add_stat(compressed_bytes_stored);
+    add_stat(chunk_decompressions);
+    add_stat(decompress_usecs);
+    add_stat(ram_cache_hits);
+    add_stat(ram_cache_misses);
+    add_stat(ram_cache_evictions);
+    add_stat(uring_submits);
+    add_stat(uring_reads);
+    add_stat(bytes_spliced);
+    add_stat(fill_rate);
 #undef add_stat
 
 #define add_fixed32(n) _vmnetfs_fuse_add_file(stats, #n, &u32_fixed_ops, &img->n)
@@ -129,3 +152,20 @@ void _vmnetfs_fuse_stats_populate(struct vmnetfs_fuse_dentry *dir,
 
     _vmnetfs_fuse_add_file(stats, "chunks", &chunks_ops, img);
 }
+
+void _vmnetfs_fuse_stats_populate_root(struct vmnetfs_fuse_dentry *dir,
+        struct vmnetfs *fs)
+{
+    struct vmnetfs_fuse_dentry *stats;
+
+    if (fs->cache == NULL) {
+        return;
+    }
+    stats = _vmnetfs_fuse_add_dir(dir, "stats");
+
+#define add_stat(n) _vmnetfs_fuse_add_file(stats, #n, &u64_stat_ops, fs->n)
+    add_stat(cache_bytes);
+    add_stat(cache_evictions);
+    add_stat(cache_bytes_evicted);
+#undef add_stat
+}
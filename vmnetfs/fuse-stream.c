@@ -91,7 +91,13 @@ void _vmnetfs_fuse_stream_populate(struct vmnetfs_fuse_dentry *dir,
             _vmnetfs_bit_get_stream_group(img->fetched_map));
     _vmnetfs_fuse_add_file(streams, "chunks_modified", &stream_ops,
             _vmnetfs_bit_get_stream_group(img->modified_map));
+    _vmnetfs_fuse_add_file(streams, "chunks_discarded", &stream_ops,
+            _vmnetfs_bit_get_stream_group(img->discarded_map));
+    _vmnetfs_fuse_add_file(streams, "chunks_pinned", &stream_ops,
+            _vmnetfs_bit_get_stream_group(img->pinned_map));
     _vmnetfs_fuse_add_file(streams, "io", &stream_ops, img->io_stream);
+    _vmnetfs_fuse_add_file(streams, "prefetch", &stream_ops,
+            _vmnetfs_prefetch_get_stream_group(img));
 }
 
 void _vmnetfs_fuse_stream_populate_root(struct vmnetfs_fuse_dentry *dir,
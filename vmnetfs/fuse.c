@@ -21,17 +21,84 @@
 #include <unistd.h>
 #include <poll.h>
 #include <errno.h>
-#define FUSE_USE_VERSION 26
-#include <fuse.h>
+#include <signal.h>
+#include <pthread.h>
+#define FUSE_USE_VERSION 312
+#include <fuse_lowlevel.h>
 #include "vmnetfs-private.h"
 
+/* The tree only changes when image sets are attached or detached, and
+   we invalidate the kernel's entry for the top-level directory when
+   that happens, so the kernel can cache lookups for a long time.
+   Attributes of pseudo-files can change underneath it, so cache those
+   only briefly. */
+#define ENTRY_TIMEOUT 86400.0
+#define ATTR_TIMEOUT 1.0
+
+/* Threads replying to reads that waited for the network */
+#define REPLY_MAX_THREADS 8
+
+/* Lower bound on the size of read and write requests; libfuse clamps
+   larger values to the size of its request buffer */
+#define MIN_MAX_IO (1 << 20)
+
 struct vmnetfs_fuse_dentry {
     const struct vmnetfs_fuse_ops *ops;
     GHashTable *children;
+    struct vmnetfs_fuse_dentry *parent;
+    fuse_ino_t ino;
     uint32_t nlink;
     void *ctx;
+    struct attachment *att;  /* NULL if part of the tree at mount */
+};
+
+/* A directory of images added under the root at runtime.  Once detached,
+   its dentries and images are freed when the last request or open file
+   using them is done.  refs and detached are protected by the
+   tree_lock. */
+struct attachment {
+    char *name;
+    struct vmnetfs_fuse_dentry *dir;
+    uint32_t refs;
+    bool detached;
+    void (*destroy)(void *data);
+    void *data;
+};
+
+/* The FUSE request being handled by the current thread */
+struct request_state {
+    fuse_req_t req;
+    pthread_t thr;
+};
+
+struct dir_listing {
+    char *buf;
+    size_t size;
 };
 
+/* A read parked until its chunks arrive from the network.  Protected by
+   the pending_lock.  The counts are signed because fetches can complete
+   before defer_read() learns how many it started. */
+struct pending_read {
+    struct vmnetfs_fuse *fuse;
+    fuse_req_t req;
+    struct vmnetfs_fuse_fh *fh;
+    off_t start;
+    size_t count;
+    int refs;
+    int waiting;
+    bool armed;
+    bool queued;
+    bool interrupted;
+};
+
+static GPrivate *current_request;
+
+/* The mounted session, for invalidations from threads that aren't
+   serving FUSE requests.  Cleared before the session is destroyed. */
+static GMutex *notify_lock;
+static struct fuse_session *notify_session;
+
 static int dir_getattr(void *dentry_ctx G_GNUC_UNUSED, struct stat *st)
 {
     st->st_mode = S_IFDIR | 0500;
@@ -63,7 +130,10 @@ struct vmnetfs_fuse_dentry *_vmnetfs_fuse_add_dir(
     dentry->ctx = dentry;
     if (parent != NULL) {
         parent->nlink++;
+        dentry->parent = parent;
         g_hash_table_insert(parent->children, g_strdup(name), dentry);
+    } else {
+        dentry->parent = dentry;
     }
     return dentry;
 }
@@ -75,222 +145,728 @@ void _vmnetfs_fuse_add_file(struct vmnetfs_fuse_dentry *parent,
 
     dentry = g_slice_new0(struct vmnetfs_fuse_dentry);
     dentry->ops = ops;
+    dentry->parent = parent;
     dentry->nlink = 1;
     dentry->ctx = ctx;
     g_hash_table_insert(parent->children, g_strdup(name), dentry);
 }
 
-static struct vmnetfs_fuse_dentry *lookup(struct vmnetfs_fuse *fuse,
-        const char *path)
+/* Number the dentries in the order they appear in the inode table.  The
+   root is added first and so receives FUSE_ROOT_ID.  Inode numbers are
+   not reused after a detach. */
+static void add_inodes(GPtrArray *inodes, struct vmnetfs_fuse_dentry *dentry,
+        struct attachment *att)
 {
-    struct vmnetfs_fuse_dentry *dentry = fuse->root;
-    gchar **components;
-    gchar **cur;
+    GHashTableIter iter;
+    void *child;
 
-    if (g_str_equal(path, "/")) {
-        return dentry;
+    dentry->ino = inodes->len;
+    dentry->att = att;
+    g_ptr_array_add(inodes, dentry);
+    if (dentry->children == NULL) {
+        return;
     }
+    g_hash_table_iter_init(&iter, dentry->children);
+    while (g_hash_table_iter_next(&iter, NULL, &child)) {
+        add_inodes(inodes, child, att);
+    }
+}
 
-    components = g_strsplit(path, "/", 0);
-    /* Drop leading slash */
-    for (cur = components + 1; *cur != NULL; cur++) {
-        if (dentry->children == NULL) {
-            /* Not a directory */
-            dentry = NULL;
-            break;
-        }
-        dentry = g_hash_table_lookup(dentry->children, *cur);
-        if (dentry == NULL) {
-            /* No such dentry */
-            break;
-        }
+/* tree_lock must be held. */
+static void remove_inodes(GPtrArray *inodes,
+        struct vmnetfs_fuse_dentry *dentry)
+{
+    GHashTableIter iter;
+    void *child;
+
+    g_ptr_array_index(inodes, dentry->ino) = NULL;
+    if (dentry->children == NULL) {
+        return;
+    }
+    g_hash_table_iter_init(&iter, dentry->children);
+    while (g_hash_table_iter_next(&iter, NULL, &child)) {
+        remove_inodes(inodes, child);
+    }
+}
+
+/* tree_lock must be held.  Removes the directory from the root without
+   freeing it. */
+static void unlink_attachment(struct vmnetfs_fuse *fuse,
+        struct attachment *att)
+{
+    void *key;
+
+    if (g_hash_table_lookup_extended(fuse->root->children, att->name, &key,
+            NULL)) {
+        g_hash_table_steal(fuse->root->children, att->name);
+        g_free(key);
+        fuse->root->nlink--;
+    }
+}
+
+static void attachment_free(struct attachment *att)
+{
+    dentry_free(att->dir);
+    att->destroy(att->data);
+    g_free(att->name);
+    g_slice_free(struct attachment, att);
+}
+
+/* tree_lock must be held. */
+static struct vmnetfs_fuse_dentry *_ref_dentry(
+        struct vmnetfs_fuse_dentry *dentry)
+{
+    if (dentry != NULL && dentry->att != NULL) {
+        dentry->att->refs++;
     }
-    g_strfreev(components);
     return dentry;
 }
 
-static int do_getattr(const char *path, struct stat *st)
+/* Every dentry returned by get_dentry() or get_child() must be released
+   with put_dentry(). */
+static void put_dentry(struct vmnetfs_fuse *fuse,
+        struct vmnetfs_fuse_dentry *dentry)
 {
-    struct vmnetfs_fuse *fuse = fuse_get_context()->private_data;
+    struct attachment *att;
+    bool last;
+
+    if (dentry == NULL || dentry->att == NULL) {
+        return;
+    }
+    att = dentry->att;
+    g_mutex_lock(fuse->tree_lock);
+    last = --att->refs == 0 && att->detached;
+    if (last) {
+        fuse->attachments = g_slist_remove(fuse->attachments, att);
+    }
+    g_mutex_unlock(fuse->tree_lock);
+    if (last) {
+        attachment_free(att);
+    }
+}
+
+static struct vmnetfs_fuse_dentry *get_dentry(fuse_req_t req, fuse_ino_t ino)
+{
+    struct vmnetfs_fuse *fuse = fuse_req_userdata(req);
+    struct vmnetfs_fuse_dentry *dentry = NULL;
+
+    g_mutex_lock(fuse->tree_lock);
+    if (ino < fuse->inodes->len) {
+        dentry = _ref_dentry(g_ptr_array_index(fuse->inodes, ino));
+    }
+    g_mutex_unlock(fuse->tree_lock);
+    return dentry;
+}
+
+static struct vmnetfs_fuse_dentry *get_child(fuse_req_t req,
+        struct vmnetfs_fuse_dentry *dir, const char *name)
+{
+    struct vmnetfs_fuse *fuse = fuse_req_userdata(req);
     struct vmnetfs_fuse_dentry *dentry;
+
+    g_mutex_lock(fuse->tree_lock);
+    dentry = _ref_dentry(g_hash_table_lookup(dir->children, name));
+    g_mutex_unlock(fuse->tree_lock);
+    return dentry;
+}
+
+static void interrupt_request(fuse_req_t req G_GNUC_UNUSED, void *data)
+{
+    struct request_state *rs = data;
+
+    /* Wake _vmnetfs_cond_wait() */
+    pthread_kill(rs->thr, SIGUSR1);
+}
+
+/* Call before handing a request to a vmnetfs_fuse_ops method, so that it
+   can be interrupted. */
+static void begin_request(struct request_state *rs, fuse_req_t req)
+{
+    rs->req = req;
+    rs->thr = pthread_self();
+    g_private_set(current_request, rs);
+    fuse_req_interrupt_func(req, interrupt_request, rs);
+}
+
+/* Must be called before replying to the request. */
+static void end_request(struct request_state *rs)
+{
+    fuse_req_interrupt_func(rs->req, NULL, NULL);
+    g_private_set(current_request, NULL);
+}
+
+static int get_stat(fuse_req_t req, struct vmnetfs_fuse_dentry *dentry,
+        struct stat *st)
+{
+    struct request_state rs;
     int ret;
 
-    dentry = lookup(fuse, path);
-    if (dentry == NULL) {
-        return -ENOENT;
-    }
     if (dentry->ops->getattr == NULL) {
         return -ENOSYS;
     }
 
+    memset(st, 0, sizeof(*st));
+    st->st_ino = dentry->ino;
     st->st_nlink = dentry->nlink;
     st->st_uid = getuid();
     st->st_gid = getgid();
     st->st_size = 0;
     st->st_atime = st->st_mtime = st->st_ctime = time(NULL);
 
+    begin_request(&rs, req);
     ret = dentry->ops->getattr(dentry->ctx, st);
+    end_request(&rs);
     st->st_blocks = (st->st_size + 511) / 512;
     return ret;
 }
 
-static int do_truncate(const char *path, off_t length)
+static void do_init(void *userdata, struct fuse_conn_info *conn)
 {
-    struct vmnetfs_fuse *fuse = fuse_get_context()->private_data;
+    struct vmnetfs_fuse *fuse = userdata;
+
+    /* Let read replies move page cache pages of our cache files into
+       the kernel */
+    conn->want |= conn->capable &
+            (FUSE_CAP_SPLICE_WRITE | FUSE_CAP_SPLICE_MOVE);
+    if (fuse->fs->fuse_writeback_cache) {
+        conn->want |= conn->capable & FUSE_CAP_WRITEBACK_CACHE;
+    }
+    conn->max_read = fuse->max_io;
+    conn->max_write = fuse->max_io;
+}
+
+static void do_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+    struct vmnetfs_fuse *fuse = fuse_req_userdata(req);
+    struct vmnetfs_fuse_dentry *dir;
     struct vmnetfs_fuse_dentry *dentry;
+    struct fuse_entry_param entry = {
+        .attr_timeout = ATTR_TIMEOUT,
+        .entry_timeout = ENTRY_TIMEOUT,
+    };
+    int ret;
 
-    dentry = lookup(fuse, path);
+    dir = get_dentry(req, parent);
+    if (dir == NULL) {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+    if (dir->children == NULL) {
+        fuse_reply_err(req, ENOTDIR);
+        goto out;
+    }
+    dentry = get_child(req, dir, name);
     if (dentry == NULL) {
-        return -ENOENT;
+        fuse_reply_err(req, ENOENT);
+        goto out;
     }
-    if (dentry->children != NULL) {
-        return -EISDIR;
+    ret = get_stat(req, dentry, &entry.attr);
+    if (ret) {
+        fuse_reply_err(req, -ret);
+    } else {
+        entry.ino = dentry->ino;
+        fuse_reply_entry(req, &entry);
     }
-    if (dentry->ops->truncate) {
-        return dentry->ops->truncate(dentry->ctx, length);
+    put_dentry(fuse, dentry);
+out:
+    put_dentry(fuse, dir);
+}
+
+static void do_forget(fuse_req_t req, fuse_ino_t ino G_GNUC_UNUSED,
+        unsigned long nlookup G_GNUC_UNUSED)
+{
+    /* Inodes live as long as the filesystem or their attachment */
+    fuse_reply_none(req);
+}
+
+static void do_getattr(fuse_req_t req, fuse_ino_t ino,
+        struct fuse_file_info *fi G_GNUC_UNUSED)
+{
+    struct vmnetfs_fuse *fuse = fuse_req_userdata(req);
+    struct vmnetfs_fuse_dentry *dentry;
+    struct stat st;
+    int ret;
+
+    dentry = get_dentry(req, ino);
+    if (dentry == NULL) {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+    ret = get_stat(req, dentry, &st);
+    if (ret) {
+        fuse_reply_err(req, -ret);
     } else {
-        return -ENOSYS;
+        fuse_reply_attr(req, &st, ATTR_TIMEOUT);
     }
+    put_dentry(fuse, dentry);
 }
 
-static int do_open(const char *path, struct fuse_file_info *fi)
+/* Only truncation is supported.  The kernel also asks to update the
+   mtime when truncating; ignore that, as the high-level API did. */
+static void do_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr,
+        int to_set, struct fuse_file_info *fi G_GNUC_UNUSED)
 {
-    struct vmnetfs_fuse *fuse = fuse_get_context()->private_data;
+    struct vmnetfs_fuse *fuse = fuse_req_userdata(req);
+    struct vmnetfs_fuse_dentry *dentry;
+    struct request_state rs;
+    struct stat st;
+    int ret;
+
+    dentry = get_dentry(req, ino);
+    if (dentry == NULL) {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+    if (to_set & (FUSE_SET_ATTR_MODE | FUSE_SET_ATTR_UID |
+            FUSE_SET_ATTR_GID)) {
+        fuse_reply_err(req, ENOSYS);
+        goto out;
+    }
+    if (to_set & FUSE_SET_ATTR_SIZE) {
+        if (dentry->children != NULL) {
+            fuse_reply_err(req, EISDIR);
+            goto out;
+        }
+        if (dentry->ops->truncate == NULL) {
+            fuse_reply_err(req, ENOSYS);
+            goto out;
+        }
+        begin_request(&rs, req);
+        ret = dentry->ops->truncate(dentry->ctx, attr->st_size);
+        end_request(&rs);
+        if (ret) {
+            fuse_reply_err(req, -ret);
+            goto out;
+        }
+    }
+    if ((to_set & (FUSE_SET_ATTR_ATIME | FUSE_SET_ATTR_MTIME)) ==
+            (FUSE_SET_ATTR_ATIME | FUSE_SET_ATTR_MTIME)) {
+        fuse_reply_err(req, ENOSYS);
+        goto out;
+    }
+    ret = get_stat(req, dentry, &st);
+    if (ret) {
+        fuse_reply_err(req, -ret);
+    } else {
+        fuse_reply_attr(req, &st, ATTR_TIMEOUT);
+    }
+out:
+    put_dentry(fuse, dentry);
+}
+
+static void release_fh(struct vmnetfs_fuse *fuse, struct vmnetfs_fuse_fh *fh)
+{
+    if (fh->ops->release) {
+        fh->ops->release(fh);
+    }
+    /* May free the images the file belonged to */
+    put_dentry(fuse, fh->dentry);
+    g_slice_free(struct vmnetfs_fuse_fh, fh);
+}
+
+static void do_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    struct vmnetfs_fuse *fuse = fuse_req_userdata(req);
     struct vmnetfs_fuse_dentry *dentry;
     struct vmnetfs_fuse_fh *fh;
+    struct request_state rs;
     int ret;
 
-    dentry = lookup(fuse, path);
+    dentry = get_dentry(req, ino);
     if (dentry == NULL) {
-        return -ENOENT;
+        fuse_reply_err(req, ENOENT);
+        return;
     }
     if (dentry->ops->open == NULL) {
-        return -ENOSYS;
+        put_dentry(fuse, dentry);
+        fuse_reply_err(req, ENOSYS);
+        return;
     }
 
+    /* The file keeps our reference to the dentry */
     fh = g_slice_new0(struct vmnetfs_fuse_fh);
     fh->ops = dentry->ops;
+    fh->dentry = dentry;
+    fh->ino = dentry->ino;
     fh->blocking = !(fi->flags & O_NONBLOCK);
+    begin_request(&rs, req);
     ret = dentry->ops->open(dentry->ctx, fh);
+    end_request(&rs);
     if (ret) {
         g_slice_free(struct vmnetfs_fuse_fh, fh);
+        put_dentry(fuse, dentry);
+        fuse_reply_err(req, -ret);
+        return;
+    }
+    fi->fh = (uintptr_t) fh;
+    fi->nonseekable = fh->ops->nonseekable;
+    /* Unless the file asks for the kernel page cache, avoid it in order
+       to preserve semantics of read() and write() return values. */
+    fi->direct_io = !fh->kernel_cache;
+    fi->keep_cache = fh->kernel_cache;
+    if (fuse_reply_open(req, fi) == -ENOENT) {
+        /* The open() was interrupted and the kernel has forgotten it */
+        release_fh(fuse, fh);
+    }
+}
+
+/* Reply with the first @count bytes of @segs, letting libfuse splice
+   file segments into the kernel instead of copying them through our
+   address space. */
+static void reply_segments(fuse_req_t req, GArray *segs, size_t count)
+{
+    struct vmnetfs_segment *seg;
+    struct fuse_bufvec *bufv;
+    struct fuse_buf *fbuf;
+    unsigned i;
+
+    bufv = g_malloc0(sizeof(*bufv) + segs->len * sizeof(bufv->buf[0]));
+    for (i = 0; i < segs->len && count > 0; i++) {
+        seg = &g_array_index(segs, struct vmnetfs_segment, i);
+        if (seg->length == 0) {
+            continue;
+        }
+        fbuf = &bufv->buf[bufv->count++];
+        fbuf->size = MIN(seg->length, count);
+        if (seg->fd != -1) {
+            fbuf->flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+            fbuf->fd = seg->fd;
+            fbuf->pos = seg->pos;
+        } else {
+            fbuf->mem = seg->buf;
+        }
+        count -= fbuf->size;
+    }
+    fuse_reply_data(req, bufv, FUSE_BUF_SPLICE_MOVE);
+    g_free(bufv);
+}
+
+static void reply_read(fuse_req_t req, struct vmnetfs_fuse_fh *fh,
+        off_t start, size_t count)
+{
+    struct request_state rs;
+    char *buf;
+    int ret;
+
+    if (fh->ops->read_segments != NULL) {
+        GArray *segs;
+
+        segs = g_array_new(FALSE, FALSE, sizeof(struct vmnetfs_segment));
+        begin_request(&rs, req);
+        ret = fh->ops->read_segments(fh, segs, start, count);
+        end_request(&rs);
+        if (ret < 0) {
+            fuse_reply_err(req, -ret);
+        } else {
+            reply_segments(req, segs, ret);
+        }
+        fh->ops->release_segments(fh, segs);
+        g_array_free(segs, TRUE);
+        return;
+    }
+
+    buf = g_malloc(count);
+    begin_request(&rs, req);
+    ret = fh->ops->read(fh, buf, start, count);
+    end_request(&rs);
+    if (ret < 0) {
+        fuse_reply_err(req, -ret);
     } else {
-        fi->fh = (uintptr_t) fh;
-        fi->nonseekable = fh->ops->nonseekable;
+        fuse_reply_buf(req, buf, ret);
     }
-    return ret;
+    g_free(buf);
 }
 
-static int do_read(const char *path G_GNUC_UNUSED, char *buf, size_t count,
-        off_t start, struct fuse_file_info *fi)
+/* pending_lock must be held.  Returns true if the caller must free the
+   pending_read after dropping the lock. */
+static bool _pending_read_put(struct pending_read *pr)
 {
-    struct vmnetfs_fuse_fh *fh = (void *) (uintptr_t) fi->fh;
+    struct vmnetfs_fuse *fuse = pr->fuse;
+
+    if (--pr->refs > 0 || !pr->armed) {
+        return false;
+    }
+    if (--fuse->pending_reads == 0) {
+        g_cond_broadcast(fuse->pending_drained);
+    }
+    return true;
+}
+
+/* pending_lock must be held.  Hand the read to a reply thread once all
+   of its fetches have finished, or as soon as it is interrupted. */
+static void _pending_read_maybe_queue(struct pending_read *pr)
+{
+    if (!pr->armed || pr->queued) {
+        return;
+    }
+    if (pr->waiting > 0 && !pr->interrupted) {
+        return;
+    }
+    pr->queued = true;
+    pr->refs++;
+    g_thread_pool_push(pr->fuse->reply_pool, pr, NULL);
+}
+
+/* Called from a fetch thread. */
+static void read_ready(void *arg)
+{
+    struct pending_read *pr = arg;
+    GMutex *lock = pr->fuse->pending_lock;
+    bool last;
+
+    g_mutex_lock(lock);
+    pr->waiting--;
+    _pending_read_maybe_queue(pr);
+    last = _pending_read_put(pr);
+    g_mutex_unlock(lock);
+    if (last) {
+        g_slice_free(struct pending_read, pr);
+    }
+}
 
-    if (fh->ops->read) {
-        return fh->ops->read(fh, buf, start, count);
+/* Must not reply to the request, since libfuse calls us with the request
+   locked. */
+static void interrupt_read(fuse_req_t req G_GNUC_UNUSED, void *data)
+{
+    struct pending_read *pr = data;
+
+    g_mutex_lock(pr->fuse->pending_lock);
+    pr->interrupted = true;
+    _pending_read_maybe_queue(pr);
+    g_mutex_unlock(pr->fuse->pending_lock);
+}
+
+static void reply_worker(void *data, void *user_data G_GNUC_UNUSED)
+{
+    struct pending_read *pr = data;
+    GMutex *lock = pr->fuse->pending_lock;
+    bool last;
+
+    /* Waits for interrupt_read() to return if it is running */
+    fuse_req_interrupt_func(pr->req, NULL, NULL);
+    if (fuse_req_interrupted(pr->req)) {
+        /* The fetches continue and will be queued for writeback */
+        fuse_reply_err(pr->req, EINTR);
     } else {
-        return -ENOSYS;
+        reply_read(pr->req, pr->fh, pr->start, pr->count);
+    }
+
+    g_mutex_lock(lock);
+    last = _pending_read_put(pr);
+    g_mutex_unlock(lock);
+    if (last) {
+        g_slice_free(struct pending_read, pr);
     }
 }
 
-static int do_write(const char *path G_GNUC_UNUSED, const char *buf,
+/* If the read needs chunks from the network, start fetching them and
+   return true.  The reply is then sent from the reply pool once the
+   fetches complete, leaving this thread free to serve other requests. */
+static bool defer_read(fuse_req_t req, struct vmnetfs_fuse_fh *fh,
+        off_t start, size_t count)
+{
+    struct vmnetfs_fuse *fuse = fuse_req_userdata(req);
+    struct pending_read *pr;
+    int waits;
+
+    pr = g_slice_new0(struct pending_read);
+    pr->fuse = fuse;
+    pr->req = req;
+    pr->fh = fh;
+    pr->start = start;
+    pr->count = count;
+    waits = fh->ops->read_defer(fh, start, count, read_ready, pr);
+    if (waits == 0) {
+        g_slice_free(struct pending_read, pr);
+        return false;
+    }
+    fuse_req_interrupt_func(req, interrupt_read, pr);
+
+    g_mutex_lock(fuse->pending_lock);
+    pr->refs += waits;
+    pr->waiting += waits;
+    pr->armed = true;
+    fuse->pending_reads++;
+    _pending_read_maybe_queue(pr);
+    g_mutex_unlock(fuse->pending_lock);
+    return true;
+}
+
+static void do_read(fuse_req_t req, fuse_ino_t ino G_GNUC_UNUSED,
         size_t count, off_t start, struct fuse_file_info *fi)
 {
     struct vmnetfs_fuse_fh *fh = (void *) (uintptr_t) fi->fh;
 
-    if (fh->ops->write) {
-        return fh->ops->write(fh, buf, start, count);
+    if (fh->ops->read == NULL && fh->ops->read_segments == NULL) {
+        fuse_reply_err(req, ENOSYS);
+        return;
+    }
+    if (fh->ops->read_defer != NULL && defer_read(req, fh, start, count)) {
+        return;
+    }
+    reply_read(req, fh, start, count);
+}
+
+static void do_write(fuse_req_t req, fuse_ino_t ino G_GNUC_UNUSED,
+        const char *buf, size_t count, off_t start,
+        struct fuse_file_info *fi)
+{
+    struct vmnetfs_fuse_fh *fh = (void *) (uintptr_t) fi->fh;
+    struct request_state rs;
+    int ret;
+
+    if (fh->ops->write == NULL) {
+        fuse_reply_err(req, ENOSYS);
+        return;
+    }
+    begin_request(&rs, req);
+    ret = fh->ops->write(fh, buf, start, count);
+    end_request(&rs);
+    if (ret < 0) {
+        fuse_reply_err(req, -ret);
     } else {
-        return -ENOSYS;
+        fuse_reply_write(req, ret);
     }
 }
 
-static int do_poll(const char *path G_GNUC_UNUSED, struct fuse_file_info *fi,
-        struct fuse_pollhandle *ph, unsigned *reventsp)
+static void do_poll(fuse_req_t req, fuse_ino_t ino G_GNUC_UNUSED,
+        struct fuse_file_info *fi, struct fuse_pollhandle *ph)
 {
     struct vmnetfs_fuse_fh *fh = (void *) (uintptr_t) fi->fh;
+    struct request_state rs;
     bool readable = false;
     int ret;
 
     if (fh->ops->poll) {
+        begin_request(&rs, req);
         ret = fh->ops->poll(fh, ph, &readable);
-        if (readable) {
-            *reventsp = POLLIN;
+        end_request(&rs);
+        if (ret) {
+            fuse_reply_err(req, -ret);
         } else {
-            *reventsp = 0;
+            fuse_reply_poll(req, readable ? POLLIN : 0);
         }
-        return ret;
     } else {
         /* Assume readable and writable (linux/poll.h DEFAULT_POLLMASK) */
-        *reventsp = POLLIN | POLLOUT | POLLRDNORM | POLLWRNORM;
-        fuse_notify_poll(ph);
-        fuse_pollhandle_destroy(ph);
-        return 0;
+        if (ph != NULL) {
+            fuse_lowlevel_notify_poll(ph);
+            fuse_pollhandle_destroy(ph);
+        }
+        fuse_reply_poll(req, POLLIN | POLLOUT | POLLRDNORM | POLLWRNORM);
     }
 }
 
-static int do_release(const char *path G_GNUC_UNUSED,
-        struct fuse_file_info *fi)
+static void do_fallocate(fuse_req_t req, fuse_ino_t ino G_GNUC_UNUSED,
+        int mode, off_t start, off_t count, struct fuse_file_info *fi)
 {
     struct vmnetfs_fuse_fh *fh = (void *) (uintptr_t) fi->fh;
+    struct request_state rs;
+    int ret;
 
-    if (fh->ops->release) {
-        fh->ops->release(fh);
+    if (fh->ops->fallocate == NULL) {
+        fuse_reply_err(req, EOPNOTSUPP);
+        return;
     }
-    g_slice_free(struct vmnetfs_fuse_fh, fh);
-    return 0;
+    begin_request(&rs, req);
+    ret = fh->ops->fallocate(fh, mode, start, count);
+    end_request(&rs);
+    fuse_reply_err(req, -ret);
 }
 
-static int do_opendir(const char *path, struct fuse_file_info *fi)
+static void do_release(fuse_req_t req, fuse_ino_t ino G_GNUC_UNUSED,
+        struct fuse_file_info *fi)
 {
-    struct vmnetfs_fuse *fuse = fuse_get_context()->private_data;
-    struct vmnetfs_fuse_dentry *dentry;
+    struct vmnetfs_fuse *fuse = fuse_req_userdata(req);
 
-    dentry = lookup(fuse, path);
-    if (dentry == NULL) {
-        return -ENOENT;
-    }
-    if (dentry->children == NULL) {
-        return -ENOTDIR;
-    }
-    fi->fh = (uintptr_t) dentry;
-    return 0;
+    release_fh(fuse, (void *) (uintptr_t) fi->fh);
+    fuse_reply_err(req, 0);
+}
+
+static void add_dir_entry(fuse_req_t req, struct dir_listing *listing,
+        const char *name, struct vmnetfs_fuse_dentry *dentry)
+{
+    struct stat st = {
+        .st_ino = dentry->ino,
+        .st_mode = dentry->children != NULL ? S_IFDIR : S_IFREG,
+    };
+    size_t offset = listing->size;
+
+    listing->size += fuse_add_direntry(req, NULL, 0, name, NULL, 0);
+    listing->buf = g_realloc(listing->buf, listing->size);
+    fuse_add_direntry(req, listing->buf + offset, listing->size - offset,
+            name, &st, listing->size);
 }
 
 struct fill_data {
-    fuse_fill_dir_t filler;
-    void *buf;
-    int failed;
+    fuse_req_t req;
+    struct dir_listing *listing;
 };
 
-static void collect_names(char *name,
-        struct vmnetfs_fuse_dentry *dentry G_GNUC_UNUSED,
+static void collect_names(char *name, struct vmnetfs_fuse_dentry *dentry,
         struct fill_data *fill)
 {
-    if (!fill->failed) {
-        fill->failed = fill->filler(fill->buf, name, NULL, 0);
-    }
+    add_dir_entry(fill->req, fill->listing, name, dentry);
 }
 
-static int do_readdir(const char *path G_GNUC_UNUSED, void *buf,
-        fuse_fill_dir_t filler, off_t off G_GNUC_UNUSED,
+/* The directory is listed once at open, so that readdir() offsets stay
+   valid however the listing is split between replies. */
+static void do_opendir(fuse_req_t req, fuse_ino_t ino,
         struct fuse_file_info *fi)
 {
-    struct vmnetfs_fuse_dentry *dentry = (void *) (uintptr_t) fi->fh;
+    struct vmnetfs_fuse *fuse = fuse_req_userdata(req);
+    struct vmnetfs_fuse_dentry *dentry;
+    struct dir_listing *listing;
     struct fill_data fill = {
-        .filler = filler,
-        .buf = buf,
-        .failed = 0,
+        .req = req,
     };
 
-    g_assert(dentry->children != NULL);
-
-    fill.failed = filler(buf, ".", NULL, 0);
-    if (!fill.failed) {
-        fill.failed = filler(buf, "..", NULL, 0);
+    dentry = get_dentry(req, ino);
+    if (dentry == NULL) {
+        fuse_reply_err(req, ENOENT);
+        return;
     }
+    if (dentry->children == NULL) {
+        put_dentry(fuse, dentry);
+        fuse_reply_err(req, ENOTDIR);
+        return;
+    }
+
+    listing = g_slice_new0(struct dir_listing);
+    g_mutex_lock(fuse->tree_lock);
+    add_dir_entry(req, listing, ".", dentry);
+    add_dir_entry(req, listing, "..", dentry->parent);
+    fill.listing = listing;
     g_hash_table_foreach(dentry->children, (GHFunc) collect_names, &fill);
-    return fill.failed ? -EIO : 0;
+    g_mutex_unlock(fuse->tree_lock);
+    put_dentry(fuse, dentry);
+    fi->fh = (uintptr_t) listing;
+    if (fuse_reply_open(req, fi) == -ENOENT) {
+        g_free(listing->buf);
+        g_slice_free(struct dir_listing, listing);
+    }
+}
+
+static void do_readdir(fuse_req_t req, fuse_ino_t ino G_GNUC_UNUSED,
+        size_t size, off_t off, struct fuse_file_info *fi)
+{
+    struct dir_listing *listing = (void *) (uintptr_t) fi->fh;
+
+    if ((size_t) off >= listing->size) {
+        fuse_reply_buf(req, NULL, 0);
+    } else {
+        fuse_reply_buf(req, listing->buf + off,
+                MIN(size, listing->size - off));
+    }
+}
+
+static void do_releasedir(fuse_req_t req, fuse_ino_t ino G_GNUC_UNUSED,
+        struct fuse_file_info *fi)
+{
+    struct dir_listing *listing = (void *) (uintptr_t) fi->fh;
+
+    g_free(listing->buf);
+    g_slice_free(struct dir_listing, listing);
+    fuse_reply_err(req, 0);
 }
 
 static void stat_one(void *key G_GNUC_UNUSED, void *value, void *data)
@@ -301,23 +877,29 @@ static void stat_one(void *key G_GNUC_UNUSED, void *value, void *data)
     *image_size += _vmnetfs_io_get_image_size(img, NULL);
 }
 
-static int do_statfs(const char *path G_GNUC_UNUSED, struct statvfs *st)
+static void do_statfs(fuse_req_t req, fuse_ino_t ino G_GNUC_UNUSED)
 {
-    struct vmnetfs_fuse *fuse = fuse_get_context()->private_data;
+    struct vmnetfs_fuse *fuse = fuse_req_userdata(req);
+    struct statvfs st = {
+        .f_bsize = 512,
+        .f_namemax = 256,
+    };
     uint64_t image_size = 0;
 
-    g_hash_table_foreach(fuse->fs->images, stat_one, &image_size);
+    g_mutex_lock(fuse->fs->images_lock);
+    _vmnetfs_images_foreach(fuse->fs, stat_one, &image_size);
+    g_mutex_unlock(fuse->fs->images_lock);
 
-    st->f_bsize = 512;
-    st->f_blocks = image_size / 512;
-    st->f_bfree = st->f_bavail = 0;
-    st->f_namemax = 256;
-    return 0;
+    st.f_blocks = image_size / 512;
+    st.f_bfree = st.f_bavail = 0;
+    fuse_reply_statfs(req, &st);
 }
 
-static const struct fuse_operations fuse_ops = {
+static const struct fuse_lowlevel_ops fuse_ops = {
+    .lookup = do_lookup,
+    .forget = do_forget,
     .getattr = do_getattr,
-    .truncate = do_truncate,
+    .setattr = do_setattr,
     .open = do_open,
     .read = do_read,
     .write = do_write,
@@ -325,8 +907,10 @@ static const struct fuse_operations fuse_ops = {
     .release = do_release,
     .opendir = do_opendir,
     .readdir = do_readdir,
+    .releasedir = do_releasedir,
     .statfs = do_statfs,
-    .flag_nullpath_ok = 1,
+    .init = do_init,
+    .fallocate = do_fallocate,
 };
 
 static void add_image(void *key, void *value, void *data)
@@ -342,11 +926,27 @@ static void add_image(void *key, void *value, void *data)
     _vmnetfs_fuse_stream_populate(dir, img);
 }
 
+static void max_chunk_size(void *key G_GNUC_UNUSED, void *value,
+        void *data)
+{
+    struct vmnetfs_image *img = value;
+    uint32_t *max_io = data;
+
+    *max_io = MAX(*max_io, img->chunk_size);
+}
+
+static void interrupt_signal(int sig G_GNUC_UNUSED)
+{
+}
+
 struct vmnetfs_fuse *_vmnetfs_fuse_new(struct vmnetfs *fs, GError **err)
 {
     struct vmnetfs_fuse *fuse;
     GPtrArray *argv;
     struct fuse_args args;
+    struct sigaction sa = {
+        .sa_handler = interrupt_signal,
+    };
     char *runtime_dir;
 
     /* Set up data structures */
@@ -354,8 +954,33 @@ struct vmnetfs_fuse *_vmnetfs_fuse_new(struct vmnetfs *fs, GError **err)
     fuse->fs = fs;
     fuse->root = _vmnetfs_fuse_add_dir(NULL, NULL);
     g_hash_table_foreach(fs->images, add_image, fuse->root);
+    _vmnetfs_fuse_stats_populate_root(fuse->root, fs);
     _vmnetfs_fuse_stream_populate_root(fuse->root, fs);
     _vmnetfs_fuse_misc_populate_root(fuse->root, fs);
+    fuse->inodes = g_ptr_array_new();
+    g_ptr_array_add(fuse->inodes, NULL);
+    add_inodes(fuse->inodes, fuse->root, NULL);
+    fuse->tree_lock = g_mutex_new();
+    g_assert(fuse->root->ino == FUSE_ROOT_ID);
+    /* Let a request cover at least a whole chunk */
+    fuse->max_io = MIN_MAX_IO;
+    g_hash_table_foreach(fs->images, max_chunk_size, &fuse->max_io);
+    fuse->pending_lock = g_mutex_new();
+    fuse->pending_drained = g_cond_new();
+    fuse->reply_pool = g_thread_pool_new(reply_worker, NULL,
+            REPLY_MAX_THREADS, FALSE, err);
+    if (fuse->reply_pool == NULL) {
+        goto bad_dealloc;
+    }
+
+    /* Interrupted requests are woken with SIGUSR1, which must not kill
+       us */
+    if (current_request == NULL) {
+        current_request = g_private_new(NULL);
+        notify_lock = g_mutex_new();
+    }
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGUSR1, &sa, NULL);
 
     /* Construct mountpoint */
     runtime_dir = getenv("XDG_RUNTIME_DIR");
@@ -371,46 +996,51 @@ struct vmnetfs_fuse *_vmnetfs_fuse_new(struct vmnetfs *fs, GError **err)
         goto bad_dealloc;
     }
 
-    /* Build FUSE command line */
+    /* Build FUSE command line.  The first argument is the program
+       name. */
     argv = g_ptr_array_new();
-    g_ptr_array_add(argv, g_strdup("-odefault_permissions"));
+    g_ptr_array_add(argv, g_strdup("vmnetfs"));
     g_ptr_array_add(argv, g_strdup_printf("-ofsname=vmnetfs#%d", getpid()));
     g_ptr_array_add(argv, g_strdup("-osubtype=vmnetfs"));
-    g_ptr_array_add(argv, g_strdup("-obig_writes"));
-    g_ptr_array_add(argv, g_strdup("-ointr"));
-    /* Avoid kernel page cache in order to preserve semantics of read()
-       and write() return values. */
-    g_ptr_array_add(argv, g_strdup("-odirect_io"));
+    g_ptr_array_add(argv, g_strdup_printf("-omax_read=%u", fuse->max_io));
     g_ptr_array_add(argv, NULL);
     args.argv = (gchar **) g_ptr_array_free(argv, FALSE);
     args.argc = g_strv_length(args.argv);
     args.allocated = 0;
 
     /* Initialize FUSE */
-    fuse->chan = fuse_mount(fuse->mountpoint, &args);
-    if (fuse->chan == NULL) {
-        g_set_error(err, VMNETFS_FUSE_ERROR, VMNETFS_FUSE_ERROR_FAILED,
-                "Couldn't mount FUSE filesystem");
-        g_strfreev(args.argv);
-        goto bad_rmdir;
-    }
-    fuse->fuse = fuse_new(fuse->chan, &args, &fuse_ops, sizeof(fuse_ops),
+    fuse->session = fuse_session_new(&args, &fuse_ops, sizeof(fuse_ops),
             fuse);
     g_strfreev(args.argv);
-    if (fuse->fuse == NULL) {
+    if (fuse->session == NULL) {
         g_set_error(err, VMNETFS_FUSE_ERROR, VMNETFS_FUSE_ERROR_FAILED,
                 "Couldn't create FUSE filesystem");
-        goto bad_unmount;
+        goto bad_rmdir;
     }
+    if (fuse_session_mount(fuse->session, fuse->mountpoint)) {
+        g_set_error(err, VMNETFS_FUSE_ERROR, VMNETFS_FUSE_ERROR_FAILED,
+                "Couldn't mount FUSE filesystem");
+        goto bad_destroy;
+    }
+    g_mutex_lock(notify_lock);
+    notify_session = fuse->session;
+    g_mutex_unlock(notify_lock);
 
     return fuse;
 
-bad_unmount:
-    fuse_unmount(fuse->mountpoint, fuse->chan);
+bad_destroy:
+    fuse_session_destroy(fuse->session);
 bad_rmdir:
     rmdir(fuse->mountpoint);
 bad_dealloc:
+    if (fuse->reply_pool != NULL) {
+        g_thread_pool_free(fuse->reply_pool, TRUE, TRUE);
+    }
+    g_cond_free(fuse->pending_drained);
+    g_mutex_free(fuse->pending_lock);
     g_free(fuse->mountpoint);
+    g_mutex_free(fuse->tree_lock);
+    g_ptr_array_free(fuse->inodes, TRUE);
     dentry_free(fuse->root);
     g_slice_free(struct vmnetfs_fuse, fuse);
     return NULL;
@@ -418,12 +1048,25 @@ bad_dealloc:
 
 void _vmnetfs_fuse_run(struct vmnetfs_fuse *fuse)
 {
-    fuse_loop_mt(fuse->fuse);
+    struct vmnetfs *fs = fuse->fs;
+    struct fuse_loop_config *config;
+
+    config = fuse_loop_cfg_create();
+    /* Give each worker thread its own /dev/fuse descriptor */
+    fuse_loop_cfg_set_clone_fd(config, 1);
+    if (fs->fuse_max_threads) {
+        fuse_loop_cfg_set_max_threads(config, fs->fuse_max_threads);
+    }
+    if (fs->fuse_max_idle_threads) {
+        fuse_loop_cfg_set_idle_threads(config, fs->fuse_max_idle_threads);
+    }
+    fuse_session_loop_mt(fuse->session, config);
+    fuse_loop_cfg_destroy(config);
 }
 
 void _vmnetfs_fuse_terminate(struct vmnetfs_fuse *fuse)
 {
-    char *argv[] = {"fusermount", "-uqz", "--", fuse->mountpoint, NULL};
+    char *argv[] = {"fusermount3", "-uqz", "--", fuse->mountpoint, NULL};
 
     /* swallow errors */
     g_spawn_sync("/", argv, NULL, G_SPAWN_SEARCH_PATH, NULL, NULL, NULL,
@@ -435,18 +1078,147 @@ void _vmnetfs_fuse_free(struct vmnetfs_fuse *fuse)
     if (fuse == NULL) {
         return;
     }
+    /* Deferred reads still refer to the session and to each other */
+    g_mutex_lock(fuse->pending_lock);
+    while (fuse->pending_reads > 0) {
+        g_cond_wait(fuse->pending_drained, fuse->pending_lock);
+    }
+    g_mutex_unlock(fuse->pending_lock);
+    g_thread_pool_free(fuse->reply_pool, FALSE, TRUE);
+    g_cond_free(fuse->pending_drained);
+    g_mutex_free(fuse->pending_lock);
+    g_mutex_lock(notify_lock);
+    notify_session = NULL;
+    g_mutex_unlock(notify_lock);
     /* Normally the filesystem will already have been unmounted.  Try
        to make sure. */
-    fuse_unmount(fuse->mountpoint, fuse->chan);
-    fuse_destroy(fuse->fuse);
+    fuse_session_unmount(fuse->session);
+    fuse_session_destroy(fuse->session);
     rmdir(fuse->mountpoint);
     g_free(fuse->mountpoint);
+    /* No requests remain, so attachments can go regardless of their
+       references */
+    while (fuse->attachments != NULL) {
+        struct attachment *att = fuse->attachments->data;
+
+        if (!att->detached) {
+            unlink_attachment(fuse, att);
+        }
+        attachment_free(att);
+        fuse->attachments = g_slist_delete_link(fuse->attachments,
+                fuse->attachments);
+    }
+    g_mutex_free(fuse->tree_lock);
+    g_ptr_array_free(fuse->inodes, TRUE);
     dentry_free(fuse->root);
     g_slice_free(struct vmnetfs_fuse, fuse);
 }
 
+/* Add a directory @name under the root containing @images, which are
+   keyed by name.  Once the directory has been detached and nothing in
+   the filesystem refers to it any longer, @destroy is called with @data
+   from whichever thread dropped the last reference. */
+bool _vmnetfs_fuse_attach(struct vmnetfs_fuse *fuse, const char *name,
+        GHashTable *images, void (*destroy)(void *data), void *data,
+        GError **err)
+{
+    struct attachment *att;
+    struct vmnetfs_fuse_dentry *dir;
+
+    dir = _vmnetfs_fuse_add_dir(NULL, NULL);
+    g_hash_table_foreach(images, add_image, dir);
+
+    g_mutex_lock(fuse->tree_lock);
+    if (g_hash_table_lookup(fuse->root->children, name) != NULL) {
+        g_mutex_unlock(fuse->tree_lock);
+        g_set_error(err, VMNETFS_FUSE_ERROR, VMNETFS_FUSE_ERROR_EXISTS,
+                "%s already exists", name);
+        dentry_free(dir);
+        return false;
+    }
+    att = g_slice_new0(struct attachment);
+    att->name = g_strdup(name);
+    att->dir = dir;
+    att->destroy = destroy;
+    att->data = data;
+    dir->parent = fuse->root;
+    fuse->root->nlink++;
+    g_hash_table_insert(fuse->root->children, g_strdup(name), dir);
+    add_inodes(fuse->inodes, dir, att);
+    fuse->attachments = g_slist_prepend(fuse->attachments, att);
+    g_mutex_unlock(fuse->tree_lock);
+    return true;
+}
+
+/* Return true if the root directory has an entry named @name. */
+bool _vmnetfs_fuse_exists(struct vmnetfs_fuse *fuse, const char *name)
+{
+    bool exists;
+
+    g_mutex_lock(fuse->tree_lock);
+    exists = g_hash_table_lookup(fuse->root->children, name) != NULL;
+    g_mutex_unlock(fuse->tree_lock);
+    return exists;
+}
+
+/* Remove a directory added with _vmnetfs_fuse_attach().  Open files
+   in it keep working until they are closed. */
+bool _vmnetfs_fuse_detach(struct vmnetfs_fuse *fuse, const char *name,
+        GError **err)
+{
+    struct vmnetfs_fuse_dentry *dir;
+    struct attachment *att;
+    bool last;
+
+    g_mutex_lock(fuse->tree_lock);
+    dir = g_hash_table_lookup(fuse->root->children, name);
+    if (dir == NULL || dir->att == NULL) {
+        g_mutex_unlock(fuse->tree_lock);
+        g_set_error(err, VMNETFS_FUSE_ERROR, VMNETFS_FUSE_ERROR_NOT_FOUND,
+                "No attached directory named %s", name);
+        return false;
+    }
+    att = dir->att;
+    unlink_attachment(fuse, att);
+    remove_inodes(fuse->inodes, dir);
+    att->detached = true;
+    last = att->refs == 0;
+    if (last) {
+        fuse->attachments = g_slist_remove(fuse->attachments, att);
+    }
+    g_mutex_unlock(fuse->tree_lock);
+
+    /* Have the kernel look the name up again, so that it finds nothing */
+    fuse_lowlevel_notify_inval_entry(fuse->session, FUSE_ROOT_ID, name,
+            strlen(name));
+    if (last) {
+        attachment_free(att);
+    }
+    return true;
+}
+
+/* Have the kernel drop cached data for @count bytes of inode @ino from
+   @start, or to the end of the file if @count is zero.  Must not be
+   called while serving a FUSE request, which could deadlock against the
+   kernel's locks. */
+void _vmnetfs_fuse_invalidate(uint64_t ino, uint64_t start, uint64_t count)
+{
+    if (notify_lock == NULL) {
+        return;
+    }
+    g_mutex_lock(notify_lock);
+    if (notify_session != NULL) {
+        /* Fails harmlessly if the kernel has forgotten the inode */
+        fuse_lowlevel_notify_inval_inode(notify_session, ino, start,
+                count);
+    }
+    g_mutex_unlock(notify_lock);
+}
+
 /* Return true if the current FUSE request was interrupted. */
 bool _vmnetfs_fuse_interrupted(void)
 {
-    return fuse_interrupted();
+    struct request_state *rs = g_private_get(current_request);
+
+    return rs != NULL && fuse_req_interrupted(rs->req);
 }
@@ -17,6 +17,7 @@
 
 #include <string.h>
 #include <inttypes.h>
+#include <unistd.h>
 #include "vmnetfs-private.h"
 
 struct chunk_state {
@@ -34,6 +35,18 @@ struct chunk_lock {
     uint32_t waiters;
 };
 
+struct batched_read {
+    uint64_t chunk;
+    uint64_t image_size;
+    char *data;
+    uint32_t offset;
+    uint32_t length;
+    bool modified;
+    char *fill;  /* pool buffer receiving the whole chunk, or NULL */
+    uint32_t fill_length;
+    int op;  /* -1 if served from the memory cache */
+};
+
 struct stream_state {
     uint64_t start_chunk;
     uint64_t chunks;
@@ -87,6 +100,14 @@ static bool _set_image_size(struct vmnetfs_image *img, uint64_t new_size,
 static bool lock_and_copy_to_modified(struct vmnetfs_image *img,
         uint64_t chunk, GError **err);
 
+/* Returns true if some of the chunk's data is still only available from
+   the pristine image. */
+static bool chunk_needs_copy(struct vmnetfs_image *img, uint64_t chunk)
+{
+    return !_vmnetfs_bit_test(img->modified_map, chunk) ||
+            _vmnetfs_ll_modified_chunk_is_incomplete(img, chunk);
+}
+
 /* chunk_state lock must be held, and may be dropped and reacquired by
    this function. */
 static bool expand_image(struct vmnetfs_image *img, uint64_t new_size,
@@ -99,10 +120,10 @@ static bool expand_image(struct vmnetfs_image *img, uint64_t new_size,
     g_assert(new_size > cs->image_size);
     last_chunk = (cs->image_size - 1) / img->chunk_size;
     if (cs->image_size % img->chunk_size != 0 &&
-            !_vmnetfs_bit_test(img->modified_map, last_chunk)) {
-        /* The current last chunk is a partial chunk and is not in the
-           modified cache.  Copy it there so that accesses to the tail
-           of the chunk don't overrun the pristine cache. */
+            chunk_needs_copy(img, last_chunk)) {
+        /* The current last chunk is a partial chunk and is not entirely
+           in the modified cache.  Copy it there so that accesses to the
+           tail of the chunk don't overrun the pristine cache. */
         g_mutex_unlock(cs->lock);
         ret = lock_and_copy_to_modified(img, last_chunk, err);
         g_mutex_lock(cs->lock);
@@ -223,20 +244,6 @@ static void chunk_unlock(struct vmnetfs_image *img, uint64_t chunk)
     g_mutex_unlock(cs->lock);
 }
 
-static bool io_interrupted(void *data G_GNUC_UNUSED)
-{
-    return _vmnetfs_fuse_interrupted();
-}
-
-/* Fetch the specified byte range from the image. */
-static bool fetch_data(struct vmnetfs_image *img, void *buf, uint64_t start,
-        uint64_t count, GError **err)
-{
-    return _vmnetfs_transport_fetch(img->cpool, img->url, img->username,
-            img->password, img->etag, img->last_modified, buf,
-            start + img->fetch_offset, count, io_interrupted, NULL, err);
-}
-
 static bool stream_callback(void *arg, const void *buf, uint64_t count,
         GError **err)
 {
@@ -291,12 +298,12 @@ static bool do_stream(struct vmnetfs_image *img, GError **err)
             img->initial_size - offset);
 
     /* Fetch data */
-    state->buf = g_malloc(img->chunk_size);
+    state->buf = _vmnetfs_pool_get(img);
     _vmnetfs_transport_fetch_stream_once(img->cpool, img->url,
             img->username, img->password, img->etag, img->last_modified,
             stream_callback, img, img->fetch_offset + offset,
             img->initial_size - offset, stream_should_stop, img, &my_err);
-    g_free(state->buf);
+    _vmnetfs_pool_put(img, state->buf);
     /* transport will report short reads */
 
     /* Release remaining chunk locks */
@@ -399,41 +406,147 @@ static void stream_stop(struct vmnetfs_image *img)
     }
 }
 
-bool _vmnetfs_io_init(struct vmnetfs_image *img, GError **err)
+/* Set up the pristine cache, content store and fetch machinery.  The
+   image's bitmap group must exist and its cache must be open. */
+static bool pristine_init(struct vmnetfs_image *img, GError **err)
 {
     GList *cur;
 
-    img->bitmaps = _vmnetfs_bit_group_new((img->initial_size +
-            img->chunk_size - 1) / img->chunk_size);
-    if (!_vmnetfs_ll_pristine_init(img, err)) {
-        _vmnetfs_bit_group_free(img->bitmaps);
+    if (!_vmnetfs_store_init(img, err)) {
         return false;
     }
-    if (!_vmnetfs_ll_modified_init(img, err)) {
-        _vmnetfs_ll_pristine_destroy(img);
-        _vmnetfs_bit_group_free(img->bitmaps);
-        return false;
+    if (!_vmnetfs_ll_pristine_init(img, err)) {
+        goto bad_store;
     }
     img->cpool = _vmnetfs_transport_pool_new(err);
     if (img->cpool == NULL) {
-        _vmnetfs_ll_modified_destroy(img);
-        _vmnetfs_ll_pristine_destroy(img);
-        _vmnetfs_bit_group_free(img->bitmaps);
-        return false;
+        goto bad_pristine;
     }
     for (cur = img->cookies; cur != NULL; cur = cur->next) {
         if (!_vmnetfs_transport_pool_set_cookie(img->cpool, cur->data, err)) {
-            _vmnetfs_transport_pool_free(img->cpool);
-            _vmnetfs_ll_modified_destroy(img);
-            _vmnetfs_ll_pristine_destroy(img);
-            _vmnetfs_bit_group_free(img->bitmaps);
-            return false;
+            goto bad_cpool;
         }
     }
-    img->accessed_map = _vmnetfs_bit_new(img->bitmaps, false);
+    if (!_vmnetfs_writeback_init(img, err)) {
+        goto bad_cpool;
+    }
+    if (!_vmnetfs_fetch_init(img, err)) {
+        goto bad_writeback;
+    }
     img->fetched_map = _vmnetfs_bit_new(img->bitmaps, false);
+    return true;
+
+bad_writeback:
+    _vmnetfs_writeback_destroy(img);
+bad_cpool:
+    _vmnetfs_transport_pool_free(img->cpool);
+bad_pristine:
+    _vmnetfs_ll_pristine_destroy(img);
+bad_store:
+    _vmnetfs_store_destroy(img);
+    return false;
+}
+
+static void pristine_destroy(struct vmnetfs_image *img)
+{
+    _vmnetfs_fetch_destroy(img);
+    _vmnetfs_writeback_destroy(img);
+    _vmnetfs_bit_free(img->fetched_map);
+    _vmnetfs_transport_pool_free(img->cpool);
+    _vmnetfs_ll_pristine_destroy(img);
+    _vmnetfs_store_destroy(img);
+}
+
+/* An image attached to a daemon reads through its origin, which it
+   shares with every other image using the same pristine cache. */
+static void pristine_borrow(struct vmnetfs_image *img)
+{
+    struct vmnetfs_image *origin = img->origin;
+
+    img->store = origin->store;
+    img->present_map = origin->present_map;
+    img->zero_map = origin->zero_map;
+    img->compressed_map = origin->compressed_map;
+    img->shared_map = origin->shared_map;
+    img->fetched_map = origin->fetched_map;
+    img->cpool = origin->cpool;
+    img->writeback = origin->writeback;
+    img->fetch = origin->fetch;
+}
+
+/* An origin is only used through the images borrowing from it, so it
+   has no modified state, RAM cache or access records of its own. */
+bool _vmnetfs_io_init_origin(struct vmnetfs_image *img, GError **err)
+{
+    if (!_vmnetfs_pool_init(img, err)) {
+        return false;
+    }
+    img->bitmaps = _vmnetfs_bit_group_new((img->initial_size +
+            img->chunk_size - 1) / img->chunk_size);
+    if (!_vmnetfs_cache_open_image(img, err)) {
+        goto bad_bitmaps;
+    }
+    if (!pristine_init(img, err)) {
+        goto bad_cache;
+    }
+    return true;
+
+bad_cache:
+    _vmnetfs_cache_close_image(img);
+bad_bitmaps:
+    _vmnetfs_bit_group_free(img->bitmaps);
+    _vmnetfs_pool_destroy(img);
+    return false;
+}
+
+/* All images borrowing from the origin must have been destroyed. */
+void _vmnetfs_io_destroy_origin(struct vmnetfs_image *img)
+{
+    pristine_destroy(img);
+    _vmnetfs_cache_close_image(img);
+    _vmnetfs_bit_group_free(img->bitmaps);
+    _vmnetfs_pool_destroy(img);
+}
+
+/* If img->origin is set, it must already have been initialized with
+   _vmnetfs_io_init_origin(). */
+bool _vmnetfs_io_init(struct vmnetfs_image *img, GError **err)
+{
+    if (!_vmnetfs_pool_init(img, err)) {
+        return false;
+    }
+    _vmnetfs_ramcache_init(img);
+    img->bitmaps = _vmnetfs_bit_group_new((img->initial_size +
+            img->chunk_size - 1) / img->chunk_size);
+    if (!_vmnetfs_cache_open_image(img, err)) {
+        goto bad_bitmaps;
+    }
+    if (img->origin != NULL) {
+        pristine_borrow(img);
+    } else if (!pristine_init(img, err)) {
+        goto bad_cache;
+    }
+    if (!_vmnetfs_ll_modified_init(img, err)) {
+        goto bad_pristine;
+    }
+    _vmnetfs_uring_init(img);
+    img->accessed_map = _vmnetfs_bit_new(img->bitmaps, false);
+    img->discarded_map = _vmnetfs_bit_new(img->bitmaps, false);
     img->chunk_state = chunk_state_new(img->initial_size);
+    _vmnetfs_prefetch_init(img);
     return true;
+
+bad_pristine:
+    if (img->origin == NULL) {
+        pristine_destroy(img);
+    }
+bad_cache:
+    _vmnetfs_cache_close_image(img);
+bad_bitmaps:
+    _vmnetfs_bit_group_free(img->bitmaps);
+    _vmnetfs_ramcache_destroy(img);
+    _vmnetfs_pool_destroy(img);
+    return false;
 }
 
 /* Cannot fail because we have already committed to launch. */
@@ -446,6 +559,19 @@ void _vmnetfs_io_open(struct vmnetfs_image *img)
             g_warning("Couldn't start streaming: %s", my_err->message);
             g_clear_error(&my_err);
         }
+    } else if (img->background_fill) {
+        if (!_vmnetfs_fill_start(img, &my_err)) {
+            g_warning("Couldn't start background fill: %s",
+                    my_err->message);
+            g_clear_error(&my_err);
+        }
+    }
+    if (img->fetch_mode == FETCH_MODE_DEMAND && img->fs_prefetch) {
+        if (!_vmnetfs_fsmap_start(img, &my_err)) {
+            g_warning("Couldn't start filesystem prefetch: %s",
+                    my_err->message);
+            g_clear_error(&my_err);
+        }
     }
 }
 
@@ -453,6 +579,9 @@ void _vmnetfs_io_close(struct vmnetfs_image *img)
 {
     struct chunk_state *cs = img->chunk_state;
 
+    _vmnetfs_fsmap_stop(img);
+    _vmnetfs_prefetch_close(img);
+    _vmnetfs_fill_stop(img);
     stream_stop(img);
     _vmnetfs_bit_group_close(img->bitmaps);
 
@@ -478,23 +607,109 @@ void _vmnetfs_io_destroy(struct vmnetfs_image *img)
     if (img == NULL) {
         return;
     }
+    _vmnetfs_fsmap_destroy(img);
+    _vmnetfs_fill_destroy(img);
+    _vmnetfs_prefetch_destroy(img);
     if (img->stream) {
         stream_stop(img);
         g_thread_join(img->stream->thread);
         g_slice_free(struct stream_state, img->stream);
     }
+    if (img->origin == NULL) {
+        pristine_destroy(img);
+    }
+    _vmnetfs_uring_destroy(img);
     _vmnetfs_ll_modified_destroy(img);
-    _vmnetfs_ll_pristine_destroy(img);
+    _vmnetfs_cache_close_image(img);
     chunk_state_free(img->chunk_state);
     _vmnetfs_bit_free(img->accessed_map);
-    _vmnetfs_bit_free(img->fetched_map);
+    _vmnetfs_bit_free(img->discarded_map);
     _vmnetfs_bit_group_free(img->bitmaps);
-    _vmnetfs_transport_pool_free(img->cpool);
+    _vmnetfs_ramcache_destroy(img);
+    _vmnetfs_pool_destroy(img);
 }
 
+/* Another vmnetfs sharing the pristine cache may have evicted the chunk
+   file.  If so, forget that the chunk is present.  chunk lock must be
+   held. */
+static bool pristine_chunk_vanished(struct vmnetfs_image *img,
+        uint64_t chunk, GError *err)
+{
+    if (!g_error_matches(err, G_FILE_ERROR, G_FILE_ERROR_NOENT)) {
+        return false;
+    }
+    _vmnetfs_bit_clear(img->present_map, chunk);
+    _vmnetfs_bit_clear(img->compressed_map, chunk);
+    return true;
+}
+
+/* Read from the unmodified image, fetching at @priority if necessary.
+   chunk lock must be held. */
+static bool read_pristine_unlocked(struct vmnetfs_image *img, void *data,
+        uint64_t chunk, uint32_t offset, uint32_t length,
+        enum fetch_priority priority, GError **err)
+{
+    GError *my_err = NULL;
+
+    if (_vmnetfs_bit_test(img->zero_map, chunk)) {
+        memset(data, 0, length);
+        return true;
+    }
+    if (_vmnetfs_writeback_read_chunk(img, data, chunk, offset, length)) {
+        return true;
+    }
+    /* The chunk is not waiting in the writeback queue, so if it was
+       ever queued, it is now marked present. */
+    if (_vmnetfs_bit_test(img->present_map, chunk) ||
+            _vmnetfs_ll_pristine_adopt_chunk(img, chunk) ||
+            _vmnetfs_ll_pristine_import_chunk(img, chunk)) {
+        if (_vmnetfs_ll_pristine_read_chunk(img, data, chunk, offset,
+                length, &my_err)) {
+            return true;
+        }
+        if (!pristine_chunk_vanished(img, chunk, my_err)) {
+            g_propagate_error(err, my_err);
+            return false;
+        }
+        g_clear_error(&my_err);
+    }
+    /* The fetch engine waits for any other vmnetfs process fetching the
+       chunk into the same pristine cache, and queues the chunk for
+       writeback, even if we are interrupted while waiting for it. */
+    if (priority == FETCH_PRIORITY_DEMAND) {
+        _vmnetfs_fill_note_demand(img, length);
+    }
+    return _vmnetfs_fetch_chunk(img, data, chunk, offset, length, priority,
+            err);
+}
+
+/* Fill in the sectors of an incomplete chunk that the guest has not
+   written, making the modified cache authoritative for the whole chunk.
+   chunk lock must be held. */
+static bool complete_chunk(struct vmnetfs_image *img,
+        uint64_t image_size, uint64_t chunk, enum fetch_priority priority,
+        GError **err)
+{
+    uint64_t count;
+    void *buf;
+    bool ret;
+
+    count = MIN(img->initial_size - chunk * img->chunk_size, img->chunk_size);
+    buf = _vmnetfs_pool_get(img);
+    ret = read_pristine_unlocked(img, buf, chunk, 0, count, priority, err);
+    if (ret) {
+        ret = _vmnetfs_ll_modified_complete_chunk(img, image_size, buf, chunk,
+                err);
+    }
+    _vmnetfs_pool_put(img, buf);
+    return ret;
+}
+
+/* Reads at FETCH_PRIORITY_DEMAND are on behalf of a client, and mark
+   the chunk accessed.  chunk lock must be held. */
 static uint64_t read_chunk_unlocked(struct vmnetfs_image *img,
         uint64_t image_size, void *data, uint64_t chunk, uint32_t offset,
-        uint32_t length, GError **err)
+        uint32_t length, enum fetch_priority priority, GError **err)
 {
     g_assert(offset < img->chunk_size);
     g_assert(offset + length <= img->chunk_size);
@@ -505,38 +720,24 @@ static uint64_t read_chunk_unlocked(struct vmnetfs_image *img,
         return false;
     }
     length = MIN(image_size - chunk * img->chunk_size - offset, length);
-    _vmnetfs_bit_set(img->accessed_map, chunk);
+    if (priority == FETCH_PRIORITY_DEMAND) {
+        _vmnetfs_bit_set(img->accessed_map, chunk);
+    }
     if (_vmnetfs_bit_test(img->modified_map, chunk)) {
-        if (!_vmnetfs_ll_modified_read_chunk(img, image_size, data, chunk,
-                offset, length, err)) {
-            return 0;
-        }
-    } else {
-        /* If two vmnetfs instances are working out of the same pristine
-           cache, they will redundantly fetch chunks due to our failure to
-           keep the present map up to date. */
-        if (!_vmnetfs_bit_test(img->present_map, chunk)) {
-            uint64_t start = chunk * img->chunk_size;
-            uint64_t count = MIN(img->initial_size - start, img->chunk_size);
-            void *buf = g_malloc(count);
-
-            _vmnetfs_u64_stat_increment(img->chunk_fetches, 1);
-            if (!fetch_data(img, buf, start, count, err)) {
-                g_free(buf);
-                return 0;
-            }
-            _vmnetfs_bit_set(img->fetched_map, chunk);
-            bool ok = _vmnetfs_ll_pristine_write_chunk(img, buf, chunk,
-                    count, err);
-            g_free(buf);
-            if (!ok) {
+        if (!_vmnetfs_ll_modified_range_is_dirty(img, chunk, offset,
+                length)) {
+            /* Reading a part of the chunk that was never written */
+            if (!complete_chunk(img, image_size, chunk, priority, err)) {
                 return 0;
             }
         }
-        if (!_vmnetfs_ll_pristine_read_chunk(img, data, chunk, offset,
-                length, err)) {
+        if (!_vmnetfs_ll_modified_read_chunk(img, image_size, data, chunk,
+                offset, length, err)) {
             return 0;
         }
+    } else if (!read_pristine_unlocked(img, data, chunk, offset, length,
+            priority, err)) {
+        return 0;
     }
     return length;
 }
@@ -547,15 +748,408 @@ uint64_t _vmnetfs_io_read_chunk(struct vmnetfs_image *img, void *data,
     uint64_t image_size;
     uint64_t ret;
 
+    /* Unmodified zero chunks don't need the chunk lock.  If we race
+       with a write to the chunk, it's as though the read came first. */
+    if (_vmnetfs_bit_test(img->zero_map, chunk) &&
+            !_vmnetfs_bit_test(img->modified_map, chunk)) {
+        image_size = _vmnetfs_io_get_image_size(img, NULL);
+        if (chunk * img->chunk_size + offset < image_size) {
+            length = MIN(image_size - chunk * img->chunk_size - offset,
+                    length);
+            _vmnetfs_bit_set(img->accessed_map, chunk);
+            memset(data, 0, length);
+            return length;
+        }
+    }
+
     if (!chunk_trylock(img, chunk, &image_size, err)) {
         return false;
     }
     ret = read_chunk_unlocked(img, image_size, data, chunk, offset, length,
-            err);
+            FETCH_PRIORITY_DEMAND, err);
+    chunk_unlock(img, chunk);
+    return ret;
+}
+
+/* Read for vmnetfs's own use, at prefetch priority.  The chunk is not
+   marked accessed or added to the RAM cache, so that the read doesn't
+   count as use by the guest. */
+uint64_t _vmnetfs_io_peek_chunk(struct vmnetfs_image *img, void *data,
+        uint64_t chunk, uint32_t offset, uint32_t length, GError **err)
+{
+    uint64_t image_size;
+    uint64_t ret;
+
+    if (!chunk_trylock(img, chunk, &image_size, err)) {
+        return false;
+    }
+    ret = read_chunk_unlocked(img, image_size, data, chunk, offset, length,
+            FETCH_PRIORITY_PREFETCH, err);
     chunk_unlock(img, chunk);
     return ret;
 }
 
+/* If the chunk's data is already in a cache file, queue a read of it on
+   @batch.  Returns false if the chunk needs the synchronous path.  chunk
+   lock must be held. */
+static bool queue_read(struct vmnetfs_image *img,
+        struct vmnetfs_uring_batch *batch, struct batched_read *br)
+{
+    uint64_t start = br->chunk * img->chunk_size;
+    void *buf = br->data;
+    uint32_t offset = br->offset;
+    uint32_t length = br->length;
+
+    br->modified = _vmnetfs_bit_test(img->modified_map, br->chunk);
+    if (br->modified) {
+        if (_vmnetfs_ll_modified_chunk_is_incomplete(img, br->chunk)) {
+            return false;
+        }
+        br->fill_length = MIN(img->chunk_size, br->image_size - start);
+    } else {
+        if (_vmnetfs_bit_test(img->zero_map, br->chunk) ||
+                !_vmnetfs_bit_test(img->present_map, br->chunk) ||
+                _vmnetfs_bit_test(img->compressed_map, br->chunk)) {
+            return false;
+        }
+        br->fill_length = MIN(img->chunk_size, img->initial_size - start);
+    }
+    _vmnetfs_bit_set(img->accessed_map, br->chunk);
+
+    if (_vmnetfs_ramcache_read(img, br->data, br->chunk, br->modified,
+            br->offset, br->length)) {
+        br->op = -1;
+        return true;
+    }
+    if (_vmnetfs_ramcache_enabled(img)) {
+        br->fill = _vmnetfs_pool_get(img);
+        buf = br->fill;
+        offset = 0;
+        length = br->fill_length;
+    }
+    if (br->modified) {
+        br->op = _vmnetfs_ll_modified_queue_read(img, batch, buf, br->chunk,
+                offset, length);
+    } else {
+        br->op = _vmnetfs_ll_pristine_queue_read(img, batch, buf, br->chunk,
+                offset, length);
+    }
+    return true;
+}
+
+/* Finish a queued read.  chunk lock must be held. */
+static bool complete_read(struct vmnetfs_image *img,
+        struct vmnetfs_uring_batch *batch, struct batched_read *br,
+        GError **err)
+{
+    GError *my_err = NULL;
+    bool ret = true;
+
+    if (br->op == -1) {
+        /* Served from memory */
+    } else if (_vmnetfs_uring_batch_result(batch, br->op, &my_err)) {
+        if (br->fill != NULL) {
+            _vmnetfs_ramcache_insert(img, br->fill, br->chunk, br->modified,
+                    br->fill_length);
+            memcpy(br->data, br->fill + br->offset, br->length);
+        }
+    } else if (my_err == NULL || (!br->modified &&
+            pristine_chunk_vanished(img, br->chunk, my_err))) {
+        /* Try again the slow way */
+        g_clear_error(&my_err);
+        ret = read_chunk_unlocked(img, br->image_size, br->data, br->chunk,
+                br->offset, br->length, FETCH_PRIORITY_DEMAND, err) ==
+                br->length;
+    } else {
+        g_propagate_error(err, my_err);
+        ret = false;
+    }
+    _vmnetfs_pool_put(img, br->fill);
+    return ret;
+}
+
+/* Submit the queued reads, finish them in order, and release their chunk
+   locks.  Adds the bytes read before the first failure to *count. */
+static bool flush_reads(struct vmnetfs_image *img,
+        struct vmnetfs_uring_batch *batch, struct batched_read *reads,
+        int *queued, uint64_t *count, GError **err)
+{
+    GError *my_err = NULL;
+    int i;
+
+    if (*queued == 0) {
+        return true;
+    }
+    _vmnetfs_uring_batch_submit(batch);
+    for (i = 0; i < *queued; i++) {
+        if (my_err != NULL) {
+            /* Only report data up to the first failure */
+            _vmnetfs_pool_put(img, reads[i].fill);
+        } else if (complete_read(img, batch, &reads[i], &my_err)) {
+            *count += reads[i].length;
+        }
+        chunk_unlock(img, reads[i].chunk);
+    }
+    _vmnetfs_uring_batch_clear(batch);
+    *queued = 0;
+    if (my_err) {
+        g_propagate_error(err, my_err);
+        return false;
+    }
+    return true;
+}
+
+/* Read a range which may span several chunks.  If io_uring is available,
+   reads of chunks whose data is already in a cache file are submitted
+   together; other chunks take the usual path.  Returns the number of
+   bytes read before the first error, if any. */
+uint64_t _vmnetfs_io_read(struct vmnetfs_image *img, void *data,
+        uint64_t start, uint64_t count, GError **err)
+{
+    struct vmnetfs_uring_batch *batch;
+    struct batched_read reads[VMNETFS_URING_BATCH_OPS];
+    struct batched_read *br;
+    struct vmnetfs_cursor cur;
+    uint64_t image_size;
+    uint64_t done = 0;
+    uint64_t read = 0;
+    int queued = 0;
+    GError *my_err = NULL;
+    GError *flush_err = NULL;
+
+    batch = _vmnetfs_uring_batch_new(img);
+    for (_vmnetfs_cursor_start(img, &cur, start, count);
+            _vmnetfs_cursor_chunk(&cur, read); ) {
+        if (batch == NULL) {
+            read = _vmnetfs_io_read_chunk(img, data + cur.io_offset,
+                    cur.chunk, cur.offset, cur.length, &my_err);
+            done += read;
+            if (read < cur.length) {
+                break;
+            }
+            continue;
+        }
+
+        if (!chunk_trylock(img, cur.chunk, &image_size, &my_err)) {
+            break;
+        }
+        br = &reads[queued];
+        memset(br, 0, sizeof(*br));
+        br->chunk = cur.chunk;
+        br->image_size = image_size;
+        br->data = data + cur.io_offset;
+        br->offset = cur.offset;
+        if (cur.chunk * img->chunk_size + cur.offset < image_size) {
+            br->length = MIN(image_size - cur.chunk * img->chunk_size -
+                    cur.offset, cur.length);
+        }
+        if (br->length > 0 && queue_read(img, batch, br)) {
+            read = br->length;
+            if (++queued == VMNETFS_URING_BATCH_OPS &&
+                    !flush_reads(img, batch, reads, &queued, &done,
+                    &my_err)) {
+                break;
+            }
+        } else {
+            /* Earlier chunks must be finished before we can report on
+               this one */
+            if (!flush_reads(img, batch, reads, &queued, &done, &my_err)) {
+                chunk_unlock(img, cur.chunk);
+                break;
+            }
+            read = read_chunk_unlocked(img, image_size,
+                    data + cur.io_offset, cur.chunk, cur.offset,
+                    cur.length, FETCH_PRIORITY_DEMAND, &my_err);
+            chunk_unlock(img, cur.chunk);
+            done += read;
+            if (read < cur.length) {
+                break;
+            }
+        }
+    }
+    if (batch != NULL) {
+        /* Reads still queued precede any failure in the loop */
+        if (!flush_reads(img, batch, reads, &queued, &done, &flush_err)) {
+            g_clear_error(&my_err);
+            my_err = flush_err;
+        }
+        _vmnetfs_uring_batch_free(batch);
+    }
+    if (my_err) {
+        g_propagate_error(err, my_err);
+    }
+    return done;
+}
+
+/* Point @seg at the chunk's cache file if its data can be read straight
+   from there, or else read the data into a pool buffer.  Images with a
+   RAM cache never splice, so that their reads fill it.  chunk lock must
+   be held. */
+static uint64_t read_segment_unlocked(struct vmnetfs_image *img,
+        uint64_t image_size, struct vmnetfs_segment *seg, uint64_t chunk,
+        uint32_t offset, uint32_t length, GError **err)
+{
+    uint64_t start = chunk * img->chunk_size;
+    bool modified;
+    GError *my_err = NULL;
+
+    if (start + offset >= image_size) {
+        g_set_error(err, VMNETFS_IO_ERROR, VMNETFS_IO_ERROR_EOF,
+                "End of file");
+        return 0;
+    }
+    length = MIN(image_size - start - offset, length);
+    modified = _vmnetfs_bit_test(img->modified_map, chunk);
+
+    seg->buf = _vmnetfs_pool_get(img);
+    if (!_vmnetfs_ramcache_enabled(img) && (modified ?
+            !_vmnetfs_ll_modified_chunk_is_incomplete(img, chunk) :
+            (_vmnetfs_bit_test(img->present_map, chunk) &&
+            !_vmnetfs_bit_test(img->zero_map, chunk) &&
+            !_vmnetfs_bit_test(img->compressed_map, chunk)))) {
+        _vmnetfs_bit_set(img->accessed_map, chunk);
+        if (modified) {
+            seg->fd = img->write_fd;
+            seg->pos = start + offset;
+        } else {
+            seg->fd = _vmnetfs_ll_pristine_open_chunk(img, chunk, &my_err);
+            seg->close_fd = true;
+            seg->pos = offset;
+        }
+        if (seg->fd != -1) {
+            _vmnetfs_pool_put(img, seg->buf);
+            seg->buf = NULL;
+            seg->length = length;
+            _vmnetfs_u64_stat_increment(img->bytes_spliced, length);
+            return length;
+        }
+        seg->close_fd = false;
+        if (!pristine_chunk_vanished(img, chunk, my_err)) {
+            g_propagate_error(err, my_err);
+            return 0;
+        }
+        g_clear_error(&my_err);
+    }
+    seg->length = read_chunk_unlocked(img, image_size, seg->buf, chunk,
+            offset, length, FETCH_PRIORITY_DEMAND, err);
+    return seg->length;
+}
+
+/* Describe the range as a list of segments that the FUSE layer can
+   splice to the kernel instead of copying.  Chunks whose data is in a
+   cache file become file segments; everything else is read into a
+   buffer.  The chunk locks are held until the segments are released,
+   so the files can't change underneath the reply.  Returns the number
+   of bytes described; if short, @err says why. */
+uint64_t _vmnetfs_io_read_segments(struct vmnetfs_image *img, GArray *segs,
+        uint64_t start, uint64_t count, GError **err)
+{
+    struct vmnetfs_segment seg;
+    struct vmnetfs_cursor cur;
+    uint64_t image_size;
+    uint64_t done = 0;
+    uint64_t read = 0;
+
+    for (_vmnetfs_cursor_start(img, &cur, start, count);
+            _vmnetfs_cursor_chunk(&cur, read); ) {
+        if (!chunk_trylock(img, cur.chunk, &image_size, err)) {
+            break;
+        }
+        memset(&seg, 0, sizeof(seg));
+        seg.fd = -1;
+        seg.chunk = cur.chunk;
+        read = read_segment_unlocked(img, image_size, &seg, cur.chunk,
+                cur.offset, cur.length, err);
+        g_array_append_val(segs, seg);
+        done += read;
+        if (read < cur.length) {
+            break;
+        }
+    }
+    return done;
+}
+
+void _vmnetfs_io_release_segments(struct vmnetfs_image *img, GArray *segs)
+{
+    struct vmnetfs_segment *seg;
+    unsigned i;
+
+    for (i = 0; i < segs->len; i++) {
+        seg = &g_array_index(segs, struct vmnetfs_segment, i);
+        if (seg->close_fd) {
+            close(seg->fd);
+        }
+        if (seg->buf != NULL) {
+            _vmnetfs_pool_put(img, seg->buf);
+        }
+        chunk_unlock(img, seg->chunk);
+    }
+}
+
+/* Returns true if reading the range would have to wait for the network.
+   chunk lock must be held. */
+static bool chunk_needs_fetch(struct vmnetfs_image *img, uint64_t chunk,
+        uint32_t offset, uint32_t length)
+{
+    if (_vmnetfs_bit_test(img->modified_map, chunk) &&
+            _vmnetfs_ll_modified_range_is_dirty(img, chunk, offset,
+            length)) {
+        return false;
+    }
+    return !_vmnetfs_bit_test(img->zero_map, chunk) &&
+            !_vmnetfs_bit_test(img->present_map, chunk) &&
+            !_vmnetfs_writeback_contains(img, chunk) &&
+            !_vmnetfs_ll_pristine_import_chunk(img, chunk);
+}
+
+/* Start background fetches of any chunks in the range that are not
+   available locally, arranging for @ready to be called with @arg as each
+   one completes.  Returns the number of calls to expect; if zero, the
+   range can be read without blocking on the network.  Chunks that are
+   locked by another operation are skipped, so the eventual read may
+   still have to wait for them.  Fetches are queued behind those of
+   more urgent @priority. */
+int _vmnetfs_io_fetch_async(struct vmnetfs_image *img, uint64_t start,
+        uint64_t count, enum fetch_priority priority,
+        void (*ready)(void *arg), void *arg)
+{
+    struct chunk_state *cs = img->chunk_state;
+    struct vmnetfs_cursor cur;
+    uint64_t image_size;
+    uint64_t step = 0;
+    int pending = 0;
+
+    for (_vmnetfs_cursor_start(img, &cur, start, count);
+            _vmnetfs_cursor_chunk(&cur, step); step = cur.length) {
+        if (cur.chunk * img->chunk_size >= img->initial_size) {
+            break;
+        }
+        g_mutex_lock(cs->lock);
+        image_size = cs->image_size;
+        if (cur.chunk * img->chunk_size + cur.offset >= image_size) {
+            g_mutex_unlock(cs->lock);
+            break;
+        }
+        if (g_hash_table_lookup(cs->chunk_locks, &cur.chunk) != NULL) {
+            g_mutex_unlock(cs->lock);
+            continue;
+        }
+        /* Can't fail, since nobody holds the lock */
+        if (!_chunk_trylock(cs, cur.chunk, NULL, NULL)) {
+            g_assert_not_reached();
+        }
+        g_mutex_unlock(cs->lock);
+
+        if (chunk_needs_fetch(img, cur.chunk, cur.offset, cur.length) &&
+                _vmnetfs_fetch_chunk_async(img, cur.chunk, priority,
+                ready, arg)) {
+            pending++;
+        }
+        chunk_unlock(img, cur.chunk);
+    }
+    return pending;
+}
+
 /* chunk lock must be held. */
 static bool copy_to_modified(struct vmnetfs_image *img, uint64_t image_size,
         uint64_t chunk, GError **err)
@@ -563,15 +1157,53 @@ static bool copy_to_modified(struct vmnetfs_image *img, uint64_t image_size,
     uint64_t count;
     uint64_t read_count;
     void *buf;
+    int fd;
     bool ret;
     GError *my_err = NULL;
 
-    count = MIN(img->initial_size - chunk * img->chunk_size, img->chunk_size);
-    buf = g_malloc(count);
+    if (_vmnetfs_ll_modified_chunk_is_incomplete(img, chunk)) {
+        /* Already dirty */
+        return complete_chunk(img, image_size, chunk,
+                FETCH_PRIORITY_DEMAND, err);
+    }
 
+    count = MIN(img->initial_size - chunk * img->chunk_size, img->chunk_size);
     _vmnetfs_u64_stat_increment(img->chunk_dirties, 1);
+
+    if (_vmnetfs_bit_test(img->zero_map, chunk)) {
+        /* Nothing to copy; just leave a hole */
+        return _vmnetfs_ll_modified_discard_chunk(img, image_size, chunk,
+                count, err);
+    }
+
+    if (_vmnetfs_bit_test(img->present_map, chunk) &&
+            !_vmnetfs_bit_test(img->compressed_map, chunk)) {
+        /* Try to have the kernel copy the chunk file */
+        fd = _vmnetfs_ll_pristine_open_chunk(img, chunk, &my_err);
+        if (fd == -1) {
+            if (!pristine_chunk_vanished(img, chunk, my_err)) {
+                g_propagate_error(err, my_err);
+                return false;
+            }
+            /* Fetch it below */
+            g_clear_error(&my_err);
+        } else {
+            ret = _vmnetfs_ll_modified_clone_chunk(img, image_size, fd,
+                    chunk, count, &my_err);
+            close(fd);
+            if (ret) {
+                return true;
+            } else if (my_err) {
+                g_propagate_error(err, my_err);
+                return false;
+            }
+        }
+    }
+
+    _vmnetfs_u64_stat_increment(img->chunk_copies_user, 1);
+    buf = _vmnetfs_pool_get(img);
     read_count = read_chunk_unlocked(img, image_size, buf, chunk, 0, count,
-            &my_err);
+            FETCH_PRIORITY_DEMAND, &my_err);
     if (read_count != count) {
         if (!my_err) {
             g_set_error(err, VMNETFS_IO_ERROR, VMNETFS_IO_ERROR_PREMATURE_EOF,
@@ -579,13 +1211,13 @@ static bool copy_to_modified(struct vmnetfs_image *img, uint64_t image_size,
         } else {
             g_propagate_error(err, my_err);
         }
-        g_free(buf);
+        _vmnetfs_pool_put(img, buf);
         return false;
     }
     ret = _vmnetfs_ll_modified_write_chunk(img, image_size, buf, chunk,
             0, count, err);
 
-    g_free(buf);
+    _vmnetfs_pool_put(img, buf);
     return ret;
 }
 
@@ -597,29 +1229,22 @@ static bool lock_and_copy_to_modified(struct vmnetfs_image *img,
     if (!chunk_trylock(img, chunk, &image_size, err)) {
         return false;
     }
-    /* If the chunk is still unmodified, and has not been truncated away
-       while we had the lock released, copy it to the modified cache. */
+    /* If the chunk is still not fully in the modified cache, and has not
+       been truncated away while we had the lock released, copy it
+       there. */
     if (chunk * img->chunk_size < image_size &&
-            !_vmnetfs_bit_test(img->modified_map, chunk)) {
+            chunk_needs_copy(img, chunk)) {
         ret = copy_to_modified(img, image_size, chunk, err);
     }
     chunk_unlock(img, chunk);
     return ret;
 }
 
-uint64_t _vmnetfs_io_write_chunk(struct vmnetfs_image *img, const void *data,
-        uint64_t chunk, uint32_t offset, uint32_t length, GError **err)
+/* chunk lock must be held. */
+static uint64_t write_chunk_unlocked(struct vmnetfs_image *img,
+        uint64_t image_size, const void *data, uint64_t chunk,
+        uint32_t offset, uint32_t length, GError **err)
 {
-    uint64_t image_size;
-    uint64_t ret = 0;
-
-    g_assert(offset < img->chunk_size);
-    g_assert(offset + length <= img->chunk_size);
-
-    if (!chunk_trylock_ensure_size(img, chunk,
-            chunk * img->chunk_size + offset + length, &image_size, err)) {
-        return 0;
-    }
     _vmnetfs_bit_set(img->accessed_map, chunk);
     if (!_vmnetfs_bit_test(img->modified_map, chunk)) {
         if (offset == 0 && length == MIN(img->chunk_size,
@@ -627,21 +1252,106 @@ uint64_t _vmnetfs_io_write_chunk(struct vmnetfs_image *img, const void *data,
             /* Writing the whole chunk; skip fetch. */
             _vmnetfs_u64_stat_increment(img->chunk_dirties, 1);
             _vmnetfs_u64_stat_increment(img->chunk_fetch_skips, 1);
+        } else if (_vmnetfs_ll_modified_can_write_sectors(img, chunk,
+                offset, length)) {
+            /* Sector-aligned; defer the fetch until someone reads the
+               rest of the chunk.  If the guest eventually writes all of
+               it, the fetch is skipped. */
+            _vmnetfs_u64_stat_increment(img->chunk_dirties, 1);
         } else {
             if (!copy_to_modified(img, image_size, chunk, err)) {
-                goto out;
+                return 0;
             }
         }
+    } else if (_vmnetfs_ll_modified_chunk_is_incomplete(img, chunk) &&
+            !_vmnetfs_ll_modified_can_write_sectors(img, chunk, offset,
+            length)) {
+        /* Can't track a sub-sector write; fill in the rest first */
+        if (!complete_chunk(img, image_size, chunk,
+                FETCH_PRIORITY_DEMAND, err)) {
+            return 0;
+        }
     }
-    if (_vmnetfs_ll_modified_write_chunk(img, image_size, data, chunk,
+    if (!_vmnetfs_ll_modified_write_chunk(img, image_size, data, chunk,
             offset, length, err)) {
-        ret = length;
+        return 0;
+    }
+    return length;
+}
+
+uint64_t _vmnetfs_io_write_chunk(struct vmnetfs_image *img, const void *data,
+        uint64_t chunk, uint32_t offset, uint32_t length, GError **err)
+{
+    uint64_t image_size;
+    uint64_t ret;
+
+    g_assert(offset < img->chunk_size);
+    g_assert(offset + length <= img->chunk_size);
+
+    if (!chunk_trylock_ensure_size(img, chunk,
+            chunk * img->chunk_size + offset + length, &image_size, err)) {
+        return 0;
+    }
+    ret = write_chunk_unlocked(img, image_size, data, chunk, offset, length,
+            err);
+    chunk_unlock(img, chunk);
+    return ret;
+}
+
+/* Replace the specified range with zeroes without changing the image
+   size.  Whole chunks are dropped from the modified cache and never need
+   to be fetched. */
+bool _vmnetfs_io_discard_chunk(struct vmnetfs_image *img, uint64_t chunk,
+        uint32_t offset, uint32_t length, GError **err)
+{
+    uint64_t start = chunk * img->chunk_size;
+    uint64_t image_size;
+    void *buf;
+    bool ret = true;
+
+    g_assert(offset < img->chunk_size);
+    g_assert(offset + length <= img->chunk_size);
+
+    if (!chunk_trylock(img, chunk, &image_size, err)) {
+        return false;
+    }
+    if (start + offset >= image_size) {
+        /* Nothing to discard */
+        goto out;
+    }
+    length = MIN(image_size - start - offset, length);
+    if (offset == 0 && length == MIN(img->chunk_size, image_size - start)) {
+        ret = _vmnetfs_ll_modified_discard_chunk(img, image_size, chunk,
+                length, err);
+        if (ret) {
+            _vmnetfs_bit_set(img->discarded_map, chunk);
+            _vmnetfs_u64_stat_increment(img->chunk_discards, 1);
+        }
+    } else {
+        buf = _vmnetfs_pool_get(img);
+        memset(buf, 0, length);
+        ret = write_chunk_unlocked(img, image_size, buf, chunk, offset,
+                length, err) == length;
+        _vmnetfs_pool_put(img, buf);
     }
 out:
     chunk_unlock(img, chunk);
     return ret;
 }
 
+/* Must be called after the image is changed by a writer other than the
+   FUSE image file, such as the NBD server, so that the kernel doesn't
+   keep serving the old data.  @count of zero means to the end of the
+   image, as after a change of size.  Call without holding chunk
+   locks. */
+void _vmnetfs_io_notify_changed(struct vmnetfs_image *img, uint64_t start,
+        uint64_t count)
+{
+    if (img->kernel_cache) {
+        _vmnetfs_fuse_image_invalidate(img, start, count);
+    }
+}
+
 uint64_t _vmnetfs_io_get_image_size(struct vmnetfs_image *img,
         uint64_t *change_cookie)
 {
@@ -675,8 +1385,7 @@ bool _vmnetfs_io_set_image_size(struct vmnetfs_image *img, uint64_t size,
         /* Reduce image. */
 
         if (size % img->chunk_size > 0 && size < img->initial_size &&
-                !_vmnetfs_bit_test(img->modified_map,
-                (size - 1) / img->chunk_size)) {
+                chunk_needs_copy(img, (size - 1) / img->chunk_size)) {
             /* The new last chunk will be a partial chunk within the
                boundaries of the pristine cache, and it is not in the
                modified cache.  Copy it there so that subsequent expansions
@@ -742,3 +1451,48 @@ bool _vmnetfs_io_image_size_add_poll_handle(struct vmnetfs_image *img,
     g_mutex_unlock(cs->lock);
     return changed;
 }
+
+/* Remove a chunk from the pristine cache on behalf of the cache manager.
+   @imgs lists every open image using the cache.  Chunks accessed by any
+   of them during this session, or pinned by any of them, are kept.
+   Never waits for a chunk lock; returns false if the chunk is busy. */
+bool _vmnetfs_io_evict_chunk(GSList *imgs, uint64_t chunk)
+{
+    struct vmnetfs_image *img;
+    struct chunk_state *cs;
+    GSList *locked = NULL;
+    GSList *cur;
+    bool ret = false;
+
+    for (cur = imgs; cur != NULL; cur = cur->next) {
+        img = cur->data;
+        cs = img->chunk_state;
+        g_mutex_lock(cs->lock);
+        if (g_hash_table_lookup(cs->chunk_locks, &chunk) != NULL) {
+            g_mutex_unlock(cs->lock);
+            goto out;
+        }
+        /* Can't fail, since nobody holds the lock */
+        if (!_chunk_trylock(cs, chunk, NULL, NULL)) {
+            g_assert_not_reached();
+        }
+        g_mutex_unlock(cs->lock);
+        locked = g_slist_prepend(locked, img);
+        if (_vmnetfs_bit_test(img->accessed_map, chunk) ||
+                _vmnetfs_bit_test(img->pinned_map, chunk)) {
+            goto out;
+        }
+    }
+
+    /* The images share one present map */
+    img = imgs->data;
+    if (_vmnetfs_bit_test(img->present_map, chunk)) {
+        ret = _vmnetfs_ll_pristine_evict_chunk(img, chunk);
+    }
+out:
+    for (cur = locked; cur != NULL; cur = cur->next) {
+        chunk_unlock(cur->data, chunk);
+    }
+    g_slist_free(locked);
+    return ret;
+}
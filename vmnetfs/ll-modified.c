@@ -16,12 +16,77 @@
  */
 
 #include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <fcntl.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
+#ifdef HAVE_LINUX_FS_H
+#include <linux/fs.h>
+#endif
 #include "vmnetfs-private.h"
 
+/* Granularity of dirty tracking within an incomplete chunk.  A chunk is
+   incomplete if the guest has written some of it, with sector-aligned
+   writes, but the rest has not yet been copied from the pristine image. */
+#define SECTOR_SIZE 512
+
+struct incomplete_chunk {
+    uint64_t chunk;
+    uint32_t sectors;
+    uint32_t dirty_sectors;
+    uint8_t *dirty;
+};
+
+static uint32_t pristine_length(struct vmnetfs_image *img, uint64_t chunk)
+{
+    return MIN(img->chunk_size, img->initial_size - chunk * img->chunk_size);
+}
+
+static void incomplete_free(void *data)
+{
+    struct incomplete_chunk *ic = data;
+
+    g_free(ic->dirty);
+    g_slice_free(struct incomplete_chunk, ic);
+}
+
+static struct incomplete_chunk *incomplete_get(struct vmnetfs_image *img,
+        uint64_t chunk)
+{
+    struct incomplete_chunk *ic;
+
+    g_mutex_lock(img->incomplete_lock);
+    ic = g_hash_table_lookup(img->incomplete_chunks, &chunk);
+    g_mutex_unlock(img->incomplete_lock);
+    return ic;
+}
+
+static bool sector_is_dirty(struct incomplete_chunk *ic, uint32_t sector)
+{
+    return !!(ic->dirty[sector / 8] & (1 << (sector % 8)));
+}
+
+#ifdef HAVE_COPY_FILE_RANGE
+/* errno values indicating that the kernel can't copy between these two
+   files, as opposed to an I/O error */
+static bool copy_unsupported(int error)
+{
+    switch (error) {
+    case EXDEV:
+    case EINVAL:
+    case ENOSYS:
+    case EOPNOTSUPP:
+    case EBADF:
+        return true;
+    default:
+        return false;
+    }
+}
+#endif
+
 bool _vmnetfs_ll_modified_init(struct vmnetfs_image *img, GError **err)
 {
     char *file;
@@ -39,63 +104,371 @@ bool _vmnetfs_ll_modified_init(struct vmnetfs_image *img, GError **err)
     /* set_on_extend ensures that chunks that are truncated away are not
        retrieved from the pristine cache if the image is extended again. */
     img->modified_map = _vmnetfs_bit_new(img->bitmaps, true);
+    img->incomplete_lock = g_mutex_new();
+    img->incomplete_chunks = g_hash_table_new_full(g_int64_hash,
+            g_int64_equal, NULL, incomplete_free);
     return true;
 }
 
 void _vmnetfs_ll_modified_destroy(struct vmnetfs_image *img)
 {
+    g_hash_table_destroy(img->incomplete_chunks);
+    g_mutex_free(img->incomplete_lock);
     _vmnetfs_bit_free(img->modified_map);
     close(img->write_fd);
 }
 
+/* Returns true if the chunk is modified but some of its sectors are still
+   only in the pristine image.  chunk lock must be held. */
+bool _vmnetfs_ll_modified_chunk_is_incomplete(struct vmnetfs_image *img,
+        uint64_t chunk)
+{
+    return incomplete_get(img, chunk) != NULL;
+}
+
+/* Returns true if a write to this range can be tracked without first
+   copying the chunk to the modified cache. */
+bool _vmnetfs_ll_modified_can_write_sectors(struct vmnetfs_image *img,
+        uint64_t chunk, uint32_t offset, uint32_t length)
+{
+    uint64_t end = offset + length;
+
+    return offset % SECTOR_SIZE == 0 && (end % SECTOR_SIZE == 0 ||
+            end == pristine_length(img, chunk));
+}
+
+/* Returns false if any part of the range must still be obtained from the
+   pristine image.  chunk lock must be held. */
+bool _vmnetfs_ll_modified_range_is_dirty(struct vmnetfs_image *img,
+        uint64_t chunk, uint32_t offset, uint32_t length)
+{
+    struct incomplete_chunk *ic;
+    uint32_t sector;
+
+    ic = incomplete_get(img, chunk);
+    if (ic == NULL) {
+        return true;
+    }
+    for (sector = offset / SECTOR_SIZE;
+            sector < (offset + length + SECTOR_SIZE - 1) / SECTOR_SIZE;
+            sector++) {
+        if (!sector_is_dirty(ic, sector)) {
+            return false;
+        }
+    }
+    return true;
+}
+
 bool _vmnetfs_ll_modified_read_chunk(struct vmnetfs_image *img,
         uint64_t image_size, void *data, uint64_t chunk, uint32_t offset,
         uint32_t length, GError **err)
 {
+    uint64_t start = chunk * img->chunk_size;
+    uint32_t count;
+    char *buf;
+    bool ret;
+
     g_assert(_vmnetfs_bit_test(img->modified_map, chunk));
     g_assert(offset < img->chunk_size);
     g_assert(offset + length <= img->chunk_size);
     g_assert(chunk * img->chunk_size + offset + length <= image_size);
 
-    return _vmnetfs_safe_pread("image", img->write_fd, data, length,
-            chunk * img->chunk_size + offset, err);
+    if (!_vmnetfs_ramcache_enabled(img) ||
+            _vmnetfs_ll_modified_chunk_is_incomplete(img, chunk)) {
+        /* Unwritten sectors of an incomplete chunk aren't valid, so it
+           can't be cached */
+        return _vmnetfs_safe_pread("image", img->write_fd, data, length,
+                start + offset, err);
+    }
+    if (_vmnetfs_ramcache_read(img, data, chunk, true, offset, length)) {
+        return true;
+    }
+    count = MIN(img->chunk_size, image_size - start);
+    buf = _vmnetfs_pool_get(img);
+    ret = _vmnetfs_safe_pread("image", img->write_fd, buf, count, start,
+            err);
+    if (ret) {
+        _vmnetfs_ramcache_insert(img, buf, chunk, true, count);
+        memcpy(data, buf + offset, length);
+    }
+    _vmnetfs_pool_put(img, buf);
+    return ret;
+}
+
+/* Queue a read of a complete chunk on @batch, bypassing the memory cache.
+   Returns the op number. */
+int _vmnetfs_ll_modified_queue_read(struct vmnetfs_image *img,
+        struct vmnetfs_uring_batch *batch, void *data, uint64_t chunk,
+        uint32_t offset, uint32_t length)
+{
+    g_assert(_vmnetfs_bit_test(img->modified_map, chunk));
+    g_assert(!_vmnetfs_ll_modified_chunk_is_incomplete(img, chunk));
+    g_assert(offset + length <= img->chunk_size);
+
+    return _vmnetfs_uring_batch_read_image(batch, data, length,
+            chunk * img->chunk_size + offset);
 }
 
 bool _vmnetfs_ll_modified_write_chunk(struct vmnetfs_image *img,
         uint64_t image_size, const void *data, uint64_t chunk,
         uint32_t offset, uint32_t length, GError **err)
 {
-    g_assert(_vmnetfs_bit_test(img->modified_map, chunk) ||
-            (offset == 0 && length == MIN(img->chunk_size,
-            img->initial_size - chunk * img->chunk_size)));
+    struct incomplete_chunk *ic;
+    uint32_t sector;
+    bool whole = offset == 0 && length == MIN(img->chunk_size,
+            img->initial_size - chunk * img->chunk_size);
+
     g_assert(offset < img->chunk_size);
     g_assert(offset + length <= img->chunk_size);
     g_assert(chunk * img->chunk_size + offset + length <= image_size);
 
-    if (_vmnetfs_safe_pwrite("image", img->write_fd, data, length,
+    _vmnetfs_ramcache_invalidate(img, chunk);
+    if (!_vmnetfs_safe_pwrite("image", img->write_fd, data, length,
             chunk * img->chunk_size + offset, err)) {
-        _vmnetfs_bit_set(img->modified_map, chunk);
-        return true;
+        return false;
+    }
+
+    if (!_vmnetfs_bit_test(img->modified_map, chunk) && !whole) {
+        /* First write to the chunk, and we don't have the rest of it */
+        g_assert(_vmnetfs_ll_modified_can_write_sectors(img, chunk, offset,
+                length));
+        ic = g_slice_new0(struct incomplete_chunk);
+        ic->chunk = chunk;
+        ic->sectors = (pristine_length(img, chunk) + SECTOR_SIZE - 1) /
+                SECTOR_SIZE;
+        ic->dirty = g_malloc0((ic->sectors + 7) / 8);
+        g_mutex_lock(img->incomplete_lock);
+        g_hash_table_replace(img->incomplete_chunks, &ic->chunk, ic);
+        g_mutex_unlock(img->incomplete_lock);
     } else {
+        ic = incomplete_get(img, chunk);
+    }
+    if (ic != NULL) {
+        g_assert(_vmnetfs_ll_modified_can_write_sectors(img, chunk, offset,
+                length));
+        for (sector = offset / SECTOR_SIZE;
+                sector < (offset + length + SECTOR_SIZE - 1) / SECTOR_SIZE;
+                sector++) {
+            if (!sector_is_dirty(ic, sector)) {
+                ic->dirty[sector / 8] |= 1 << (sector % 8);
+                ic->dirty_sectors++;
+            }
+        }
+        if (ic->dirty_sectors == ic->sectors) {
+            /* The guest has overwritten the whole chunk */
+            g_mutex_lock(img->incomplete_lock);
+            g_hash_table_remove(img->incomplete_chunks, &chunk);
+            g_mutex_unlock(img->incomplete_lock);
+            _vmnetfs_u64_stat_increment(img->chunk_fetch_skips, 1);
+        }
+    }
+    _vmnetfs_bit_set(img->modified_map, chunk);
+    return true;
+}
+
+/* Replace the whole chunk with a hole.  chunk lock must be held. */
+bool _vmnetfs_ll_modified_discard_chunk(struct vmnetfs_image *img,
+        uint64_t image_size, uint64_t chunk, uint32_t length, GError **err)
+{
+    uint64_t start = chunk * img->chunk_size;
+    struct stat st;
+    void *buf;
+    bool ret;
+
+    g_assert(start + length <= image_size);
+
+    _vmnetfs_ramcache_invalidate(img, chunk);
+    if (fallocate(img->write_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+            start, length)) {
+        if (errno != EOPNOTSUPP) {
+            g_set_error(err, G_FILE_ERROR, g_file_error_from_errno(errno),
+                    "Couldn't discard chunk: %s", strerror(errno));
+            return false;
+        }
+        /* Filesystem doesn't support holes */
+        buf = g_malloc0(length);
+        ret = _vmnetfs_safe_pwrite("image", img->write_fd, buf, length,
+                start, err);
+        g_free(buf);
+        if (!ret) {
+            return false;
+        }
+    }
+    /* The modified cache is only as large as the highest chunk written.
+       Make sure the hole is within the file. */
+    if (fstat(img->write_fd, &st)) {
+        g_set_error(err, G_FILE_ERROR, g_file_error_from_errno(errno),
+                "Couldn't stat image: %s", strerror(errno));
+        return false;
+    }
+    if ((uint64_t) st.st_size < start + length &&
+            ftruncate(img->write_fd, start + length)) {
+        g_set_error(err, G_FILE_ERROR, g_file_error_from_errno(errno),
+                "Couldn't extend image: %s", strerror(errno));
         return false;
     }
+
+    g_mutex_lock(img->incomplete_lock);
+    g_hash_table_remove(img->incomplete_chunks, &chunk);
+    g_mutex_unlock(img->incomplete_lock);
+    _vmnetfs_bit_set(img->modified_map, chunk);
+    return true;
+}
+
+/* Copy the sectors of an incomplete chunk which the guest has not written
+   from @pristine, which contains the entire pristine chunk.  chunk lock
+   must be held. */
+bool _vmnetfs_ll_modified_complete_chunk(struct vmnetfs_image *img,
+        uint64_t image_size, const void *pristine, uint64_t chunk,
+        GError **err)
+{
+    struct incomplete_chunk *ic;
+    uint64_t start = chunk * img->chunk_size;
+    uint32_t length = pristine_length(img, chunk);
+    uint32_t sector;
+    uint32_t end;
+    uint32_t offset;
+
+    ic = incomplete_get(img, chunk);
+    g_assert(ic != NULL);
+    g_assert(start + length <= image_size);
+
+    for (sector = 0; sector < ic->sectors; sector = end) {
+        if (sector_is_dirty(ic, sector)) {
+            end = sector + 1;
+            continue;
+        }
+        for (end = sector + 1; end < ic->sectors && !sector_is_dirty(ic, end);
+                end++) {}
+        offset = sector * SECTOR_SIZE;
+        if (!_vmnetfs_safe_pwrite("image", img->write_fd, pristine + offset,
+                MIN(end * SECTOR_SIZE, length) - offset, start + offset,
+                err)) {
+            return false;
+        }
+    }
+
+    g_mutex_lock(img->incomplete_lock);
+    g_hash_table_remove(img->incomplete_chunks, &chunk);
+    g_mutex_unlock(img->incomplete_lock);
+    return true;
+}
+
+/* Copy @length bytes from the start of @fd into the chunk without passing
+   them through userspace, by reflinking if the filesystem supports it or
+   otherwise by copy_file_range().  Returns false without setting @err if
+   the kernel can't do either for these files; the caller should then fall
+   back to a regular copy. */
+bool _vmnetfs_ll_modified_clone_chunk(struct vmnetfs_image *img,
+        uint64_t image_size, int fd, uint64_t chunk, uint32_t length,
+        GError **err)
+{
+    uint64_t start = chunk * img->chunk_size;
+
+    g_assert(!_vmnetfs_bit_test(img->modified_map, chunk));
+    g_assert(length == MIN(img->chunk_size, img->initial_size - start));
+    g_assert(start + length <= image_size);
+
+    _vmnetfs_ramcache_invalidate(img, chunk);
+#ifdef FICLONERANGE
+    if (!g_atomic_int_get(&img->modified_no_reflink)) {
+        struct file_clone_range range = {
+            .src_fd = fd,
+            .src_offset = 0,
+            .src_length = length,
+            .dest_offset = start,
+        };
+
+        if (!ioctl(img->write_fd, FICLONERANGE, &range)) {
+            _vmnetfs_bit_set(img->modified_map, chunk);
+            _vmnetfs_u64_stat_increment(img->chunk_copies_reflink, 1);
+            return true;
+        }
+        if (errno == EXDEV || errno == EOPNOTSUPP || errno == ENOTTY) {
+            /* Won't work for any chunk */
+            g_atomic_int_set(&img->modified_no_reflink, 1);
+        }
+        /* Otherwise probably an unaligned tail chunk; try the next
+           method */
+    }
+#endif
+
+#ifdef HAVE_COPY_FILE_RANGE
+    if (!g_atomic_int_get(&img->modified_no_copy_range)) {
+        loff_t in_off = 0;
+        loff_t out_off = start;
+        uint32_t remaining = length;
+        ssize_t cur;
+
+        while (remaining > 0) {
+            cur = copy_file_range(fd, &in_off, img->write_fd, &out_off,
+                    remaining, 0);
+            if (cur > 0) {
+                remaining -= cur;
+            } else if (cur == 0) {
+                g_set_error(err, VMNETFS_IO_ERROR,
+                        VMNETFS_IO_ERROR_PREMATURE_EOF,
+                        "Couldn't copy chunk: Premature end of file");
+                return false;
+            } else if (remaining == length && copy_unsupported(errno)) {
+                g_atomic_int_set(&img->modified_no_copy_range, 1);
+                return false;
+            } else {
+                g_set_error(err, G_FILE_ERROR, g_file_error_from_errno(errno),
+                        "Couldn't copy chunk: %s", strerror(errno));
+                return false;
+            }
+        }
+        _vmnetfs_bit_set(img->modified_map, chunk);
+        _vmnetfs_u64_stat_increment(img->chunk_copies_kernel, 1);
+        return true;
+    }
+#endif
+
+    return false;
+}
+
+static gboolean incomplete_truncated(void *key G_GNUC_UNUSED, void *value,
+        void *data)
+{
+    struct incomplete_chunk *ic = value;
+    uint64_t *first_removed = data;
+
+    return ic->chunk >= *first_removed;
 }
 
 bool _vmnetfs_ll_modified_set_size(struct vmnetfs_image *img,
         uint64_t current_size, uint64_t new_size, GError **err)
 {
+    uint64_t first_removed;
+
     /* If we're truncating the new last chunk, it must be in the modified
        cache to ensure that subsequent expansions don't reveal the truncated
        part. */
     g_assert(new_size > current_size ||
             new_size % img->chunk_size == 0 ||
-            _vmnetfs_bit_test(img->modified_map, new_size / img->chunk_size));
+            (_vmnetfs_bit_test(img->modified_map,
+            new_size / img->chunk_size) &&
+            !incomplete_get(img, new_size / img->chunk_size)));
 
     if (ftruncate(img->write_fd, new_size)) {
         g_set_error(err, G_FILE_ERROR, g_file_error_from_errno(errno),
                 "Couldn't truncate image: %s", strerror(errno));
         return false;
     }
+    /* The last chunk's length changes, and chunks past the end are gone */
+    _vmnetfs_ramcache_truncate(img, MIN(current_size, new_size) /
+            img->chunk_size);
+
+    if (new_size < current_size) {
+        /* Forget incomplete chunks that have been truncated away, so
+           that they read as zeroes if the image is extended again */
+        first_removed = (new_size + img->chunk_size - 1) / img->chunk_size;
+        g_mutex_lock(img->incomplete_lock);
+        g_hash_table_foreach_remove(img->incomplete_chunks,
+                incomplete_truncated, &first_removed);
+        g_mutex_unlock(img->incomplete_lock);
+    }
 
     return true;
 }
@@ -17,11 +17,15 @@
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <stdio.h>
 #include <fcntl.h>
 #include <string.h>
 #include <unistd.h>
 #include <inttypes.h>
 #include <errno.h>
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#endif
 #include "vmnetfs-private.h"
 
 #define CHUNKS_PER_DIR 4096
@@ -52,6 +56,138 @@ static char *get_file(struct vmnetfs_image *img, uint64_t chunk)
             get_dir_num(chunk), chunk);
 }
 
+static char *get_compressed_file(struct vmnetfs_image *img, uint64_t chunk)
+{
+    return g_strdup_printf("%s/%"PRIu64"/%"PRIu64"%s", img->read_base,
+            get_dir_num(chunk), chunk, VMNETFS_COMPRESSED_SUFFIX);
+}
+
+static uint32_t chunk_length(struct vmnetfs_image *img, uint64_t chunk)
+{
+    return MIN(img->initial_size - chunk * img->chunk_size, img->chunk_size);
+}
+
+static void mark_zero(struct vmnetfs_image *img, uint64_t chunk)
+{
+    if (!_vmnetfs_bit_test(img->zero_map, chunk)) {
+        _vmnetfs_bit_set(img->zero_map, chunk);
+        _vmnetfs_u64_stat_increment(img->chunks_zero, 1);
+    }
+}
+
+static bool set_zero_from_config(struct vmnetfs_image *img, GError **err)
+{
+    gchar **ranges;
+    gchar **cur;
+    char *endptr;
+    uint64_t chunks;
+    uint64_t first;
+    uint64_t last;
+    uint64_t chunk;
+    bool ret = true;
+
+    if (img->zero_chunks == NULL) {
+        return true;
+    }
+    chunks = (img->initial_size + img->chunk_size - 1) / img->chunk_size;
+    ranges = g_strsplit(img->zero_chunks, ",", 0);
+    for (cur = ranges; *cur != NULL; cur++) {
+        if (**cur == 0) {
+            continue;
+        }
+        /* Syntax has been checked by schema validation */
+        first = last = g_ascii_strtoull(*cur, &endptr, 10);
+        if (*endptr == '-') {
+            last = g_ascii_strtoull(endptr + 1, &endptr, 10);
+        }
+        if (first > last || last >= chunks) {
+            g_set_error(err, VMNETFS_CONFIG_ERROR,
+                    VMNETFS_CONFIG_ERROR_INVALID_CONFIG,
+                    "Invalid zero chunk range %s", *cur);
+            ret = false;
+            break;
+        }
+        for (chunk = first; chunk <= last; chunk++) {
+            mark_zero(img, chunk);
+        }
+    }
+    g_strfreev(ranges);
+    return ret;
+}
+
+/* Chunks that are all zeroes are stored as holes.  Learn about any that
+   we stored in a previous run, and reclaim the space used by chunks that
+   the config says are zero. */
+static bool check_zero_chunk_file(struct vmnetfs_image *img,
+        const char *file, uint64_t chunk, GError **err)
+{
+    struct stat st;
+    gchar *contents;
+    gsize len;
+    int fd;
+
+    if (stat(file, &st)) {
+        g_set_error(err, G_FILE_ERROR, g_file_error_from_errno(errno),
+                "Couldn't stat %s: %s", file, strerror(errno));
+        return false;
+    }
+    if (_vmnetfs_bit_test(img->zero_map, chunk)) {
+        /* Don't modify a file shared with the content store */
+        if (st.st_blocks > 0 && st.st_nlink == 1) {
+            /* Best effort */
+            fd = open(file, O_WRONLY);
+            if (fd != -1) {
+                fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                        0, st.st_size);
+                close(fd);
+            }
+        }
+    } else if (st.st_blocks == 0 && st.st_size > 0) {
+        /* Probably a hole, but could be a small file stored inline in
+           the inode */
+        if (!g_file_get_contents(file, &contents, &len, err)) {
+            return false;
+        }
+        if (_vmnetfs_buffer_is_zero(contents, len)) {
+            mark_zero(img, chunk);
+        }
+        g_free(contents);
+    }
+    return true;
+}
+
+/* Like g_file_set_contents(), but for a file of zeroes. */
+static bool write_hole_file(const char *file, uint32_t length, GError **err)
+{
+    char *tmp;
+    int fd;
+    bool ret = false;
+
+    tmp = g_strdup_printf("%s.XXXXXX", file);
+    fd = g_mkstemp(tmp);
+    if (fd == -1) {
+        g_set_error(err, G_FILE_ERROR, g_file_error_from_errno(errno),
+                "Couldn't create %s: %s", tmp, strerror(errno));
+        g_free(tmp);
+        return false;
+    }
+    if (ftruncate(fd, length)) {
+        g_set_error(err, G_FILE_ERROR, g_file_error_from_errno(errno),
+                "Couldn't extend %s: %s", tmp, strerror(errno));
+    } else if (rename(tmp, file)) {
+        g_set_error(err, G_FILE_ERROR, g_file_error_from_errno(errno),
+                "Couldn't rename %s: %s", tmp, strerror(errno));
+    } else {
+        ret = true;
+    }
+    close(fd);
+    if (!ret) {
+        unlink(tmp);
+    }
+    g_free(tmp);
+    return ret;
+}
+
 static bool set_present_from_directory(struct vmnetfs_image *img,
         const char *path, uint64_t dir_num, GError **err)
 {
@@ -60,6 +196,9 @@ static bool set_present_from_directory(struct vmnetfs_image *img,
     uint64_t chunk;
     uint64_t chunks;
     char *endptr;
+    char *filepath;
+    bool compressed;
+    bool ok;
 
     chunks = (img->initial_size + img->chunk_size - 1) / img->chunk_size;
     dir = g_dir_open(path, 0, err);
@@ -68,7 +207,12 @@ static bool set_present_from_directory(struct vmnetfs_image *img,
     }
     while ((file = g_dir_read_name(dir)) != NULL) {
         chunk = g_ascii_strtoull(file, &endptr, 10);
-        if (*endptr != 0) {
+        compressed = !strcmp(endptr, VMNETFS_COMPRESSED_SUFFIX);
+#ifndef HAVE_LZ4
+        /* We can't read it */
+        compressed = false;
+#endif
+        if (*endptr != 0 && !compressed) {
             /* May be a temporary file created by g_file_set_contents(),
                either a stale one from a crash or a current one if we are
                racing with another vmnetfs process.  Ignore. */
@@ -80,6 +224,20 @@ static bool set_present_from_directory(struct vmnetfs_image *img,
             g_dir_close(dir);
             return false;
         }
+        if (compressed) {
+            if (file == endptr) {
+                continue;
+            }
+            _vmnetfs_bit_set(img->compressed_map, chunk);
+        } else {
+            filepath = g_strdup_printf("%s/%s", path, file);
+            ok = check_zero_chunk_file(img, filepath, chunk, err);
+            g_free(filepath);
+            if (!ok) {
+                g_dir_close(dir);
+                return false;
+            }
+        }
         _vmnetfs_bit_set(img->present_map, chunk);
     }
     g_dir_close(dir);
@@ -93,6 +251,7 @@ bool _vmnetfs_ll_pristine_init(struct vmnetfs_image *img, GError **err)
     char *path;
     char *endptr;
     uint64_t dir_num;
+    GError *my_err = NULL;
 
     if (!mkdir_with_parents(img->read_base, err)) {
         return false;
@@ -103,6 +262,15 @@ bool _vmnetfs_ll_pristine_init(struct vmnetfs_image *img, GError **err)
         return false;
     }
     img->present_map = _vmnetfs_bit_new(img->bitmaps, false);
+    img->zero_map = _vmnetfs_bit_new(img->bitmaps, false);
+    img->compressed_map = _vmnetfs_bit_new(img->bitmaps, false);
+    if (!set_zero_from_config(img, err)) {
+        g_dir_close(dir);
+        _vmnetfs_bit_free(img->compressed_map);
+        _vmnetfs_bit_free(img->zero_map);
+        _vmnetfs_bit_free(img->present_map);
+        return false;
+    }
     while ((name = g_dir_read_name(dir)) != NULL) {
         path = g_strdup_printf("%s/%s", img->read_base, name);
         dir_num = g_ascii_strtoull(name, &endptr, 10);
@@ -111,6 +279,8 @@ bool _vmnetfs_ll_pristine_init(struct vmnetfs_image *img, GError **err)
             if (!set_present_from_directory(img, path, dir_num, err)) {
                 g_free(path);
                 g_dir_close(dir);
+                _vmnetfs_bit_free(img->compressed_map);
+                _vmnetfs_bit_free(img->zero_map);
                 _vmnetfs_bit_free(img->present_map);
                 return false;
             }
@@ -118,31 +288,135 @@ bool _vmnetfs_ll_pristine_init(struct vmnetfs_image *img, GError **err)
         g_free(path);
     }
     g_dir_close(dir);
+    if (!_vmnetfs_shared_map_init(img, &my_err)) {
+        /* Not fatal: we just won't see chunks fetched by other
+           processes until the next time we start */
+        g_warning("%s", my_err->message);
+        g_clear_error(&my_err);
+    }
     return true;
 }
 
 void _vmnetfs_ll_pristine_destroy(struct vmnetfs_image *img)
 {
+    _vmnetfs_shared_map_destroy(img);
+    _vmnetfs_bit_free(img->compressed_map);
+    _vmnetfs_bit_free(img->zero_map);
     _vmnetfs_bit_free(img->present_map);
 }
 
-bool _vmnetfs_ll_pristine_read_chunk(struct vmnetfs_image *img, void *data,
+static int open_chunk_file(const char *file, GError **err)
+{
+    int fd;
+
+    fd = open(file, O_RDONLY);
+    if (fd == -1) {
+        g_set_error(err, G_FILE_ERROR, g_file_error_from_errno(errno),
+                "Couldn't open %s: %s", file, strerror(errno));
+    }
+    return fd;
+}
+
+/* Returns a read-only fd for the chunk file, or -1 on error.  The chunk
+   must not be compressed. */
+int _vmnetfs_ll_pristine_open_chunk(struct vmnetfs_image *img,
+        uint64_t chunk, GError **err)
+{
+    char *file;
+    int fd;
+
+    g_assert(_vmnetfs_bit_test(img->present_map, chunk));
+    g_assert(!_vmnetfs_bit_test(img->compressed_map, chunk));
+
+    file = get_file(img, chunk);
+    fd = open_chunk_file(file, err);
+    g_free(file);
+    return fd;
+}
+
+#ifdef HAVE_LZ4
+static bool read_compressed_chunk(struct vmnetfs_image *img, void *data,
+        uint64_t chunk, uint32_t offset, uint32_t length, GError **err)
+{
+    GTimer *timer;
+    char *file;
+    gchar *contents;
+    gsize size;
+    char *buf;
+    int count;
+    bool ret;
+
+    file = get_compressed_file(img, chunk);
+    if (!g_file_get_contents(file, &contents, &size, err)) {
+        g_free(file);
+        return false;
+    }
+
+    timer = g_timer_new();
+    buf = _vmnetfs_pool_get(img);
+    count = LZ4_decompress_safe(contents, buf, size, img->chunk_size);
+    ret = count >= 0 && (uint32_t) count == chunk_length(img, chunk);
+    if (ret) {
+        memcpy(data, buf + offset, length);
+    } else {
+        g_set_error(err, VMNETFS_IO_ERROR, VMNETFS_IO_ERROR_INVALID_CACHE,
+                "Couldn't decompress %s", file);
+    }
+    _vmnetfs_pool_put(img, buf);
+    _vmnetfs_u64_stat_increment(img->chunk_decompressions, 1);
+    _vmnetfs_u64_stat_increment(img->decompress_usecs,
+            g_timer_elapsed(timer, NULL) * G_USEC_PER_SEC);
+    g_timer_destroy(timer);
+    g_free(contents);
+    g_free(file);
+    return ret;
+}
+
+/* Returns the compressed contents of the chunk in a newly-allocated
+   buffer, or NULL if the chunk should be stored raw. */
+static void *compress_chunk(struct vmnetfs_image *img, const void *data,
+        uint32_t length, uint32_t *out_length)
+{
+    char *buf;
+    int bound;
+    int count;
+
+    bound = LZ4_compressBound(length);
+    buf = g_malloc(bound);
+    count = LZ4_compress_default(data, buf, length, bound);
+    if (count <= 0 || (uint32_t) count > length - length / 8) {
+        /* Not worth the decompression cost */
+        g_free(buf);
+        return NULL;
+    }
+    *out_length = count;
+    return buf;
+}
+#else
+static void *compress_chunk(struct vmnetfs_image *img G_GNUC_UNUSED,
+        const void *data G_GNUC_UNUSED, uint32_t length G_GNUC_UNUSED,
+        uint32_t *out_length G_GNUC_UNUSED)
+{
+    return NULL;
+}
+#endif
+
+static bool read_chunk_file(struct vmnetfs_image *img, void *data,
         uint64_t chunk, uint32_t offset, uint32_t length, GError **err)
 {
     char *file;
     int fd;
     bool ret;
 
-    g_assert(_vmnetfs_bit_test(img->present_map, chunk));
-    g_assert(offset < img->chunk_size);
-    g_assert(offset + length <= img->chunk_size);
-    g_assert(chunk * img->chunk_size + offset + length <= img->initial_size);
+#ifdef HAVE_LZ4
+    if (_vmnetfs_bit_test(img->compressed_map, chunk)) {
+        return read_compressed_chunk(img, data, chunk, offset, length, err);
+    }
+#endif
 
     file = get_file(img, chunk);
-    fd = open(file, O_RDONLY);
+    fd = open_chunk_file(file, err);
     if (fd == -1) {
-        g_set_error(err, G_FILE_ERROR, g_file_error_from_errno(errno),
-                "Couldn't open %s: %s", file, strerror(errno));
         g_free(file);
         return false;
     }
@@ -152,11 +426,62 @@ bool _vmnetfs_ll_pristine_read_chunk(struct vmnetfs_image *img, void *data,
     return ret;
 }
 
+bool _vmnetfs_ll_pristine_read_chunk(struct vmnetfs_image *img, void *data,
+        uint64_t chunk, uint32_t offset, uint32_t length, GError **err)
+{
+    uint32_t count;
+    char *buf;
+    bool ret;
+
+    g_assert(_vmnetfs_bit_test(img->present_map, chunk));
+    g_assert(offset < img->chunk_size);
+    g_assert(offset + length <= img->chunk_size);
+    g_assert(chunk * img->chunk_size + offset + length <= img->initial_size);
+
+    if (!_vmnetfs_ramcache_enabled(img)) {
+        return read_chunk_file(img, data, chunk, offset, length, err);
+    }
+    if (_vmnetfs_ramcache_read(img, data, chunk, false, offset, length)) {
+        return true;
+    }
+    /* Read the whole chunk so later reads can be served from memory */
+    count = chunk_length(img, chunk);
+    buf = _vmnetfs_pool_get(img);
+    ret = read_chunk_file(img, buf, chunk, 0, count, err);
+    if (ret) {
+        _vmnetfs_ramcache_insert(img, buf, chunk, false, count);
+        memcpy(data, buf + offset, length);
+    }
+    _vmnetfs_pool_put(img, buf);
+    return ret;
+}
+
+/* Queue a read of an uncompressed chunk on @batch, bypassing the memory
+   cache.  Returns the op number. */
+int _vmnetfs_ll_pristine_queue_read(struct vmnetfs_image *img,
+        struct vmnetfs_uring_batch *batch, void *data, uint64_t chunk,
+        uint32_t offset, uint32_t length)
+{
+    char *file;
+    int op;
+
+    g_assert(_vmnetfs_bit_test(img->present_map, chunk));
+    g_assert(!_vmnetfs_bit_test(img->compressed_map, chunk));
+    g_assert(offset + length <= chunk_length(img, chunk));
+
+    file = get_file(img, chunk);
+    op = _vmnetfs_uring_batch_read_file(batch, file, data, length, offset);
+    g_free(file);
+    return op;
+}
+
 bool _vmnetfs_ll_pristine_write_chunk(struct vmnetfs_image *img, void *data,
         uint64_t chunk, uint32_t length, GError **err)
 {
     char *dir;
     char *file;
+    void *compressed = NULL;
+    uint32_t compressed_length;
     bool ret;
 
     g_assert(length <= img->chunk_size);
@@ -169,14 +494,156 @@ bool _vmnetfs_ll_pristine_write_chunk(struct vmnetfs_image *img, void *data,
     if (!ret) {
         goto out;
     }
-    ret = g_file_set_contents(file, data, length, err);
+    if (_vmnetfs_bit_test(img->zero_map, chunk) ||
+            _vmnetfs_buffer_is_zero(data, length)) {
+        /* Don't allocate disk space for it */
+        mark_zero(img, chunk);
+        ret = write_hole_file(file, length, err);
+    } else if (img->compress && (compressed = compress_chunk(img, data,
+            length, &compressed_length)) != NULL) {
+        g_free(file);
+        file = get_compressed_file(img, chunk);
+        ret = g_file_set_contents(file, compressed, compressed_length, err);
+        g_free(compressed);
+        if (ret) {
+            _vmnetfs_u64_stat_increment(img->compressed_bytes_raw, length);
+            _vmnetfs_u64_stat_increment(img->compressed_bytes_stored,
+                    compressed_length);
+        }
+    } else {
+        ret = g_file_set_contents(file, data, length, err);
+    }
     if (!ret) {
         goto out;
     }
+    _vmnetfs_store_add_chunk(img, chunk, data, length, compressed != NULL,
+            file);
+    if (compressed != NULL) {
+        _vmnetfs_bit_set(img->compressed_map, chunk);
+    }
     _vmnetfs_bit_set(img->present_map, chunk);
+    _vmnetfs_shared_map_set(img, chunk);
+    _vmnetfs_cache_note_write(img, length);
+
+out:
+    g_free(file);
+    g_free(dir);
+    return ret;
+}
+
+/* Populate the chunk from the content store, if possible.  chunk lock
+   must be held. */
+bool _vmnetfs_ll_pristine_import_chunk(struct vmnetfs_image *img,
+        uint64_t chunk)
+{
+    GError *err = NULL;
+    char *dir;
+    char *file;
+    bool ret = false;
+
+    if (img->store == NULL) {
+        return false;
+    }
+    dir = get_dir(img, chunk);
+    file = get_file(img, chunk);
+    if (!mkdir_with_parents(dir, &err)) {
+        g_warning("%s", err->message);
+        g_clear_error(&err);
+        goto out;
+    }
+    if (_vmnetfs_store_link_chunk(img, chunk, chunk_length(img, chunk),
+            false, file)) {
+        _vmnetfs_bit_set(img->present_map, chunk);
+        _vmnetfs_shared_map_set(img, chunk);
+        ret = true;
+    }
+#ifdef HAVE_LZ4
+    if (!ret) {
+        g_free(file);
+        file = get_compressed_file(img, chunk);
+        if (_vmnetfs_store_link_chunk(img, chunk, chunk_length(img, chunk),
+                true, file)) {
+            _vmnetfs_bit_set(img->compressed_map, chunk);
+            _vmnetfs_bit_set(img->present_map, chunk);
+            _vmnetfs_shared_map_set(img, chunk);
+            ret = true;
+        }
+    }
+#endif
 
 out:
     g_free(file);
     g_free(dir);
     return ret;
 }
+
+/* If another vmnetfs process has written the chunk to the pristine
+   cache, mark it present.  Must be called with the chunk lock held, or
+   while holding the chunk's fetch lease. */
+bool _vmnetfs_ll_pristine_adopt_chunk(struct vmnetfs_image *img,
+        uint64_t chunk)
+{
+    GError *err = NULL;
+    char *file;
+    bool ret = false;
+
+    if (!_vmnetfs_shared_map_test(img, chunk)) {
+        return false;
+    }
+    file = get_file(img, chunk);
+    if (g_file_test(file, G_FILE_TEST_IS_REGULAR)) {
+        if (check_zero_chunk_file(img, file, chunk, &err)) {
+            _vmnetfs_bit_set(img->present_map, chunk);
+            ret = true;
+        } else {
+            g_clear_error(&err);
+        }
+    }
+#ifdef HAVE_LZ4
+    if (!ret) {
+        g_free(file);
+        file = get_compressed_file(img, chunk);
+        if (g_file_test(file, G_FILE_TEST_IS_REGULAR)) {
+            _vmnetfs_bit_set(img->compressed_map, chunk);
+            _vmnetfs_bit_set(img->present_map, chunk);
+            ret = true;
+        }
+    }
+#endif
+    if (ret) {
+        _vmnetfs_u64_stat_increment(img->chunk_shared_hits, 1);
+    } else {
+        /* Stale */
+        _vmnetfs_shared_map_clear(img, chunk);
+    }
+    g_free(file);
+    return ret;
+}
+
+/* chunk lock must be held. */
+bool _vmnetfs_ll_pristine_evict_chunk(struct vmnetfs_image *img,
+        uint64_t chunk)
+{
+    char *file;
+    bool compressed;
+    bool ret;
+
+    compressed = _vmnetfs_bit_test(img->compressed_map, chunk);
+    if (compressed) {
+        file = get_compressed_file(img, chunk);
+    } else {
+        file = get_file(img, chunk);
+    }
+    _vmnetfs_bit_clear(img->present_map, chunk);
+    _vmnetfs_shared_map_clear(img, chunk);
+    ret = unlink(file) == 0 || errno == ENOENT;
+    if (!ret) {
+        g_warning("Couldn't remove %s: %s", file, strerror(errno));
+        _vmnetfs_bit_set(img->present_map, chunk);
+        _vmnetfs_shared_map_set(img, chunk);
+    } else {
+        _vmnetfs_bit_clear(img->compressed_map, chunk);
+    }
+    g_free(file);
+    return ret;
+}
@@ -0,0 +1,825 @@
+/*
+ * vmnetfs - virtual machine network execution virtual filesystem
+ *
+ * Copyright (C) 2006-2014 Carnegie Mellon University
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of version 2 of the GNU General Public License as published
+ * by the Free Software Foundation.  A copy of the GNU General Public License
+ * should have been distributed along with this program in the file
+ * COPYING.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ */
+
+/* Export an image over the NBD protocol on a UNIX socket, so that the
+   emulator can attach it as a network block device rather than as a file
+   on the FUSE mount.  Only the fixed newstyle handshake is supported.
+   Each connection is served by its own thread, which handles one request
+   at a time; clients wanting parallelism open several connections. */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <string.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <errno.h>
+#include "vmnetfs-private.h"
+
+#define NBD_MAGIC 0x4e42444d41474943ULL  /* "NBDMAGIC" */
+#define NBD_OPT_MAGIC 0x49484156454f5054ULL  /* "IHAVEOPT" */
+#define NBD_REP_MAGIC 0x0003e889045565a9ULL
+#define NBD_REQUEST_MAGIC 0x25609513
+#define NBD_SIMPLE_REPLY_MAGIC 0x67446698
+#define NBD_STRUCTURED_REPLY_MAGIC 0x668e33ef
+
+/* Handshake flags */
+#define NBD_FLAG_FIXED_NEWSTYLE (1 << 0)
+#define NBD_FLAG_NO_ZEROES (1 << 1)
+
+/* Transmission flags */
+#define NBD_FLAG_HAS_FLAGS (1 << 0)
+#define NBD_FLAG_SEND_FLUSH (1 << 2)
+#define NBD_FLAG_SEND_FUA (1 << 3)
+#define NBD_FLAG_SEND_TRIM (1 << 5)
+#define NBD_FLAG_SEND_WRITE_ZEROES (1 << 6)
+#define NBD_FLAG_CAN_MULTI_CONN (1 << 8)
+
+/* Options */
+#define NBD_OPT_EXPORT_NAME 1
+#define NBD_OPT_ABORT 2
+#define NBD_OPT_LIST 3
+#define NBD_OPT_INFO 6
+#define NBD_OPT_GO 7
+#define NBD_OPT_STRUCTURED_REPLY 8
+
+/* Option replies */
+#define NBD_REP_ACK 1
+#define NBD_REP_SERVER 2
+#define NBD_REP_INFO 3
+#define NBD_REP_ERR_UNSUP 0x80000001
+#define NBD_REP_ERR_INVALID 0x80000003
+
+/* Information types */
+#define NBD_INFO_EXPORT 0
+#define NBD_INFO_BLOCK_SIZE 3
+
+/* Commands */
+#define NBD_CMD_READ 0
+#define NBD_CMD_WRITE 1
+#define NBD_CMD_DISC 2
+#define NBD_CMD_FLUSH 3
+#define NBD_CMD_TRIM 4
+#define NBD_CMD_WRITE_ZEROES 6
+
+/* Command flags */
+#define NBD_CMD_FLAG_NO_HOLE (1 << 1)
+
+/* Structured reply chunks */
+#define NBD_REPLY_FLAG_DONE (1 << 0)
+#define NBD_REPLY_TYPE_NONE 0
+#define NBD_REPLY_TYPE_OFFSET_DATA 1
+#define NBD_REPLY_TYPE_OFFSET_HOLE 2
+#define NBD_REPLY_TYPE_ERROR 0x8001
+
+/* Error values */
+#define NBD_EIO 5
+#define NBD_EINVAL 22
+#define NBD_ENOSPC 28
+
+/* Longest request or option we accept */
+#define MAX_REQUEST (32 << 20)
+#define MAX_OPTION 4096
+
+struct nbd_option {
+    uint64_t magic;
+    uint32_t option;
+    uint32_t length;
+} __attribute__((packed));
+
+struct nbd_option_reply {
+    uint64_t magic;
+    uint32_t option;
+    uint32_t type;
+    uint32_t length;
+} __attribute__((packed));
+
+struct nbd_request {
+    uint32_t magic;
+    uint16_t flags;
+    uint16_t type;
+    uint64_t handle;
+    uint64_t offset;
+    uint32_t length;
+} __attribute__((packed));
+
+struct nbd_simple_reply {
+    uint32_t magic;
+    uint32_t error;
+    uint64_t handle;
+} __attribute__((packed));
+
+struct nbd_structured_reply {
+    uint32_t magic;
+    uint16_t flags;
+    uint16_t type;
+    uint64_t handle;
+    uint32_t length;
+} __attribute__((packed));
+
+struct nbd_state {
+    char *path;
+    int listen_fd;
+    GThread *thread;
+    GMutex *lock;
+    GList *conns;
+    bool closed;
+};
+
+struct nbd_conn {
+    struct vmnetfs_image *img;
+    int fd;
+    GThread *thread;
+    uint64_t size;
+    bool structured;
+    bool finished;  /* protected by nbd_state lock */
+};
+
+static bool send_all(int fd, const void *buf, size_t count, bool more)
+{
+    ssize_t ret;
+
+    while (count > 0) {
+        ret = send(fd, buf, count, MSG_NOSIGNAL | (more ? MSG_MORE : 0));
+        if (ret == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        buf += ret;
+        count -= ret;
+    }
+    return true;
+}
+
+static bool recv_all(int fd, void *buf, size_t count)
+{
+    ssize_t ret;
+
+    while (count > 0) {
+        ret = recv(fd, buf, count, MSG_WAITALL);
+        if (ret == -1 && errno == EINTR) {
+            continue;
+        } else if (ret <= 0) {
+            return false;
+        }
+        buf += ret;
+        count -= ret;
+    }
+    return true;
+}
+
+/* Handshake */
+
+static bool send_option_reply(struct nbd_conn *conn, uint32_t option,
+        uint32_t type, const void *data, uint32_t length)
+{
+    struct nbd_option_reply reply = {
+        .magic = GUINT64_TO_BE(NBD_REP_MAGIC),
+        .option = GUINT32_TO_BE(option),
+        .type = GUINT32_TO_BE(type),
+        .length = GUINT32_TO_BE(length),
+    };
+
+    return send_all(conn->fd, &reply, sizeof(reply), length > 0) &&
+            send_all(conn->fd, data, length, false);
+}
+
+static uint16_t transmission_flags(void)
+{
+    return NBD_FLAG_HAS_FLAGS | NBD_FLAG_SEND_FLUSH | NBD_FLAG_SEND_FUA |
+            NBD_FLAG_SEND_TRIM | NBD_FLAG_SEND_WRITE_ZEROES |
+            NBD_FLAG_CAN_MULTI_CONN;
+}
+
+static bool send_info(struct nbd_conn *conn, uint32_t option)
+{
+    struct {
+        uint16_t type;
+        uint64_t size;
+        uint16_t flags;
+    } __attribute__((packed)) export = {
+        .type = GUINT16_TO_BE(NBD_INFO_EXPORT),
+        .size = GUINT64_TO_BE(conn->size),
+        .flags = GUINT16_TO_BE(transmission_flags()),
+    };
+    struct {
+        uint16_t type;
+        uint32_t minimum;
+        uint32_t preferred;
+        uint32_t maximum;
+    } __attribute__((packed)) block_size = {
+        .type = GUINT16_TO_BE(NBD_INFO_BLOCK_SIZE),
+        .minimum = GUINT32_TO_BE(1),
+        .preferred = GUINT32_TO_BE(conn->img->chunk_size),
+        .maximum = GUINT32_TO_BE(MAX_REQUEST),
+    };
+
+    return send_option_reply(conn, option, NBD_REP_INFO, &export,
+            sizeof(export)) &&
+            send_option_reply(conn, option, NBD_REP_INFO, &block_size,
+            sizeof(block_size)) &&
+            send_option_reply(conn, option, NBD_REP_ACK, NULL, 0);
+}
+
+/* Check the layout of an NBD_OPT_INFO or NBD_OPT_GO request.  Since each
+   socket exports only one image, the name itself is ignored. */
+static bool info_request_valid(const char *data, uint32_t length)
+{
+    uint32_t name_length;
+    uint16_t requests;
+
+    if (length < 6) {
+        return false;
+    }
+    memcpy(&name_length, data, sizeof(name_length));
+    name_length = GUINT32_FROM_BE(name_length);
+    if (name_length > length - 6) {
+        return false;
+    }
+    memcpy(&requests, data + 4 + name_length, sizeof(requests));
+    requests = GUINT16_FROM_BE(requests);
+    return length == 6 + name_length + 2 * (uint32_t) requests;
+}
+
+/* Returns true when the client is ready to start transmission. */
+static bool negotiate(struct nbd_conn *conn, bool no_zeroes)
+{
+    struct nbd_option opt;
+    struct {
+        uint64_t size;
+        uint16_t flags;
+        char zeroes[124];
+    } __attribute__((packed)) export = {
+        .size = GUINT64_TO_BE(conn->size),
+        .flags = GUINT16_TO_BE(transmission_flags()),
+    };
+    char *data;
+    uint32_t option;
+    uint32_t length;
+    uint32_t name_length = 0;
+    bool ok;
+
+    while (recv_all(conn->fd, &opt, sizeof(opt))) {
+        option = GUINT32_FROM_BE(opt.option);
+        length = GUINT32_FROM_BE(opt.length);
+        if (GUINT64_FROM_BE(opt.magic) != NBD_OPT_MAGIC ||
+                length > MAX_OPTION) {
+            return false;
+        }
+        data = g_malloc(length);
+        if (!recv_all(conn->fd, data, length)) {
+            g_free(data);
+            return false;
+        }
+
+        switch (option) {
+        case NBD_OPT_EXPORT_NAME:
+            g_free(data);
+            return send_all(conn->fd, &export, no_zeroes ?
+                    sizeof(export) - sizeof(export.zeroes) :
+                    sizeof(export), false);
+        case NBD_OPT_ABORT:
+            g_free(data);
+            send_option_reply(conn, option, NBD_REP_ACK, NULL, 0);
+            return false;
+        case NBD_OPT_LIST:
+            if (length) {
+                ok = send_option_reply(conn, option, NBD_REP_ERR_INVALID,
+                        NULL, 0);
+            } else {
+                ok = send_option_reply(conn, option, NBD_REP_SERVER,
+                        &name_length, sizeof(name_length)) &&
+                        send_option_reply(conn, option, NBD_REP_ACK, NULL,
+                        0);
+            }
+            break;
+        case NBD_OPT_STRUCTURED_REPLY:
+            if (length) {
+                ok = send_option_reply(conn, option, NBD_REP_ERR_INVALID,
+                        NULL, 0);
+            } else {
+                conn->structured = true;
+                ok = send_option_reply(conn, option, NBD_REP_ACK, NULL, 0);
+            }
+            break;
+        case NBD_OPT_INFO:
+        case NBD_OPT_GO:
+            if (!info_request_valid(data, length)) {
+                ok = send_option_reply(conn, option, NBD_REP_ERR_INVALID,
+                        NULL, 0);
+            } else if (!send_info(conn, option)) {
+                ok = false;
+            } else if (option == NBD_OPT_GO) {
+                g_free(data);
+                return true;
+            } else {
+                ok = true;
+            }
+            break;
+        default:
+            ok = send_option_reply(conn, option, NBD_REP_ERR_UNSUP, NULL,
+                    0);
+            break;
+        }
+        g_free(data);
+        if (!ok) {
+            return false;
+        }
+    }
+    return false;
+}
+
+static bool handshake(struct nbd_conn *conn)
+{
+    struct {
+        uint64_t magic;
+        uint64_t opt_magic;
+        uint16_t flags;
+    } __attribute__((packed)) hello = {
+        .magic = GUINT64_TO_BE(NBD_MAGIC),
+        .opt_magic = GUINT64_TO_BE(NBD_OPT_MAGIC),
+        .flags = GUINT16_TO_BE(NBD_FLAG_FIXED_NEWSTYLE | NBD_FLAG_NO_ZEROES),
+    };
+    uint32_t flags;
+
+    if (!send_all(conn->fd, &hello, sizeof(hello), false) ||
+            !recv_all(conn->fd, &flags, sizeof(flags))) {
+        return false;
+    }
+    flags = GUINT32_FROM_BE(flags);
+    if (!(flags & NBD_FLAG_FIXED_NEWSTYLE) ||
+            (flags & ~(NBD_FLAG_FIXED_NEWSTYLE | NBD_FLAG_NO_ZEROES))) {
+        return false;
+    }
+    return negotiate(conn, flags & NBD_FLAG_NO_ZEROES);
+}
+
+/* Transmission */
+
+static bool send_simple_reply(struct nbd_conn *conn, uint64_t handle,
+        uint32_t error, const void *data, uint32_t length)
+{
+    struct nbd_simple_reply reply = {
+        .magic = GUINT32_TO_BE(NBD_SIMPLE_REPLY_MAGIC),
+        .error = GUINT32_TO_BE(error),
+        .handle = handle,
+    };
+
+    return send_all(conn->fd, &reply, sizeof(reply), length > 0) &&
+            send_all(conn->fd, data, length, false);
+}
+
+/* The chunk payload is @header_length bytes at @header followed by
+   @length bytes at @data. */
+static bool send_chunk(struct nbd_conn *conn, uint64_t handle,
+        uint16_t flags, uint16_t type, const void *header,
+        uint32_t header_length, const void *data, uint32_t length)
+{
+    struct nbd_structured_reply reply = {
+        .magic = GUINT32_TO_BE(NBD_STRUCTURED_REPLY_MAGIC),
+        .flags = GUINT16_TO_BE(flags),
+        .type = GUINT16_TO_BE(type),
+        .handle = handle,
+        .length = GUINT32_TO_BE(header_length + length),
+    };
+
+    return send_all(conn->fd, &reply, sizeof(reply),
+            header_length + length > 0) &&
+            send_all(conn->fd, header, header_length, length > 0) &&
+            send_all(conn->fd, data, length, false);
+}
+
+/* Reply to a failed command.  Returns false if the connection failed. */
+static bool send_error(struct nbd_conn *conn, uint64_t handle,
+        uint32_t error, bool structured)
+{
+    struct {
+        uint32_t error;
+        uint16_t message_length;
+    } __attribute__((packed)) payload = {
+        .error = GUINT32_TO_BE(error),
+    };
+
+    if (structured) {
+        return send_chunk(conn, handle, NBD_REPLY_FLAG_DONE,
+                NBD_REPLY_TYPE_ERROR, &payload, sizeof(payload), NULL, 0);
+    }
+    return send_simple_reply(conn, handle, error, NULL, 0);
+}
+
+/* Convert a failed I/O operation into an NBD error.  Frees @err. */
+static uint32_t io_error(struct vmnetfs_image *img, GError *err)
+{
+    g_warning("%s", err->message);
+    g_clear_error(&err);
+    _vmnetfs_u64_stat_increment(img->io_errors, 1);
+    return NBD_EIO;
+}
+
+/* Read one chunk at a time, replying with a hole for chunks known to be
+   zero. */
+static bool read_structured(struct nbd_conn *conn, uint64_t handle,
+        uint64_t start, uint32_t count)
+{
+    struct vmnetfs_image *img = conn->img;
+    struct vmnetfs_cursor cur;
+    struct {
+        uint64_t offset;
+        uint32_t length;
+    } __attribute__((packed)) hole;
+    uint64_t offset;
+    uint64_t read;
+    GError *err = NULL;
+    void *buf;
+    bool ok = true;
+
+    buf = _vmnetfs_pool_get(img);
+    for (_vmnetfs_cursor_start(img, &cur, start, count);
+            ok && _vmnetfs_cursor_chunk(&cur, cur.length); ) {
+        offset = GUINT64_TO_BE(start + cur.io_offset);
+        if (_vmnetfs_bit_test(img->zero_map, cur.chunk) &&
+                !_vmnetfs_bit_test(img->modified_map, cur.chunk)) {
+            hole.offset = offset;
+            hole.length = GUINT32_TO_BE(cur.length);
+            _vmnetfs_bit_set(img->accessed_map, cur.chunk);
+            ok = send_chunk(conn, handle, 0, NBD_REPLY_TYPE_OFFSET_HOLE,
+                    &hole, sizeof(hole), NULL, 0);
+            read = cur.length;
+        } else {
+            read = _vmnetfs_io_read_chunk(img, buf, cur.chunk, cur.offset,
+                    cur.length, &err);
+            if (err) {
+                _vmnetfs_u64_stat_increment(img->bytes_read, read);
+                _vmnetfs_pool_put(img, buf);
+                return send_error(conn, handle, io_error(img, err), true);
+            }
+            ok = send_chunk(conn, handle, 0, NBD_REPLY_TYPE_OFFSET_DATA,
+                    &offset, sizeof(offset), buf, read);
+        }
+        _vmnetfs_u64_stat_increment(img->bytes_read, read);
+    }
+    _vmnetfs_pool_put(img, buf);
+    return ok && send_chunk(conn, handle, NBD_REPLY_FLAG_DONE,
+            NBD_REPLY_TYPE_NONE, NULL, 0, NULL, 0);
+}
+
+static bool read_simple(struct nbd_conn *conn, uint64_t handle,
+        uint64_t start, uint32_t count)
+{
+    struct vmnetfs_image *img = conn->img;
+    struct vmnetfs_cursor cur;
+    uint64_t read = 0;
+    GError *err = NULL;
+    char *buf;
+    bool ok;
+
+    buf = g_malloc(count);
+    for (_vmnetfs_cursor_start(img, &cur, start, count);
+            _vmnetfs_cursor_chunk(&cur, read); ) {
+        read = _vmnetfs_io_read_chunk(img, buf + cur.io_offset, cur.chunk,
+                cur.offset, cur.length, &err);
+        _vmnetfs_u64_stat_increment(img->bytes_read, read);
+        if (err) {
+            g_free(buf);
+            return send_error(conn, handle, io_error(img, err), false);
+        }
+    }
+    ok = send_simple_reply(conn, handle, 0, buf, count);
+    g_free(buf);
+    return ok;
+}
+
+static uint32_t write_range(struct vmnetfs_image *img, const char *buf,
+        uint64_t start, uint32_t count)
+{
+    struct vmnetfs_cursor cur;
+    uint64_t written = 0;
+    GError *err = NULL;
+
+    for (_vmnetfs_cursor_start(img, &cur, start, count);
+            _vmnetfs_cursor_chunk(&cur, written); ) {
+        written = _vmnetfs_io_write_chunk(img, buf + cur.io_offset,
+                cur.chunk, cur.offset, cur.length, &err);
+        if (err) {
+            return io_error(img, err);
+        }
+        _vmnetfs_u64_stat_increment(img->bytes_written, cur.length);
+    }
+    return 0;
+}
+
+/* The discarded range reads back as zeroes. */
+static uint32_t discard_range(struct vmnetfs_image *img, uint64_t start,
+        uint32_t count)
+{
+    struct vmnetfs_cursor cur;
+    GError *err = NULL;
+
+    for (_vmnetfs_cursor_start(img, &cur, start, count);
+            _vmnetfs_cursor_chunk(&cur, cur.length); ) {
+        if (!_vmnetfs_io_discard_chunk(img, cur.chunk, cur.offset,
+                cur.length, &err)) {
+            return io_error(img, err);
+        }
+    }
+    return 0;
+}
+
+static uint32_t write_zeroes(struct vmnetfs_image *img, uint64_t start,
+        uint32_t count, bool allocate)
+{
+    struct vmnetfs_cursor cur;
+    uint64_t written = 0;
+    GError *err = NULL;
+    void *buf;
+
+    if (!allocate) {
+        return discard_range(img, start, count);
+    }
+    buf = _vmnetfs_pool_get(img);
+    memset(buf, 0, img->chunk_size);
+    for (_vmnetfs_cursor_start(img, &cur, start, count);
+            _vmnetfs_cursor_chunk(&cur, written); ) {
+        written = _vmnetfs_io_write_chunk(img, buf, cur.chunk, cur.offset,
+                cur.length, &err);
+        if (err) {
+            _vmnetfs_pool_put(img, buf);
+            return io_error(img, err);
+        }
+        _vmnetfs_u64_stat_increment(img->bytes_written, cur.length);
+    }
+    _vmnetfs_pool_put(img, buf);
+    return 0;
+}
+
+/* Returns false when the connection should be closed. */
+static bool handle_request(struct nbd_conn *conn, struct nbd_request *req)
+{
+    struct vmnetfs_image *img = conn->img;
+    uint16_t type = GUINT16_FROM_BE(req->type);
+    uint16_t flags = GUINT16_FROM_BE(req->flags);
+    uint64_t start = GUINT64_FROM_BE(req->offset);
+    uint32_t count = GUINT32_FROM_BE(req->length);
+    bool in_range = start <= conn->size && count <= conn->size - start;
+    uint32_t error;
+    char *buf;
+
+    switch (type) {
+    case NBD_CMD_READ:
+        if (!in_range || count > MAX_REQUEST) {
+            return send_error(conn, req->handle, NBD_EINVAL,
+                    conn->structured);
+        }
+        _vmnetfs_stream_group_write(img->io_stream,
+                "read %"PRIu64"+%"PRIu32"\n", start, count);
+        _vmnetfs_fsmap_note_read(img, start, count);
+        if (conn->structured) {
+            return read_structured(conn, req->handle, start, count);
+        }
+        return read_simple(conn, req->handle, start, count);
+    case NBD_CMD_WRITE:
+        if (count > MAX_REQUEST) {
+            /* Can't resynchronize with the request stream */
+            return false;
+        }
+        buf = g_malloc(count);
+        if (!recv_all(conn->fd, buf, count)) {
+            g_free(buf);
+            return false;
+        }
+        if (!in_range) {
+            error = NBD_ENOSPC;
+        } else {
+            _vmnetfs_stream_group_write(img->io_stream,
+                    "write %"PRIu64"+%"PRIu32"\n", start, count);
+            error = write_range(img, buf, start, count);
+            /* Even a failed write may have changed some chunks */
+            _vmnetfs_io_notify_changed(img, start, count);
+        }
+        g_free(buf);
+        break;
+    case NBD_CMD_DISC:
+        return false;
+    case NBD_CMD_FLUSH:
+        /* The modified cache does not outlive us, so there is nothing to
+           make durable */
+        error = 0;
+        break;
+    case NBD_CMD_TRIM:
+    case NBD_CMD_WRITE_ZEROES:
+        if (!in_range) {
+            error = NBD_ENOSPC;
+            break;
+        }
+        _vmnetfs_stream_group_write(img->io_stream,
+                "discard %"PRIu64"+%"PRIu32"\n", start, count);
+        if (type == NBD_CMD_TRIM) {
+            error = discard_range(img, start, count);
+        } else {
+            error = write_zeroes(img, start, count,
+                    flags & NBD_CMD_FLAG_NO_HOLE);
+        }
+        _vmnetfs_io_notify_changed(img, start, count);
+        break;
+    default:
+        error = NBD_EINVAL;
+        break;
+    }
+    if (error) {
+        return send_error(conn, req->handle, error, conn->structured);
+    }
+    return send_simple_reply(conn, req->handle, 0, NULL, 0);
+}
+
+static void *conn_thread(void *data)
+{
+    struct nbd_conn *conn = data;
+    struct nbd_state *ns = conn->img->nbd;
+    struct nbd_request req;
+
+    /* Later resizes through the FUSE file are not announced */
+    conn->size = _vmnetfs_io_get_image_size(conn->img, NULL);
+    if (handshake(conn)) {
+        while (recv_all(conn->fd, &req, sizeof(req)) &&
+                GUINT32_FROM_BE(req.magic) == NBD_REQUEST_MAGIC &&
+                handle_request(conn, &req)) {}
+    }
+    g_mutex_lock(ns->lock);
+    conn->finished = true;
+    g_mutex_unlock(ns->lock);
+    return NULL;
+}
+
+static void conn_free(struct nbd_conn *conn)
+{
+    g_thread_join(conn->thread);
+    close(conn->fd);
+    g_slice_free(struct nbd_conn, conn);
+}
+
+/* nbd_state lock must be held. */
+static void reap_conns(struct nbd_state *ns)
+{
+    struct nbd_conn *conn;
+    GList *cur;
+    GList *next;
+
+    for (cur = ns->conns; cur != NULL; cur = next) {
+        next = cur->next;
+        conn = cur->data;
+        if (conn->finished) {
+            ns->conns = g_list_delete_link(ns->conns, cur);
+            conn_free(conn);
+        }
+    }
+}
+
+static void *accept_thread(void *data)
+{
+    struct vmnetfs_image *img = data;
+    struct nbd_state *ns = img->nbd;
+    struct nbd_conn *conn;
+    GError *err = NULL;
+    int fd;
+
+    while (true) {
+        fd = accept(ns->listen_fd, NULL, NULL);
+        if (fd == -1) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            break;
+        }
+        g_mutex_lock(ns->lock);
+        reap_conns(ns);
+        if (ns->closed) {
+            g_mutex_unlock(ns->lock);
+            close(fd);
+            break;
+        }
+        conn = g_slice_new0(struct nbd_conn);
+        conn->img = img;
+        conn->fd = fd;
+        conn->thread = g_thread_create(conn_thread, conn, TRUE, &err);
+        if (conn->thread == NULL) {
+            g_warning("Couldn't start NBD connection: %s", err->message);
+            g_clear_error(&err);
+            close(fd);
+            g_slice_free(struct nbd_conn, conn);
+        } else {
+            ns->conns = g_list_prepend(ns->conns, conn);
+        }
+        g_mutex_unlock(ns->lock);
+    }
+    return NULL;
+}
+
+bool _vmnetfs_nbd_init(struct vmnetfs_image *img, GError **err)
+{
+    struct nbd_state *ns;
+    struct sockaddr_un addr = {
+        .sun_family = AF_UNIX,
+    };
+
+    if (img->nbd_socket == NULL) {
+        return true;
+    }
+    if (strlen(img->nbd_socket) >= sizeof(addr.sun_path)) {
+        g_set_error(err, VMNETFS_CONFIG_ERROR,
+                VMNETFS_CONFIG_ERROR_INVALID_CONFIG,
+                "NBD socket path too long: %s", img->nbd_socket);
+        return false;
+    }
+    strcpy(addr.sun_path, img->nbd_socket);
+
+    ns = g_slice_new0(struct nbd_state);
+    ns->listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (ns->listen_fd == -1) {
+        g_set_error(err, G_FILE_ERROR, g_file_error_from_errno(errno),
+                "Couldn't create NBD socket: %s", strerror(errno));
+        goto bad_free;
+    }
+    unlink(img->nbd_socket);
+    if (bind(ns->listen_fd, (struct sockaddr *) &addr, sizeof(addr)) ||
+            listen(ns->listen_fd, 16)) {
+        g_set_error(err, G_FILE_ERROR, g_file_error_from_errno(errno),
+                "Couldn't listen on %s: %s", img->nbd_socket,
+                strerror(errno));
+        goto bad_close;
+    }
+    ns->path = g_strdup(img->nbd_socket);
+    ns->lock = g_mutex_new();
+    img->nbd = ns;
+    ns->thread = g_thread_create(accept_thread, img, TRUE, err);
+    if (ns->thread == NULL) {
+        img->nbd = NULL;
+        g_mutex_free(ns->lock);
+        g_free(ns->path);
+        unlink(img->nbd_socket);
+        goto bad_close;
+    }
+    return true;
+
+bad_close:
+    close(ns->listen_fd);
+bad_free:
+    g_slice_free(struct nbd_state, ns);
+    return false;
+}
+
+/* Stop accepting connections and disconnect existing clients. */
+void _vmnetfs_nbd_close(struct vmnetfs_image *img)
+{
+    struct nbd_state *ns = img->nbd;
+    struct nbd_conn *conn;
+    GList *cur;
+
+    if (ns == NULL) {
+        return;
+    }
+    g_mutex_lock(ns->lock);
+    ns->closed = true;
+    shutdown(ns->listen_fd, SHUT_RDWR);
+    for (cur = ns->conns; cur != NULL; cur = cur->next) {
+        conn = cur->data;
+        shutdown(conn->fd, SHUT_RDWR);
+    }
+    g_mutex_unlock(ns->lock);
+}
+
+void _vmnetfs_nbd_destroy(struct vmnetfs_image *img)
+{
+    struct nbd_state *ns = img->nbd;
+
+    if (ns == NULL) {
+        return;
+    }
+    _vmnetfs_nbd_close(img);
+    g_thread_join(ns->thread);
+    while (ns->conns != NULL) {
+        conn_free(ns->conns->data);
+        ns->conns = g_list_delete_link(ns->conns, ns->conns);
+    }
+    close(ns->listen_fd);
+    unlink(ns->path);
+    g_free(ns->path);
+    g_mutex_free(ns->lock);
+    g_slice_free(struct nbd_state, ns);
+    img->nbd = NULL;
+}
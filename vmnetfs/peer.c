@@ -0,0 +1,1084 @@
+/*
+ * vmnetfs - virtual machine network execution virtual filesystem
+ *
+ * Copyright (C) 2006-2014 Carnegie Mellon University
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of version 2 of the GNU General Public License as published
+ * by the Free Software Foundation.  A copy of the GNU General Public License
+ * should have been distributed along with this program in the file
+ * COPYING.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ */
+
+/* Chunk exchange between vmnetfs instances on a LAN.
+
+   Images with a peer key and a chunk index are offered to peers.  Every
+   ANNOUNCE_INTERVAL seconds we send a datagram per image to a multicast
+   group, giving the image's key, the TCP port on which we serve chunks,
+   and the chunks in our pristine cache.  The present map is encoded as
+   alternating run lengths of absent and present chunks, starting with
+   absent, each as a little-endian base-128 varint.  Peers we haven't
+   heard from in PEER_EXPIRY seconds are forgotten.
+
+   Before fetching a chunk from the origin, we try the peers that claim
+   to have it.  A chunk request is a line
+
+       <key> <chunk>
+
+   and the reply is a line with the chunk length, followed by the chunk
+   data; a length of 0 means the peer no longer has the chunk.  Chunks
+   from peers are checked against the chunk index, and a peer that fails
+   us is forgotten until its next announcement.  Trying peers for a chunk
+   takes at most PEER_FETCH_TIMEOUT seconds in all, after which we fall
+   back to the origin.  Cached chunks are served to anyone who can reach
+   us. */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <errno.h>
+#include "vmnetfs-private.h"
+
+#define ANNOUNCE_MAGIC 0x564d4e50  /* "VMNP" */
+#define ANNOUNCE_HEADER_LEN 20
+#define ANNOUNCE_INTERVAL 5  /* seconds */
+#define PEER_EXPIRY 15  /* seconds */
+#define PEER_FETCH_TIMEOUT 5  /* seconds */
+#define STOP_POLL_INTERVAL 100  /* ms */
+#define DATAGRAM_MAX 65507
+#define REPLY_LINE_MAX 32
+
+struct peer_state {
+    uint32_t instance;  /* identifies our own announcements */
+    int udp_fd;
+    int listen_fd;
+    uint16_t port;  /* TCP, host byte order */
+    struct sockaddr_in group;
+    GThread *discovery_thread;
+    GThread *accept_thread;
+    GMutex *lock;
+    GCond *released;
+    GHashTable *images;  /* key -> struct peer_image */
+    GHashTable *remotes;  /* key -> GQueue of struct peer_remote */
+    GList *conns;
+    bool closed;  /* protected by lock */
+};
+
+struct peer_image {
+    char *key;
+    struct vmnetfs_image *img;
+    uint32_t users;  /* protected by peer lock */
+};
+
+struct peer_remote {
+    uint32_t instance;
+    struct sockaddr_in addr;  /* TCP */
+    uint64_t chunks;
+    uint8_t *bits;
+    time_t expires;
+};
+
+struct peer_conn {
+    struct peer_state *ps;
+    int fd;
+    GThread *thread;
+    bool finished;  /* protected by peer lock */
+};
+
+static void put_be(GByteArray *buf, uint64_t val, int bytes)
+{
+    uint8_t b;
+
+    while (bytes-- > 0) {
+        b = val >> (8 * bytes);
+        g_byte_array_append(buf, &b, 1);
+    }
+}
+
+static uint64_t get_be(const uint8_t *p, int bytes)
+{
+    uint64_t val = 0;
+
+    while (bytes-- > 0) {
+        val = val << 8 | *p++;
+    }
+    return val;
+}
+
+static void put_varint(GByteArray *buf, uint64_t val)
+{
+    uint8_t b;
+
+    do {
+        b = val & 0x7f;
+        val >>= 7;
+        if (val) {
+            b |= 0x80;
+        }
+        g_byte_array_append(buf, &b, 1);
+    } while (val);
+}
+
+/* Returns false on truncated or overlong input. */
+static bool get_varint(const uint8_t **p, const uint8_t *end, uint64_t *val)
+{
+    int shift;
+
+    *val = 0;
+    for (shift = 0; shift < 64 && *p < end; shift += 7) {
+        *val |= (uint64_t) (**p & 0x7f) << shift;
+        if (!(*(*p)++ & 0x80)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool bits_test(const uint8_t *bits, uint64_t bit)
+{
+    return bits[bit / 8] & (1 << (bit % 8));
+}
+
+static void remote_free(struct peer_remote *remote)
+{
+    g_free(remote->bits);
+    g_slice_free(struct peer_remote, remote);
+}
+
+static void remote_queue_free(void *data)
+{
+    GQueue *queue = data;
+
+    while (!g_queue_is_empty(queue)) {
+        remote_free(g_queue_pop_head(queue));
+    }
+    g_queue_free(queue);
+}
+
+/* Returns NULL if the datagram would be too large. */
+static GByteArray *build_announcement(struct peer_state *ps,
+        struct peer_image *pi)
+{
+    struct vmnetfs_image *img = pi->img;
+    GByteArray *buf;
+    uint64_t chunks;
+    uint64_t chunk;
+    uint64_t run = 0;
+    bool present = false;
+
+    chunks = (img->initial_size + img->chunk_size - 1) / img->chunk_size;
+    buf = g_byte_array_new();
+    put_be(buf, ANNOUNCE_MAGIC, 4);
+    put_be(buf, ps->instance, 4);
+    put_be(buf, ps->port, 2);
+    put_be(buf, strlen(pi->key), 2);
+    put_be(buf, chunks, 8);
+    g_byte_array_append(buf, (const uint8_t *) pi->key, strlen(pi->key));
+    for (chunk = 0; chunk < chunks; chunk++) {
+        if (_vmnetfs_bit_test(img->present_map, chunk) != present) {
+            put_varint(buf, run);
+            present = !present;
+            run = 0;
+        }
+        run++;
+    }
+    put_varint(buf, run);
+    if (buf->len > DATAGRAM_MAX) {
+        g_byte_array_free(buf, TRUE);
+        return NULL;
+    }
+    return buf;
+}
+
+static void announce(struct peer_state *ps)
+{
+    GHashTableIter iter;
+    GByteArray *buf;
+    GSList *msgs = NULL;
+    void *value;
+
+    g_mutex_lock(ps->lock);
+    g_hash_table_iter_init(&iter, ps->images);
+    while (g_hash_table_iter_next(&iter, NULL, &value)) {
+        /* Images too large to describe in a datagram aren't offered */
+        buf = build_announcement(ps, value);
+        if (buf != NULL) {
+            msgs = g_slist_prepend(msgs, buf);
+        }
+    }
+    g_mutex_unlock(ps->lock);
+
+    while (msgs != NULL) {
+        buf = msgs->data;
+        sendto(ps->udp_fd, buf->data, buf->len, 0,
+                (struct sockaddr *) &ps->group, sizeof(ps->group));
+        g_byte_array_free(buf, TRUE);
+        msgs = g_slist_delete_link(msgs, msgs);
+    }
+}
+
+/* Returns the present bitmap, or NULL if the encoding is invalid. */
+static uint8_t *decode_present(const uint8_t *p, const uint8_t *end,
+        uint64_t chunks)
+{
+    uint8_t *bits;
+    uint64_t chunk = 0;
+    uint64_t run;
+    bool present = false;
+
+    bits = g_malloc0((chunks + 7) / 8);
+    while (p < end) {
+        if (!get_varint(&p, end, &run) || run > chunks - chunk) {
+            g_free(bits);
+            return NULL;
+        }
+        if (present) {
+            for (; run > 0; run--, chunk++) {
+                bits[chunk / 8] |= 1 << (chunk % 8);
+            }
+        } else {
+            chunk += run;
+        }
+        present = !present;
+    }
+    if (chunk != chunks) {
+        g_free(bits);
+        return NULL;
+    }
+    return bits;
+}
+
+static void receive_announcement(struct peer_state *ps)
+{
+    static uint8_t buf[DATAGRAM_MAX];
+    struct sockaddr_in from;
+    socklen_t fromlen = sizeof(from);
+    struct peer_remote *remote;
+    struct peer_image *pi;
+    GQueue *queue;
+    GList *cur;
+    uint8_t *bits;
+    char *key;
+    uint32_t instance;
+    uint16_t port;
+    uint16_t keylen;
+    uint64_t chunks;
+    ssize_t len;
+
+    len = recvfrom(ps->udp_fd, buf, sizeof(buf), MSG_DONTWAIT,
+            (struct sockaddr *) &from, &fromlen);
+    if (len < ANNOUNCE_HEADER_LEN || from.sin_family != AF_INET ||
+            get_be(buf, 4) != ANNOUNCE_MAGIC) {
+        return;
+    }
+    instance = get_be(buf + 4, 4);
+    port = get_be(buf + 8, 2);
+    keylen = get_be(buf + 10, 2);
+    chunks = get_be(buf + 12, 8);
+    if (instance == ps->instance || port == 0 ||
+            keylen > len - ANNOUNCE_HEADER_LEN) {
+        return;
+    }
+    key = g_strndup((const char *) buf + ANNOUNCE_HEADER_LEN, keylen);
+
+    g_mutex_lock(ps->lock);
+    /* We only care about images we have */
+    pi = g_hash_table_lookup(ps->images, key);
+    if (pi == NULL || chunks != (pi->img->initial_size +
+            pi->img->chunk_size - 1) / pi->img->chunk_size) {
+        goto out;
+    }
+    bits = decode_present(buf + ANNOUNCE_HEADER_LEN + keylen, buf + len,
+            chunks);
+    if (bits == NULL) {
+        goto out;
+    }
+    queue = g_hash_table_lookup(ps->remotes, key);
+    if (queue == NULL) {
+        queue = g_queue_new();
+        g_hash_table_insert(ps->remotes, g_strdup(key), queue);
+    }
+    for (cur = queue->head; cur != NULL; cur = cur->next) {
+        remote = cur->data;
+        if (remote->instance == instance) {
+            break;
+        }
+    }
+    if (cur == NULL) {
+        remote = g_slice_new0(struct peer_remote);
+        remote->instance = instance;
+        g_queue_push_head(queue, remote);
+    }
+    remote->addr = from;
+    remote->addr.sin_port = htons(port);
+    remote->chunks = chunks;
+    g_free(remote->bits);
+    remote->bits = bits;
+    remote->expires = time(NULL) + PEER_EXPIRY;
+out:
+    g_mutex_unlock(ps->lock);
+    g_free(key);
+}
+
+/* Forget the remote, because it has expired or failed us.  peer lock
+   must be held. */
+static void drop_remote(struct peer_state *ps, const char *key,
+        uint32_t instance)
+{
+    struct peer_remote *remote;
+    GQueue *queue;
+    GList *cur;
+
+    queue = g_hash_table_lookup(ps->remotes, key);
+    if (queue == NULL) {
+        return;
+    }
+    for (cur = queue->head; cur != NULL; cur = cur->next) {
+        remote = cur->data;
+        if (remote->instance == instance) {
+            g_queue_delete_link(queue, cur);
+            remote_free(remote);
+            break;
+        }
+    }
+    if (g_queue_is_empty(queue)) {
+        g_hash_table_remove(ps->remotes, key);
+    }
+}
+
+static void expire_remotes(struct peer_state *ps)
+{
+    struct peer_remote *remote;
+    GHashTableIter iter;
+    GQueue *queue;
+    GList *cur;
+    GList *next;
+    void *value;
+    time_t now = time(NULL);
+
+    g_mutex_lock(ps->lock);
+    g_hash_table_iter_init(&iter, ps->remotes);
+    while (g_hash_table_iter_next(&iter, NULL, &value)) {
+        queue = value;
+        for (cur = queue->head; cur != NULL; cur = next) {
+            next = cur->next;
+            remote = cur->data;
+            if (remote->expires <= now) {
+                g_queue_delete_link(queue, cur);
+                remote_free(remote);
+            }
+        }
+        if (g_queue_is_empty(queue)) {
+            g_hash_table_iter_remove(&iter);
+        }
+    }
+    g_mutex_unlock(ps->lock);
+}
+
+static bool is_closed(struct peer_state *ps)
+{
+    bool ret;
+
+    g_mutex_lock(ps->lock);
+    ret = ps->closed;
+    g_mutex_unlock(ps->lock);
+    return ret;
+}
+
+static void *discovery_thread(void *data)
+{
+    struct peer_state *ps = data;
+    struct pollfd pfd = {
+        .fd = ps->udp_fd,
+        .events = POLLIN,
+    };
+    time_t next = 0;
+
+    /* Poll with a timeout so we notice when we're closed */
+    while (!is_closed(ps)) {
+        if (time(NULL) >= next) {
+            announce(ps);
+            expire_remotes(ps);
+            next = time(NULL) + ANNOUNCE_INTERVAL;
+        }
+        if (poll(&pfd, 1, 1000) > 0) {
+            receive_announcement(ps);
+        }
+    }
+    return NULL;
+}
+
+static bool send_all(int fd, const void *buf, size_t count)
+{
+    ssize_t ret;
+
+    while (count > 0) {
+        ret = send(fd, buf, count, MSG_NOSIGNAL);
+        if (ret == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        buf += ret;
+        count -= ret;
+    }
+    return true;
+}
+
+/* Read the chunk from our pristine cache, if it's there. */
+static bool read_chunk(struct vmnetfs_image *img, void *buf, uint64_t chunk,
+        uint32_t length)
+{
+    GError *err = NULL;
+
+    if (_vmnetfs_writeback_read_chunk(img, buf, chunk, 0, length)) {
+        return true;
+    }
+    if (!_vmnetfs_bit_test(img->present_map, chunk)) {
+        return false;
+    }
+    if (!_vmnetfs_ll_pristine_read_chunk(img, buf, chunk, 0, length,
+            &err)) {
+        /* Perhaps evicted */
+        g_clear_error(&err);
+        return false;
+    }
+    return true;
+}
+
+/* Returns false if the connection should be dropped. */
+static bool handle_request(struct peer_conn *conn, char *line)
+{
+    struct peer_state *ps = conn->ps;
+    struct peer_image *pi;
+    struct vmnetfs_image *img;
+    char *key;
+    char *end;
+    char reply[REPLY_LINE_MAX];
+    uint64_t chunk;
+    uint32_t length = 0;
+    void *buf = NULL;
+    bool ret;
+
+    key = line;
+    line = strchr(line, ' ');
+    if (line == NULL) {
+        return false;
+    }
+    *line++ = 0;
+    chunk = g_ascii_strtoull(line, &end, 10);
+    if (end == line || *end != 0) {
+        return false;
+    }
+
+    g_mutex_lock(ps->lock);
+    pi = g_hash_table_lookup(ps->images, key);
+    if (pi != NULL) {
+        pi->users++;
+    }
+    g_mutex_unlock(ps->lock);
+    if (pi != NULL) {
+        img = pi->img;
+        if (chunk * img->chunk_size < img->initial_size) {
+            length = MIN(img->initial_size - chunk * img->chunk_size,
+                    img->chunk_size);
+            buf = _vmnetfs_pool_get(img);
+            if (!read_chunk(img, buf, chunk, length)) {
+                length = 0;
+            }
+        }
+    }
+
+    g_snprintf(reply, sizeof(reply), "%u\n", length);
+    ret = send_all(conn->fd, reply, strlen(reply)) &&
+            send_all(conn->fd, buf, length);
+
+    if (pi != NULL) {
+        if (buf != NULL) {
+            _vmnetfs_pool_put(pi->img, buf);
+        }
+        g_mutex_lock(ps->lock);
+        if (--pi->users == 0) {
+            g_cond_broadcast(ps->released);
+        }
+        g_mutex_unlock(ps->lock);
+    }
+    return ret;
+}
+
+static void *conn_thread(void *data)
+{
+    struct peer_conn *conn = data;
+    struct peer_state *ps = conn->ps;
+    GIOChannel *chan;
+    char *line;
+    gsize terminator_pos;
+
+    chan = g_io_channel_unix_new(conn->fd);
+    g_io_channel_set_encoding(chan, NULL, NULL);
+    while (g_io_channel_read_line(chan, &line, NULL, &terminator_pos,
+            NULL) == G_IO_STATUS_NORMAL) {
+        line[terminator_pos] = 0;
+        if (!handle_request(conn, line)) {
+            g_free(line);
+            break;
+        }
+        g_free(line);
+    }
+    g_io_channel_unref(chan);
+
+    g_mutex_lock(ps->lock);
+    conn->finished = true;
+    g_mutex_unlock(ps->lock);
+    return NULL;
+}
+
+static void conn_free(struct peer_conn *conn)
+{
+    g_thread_join(conn->thread);
+    close(conn->fd);
+    g_slice_free(struct peer_conn, conn);
+}
+
+/* peer lock must be held. */
+static void reap_conns(struct peer_state *ps)
+{
+    struct peer_conn *conn;
+    GList *cur;
+    GList *next;
+
+    for (cur = ps->conns; cur != NULL; cur = next) {
+        next = cur->next;
+        conn = cur->data;
+        if (conn->finished) {
+            ps->conns = g_list_delete_link(ps->conns, cur);
+            conn_free(conn);
+        }
+    }
+}
+
+static void *accept_thread(void *data)
+{
+    struct peer_state *ps = data;
+    struct peer_conn *conn;
+    GError *err = NULL;
+    int fd;
+
+    while (true) {
+        fd = accept4(ps->listen_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (fd == -1) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            break;
+        }
+        g_mutex_lock(ps->lock);
+        reap_conns(ps);
+        if (ps->closed) {
+            g_mutex_unlock(ps->lock);
+            close(fd);
+            break;
+        }
+        conn = g_slice_new0(struct peer_conn);
+        conn->ps = ps;
+        conn->fd = fd;
+        conn->thread = g_thread_create(conn_thread, conn, TRUE, &err);
+        if (conn->thread == NULL) {
+            g_warning("Couldn't start peer connection: %s", err->message);
+            g_clear_error(&err);
+            close(fd);
+            g_slice_free(struct peer_conn, conn);
+        } else {
+            ps->conns = g_list_prepend(ps->conns, conn);
+        }
+        g_mutex_unlock(ps->lock);
+    }
+    return NULL;
+}
+
+/* The budget for fetching one chunk from peers */
+struct peer_fetch {
+    GTimer *timer;
+    bool (*should_stop)(void *arg);
+    void *arg;
+};
+
+static bool fetch_over(struct peer_fetch *pf)
+{
+    return g_timer_elapsed(pf->timer, NULL) >= PEER_FETCH_TIMEOUT ||
+            pf->should_stop(pf->arg);
+}
+
+/* Wait for the nonblocking socket to become ready.  Returns false if the
+   fetch is out of time or should stop. */
+static bool fetch_wait(struct peer_fetch *pf, int fd, short events)
+{
+    struct pollfd pfd = {
+        .fd = fd,
+        .events = events,
+    };
+    double remaining;
+    int ret;
+
+    while (!fetch_over(pf)) {
+        remaining = PEER_FETCH_TIMEOUT - g_timer_elapsed(pf->timer, NULL);
+        ret = poll(&pfd, 1, MIN(remaining * 1000 + 1,
+                STOP_POLL_INTERVAL));
+        if (ret > 0) {
+            return true;
+        }
+        if (ret == -1 && errno != EINTR) {
+            return false;
+        }
+    }
+    return false;
+}
+
+static bool fetch_send_all(struct peer_fetch *pf, int fd, const void *buf,
+        size_t count)
+{
+    ssize_t ret;
+
+    while (count > 0) {
+        ret = send(fd, buf, count, MSG_NOSIGNAL);
+        if (ret == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN && fetch_wait(pf, fd, POLLOUT)) {
+                continue;
+            }
+            return false;
+        }
+        buf += ret;
+        count -= ret;
+    }
+    return true;
+}
+
+static bool fetch_recv_all(struct peer_fetch *pf, int fd, void *buf,
+        size_t count)
+{
+    ssize_t ret;
+
+    while (count > 0) {
+        ret = recv(fd, buf, count, 0);
+        if (ret == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN && fetch_wait(pf, fd, POLLIN)) {
+                continue;
+            }
+            return false;
+        }
+        if (ret == 0) {
+            return false;
+        }
+        buf += ret;
+        count -= ret;
+    }
+    return true;
+}
+
+/* Fetch the chunk from one peer, within what remains of the budget. */
+static bool fetch_from(struct peer_fetch *pf, const struct sockaddr_in *addr,
+        const char *key, uint64_t chunk, void *buf, uint32_t length)
+{
+    char line[REPLY_LINE_MAX];
+    char *req;
+    char *end;
+    bool ret = false;
+    socklen_t len;
+    size_t i;
+    int err;
+    int fd;
+
+    fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+    if (fd == -1) {
+        return false;
+    }
+    if (connect(fd, (const struct sockaddr *) addr, sizeof(*addr))) {
+        if (errno != EINPROGRESS || !fetch_wait(pf, fd, POLLOUT)) {
+            goto out;
+        }
+        len = sizeof(err);
+        if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) || err) {
+            goto out;
+        }
+    }
+    req = g_strdup_printf("%s %"PRIu64"\n", key, chunk);
+    ret = fetch_send_all(pf, fd, req, strlen(req));
+    g_free(req);
+    if (!ret) {
+        goto out;
+    }
+    ret = false;
+    for (i = 0; i < sizeof(line) - 1; i++) {
+        if (!fetch_recv_all(pf, fd, line + i, 1)) {
+            goto out;
+        }
+        if (line[i] == '\n') {
+            break;
+        }
+    }
+    line[i] = 0;
+    if (g_ascii_strtoull(line, &end, 10) != length || end == line ||
+            *end != 0) {
+        goto out;
+    }
+    ret = fetch_recv_all(pf, fd, buf, length);
+out:
+    close(fd);
+    return ret;
+}
+
+struct candidate {
+    uint32_t instance;
+    struct sockaddr_in addr;
+};
+
+/* Try to fetch the chunk from a peer that has it.  Returns false if no
+   peer could provide a valid copy within PEER_FETCH_TIMEOUT, or if
+   @should_stop returns true first. */
+bool _vmnetfs_peer_fetch(struct vmnetfs_image *img, void *buf,
+        uint64_t chunk, uint32_t length, bool (*should_stop)(void *arg),
+        void *arg)
+{
+    struct peer_state *ps = img->peer;
+    struct peer_fetch pf = {
+        .should_stop = should_stop,
+        .arg = arg,
+    };
+    struct peer_remote *remote;
+    struct candidate *cand;
+    GSList *cands = NULL;
+    GQueue *queue;
+    GList *cur;
+    bool ret = false;
+    time_t now = time(NULL);
+
+    g_mutex_lock(ps->lock);
+    if (ps->closed) {
+        g_mutex_unlock(ps->lock);
+        return false;
+    }
+    queue = g_hash_table_lookup(ps->remotes, img->peer_key);
+    for (cur = queue ? queue->head : NULL; cur != NULL; cur = cur->next) {
+        remote = cur->data;
+        if (remote->expires > now && chunk < remote->chunks &&
+                bits_test(remote->bits, chunk)) {
+            cand = g_slice_new(struct candidate);
+            cand->instance = remote->instance;
+            cand->addr = remote->addr;
+            /* Spread the load */
+            if (g_random_boolean()) {
+                cands = g_slist_prepend(cands, cand);
+            } else {
+                cands = g_slist_append(cands, cand);
+            }
+        }
+    }
+    g_mutex_unlock(ps->lock);
+
+    pf.timer = g_timer_new();
+    while (cands != NULL) {
+        cand = cands->data;
+        if (!ret && !fetch_over(&pf)) {
+            ret = fetch_from(&pf, &cand->addr, img->peer_key, chunk, buf,
+                    length) && _vmnetfs_store_verify_chunk(img, chunk, buf,
+                    length);
+            /* Don't blame the peer if we gave up for our own reasons */
+            if (!ret && !should_stop(arg)) {
+                g_mutex_lock(ps->lock);
+                drop_remote(ps, img->peer_key, cand->instance);
+                g_mutex_unlock(ps->lock);
+            }
+        }
+        g_slice_free(struct candidate, cand);
+        cands = g_slist_delete_link(cands, cands);
+    }
+    g_timer_destroy(pf.timer);
+    return ret;
+}
+
+/* Offer the image to peers, and fetch its chunks from them.  Only
+   images with a chunk index can be offered, since that's how we check
+   what peers send us.  Images the origin serves only with credentials
+   are never offered, since peers could read them without any. */
+void _vmnetfs_peer_add_image(struct vmnetfs *fs, struct vmnetfs_image *img)
+{
+    struct peer_state *ps = fs->peer;
+    struct peer_image *pi;
+
+    if (ps == NULL || img->peer_key == NULL || img->store == NULL ||
+            img->username != NULL || img->cookies != NULL) {
+        return;
+    }
+    g_mutex_lock(ps->lock);
+    if (!ps->closed && g_hash_table_lookup(ps->images, img->peer_key) ==
+            NULL) {
+        pi = g_slice_new0(struct peer_image);
+        pi->key = g_strdup(img->peer_key);
+        pi->img = img;
+        g_hash_table_insert(ps->images, pi->key, pi);
+        img->peer = ps;
+    }
+    g_mutex_unlock(ps->lock);
+}
+
+static void image_free(struct peer_image *pi)
+{
+    g_free(pi->key);
+    g_slice_free(struct peer_image, pi);
+}
+
+/* Stop offering the image, waiting for requests reading from it. */
+void _vmnetfs_peer_remove_image(struct vmnetfs *fs,
+        struct vmnetfs_image *img)
+{
+    struct peer_state *ps = fs->peer;
+    struct peer_image *pi;
+
+    if (ps == NULL || img->peer_key == NULL) {
+        return;
+    }
+    g_mutex_lock(ps->lock);
+    pi = g_hash_table_lookup(ps->images, img->peer_key);
+    if (pi != NULL && pi->img == img) {
+        g_hash_table_steal(ps->images, img->peer_key);
+        g_hash_table_remove(ps->remotes, img->peer_key);
+        while (pi->users > 0) {
+            g_cond_wait(ps->released, ps->lock);
+        }
+        image_free(pi);
+    }
+    g_mutex_unlock(ps->lock);
+}
+
+static void add_image(void *key G_GNUC_UNUSED, void *value, void *data)
+{
+    _vmnetfs_peer_add_image(data, value);
+}
+
+/* Any interface, unless one is configured. */
+static bool get_interface(struct vmnetfs *fs, struct in_addr *iface,
+        GError **err)
+{
+    iface->s_addr = htonl(INADDR_ANY);
+    if (fs->peer_interface != NULL &&
+            !inet_aton(fs->peer_interface, iface)) {
+        g_set_error(err, VMNETFS_CONFIG_ERROR,
+                VMNETFS_CONFIG_ERROR_INVALID_CONFIG,
+                "Invalid peer interface address: %s", fs->peer_interface);
+        return false;
+    }
+    return true;
+}
+
+static int open_udp(struct vmnetfs *fs, struct in_addr iface,
+        struct sockaddr_in *group, GError **err)
+{
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_addr.s_addr = htonl(INADDR_ANY),
+    };
+    struct ip_mreq mreq;
+    int one = 1;
+    int fd;
+
+    group->sin_family = AF_INET;
+    group->sin_port = htons(fs->peer_port);
+    if (!inet_aton(fs->peer_group, &group->sin_addr) ||
+            !IN_MULTICAST(ntohl(group->sin_addr.s_addr))) {
+        g_set_error(err, VMNETFS_CONFIG_ERROR,
+                VMNETFS_CONFIG_ERROR_INVALID_CONFIG,
+                "Invalid peer multicast group: %s", fs->peer_group);
+        return -1;
+    }
+    addr.sin_port = group->sin_port;
+    mreq.imr_multiaddr = group->sin_addr;
+    mreq.imr_interface = iface;
+
+    fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        goto bad;
+    }
+    /* Let other instances on this host join the group */
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) ||
+            setsockopt(fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq,
+            sizeof(mreq)) ||
+            setsockopt(fd, IPPROTO_IP, IP_MULTICAST_IF, &iface,
+            sizeof(iface)) ||
+            setsockopt(fd, IPPROTO_IP, IP_MULTICAST_LOOP, &one,
+            sizeof(one))) {
+        close(fd);
+        goto bad;
+    }
+    return fd;
+
+bad:
+    g_set_error(err, G_FILE_ERROR, g_file_error_from_errno(errno),
+            "Couldn't join peer group %s: %s", fs->peer_group,
+            strerror(errno));
+    return -1;
+}
+
+/* Only listen on the interface we announce on, if one is configured. */
+static int open_tcp(struct in_addr iface, uint16_t *port, GError **err)
+{
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_addr = iface,
+    };
+    socklen_t len = sizeof(addr);
+    int fd;
+
+    fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        goto bad;
+    }
+    if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) ||
+            listen(fd, 64) ||
+            getsockname(fd, (struct sockaddr *) &addr, &len)) {
+        close(fd);
+        goto bad;
+    }
+    *port = ntohs(addr.sin_port);
+    return fd;
+
+bad:
+    g_set_error(err, G_FILE_ERROR, g_file_error_from_errno(errno),
+            "Couldn't listen for peers: %s", strerror(errno));
+    return -1;
+}
+
+/* Must be called after the startup images have been initialized. */
+bool _vmnetfs_peer_init(struct vmnetfs *fs, GError **err)
+{
+    struct peer_state *ps;
+    struct in_addr iface;
+
+    if (fs->peer_group == NULL) {
+        return true;
+    }
+    if (!get_interface(fs, &iface, err)) {
+        return false;
+    }
+    ps = g_slice_new0(struct peer_state);
+    ps->instance = g_random_int();
+    ps->udp_fd = open_udp(fs, iface, &ps->group, err);
+    if (ps->udp_fd == -1) {
+        goto bad_free;
+    }
+    ps->listen_fd = open_tcp(iface, &ps->port, err);
+    if (ps->listen_fd == -1) {
+        goto bad_close_udp;
+    }
+    ps->lock = g_mutex_new();
+    ps->released = g_cond_new();
+    ps->images = g_hash_table_new_full(g_str_hash, g_str_equal, NULL,
+            (GDestroyNotify) image_free);
+    ps->remotes = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+            remote_queue_free);
+    ps->discovery_thread = g_thread_create(discovery_thread, ps, TRUE,
+            err);
+    if (ps->discovery_thread == NULL) {
+        goto bad_destroy;
+    }
+    ps->accept_thread = g_thread_create(accept_thread, ps, TRUE, err);
+    if (ps->accept_thread == NULL) {
+        g_mutex_lock(ps->lock);
+        ps->closed = true;
+        g_mutex_unlock(ps->lock);
+        g_thread_join(ps->discovery_thread);
+        goto bad_destroy;
+    }
+    fs->peer = ps;
+    g_mutex_lock(fs->images_lock);
+    _vmnetfs_images_foreach(fs, add_image, fs);
+    g_mutex_unlock(fs->images_lock);
+    return true;
+
+bad_destroy:
+    g_hash_table_destroy(ps->remotes);
+    g_hash_table_destroy(ps->images);
+    g_cond_free(ps->released);
+    g_mutex_free(ps->lock);
+    close(ps->listen_fd);
+bad_close_udp:
+    close(ps->udp_fd);
+bad_free:
+    g_slice_free(struct peer_state, ps);
+    return false;
+}
+
+/* Stop exchanging chunks.  Images can still be added and removed, but
+   nothing happens. */
+void _vmnetfs_peer_close(struct vmnetfs *fs)
+{
+    struct peer_state *ps = fs->peer;
+    struct peer_conn *conn;
+    GList *cur;
+
+    if (ps == NULL) {
+        return;
+    }
+    g_mutex_lock(ps->lock);
+    if (ps->closed) {
+        g_mutex_unlock(ps->lock);
+        return;
+    }
+    ps->closed = true;
+    shutdown(ps->listen_fd, SHUT_RDWR);
+    for (cur = ps->conns; cur != NULL; cur = cur->next) {
+        conn = cur->data;
+        shutdown(conn->fd, SHUT_RDWR);
+    }
+    g_mutex_unlock(ps->lock);
+
+    g_thread_join(ps->discovery_thread);
+    g_thread_join(ps->accept_thread);
+    while (ps->conns != NULL) {
+        conn_free(ps->conns->data);
+        ps->conns = g_list_delete_link(ps->conns, ps->conns);
+    }
+    /* Connections are gone, so nobody is reading from the images */
+    g_mutex_lock(ps->lock);
+    g_hash_table_remove_all(ps->images);
+    g_hash_table_remove_all(ps->remotes);
+    g_mutex_unlock(ps->lock);
+}
+
+/* Must be called after every image has been destroyed. */
+void _vmnetfs_peer_destroy(struct vmnetfs *fs)
+{
+    struct peer_state *ps = fs->peer;
+
+    if (ps == NULL) {
+        return;
+    }
+    _vmnetfs_peer_close(fs);
+    g_hash_table_destroy(ps->remotes);
+    g_hash_table_destroy(ps->images);
+    close(ps->listen_fd);
+    close(ps->udp_fd);
+    g_cond_free(ps->released);
+    g_mutex_free(ps->lock);
+    g_slice_free(struct peer_state, ps);
+    fs->peer = NULL;
+}
@@ -15,8 +15,8 @@
  * for more details.
  */
 
-#define FUSE_USE_VERSION 26
-#include <fuse.h>
+#define FUSE_USE_VERSION 312
+#include <fuse_lowlevel.h>
 #include "vmnetfs-private.h"
 
 /* An item that may change over time. */
@@ -53,7 +53,7 @@ static void add_handle(struct vmnetfs_pollable *pll,
         return;
     }
     if (changed) {
-        fuse_notify_poll(ph);
+        fuse_lowlevel_notify_poll(ph);
         fuse_pollhandle_destroy(ph);
     } else {
         pll->unchanged = g_list_prepend(pll->unchanged, ph);
@@ -95,7 +95,7 @@ static void release_handles(struct vmnetfs_pollable *pll, bool notify)
     for (el = g_list_first(pll->unchanged); el != NULL; el = g_list_next(el)) {
         ph = el->data;
         if (notify) {
-            fuse_notify_poll(ph);
+            fuse_lowlevel_notify_poll(ph);
         }
         fuse_pollhandle_destroy(ph);
     }
@@ -0,0 +1,191 @@
+/*
+ * vmnetfs - virtual machine network execution virtual filesystem
+ *
+ * Copyright (C) 2006-2014 Carnegie Mellon University
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of version 2 of the GNU General Public License as published
+ * by the Free Software Foundation.  A copy of the GNU General Public License
+ * should have been distributed along with this program in the file
+ * COPYING.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ */
+
+/* Chunk-sized I/O buffers are carved out of a single preallocated mapping
+   rather than allocated per operation, so that the hot path doesn't take
+   page faults or bounce through malloc's mmap threshold.  Free slabs are
+   kept on a lock-free stack.  When the pool is empty, buffers come from
+   the heap instead. */
+
+#include <sys/mman.h>
+#include <string.h>
+#include <errno.h>
+#include "vmnetfs-private.h"
+
+#define POOL_DEFAULT_BYTES (16 << 20)
+#define POOL_MIN_BUFFERS 16
+#define HUGEPAGE_SIZE (2 << 20)
+
+struct buffer_pool {
+    char *region;
+    uint64_t region_len;
+    uint32_t slab_size;
+    uint32_t count;
+    /* Free list.  Slab indexes are stored biased by one so that zero can
+       terminate the list.  The upper half of head is a generation count
+       which prevents ABA races. */
+    uint32_t *next;
+    uint64_t head;
+};
+
+static void *map_region(uint64_t len, enum pool_hugepages mode)
+{
+    void *region;
+
+#ifdef MAP_HUGETLB
+    if (mode == POOL_HUGEPAGES_EXPLICIT) {
+        region = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (region != MAP_FAILED) {
+            return region;
+        }
+        g_warning("Couldn't allocate hugepages for buffer pool: %s",
+                strerror(errno));
+    }
+#endif
+    region = mmap(NULL, len, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (region == MAP_FAILED) {
+        return NULL;
+    }
+#ifdef MADV_HUGEPAGE
+    if (mode != POOL_HUGEPAGES_NONE) {
+        /* Advisory only */
+        madvise(region, len, MADV_HUGEPAGE);
+    }
+#endif
+    return region;
+}
+
+bool _vmnetfs_pool_init(struct vmnetfs_image *img, GError **err)
+{
+    struct buffer_pool *pool;
+    uint32_t i;
+
+    pool = g_slice_new0(struct buffer_pool);
+    pool->slab_size = img->chunk_size;
+    pool->count = img->pool_buffers ?: MAX(POOL_DEFAULT_BYTES /
+            img->chunk_size, POOL_MIN_BUFFERS);
+    pool->region_len = (uint64_t) pool->count * pool->slab_size;
+    if (img->pool_hugepages != POOL_HUGEPAGES_NONE) {
+        pool->region_len = (pool->region_len + HUGEPAGE_SIZE - 1) &
+                ~((uint64_t) HUGEPAGE_SIZE - 1);
+    }
+    pool->region = map_region(pool->region_len, img->pool_hugepages);
+    if (pool->region == NULL) {
+        g_set_error(err, G_FILE_ERROR, g_file_error_from_errno(errno),
+                "Couldn't allocate buffer pool: %s", strerror(errno));
+        g_slice_free(struct buffer_pool, pool);
+        return false;
+    }
+
+    pool->next = g_new(uint32_t, pool->count);
+    for (i = 0; i < pool->count; i++) {
+        pool->next[i] = i + 1 < pool->count ? i + 2 : 0;
+    }
+    pool->head = 1;
+    img->pool = pool;
+    return true;
+}
+
+void _vmnetfs_pool_destroy(struct vmnetfs_image *img)
+{
+    struct buffer_pool *pool = img->pool;
+
+    munmap(pool->region, pool->region_len);
+    g_free(pool->next);
+    g_slice_free(struct buffer_pool, pool);
+}
+
+/* Returns the mapping from which pool buffers are allocated. */
+void *_vmnetfs_pool_get_region(struct vmnetfs_image *img, uint64_t *len)
+{
+    *len = img->pool->region_len;
+    return img->pool->region;
+}
+
+/* Returns true if @buf was allocated from the pool mapping rather than
+   the heap. */
+bool _vmnetfs_pool_contains(struct vmnetfs_image *img, const void *buf)
+{
+    struct buffer_pool *pool = img->pool;
+
+    return (const char *) buf >= pool->region &&
+            (const char *) buf < pool->region + (uint64_t) pool->count *
+            pool->slab_size;
+}
+
+/* Returns a buffer of chunk_size bytes.  Never fails. */
+void *_vmnetfs_pool_get(struct vmnetfs_image *img)
+{
+    struct buffer_pool *pool = img->pool;
+    uint64_t old;
+    uint64_t new;
+    uint64_t cur;
+    uint32_t idx;
+
+    /* A torn read will just fail the compare-and-swap */
+    old = pool->head;
+    while (true) {
+        idx = old & 0xffffffff;
+        if (idx == 0) {
+            _vmnetfs_u64_stat_increment(img->buffer_pool_misses, 1);
+            return g_malloc(pool->slab_size);
+        }
+        /* next[] may be stale if another thread popped this slab, but
+           then the generation count has changed and the CAS will fail */
+        new = ((old >> 32) + 1) << 32 | pool->next[idx - 1];
+        cur = __sync_val_compare_and_swap(&pool->head, old, new);
+        if (cur == old) {
+            break;
+        }
+        old = cur;
+    }
+    _vmnetfs_u64_stat_increment(img->buffer_pool_used, 1);
+    return pool->region + (uint64_t) (idx - 1) * pool->slab_size;
+}
+
+/* Accepts any buffer returned by _vmnetfs_pool_get(), or NULL. */
+void _vmnetfs_pool_put(struct vmnetfs_image *img, void *buf)
+{
+    struct buffer_pool *pool = img->pool;
+    uint64_t old;
+    uint64_t new;
+    uint64_t cur;
+    uint32_t idx;
+
+    if (buf == NULL) {
+        return;
+    }
+    if (!_vmnetfs_pool_contains(img, buf)) {
+        g_free(buf);
+        return;
+    }
+    idx = ((char *) buf - pool->region) / pool->slab_size + 1;
+
+    old = pool->head;
+    while (true) {
+        pool->next[idx - 1] = old & 0xffffffff;
+        new = ((old >> 32) + 1) << 32 | idx;
+        cur = __sync_val_compare_and_swap(&pool->head, old, new);
+        if (cur == old) {
+            break;
+        }
+        old = cur;
+    }
+    _vmnetfs_u64_stat_decrement(img->buffer_pool_used, 1);
+}
@@ -0,0 +1,347 @@
+/*
+ * vmnetfs - virtual machine network execution virtual filesystem
+ *
+ * Copyright (C) 2006-2014 Carnegie Mellon University
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of version 2 of the GNU General Public License as published
+ * by the Free Software Foundation.  A copy of the GNU General Public License
+ * should have been distributed along with this program in the file
+ * COPYING.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ */
+
+#include <inttypes.h>
+#include "vmnetfs-private.h"
+
+/* Number of chunks requested from the fetch threads at once.  The worker
+   waits for each window to complete before starting the next, so that a
+   higher-priority request, or a cancellation, takes effect promptly. */
+#define PREFETCH_WINDOW 8
+
+struct prefetch_request {
+    uint32_t id;
+    uint64_t start;
+    uint64_t count;
+    uint64_t done;
+    int priority;
+    bool cancelled;
+};
+
+struct prefetch_state {
+    GMutex *lock;
+    GCond *changed;
+    GThread *thread;
+    GQueue *requests;  /* highest priority first */
+    struct prefetch_request *current;  /* in flight, or NULL */
+    struct vmnetfs_stream_group *stream;
+    uint32_t next_id;
+    int pending;  /* may briefly go negative */
+    bool stopped;
+};
+
+static void request_free(struct prefetch_request *req)
+{
+    g_slice_free(struct prefetch_request, req);
+}
+
+/* Tell new readers about the requests already queued. */
+static void populate_stream(struct vmnetfs_stream *strm, void *data)
+{
+    struct prefetch_state *ps = data;
+    struct prefetch_request *req;
+    GList *cur;
+
+    g_mutex_lock(ps->lock);
+    for (cur = g_queue_peek_head_link(ps->requests); cur != NULL;
+            cur = cur->next) {
+        req = cur->data;
+        _vmnetfs_stream_write(strm, "queued %"PRIu32" %"PRIu64"+%"PRIu64
+                " %d\n", req->id, req->start, req->count, req->priority);
+        _vmnetfs_stream_write(strm, "progress %"PRIu32" %"PRIu64"/%"PRIu64
+                "\n", req->id, req->done, req->count);
+    }
+    g_mutex_unlock(ps->lock);
+}
+
+static void fetch_ready(void *arg)
+{
+    struct prefetch_state *ps = arg;
+
+    g_mutex_lock(ps->lock);
+    if (--ps->pending == 0) {
+        g_cond_broadcast(ps->changed);
+    }
+    g_mutex_unlock(ps->lock);
+}
+
+/* lock must be held. */
+static void finish_request(struct prefetch_state *ps,
+        struct prefetch_request *req, const char *status)
+{
+    g_queue_remove(ps->requests, req);
+    _vmnetfs_stream_group_write(ps->stream, "%s %"PRIu32"\n", status,
+            req->id);
+    request_free(req);
+}
+
+static void *prefetch_thread(void *data)
+{
+    struct vmnetfs_image *img = data;
+    struct prefetch_state *ps = img->prefetch;
+    struct prefetch_request *req;
+    uint64_t start;
+    uint64_t end;
+    int pending;
+
+    g_mutex_lock(ps->lock);
+    while (true) {
+        while (!ps->stopped && g_queue_is_empty(ps->requests)) {
+            g_cond_wait(ps->changed, ps->lock);
+        }
+        if (ps->stopped) {
+            break;
+        }
+
+        /* Rechoose after every window, so new urgent requests preempt
+           the current one */
+        req = g_queue_peek_head(ps->requests);
+        ps->current = req;
+        start = req->start + req->done;
+        end = MIN(req->start + req->count,
+                (start / img->chunk_size + PREFETCH_WINDOW) *
+                img->chunk_size);
+        g_mutex_unlock(ps->lock);
+
+        pending = _vmnetfs_io_fetch_async(img, start, end - start,
+                FETCH_PRIORITY_PREFETCH, fetch_ready, ps);
+
+        g_mutex_lock(ps->lock);
+        ps->pending += pending;
+        while (ps->pending > 0) {
+            g_cond_wait(ps->changed, ps->lock);
+        }
+        ps->current = NULL;
+        req->done += end - start;
+        if (req->cancelled) {
+            finish_request(ps, req, "cancelled");
+        } else if (req->done == req->count) {
+            finish_request(ps, req, "done");
+        } else {
+            _vmnetfs_stream_group_write(ps->stream, "progress %"PRIu32
+                    " %"PRIu64"/%"PRIu64"\n", req->id, req->done,
+                    req->count);
+        }
+    }
+    g_mutex_unlock(ps->lock);
+    return NULL;
+}
+
+void _vmnetfs_prefetch_init(struct vmnetfs_image *img)
+{
+    struct prefetch_state *ps;
+
+    ps = g_slice_new0(struct prefetch_state);
+    ps->lock = g_mutex_new();
+    ps->changed = g_cond_new();
+    ps->requests = g_queue_new();
+    ps->stream = _vmnetfs_stream_group_new(populate_stream, ps);
+    ps->next_id = 1;
+    img->prefetch = ps;
+    img->pinned_map = _vmnetfs_bit_new(img->bitmaps, false);
+}
+
+/* Queue a background fetch of the pristine data in the byte range.
+   Requests with higher @priority are served first; the worker thread is
+   started on first use. */
+bool _vmnetfs_prefetch_queue(struct vmnetfs_image *img, uint64_t start,
+        uint64_t count, int priority, uint32_t *id, GError **err)
+{
+    struct prefetch_state *ps = img->prefetch;
+    struct prefetch_request *req;
+    GList *cur;
+
+    g_mutex_lock(ps->lock);
+    if (ps->stopped) {
+        g_set_error(err, VMNETFS_IO_ERROR, VMNETFS_IO_ERROR_INTERRUPTED,
+                "Image closed");
+        goto bad;
+    }
+    if (ps->thread == NULL) {
+        ps->thread = g_thread_create(prefetch_thread, img, TRUE, err);
+        if (ps->thread == NULL) {
+            goto bad;
+        }
+    }
+
+    /* Only the pristine image can be fetched */
+    start = MIN(start, img->initial_size);
+    count = MIN(count, img->initial_size - start);
+
+    req = g_slice_new0(struct prefetch_request);
+    req->id = ps->next_id++;
+    req->start = start;
+    req->count = count;
+    req->priority = priority;
+    *id = req->id;
+    _vmnetfs_stream_group_write(ps->stream, "queued %"PRIu32" %"PRIu64"+%"
+            PRIu64" %d\n", req->id, start, count, priority);
+    if (count == 0) {
+        _vmnetfs_stream_group_write(ps->stream, "done %"PRIu32"\n",
+                req->id);
+        request_free(req);
+        g_mutex_unlock(ps->lock);
+        return true;
+    }
+
+    for (cur = g_queue_peek_head_link(ps->requests); cur != NULL;
+            cur = cur->next) {
+        if (((struct prefetch_request *) cur->data)->priority < priority) {
+            break;
+        }
+    }
+    if (cur != NULL) {
+        g_queue_insert_before(ps->requests, cur, req);
+    } else {
+        g_queue_push_tail(ps->requests, req);
+    }
+    g_cond_broadcast(ps->changed);
+    g_mutex_unlock(ps->lock);
+    return true;
+
+bad:
+    g_mutex_unlock(ps->lock);
+    return false;
+}
+
+/* lock must be held. */
+static void cancel_request(struct prefetch_state *ps,
+        struct prefetch_request *req)
+{
+    if (req == ps->current) {
+        /* The worker will clean up when the window completes */
+        req->cancelled = true;
+    } else {
+        finish_request(ps, req, "cancelled");
+    }
+}
+
+/* Returns false if no such request is outstanding. */
+bool _vmnetfs_prefetch_cancel(struct vmnetfs_image *img, uint32_t id)
+{
+    struct prefetch_state *ps = img->prefetch;
+    struct prefetch_request *req;
+    GList *cur;
+    bool ret = false;
+
+    g_mutex_lock(ps->lock);
+    for (cur = g_queue_peek_head_link(ps->requests); cur != NULL;
+            cur = cur->next) {
+        req = cur->data;
+        if (req->id == id && !req->cancelled) {
+            cancel_request(ps, req);
+            ret = true;
+            break;
+        }
+    }
+    g_mutex_unlock(ps->lock);
+    return ret;
+}
+
+void _vmnetfs_prefetch_cancel_all(struct vmnetfs_image *img)
+{
+    struct prefetch_state *ps = img->prefetch;
+    GList *cur;
+    GList *next;
+
+    g_mutex_lock(ps->lock);
+    for (cur = g_queue_peek_head_link(ps->requests); cur != NULL;
+            cur = next) {
+        next = cur->next;
+        cancel_request(ps, cur->data);
+    }
+    g_mutex_unlock(ps->lock);
+}
+
+/* Protect the chunks covering the byte range from eviction by the cache
+   manager, or remove that protection. */
+void _vmnetfs_prefetch_pin(struct vmnetfs_image *img, uint64_t start,
+        uint64_t count, bool pinned)
+{
+    struct vmnetfs_cursor cur;
+
+    /* Only chunks of the pristine image have bits in the map */
+    start = MIN(start, img->initial_size);
+    count = MIN(count, img->initial_size - start);
+
+    for (_vmnetfs_cursor_start(img, &cur, start, count);
+            _vmnetfs_cursor_chunk(&cur, cur.length); ) {
+        if (pinned) {
+            _vmnetfs_bit_set(img->pinned_map, cur.chunk);
+        } else {
+            _vmnetfs_bit_clear(img->pinned_map, cur.chunk);
+        }
+    }
+}
+
+struct vmnetfs_stream_group *_vmnetfs_prefetch_get_stream_group(
+        struct vmnetfs_image *img)
+{
+    return img->prefetch->stream;
+}
+
+bool _vmnetfs_prefetch_is_idle(struct vmnetfs_image *img)
+{
+    struct prefetch_state *ps = img->prefetch;
+    bool ret;
+
+    g_mutex_lock(ps->lock);
+    ret = g_queue_is_empty(ps->requests);
+    g_mutex_unlock(ps->lock);
+    return ret;
+}
+
+/* Cancel outstanding requests and stop the worker after its current
+   window. */
+void _vmnetfs_prefetch_close(struct vmnetfs_image *img)
+{
+    struct prefetch_state *ps = img->prefetch;
+
+    _vmnetfs_prefetch_cancel_all(img);
+    g_mutex_lock(ps->lock);
+    ps->stopped = true;
+    g_cond_broadcast(ps->changed);
+    g_mutex_unlock(ps->lock);
+    _vmnetfs_stream_group_close(ps->stream);
+}
+
+void _vmnetfs_prefetch_destroy(struct vmnetfs_image *img)
+{
+    struct prefetch_state *ps = img->prefetch;
+    struct prefetch_request *req;
+
+    if (ps == NULL) {
+        return;
+    }
+    g_mutex_lock(ps->lock);
+    ps->stopped = true;
+    g_cond_broadcast(ps->changed);
+    g_mutex_unlock(ps->lock);
+    if (ps->thread) {
+        g_thread_join(ps->thread);
+    }
+    while ((req = g_queue_pop_head(ps->requests)) != NULL) {
+        request_free(req);
+    }
+    g_queue_free(ps->requests);
+    _vmnetfs_stream_group_free(ps->stream);
+    g_cond_free(ps->changed);
+    g_mutex_free(ps->lock);
+    g_slice_free(struct prefetch_state, ps);
+    _vmnetfs_bit_free(img->pinned_map);
+    img->prefetch = NULL;
+}
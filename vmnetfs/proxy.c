@@ -0,0 +1,1016 @@
+/*
+ * vmnetfs - virtual machine network execution virtual filesystem
+ *
+ * Copyright (C) 2006-2014 Carnegie Mellon University
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of version 2 of the GNU General Public License as published
+ * by the Free Software Foundation.  A copy of the GNU General Public License
+ * should have been distributed along with this program in the file
+ * COPYING.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ */
+
+/* Caching HTTP proxy, letting the vmnetfs instances on a site share one
+   copy of each chunk fetched across the uplink.
+
+   Clients request
+
+       GET /<origin URL>
+
+   with an optional single byte range.  The first request for a URL
+   looks up its size and validators with a HEAD request to the origin,
+   and sets up a pristine cache for it, keyed by the URL and validators,
+   under the configured directory.  Ranges are served chunk by chunk:
+   cached chunks with sendfile(), and missing ones through the usual
+   fetch engine, so that concurrent requests for a chunk fetch it from
+   the origin only once.  Responses carry the origin's ETag and
+   Last-Modified headers, so clients validate them as if they came from
+   the origin.  The origin is checked again once the validators are
+   REVALIDATE_INTERVAL old; if they have changed, requests are served
+   from a new cache.
+
+   Only http and https URLs on a configured origin, and within its path,
+   are proxied, without credentials or cookies.  URLs with userinfo or
+   dot segments are refused.  Cached data is served to anyone who can
+   reach the proxy, which by default listens only on the loopback
+   address.
+
+   A resource holds its pristine cache open, and thereby locked against
+   eviction, only while it is in the table.  The cache manager calls
+   _vmnetfs_proxy_prune() to drop resources that aren't serving a
+   request. */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <netdb.h>
+#include <inttypes.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <errno.h>
+#include "vmnetfs-private.h"
+
+#define REQUEST_MAX 16384
+#define REVALIDATE_INTERVAL 60  /* seconds */
+
+struct proxy_state {
+    struct vmnetfs *fs;
+    int listen_fd;
+    GThread *thread;
+    struct connection_pool *cpool;
+    GMutex *lock;
+    GList *conns;
+    GHashTable *resources;  /* url -> struct proxy_resource */
+    bool closed;  /* protected by lock */
+    GMutex *setup_lock;  /* serializes creating and revalidating resources */
+    GList *origins;  /* struct proxy_location */
+};
+
+struct proxy_location {
+    char *scheme;  /* lowercase */
+    char *host;  /* lowercase */
+    unsigned port;
+    char **segments;  /* of the path, unescaped */
+};
+
+struct proxy_resource {
+    char *url;
+    struct vmnetfs_image *img;
+    time_t checked;
+    uint32_t refs;  /* protected by proxy lock */
+};
+
+struct proxy_conn {
+    struct proxy_state *ps;
+    int fd;
+    GThread *thread;
+    bool finished;  /* protected by proxy lock */
+    char buf[REQUEST_MAX];
+    size_t len;
+};
+
+struct proxy_request {
+    char *method;
+    char *url;
+    bool keepalive;
+    bool have_range;
+    bool range_suffix;
+    uint64_t first;
+    uint64_t last;  /* UINT64_MAX if open-ended */
+};
+
+static bool send_all(int fd, const void *buf, size_t count)
+{
+    ssize_t ret;
+
+    while (count > 0) {
+        ret = send(fd, buf, count, MSG_NOSIGNAL);
+        if (ret == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        buf += ret;
+        count -= ret;
+    }
+    return true;
+}
+
+static bool send_file(int sock, int fd, off_t offset, size_t count)
+{
+    ssize_t ret;
+
+    while (count > 0) {
+        ret = sendfile(sock, fd, &offset, count);
+        if (ret == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        if (ret == 0) {
+            /* Chunk file is short */
+            return false;
+        }
+        count -= ret;
+    }
+    return true;
+}
+
+static bool send_error(struct proxy_conn *conn, bool keepalive,
+        const char *status, const char *fmt, ...)
+{
+    va_list ap;
+    char *body;
+    char *str;
+    bool ret;
+
+    va_start(ap, fmt);
+    body = g_strdup_vprintf(fmt, ap);
+    va_end(ap);
+    str = g_strdup_printf("HTTP/1.1 %s\r\n"
+            "Content-Type: text/plain\r\n"
+            "Content-Length: %zu\r\n"
+            "%s"
+            "\r\n"
+            "%s\n", status, strlen(body) + 1,
+            keepalive ? "" : "Connection: close\r\n", body);
+    ret = send_all(conn->fd, str, strlen(str));
+    g_free(str);
+    g_free(body);
+    return ret && keepalive;
+}
+
+/* Returns false at EOF, on error, or if the request is too large. */
+static bool read_request(struct proxy_conn *conn, size_t *header_len)
+{
+    char *end;
+    ssize_t ret;
+
+    while (true) {
+        end = memmem(conn->buf, conn->len, "\r\n\r\n", 4);
+        if (end != NULL) {
+            *end = 0;
+            *header_len = end + 4 - conn->buf;
+            return true;
+        }
+        if (conn->len == sizeof(conn->buf)) {
+            return false;
+        }
+        ret = recv(conn->fd, conn->buf + conn->len,
+                sizeof(conn->buf) - conn->len, 0);
+        if (ret == -1 && errno == EINTR) {
+            continue;
+        }
+        if (ret <= 0) {
+            return false;
+        }
+        conn->len += ret;
+    }
+}
+
+/* Accepts "bytes=first-last", "bytes=first-" and "bytes=-count".  Other
+   forms, including multiple ranges, are ignored, as HTTP permits. */
+static void parse_range(struct proxy_request *req, const char *value)
+{
+    const char *p;
+    char *end;
+
+    if (!g_str_has_prefix(value, "bytes=") || strchr(value, ',')) {
+        return;
+    }
+    p = value + strlen("bytes=");
+    if (*p == '-') {
+        req->range_suffix = true;
+        req->first = g_ascii_strtoull(p + 1, &end, 10);
+        req->have_range = end != p + 1 && *end == 0;
+        return;
+    }
+    req->first = g_ascii_strtoull(p, &end, 10);
+    if (end == p || *end != '-') {
+        return;
+    }
+    p = end + 1;
+    if (*p == 0) {
+        req->last = UINT64_MAX;
+    } else {
+        req->last = g_ascii_strtoull(p, &end, 10);
+        if (*end != 0 || req->last < req->first) {
+            return;
+        }
+    }
+    req->have_range = true;
+}
+
+static bool parse_request(char *header, struct proxy_request *req)
+{
+    char **lines;
+    char **parts;
+    char *value;
+    bool ret = false;
+    int i;
+
+    memset(req, 0, sizeof(*req));
+    lines = g_strsplit(header, "\r\n", 0);
+    parts = g_strsplit(lines[0], " ", 0);
+    if (g_strv_length(parts) != 3 || parts[1][0] != '/' ||
+            !g_str_has_prefix(parts[2], "HTTP/1.")) {
+        goto out;
+    }
+    req->method = g_strdup(parts[0]);
+    req->url = g_strdup(parts[1] + 1);
+    req->keepalive = strcmp(parts[2], "HTTP/1.0") != 0;
+    for (i = 1; lines[i] != NULL; i++) {
+        value = strchr(lines[i], ':');
+        if (value == NULL) {
+            continue;
+        }
+        *value++ = 0;
+        g_strstrip(value);
+        if (!g_ascii_strcasecmp(lines[i], "Range")) {
+            parse_range(req, value);
+        } else if (!g_ascii_strcasecmp(lines[i], "Connection")) {
+            if (!g_ascii_strcasecmp(value, "close")) {
+                req->keepalive = false;
+            } else if (!g_ascii_strcasecmp(value, "keep-alive")) {
+                req->keepalive = true;
+            }
+        }
+    }
+    ret = true;
+out:
+    g_strfreev(parts);
+    g_strfreev(lines);
+    return ret;
+}
+
+static void request_free(struct proxy_request *req)
+{
+    g_free(req->method);
+    g_free(req->url);
+}
+
+static void resource_free(struct proxy_state *ps, struct proxy_resource *res)
+{
+    _vmnetfs_proxy_origin_put(ps->fs, res->img);
+    g_free(res->url);
+    g_slice_free(struct proxy_resource, res);
+}
+
+static void resource_put(struct proxy_state *ps, struct proxy_resource *res)
+{
+    bool release;
+
+    g_mutex_lock(ps->lock);
+    release = --res->refs == 0;
+    g_mutex_unlock(ps->lock);
+    if (release) {
+        resource_free(ps, res);
+    }
+}
+
+/* Returns a reference to the resource if its validators are fresh.
+   proxy lock must be held. */
+static struct proxy_resource *resource_lookup(struct proxy_state *ps,
+        const char *url)
+{
+    struct proxy_resource *res;
+
+    res = g_hash_table_lookup(ps->resources, url);
+    if (res == NULL || time(NULL) - res->checked >= REVALIDATE_INTERVAL) {
+        return NULL;
+    }
+    res->refs++;
+    return res;
+}
+
+static char *get_read_base(struct proxy_state *ps, const char *url,
+        const char *etag, time_t last_modified)
+{
+    char *key;
+    char *hash;
+    char *path;
+
+    key = g_strdup_printf("%s\n%s\n%"PRIu64, url, etag ? etag : "",
+            (uint64_t) last_modified);
+    hash = g_compute_checksum_for_string(G_CHECKSUM_SHA256, key, -1);
+    path = g_strdup_printf("%s/%s/%u", ps->fs->proxy_path, hash,
+            ps->fs->proxy_chunk_size);
+    g_free(hash);
+    g_free(key);
+    return path;
+}
+
+/* Returns a reference to the resource, checking the origin if we
+   haven't recently. */
+static struct proxy_resource *resource_get(struct proxy_state *ps,
+        const char *url, GError **err)
+{
+    struct proxy_resource *res;
+    struct proxy_resource *old;
+    struct vmnetfs_image *img;
+    char *read_base;
+    char *etag;
+    time_t last_modified;
+    uint64_t size;
+
+    g_mutex_lock(ps->lock);
+    res = resource_lookup(ps, url);
+    g_mutex_unlock(ps->lock);
+    if (res != NULL) {
+        return res;
+    }
+
+    g_mutex_lock(ps->setup_lock);
+    g_mutex_lock(ps->lock);
+    /* Someone may have checked while we waited */
+    res = resource_lookup(ps, url);
+    old = g_hash_table_lookup(ps->resources, url);
+    g_mutex_unlock(ps->lock);
+    if (res != NULL) {
+        g_mutex_unlock(ps->setup_lock);
+        return res;
+    }
+
+    if (!_vmnetfs_transport_get_info(ps->cpool, url, &size, &etag,
+            &last_modified, err)) {
+        g_mutex_unlock(ps->setup_lock);
+        return NULL;
+    }
+    if (old != NULL && old->img->initial_size == size &&
+            !g_strcmp0(old->img->etag, etag) &&
+            old->img->last_modified == last_modified) {
+        /* Unchanged */
+        g_mutex_lock(ps->lock);
+        old->checked = time(NULL);
+        old->refs++;
+        g_mutex_unlock(ps->lock);
+        g_mutex_unlock(ps->setup_lock);
+        g_free(etag);
+        return old;
+    }
+
+    read_base = get_read_base(ps, url, etag, last_modified);
+    img = _vmnetfs_proxy_origin_get(ps->fs, url, read_base, size,
+            ps->fs->proxy_chunk_size, etag, last_modified, err);
+    g_free(read_base);
+    g_free(etag);
+    if (img == NULL) {
+        g_mutex_unlock(ps->setup_lock);
+        return NULL;
+    }
+    res = g_slice_new0(struct proxy_resource);
+    res->url = g_strdup(url);
+    res->img = img;
+    res->checked = time(NULL);
+    res->refs = 2;  /* table and caller */
+    g_mutex_lock(ps->lock);
+    g_hash_table_replace(ps->resources, res->url, res);
+    g_mutex_unlock(ps->lock);
+    g_mutex_unlock(ps->setup_lock);
+    if (old != NULL) {
+        /* Drop the table's reference */
+        resource_put(ps, old);
+    }
+    return res;
+}
+
+/* Invalidate the resource's validators, so the next request checks the
+   origin. */
+static void resource_mark_stale(struct proxy_state *ps,
+        struct proxy_resource *res)
+{
+    g_mutex_lock(ps->lock);
+    res->checked = 0;
+    g_mutex_unlock(ps->lock);
+}
+
+static void location_free(struct proxy_location *loc)
+{
+    g_free(loc->scheme);
+    g_free(loc->host);
+    g_strfreev(loc->segments);
+    g_slice_free(struct proxy_location, loc);
+}
+
+/* Split an http or https URL into its parts, or return NULL.  URLs with
+   userinfo or dot segments are rejected, since they may name a
+   different resource than they appear to. */
+static struct proxy_location *location_parse(const char *url)
+{
+    struct proxy_location *loc;
+    GPtrArray *segments;
+    const char *host;
+    const char *host_end;
+    const char *port;
+    const char *path;
+    const char *path_end;
+    const char *cur;
+    const char *next;
+    char *scheme;
+    char *segment;
+    char *end;
+    guint64 port_num;
+
+    loc = g_slice_new0(struct proxy_location);
+    segments = g_ptr_array_new();
+
+    scheme = g_uri_parse_scheme(url);
+    if (scheme == NULL) {
+        goto bad;
+    }
+    loc->scheme = g_ascii_strdown(scheme, -1);
+    host = url + strlen(scheme) + 1;
+    g_free(scheme);
+    if (!strcmp(loc->scheme, "http")) {
+        loc->port = 80;
+    } else if (!strcmp(loc->scheme, "https")) {
+        loc->port = 443;
+    } else {
+        goto bad;
+    }
+
+    /* Authority */
+    if (!g_str_has_prefix(host, "//")) {
+        goto bad;
+    }
+    host += 2;
+    path = host + strcspn(host, "/?#");
+    if (memchr(host, '@', path - host) || memchr(host, '%', path - host)) {
+        goto bad;
+    }
+    if (*host == '[') {
+        host_end = memchr(host, ']', path - host);
+        if (host_end == NULL) {
+            goto bad;
+        }
+        host_end++;
+    } else {
+        host_end = memchr(host, ':', path - host);
+        if (host_end == NULL) {
+            host_end = path;
+        }
+    }
+    if (host_end == host) {
+        goto bad;
+    }
+    loc->host = g_ascii_strdown(host, host_end - host);
+    if (host_end < path) {
+        port = host_end + 1;
+        if (*host_end != ':' || port == path ||
+                strspn(port, "0123456789") != (size_t) (path - port)) {
+            goto bad;
+        }
+        port_num = g_ascii_strtoull(port, &end, 10);
+        if (port_num == 0 || port_num > 65535) {
+            goto bad;
+        }
+        loc->port = port_num;
+    }
+
+    /* Path segments, unescaped, without the empty one after a trailing
+       slash */
+    path_end = path + strcspn(path, "?#");
+    for (cur = path; cur < path_end; cur = next) {
+        cur++;
+        next = memchr(cur, '/', path_end - cur);
+        if (next == NULL) {
+            next = path_end;
+        }
+        if (next == cur && next == path_end) {
+            break;
+        }
+        segment = g_strndup(cur, next - cur);
+        g_ptr_array_add(segments, g_uri_unescape_string(segment, "/"));
+        g_free(segment);
+        segment = g_ptr_array_index(segments, segments->len - 1);
+        if (segment == NULL || !strcmp(segment, ".") ||
+                !strcmp(segment, "..")) {
+            goto bad;
+        }
+    }
+    g_ptr_array_add(segments, NULL);
+    loc->segments = (char **) g_ptr_array_free(segments, FALSE);
+    return loc;
+
+bad:
+    g_ptr_array_add(segments, NULL);
+    loc->segments = (char **) g_ptr_array_free(segments, FALSE);
+    location_free(loc);
+    return NULL;
+}
+
+/* Whether @url is the same origin as one of the configured ones, and its
+   path is under that origin's path. */
+static bool origin_allowed(struct proxy_state *ps, const char *url)
+{
+    struct proxy_location *loc;
+    struct proxy_location *origin;
+    GList *cur;
+    bool ret = false;
+    int i;
+
+    loc = location_parse(url);
+    if (loc == NULL) {
+        return false;
+    }
+    for (cur = ps->origins; cur != NULL && !ret; cur = cur->next) {
+        origin = cur->data;
+        if (strcmp(loc->scheme, origin->scheme) ||
+                strcmp(loc->host, origin->host) ||
+                loc->port != origin->port) {
+            continue;
+        }
+        for (i = 0; origin->segments[i] != NULL; i++) {
+            if (loc->segments[i] == NULL ||
+                    strcmp(loc->segments[i], origin->segments[i])) {
+                break;
+            }
+        }
+        ret = origin->segments[i] == NULL;
+    }
+    location_free(loc);
+    return ret;
+}
+
+/* Send part of a chunk, from wherever it can be found.  On failure,
+   headers have already been sent, so the caller must drop the
+   connection. */
+static bool send_chunk(struct proxy_conn *conn, struct vmnetfs_image *img,
+        void *buf, uint64_t chunk, uint32_t offset, uint32_t length,
+        GError **err)
+{
+    GError *my_err = NULL;
+    bool ret;
+    int fd;
+
+    if (_vmnetfs_writeback_read_chunk(img, buf, chunk, offset, length)) {
+        return send_all(conn->fd, buf, length);
+    }
+    if (_vmnetfs_bit_test(img->present_map, chunk) ||
+            _vmnetfs_ll_pristine_adopt_chunk(img, chunk)) {
+        if (_vmnetfs_bit_test(img->compressed_map, chunk)) {
+            if (_vmnetfs_ll_pristine_read_chunk(img, buf, chunk, offset,
+                    length, &my_err)) {
+                return send_all(conn->fd, buf, length);
+            }
+        } else {
+            fd = _vmnetfs_ll_pristine_open_chunk(img, chunk, &my_err);
+            if (fd != -1) {
+                ret = send_file(conn->fd, fd, offset, length);
+                close(fd);
+                return ret;
+            }
+        }
+        if (!g_error_matches(my_err, G_FILE_ERROR, G_FILE_ERROR_NOENT)) {
+            g_propagate_error(err, my_err);
+            return false;
+        }
+        /* Evicted behind our back */
+        g_clear_error(&my_err);
+        _vmnetfs_bit_clear(img->present_map, chunk);
+        _vmnetfs_bit_clear(img->compressed_map, chunk);
+    }
+    if (!_vmnetfs_fetch_chunk(img, buf, chunk, offset, length,
+            FETCH_PRIORITY_DEMAND, err)) {
+        return false;
+    }
+    return send_all(conn->fd, buf, length);
+}
+
+static void format_http_date(char *buf, size_t len, time_t t)
+{
+    struct tm tm;
+
+    gmtime_r(&t, &tm);
+    strftime(buf, len, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+}
+
+/* Returns false if the connection should be dropped. */
+static bool handle_request(struct proxy_conn *conn,
+        struct proxy_request *req)
+{
+    struct proxy_resource *res;
+    struct vmnetfs_image *img;
+    GString *hdr;
+    char date[64];
+    uint64_t start;
+    uint64_t end;  /* exclusive */
+    uint64_t size;
+    uint64_t chunk;
+    uint32_t offset;
+    uint32_t length;
+    void *buf;
+    bool head;
+    bool ret = true;
+    GError *err = NULL;
+
+    head = !strcmp(req->method, "HEAD");
+    if (!head && strcmp(req->method, "GET")) {
+        return send_error(conn, req->keepalive, "405 Method Not Allowed",
+                "Only GET and HEAD are supported");
+    }
+    if (!g_str_has_prefix(req->url, "http://") &&
+            !g_str_has_prefix(req->url, "https://")) {
+        return send_error(conn, req->keepalive, "404 Not Found",
+                "Not an http or https URL");
+    }
+    if (!origin_allowed(conn->ps, req->url)) {
+        return send_error(conn, req->keepalive, "403 Forbidden",
+                "Origin not allowed");
+    }
+    res = resource_get(conn->ps, req->url, &err);
+    if (res == NULL) {
+        ret = send_error(conn, req->keepalive, "502 Bad Gateway",
+                "%s", err->message);
+        g_clear_error(&err);
+        return ret;
+    }
+    img = res->img;
+    size = img->initial_size;
+
+    start = 0;
+    end = size;
+    if (req->have_range) {
+        if (req->range_suffix) {
+            start = size - MIN(req->first, size);
+        } else {
+            start = req->first;
+            end = MIN(req->last, size - 1) + 1;
+        }
+        if (start >= size || (req->range_suffix && req->first == 0)) {
+            hdr = g_string_new("HTTP/1.1 416 Range Not Satisfiable\r\n");
+            g_string_append_printf(hdr, "Content-Range: bytes */%"PRIu64
+                    "\r\n", size);
+            g_string_append(hdr, "Content-Length: 0\r\n");
+            if (!req->keepalive) {
+                g_string_append(hdr, "Connection: close\r\n");
+            }
+            g_string_append(hdr, "\r\n");
+            ret = send_all(conn->fd, hdr->str, hdr->len) && req->keepalive;
+            g_string_free(hdr, TRUE);
+            resource_put(conn->ps, res);
+            return ret;
+        }
+    }
+
+    if (req->have_range) {
+        hdr = g_string_new("HTTP/1.1 206 Partial Content\r\n");
+        g_string_append_printf(hdr, "Content-Range: bytes %"PRIu64"-%"
+                PRIu64"/%"PRIu64"\r\n", start, end - 1, size);
+    } else {
+        hdr = g_string_new("HTTP/1.1 200 OK\r\n");
+    }
+    g_string_append_printf(hdr, "Content-Length: %"PRIu64"\r\n",
+            end - start);
+    g_string_append(hdr, "Accept-Ranges: bytes\r\n");
+    if (img->etag != NULL) {
+        g_string_append_printf(hdr, "ETag: %s\r\n", img->etag);
+    }
+    if (img->last_modified) {
+        format_http_date(date, sizeof(date), img->last_modified);
+        g_string_append_printf(hdr, "Last-Modified: %s\r\n", date);
+    }
+    if (!req->keepalive) {
+        g_string_append(hdr, "Connection: close\r\n");
+    }
+    g_string_append(hdr, "\r\n");
+    ret = send_all(conn->fd, hdr->str, hdr->len);
+    g_string_free(hdr, TRUE);
+
+    if (ret && !head) {
+        buf = _vmnetfs_pool_get(img);
+        while (start < end) {
+            chunk = start / img->chunk_size;
+            offset = start - chunk * img->chunk_size;
+            length = MIN(end - start, img->chunk_size - offset);
+            if (!send_chunk(conn, img, buf, chunk, offset, length, &err)) {
+                if (err != NULL) {
+                    g_warning("Couldn't proxy chunk %"PRIu64" of %s: %s",
+                            chunk, res->url, err->message);
+                    if (err->domain == VMNETFS_TRANSPORT_ERROR) {
+                        /* Perhaps the origin has changed */
+                        resource_mark_stale(conn->ps, res);
+                    }
+                    g_clear_error(&err);
+                }
+                ret = false;
+                break;
+            }
+            start += length;
+        }
+        _vmnetfs_pool_put(img, buf);
+    }
+    resource_put(conn->ps, res);
+    return ret && req->keepalive;
+}
+
+static void *conn_thread(void *data)
+{
+    struct proxy_conn *conn = data;
+    struct proxy_state *ps = conn->ps;
+    struct proxy_request req;
+    size_t header_len;
+    bool ok;
+
+    while (read_request(conn, &header_len)) {
+        if (parse_request(conn->buf, &req)) {
+            ok = handle_request(conn, &req);
+            request_free(&req);
+        } else {
+            send_error(conn, false, "400 Bad Request", "Bad request");
+            ok = false;
+        }
+        if (!ok) {
+            break;
+        }
+        /* Keep any pipelined request */
+        memmove(conn->buf, conn->buf + header_len, conn->len - header_len);
+        conn->len -= header_len;
+    }
+    shutdown(conn->fd, SHUT_RDWR);
+
+    g_mutex_lock(ps->lock);
+    conn->finished = true;
+    g_mutex_unlock(ps->lock);
+    return NULL;
+}
+
+static void conn_free(struct proxy_conn *conn)
+{
+    g_thread_join(conn->thread);
+    close(conn->fd);
+    g_slice_free(struct proxy_conn, conn);
+}
+
+/* proxy lock must be held. */
+static void reap_conns(struct proxy_state *ps)
+{
+    struct proxy_conn *conn;
+    GList *cur;
+    GList *next;
+
+    for (cur = ps->conns; cur != NULL; cur = next) {
+        next = cur->next;
+        conn = cur->data;
+        if (conn->finished) {
+            ps->conns = g_list_delete_link(ps->conns, cur);
+            conn_free(conn);
+        }
+    }
+}
+
+static void *accept_thread(void *data)
+{
+    struct proxy_state *ps = data;
+    struct proxy_conn *conn;
+    GError *err = NULL;
+    int fd;
+
+    while (true) {
+        fd = accept4(ps->listen_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (fd == -1) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            break;
+        }
+        g_mutex_lock(ps->lock);
+        reap_conns(ps);
+        if (ps->closed) {
+            g_mutex_unlock(ps->lock);
+            close(fd);
+            break;
+        }
+        conn = g_slice_new0(struct proxy_conn);
+        conn->ps = ps;
+        conn->fd = fd;
+        conn->thread = g_thread_create(conn_thread, conn, TRUE, &err);
+        if (conn->thread == NULL) {
+            g_warning("Couldn't start proxy connection: %s", err->message);
+            g_clear_error(&err);
+            close(fd);
+            g_slice_free(struct proxy_conn, conn);
+        } else {
+            ps->conns = g_list_prepend(ps->conns, conn);
+        }
+        g_mutex_unlock(ps->lock);
+    }
+    return NULL;
+}
+
+static int listen_tcp(const char *address, const char *port, GError **err)
+{
+    /* Without AI_PASSIVE, a NULL address resolves to loopback */
+    struct addrinfo hints = {
+        .ai_family = AF_UNSPEC,
+        .ai_socktype = SOCK_STREAM,
+    };
+    struct addrinfo *info;
+    struct addrinfo *cur;
+    int one = 1;
+    int fd = -1;
+    int ret;
+
+    ret = getaddrinfo(address, port, &hints, &info);
+    if (ret) {
+        g_set_error(err, VMNETFS_CONFIG_ERROR,
+                VMNETFS_CONFIG_ERROR_INVALID_CONFIG,
+                "Couldn't resolve proxy address: %s", gai_strerror(ret));
+        return -1;
+    }
+    for (cur = info; cur != NULL; cur = cur->ai_next) {
+        fd = socket(cur->ai_family, cur->ai_socktype | SOCK_CLOEXEC,
+                cur->ai_protocol);
+        if (fd == -1) {
+            continue;
+        }
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if (!bind(fd, cur->ai_addr, cur->ai_addrlen) && !listen(fd, 64)) {
+            break;
+        }
+        close(fd);
+        fd = -1;
+    }
+    if (fd == -1) {
+        g_set_error(err, G_FILE_ERROR, g_file_error_from_errno(errno),
+                "Couldn't listen on proxy port %s: %s", port,
+                strerror(errno));
+    }
+    freeaddrinfo(info);
+    return fd;
+}
+
+static void free_origins(struct proxy_state *ps)
+{
+    while (ps->origins != NULL) {
+        location_free(ps->origins->data);
+        ps->origins = g_list_delete_link(ps->origins, ps->origins);
+    }
+}
+
+bool _vmnetfs_proxy_init(struct vmnetfs *fs, GError **err)
+{
+    struct proxy_state *ps;
+    struct proxy_location *origin;
+    GList *cur;
+
+    if (fs->proxy_port == NULL) {
+        return true;
+    }
+    ps = g_slice_new0(struct proxy_state);
+    ps->fs = fs;
+    for (cur = fs->proxy_origins; cur != NULL; cur = cur->next) {
+        origin = location_parse(cur->data);
+        if (origin == NULL) {
+            g_set_error(err, VMNETFS_CONFIG_ERROR,
+                    VMNETFS_CONFIG_ERROR_INVALID_CONFIG,
+                    "Invalid proxy origin: %s", (char *) cur->data);
+            goto bad_free;
+        }
+        ps->origins = g_list_prepend(ps->origins, origin);
+    }
+    ps->listen_fd = listen_tcp(fs->proxy_address, fs->proxy_port, err);
+    if (ps->listen_fd == -1) {
+        goto bad_free;
+    }
+    ps->cpool = _vmnetfs_transport_pool_new(err);
+    if (ps->cpool == NULL) {
+        goto bad_close;
+    }
+    ps->lock = g_mutex_new();
+    ps->setup_lock = g_mutex_new();
+    ps->resources = g_hash_table_new(g_str_hash, g_str_equal);
+    ps->thread = g_thread_create(accept_thread, ps, TRUE, err);
+    if (ps->thread == NULL) {
+        g_hash_table_destroy(ps->resources);
+        g_mutex_free(ps->setup_lock);
+        g_mutex_free(ps->lock);
+        _vmnetfs_transport_pool_free(ps->cpool);
+        goto bad_close;
+    }
+    /* Read by the cache manager */
+    g_atomic_pointer_set(&fs->proxy, ps);
+    return true;
+
+bad_close:
+    close(ps->listen_fd);
+bad_free:
+    free_origins(ps);
+    g_slice_free(struct proxy_state, ps);
+    return false;
+}
+
+/* Stop accepting requests and disconnect clients. */
+void _vmnetfs_proxy_close(struct vmnetfs *fs)
+{
+    struct proxy_state *ps = fs->proxy;
+    struct proxy_conn *conn;
+    GList *cur;
+
+    if (ps == NULL) {
+        return;
+    }
+    g_mutex_lock(ps->lock);
+    ps->closed = true;
+    shutdown(ps->listen_fd, SHUT_RDWR);
+    for (cur = ps->conns; cur != NULL; cur = cur->next) {
+        conn = cur->data;
+        shutdown(conn->fd, SHUT_RDWR);
+    }
+    g_mutex_unlock(ps->lock);
+}
+
+/* Waits for requests in progress, which may be waiting for fetches. */
+void _vmnetfs_proxy_destroy(struct vmnetfs *fs)
+{
+    struct proxy_state *ps = fs->proxy;
+    GHashTableIter iter;
+    void *value;
+
+    if (ps == NULL) {
+        return;
+    }
+    _vmnetfs_proxy_close(fs);
+    g_thread_join(ps->thread);
+    while (ps->conns != NULL) {
+        conn_free(ps->conns->data);
+        ps->conns = g_list_delete_link(ps->conns, ps->conns);
+    }
+    /* Connections are gone, so the table holds the last references */
+    g_hash_table_iter_init(&iter, ps->resources);
+    while (g_hash_table_iter_next(&iter, NULL, &value)) {
+        g_hash_table_iter_steal(&iter);
+        resource_put(ps, value);
+    }
+    g_hash_table_destroy(ps->resources);
+    close(ps->listen_fd);
+    _vmnetfs_transport_pool_free(ps->cpool);
+    g_mutex_free(ps->setup_lock);
+    g_mutex_free(ps->lock);
+    free_origins(ps);
+    g_slice_free(struct proxy_state, ps);
+    fs->proxy = NULL;
+}
+
+/* Drop resources that aren't serving a request, so that the cache
+   manager can evict from their caches.  The next request for one checks
+   the origin again. */
+void _vmnetfs_proxy_prune(struct vmnetfs *fs)
+{
+    struct proxy_state *ps = g_atomic_pointer_get(&fs->proxy);
+    struct proxy_resource *res;
+    GHashTableIter iter;
+    GSList *idle = NULL;
+    void *value;
+
+    if (ps == NULL) {
+        return;
+    }
+    /* resource_get() uses the old resource under the setup lock */
+    g_mutex_lock(ps->setup_lock);
+    g_mutex_lock(ps->lock);
+    g_hash_table_iter_init(&iter, ps->resources);
+    while (g_hash_table_iter_next(&iter, NULL, &value)) {
+        res = value;
+        if (res->refs == 1) {
+            g_hash_table_iter_steal(&iter);
+            idle = g_slist_prepend(idle, res);
+        }
+    }
+    g_mutex_unlock(ps->lock);
+    g_mutex_unlock(ps->setup_lock);
+    while (idle != NULL) {
+        resource_put(ps, idle->data);
+        idle = g_slist_delete_link(idle, idle);
+    }
+}
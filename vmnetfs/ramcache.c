@@ -0,0 +1,319 @@
+/*
+ * vmnetfs - virtual machine network execution virtual filesystem
+ *
+ * Copyright (C) 2006-2014 Carnegie Mellon University
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of version 2 of the GNU General Public License as published
+ * by the Free Software Foundation.  A copy of the GNU General Public License
+ * should have been distributed along with this program in the file
+ * COPYING.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ */
+
+/* Since the image is mounted with direct_io, the kernel never caches image
+   data, so we keep recently read chunks in memory ourselves.  Replacement
+   follows ARC (Megiddo and Modha, FAST '03): T1 holds chunks seen once
+   recently and T2 chunks seen at least twice, while the ghost lists B1
+   and B2 remember the chunk numbers recently evicted from each.  Ghost
+   hits adapt the target size of T1, so a sequential scan of the image
+   can't flush the chunks the guest keeps coming back to.
+
+   An entry holds either the pristine or the modified contents of its
+   chunk, and only satisfies reads from the same layer.  Callers must
+   hold the chunk lock, and must invalidate the chunk whenever they
+   change its modified contents. */
+
+#include <string.h>
+#include "vmnetfs-private.h"
+
+enum arc_list {
+    ARC_T1,
+    ARC_T2,
+    ARC_B1,
+    ARC_B2,
+    ARC_LISTS,
+};
+
+struct ram_cache {
+    GMutex *lock;
+    GHashTable *entries;
+    GQueue lists[ARC_LISTS];  /* head is most recently used */
+    uint64_t capacity;  /* chunks */
+    uint64_t target;  /* target length of T1 */
+};
+
+struct ram_entry {
+    uint64_t chunk;
+    enum arc_list list;
+    GList *link;
+    char *data;  /* NULL if on a ghost list */
+    uint32_t length;
+    bool modified;
+};
+
+static uint64_t list_length(struct ram_cache *rc, enum arc_list list)
+{
+    return g_queue_get_length(&rc->lists[list]);
+}
+
+static uint64_t resident(struct ram_cache *rc)
+{
+    return list_length(rc, ARC_T1) + list_length(rc, ARC_T2);
+}
+
+static void move_entry(struct ram_cache *rc, struct ram_entry *ent,
+        enum arc_list list)
+{
+    g_queue_unlink(&rc->lists[ent->list], ent->link);
+    g_queue_push_head_link(&rc->lists[list], ent->link);
+    ent->list = list;
+}
+
+/* Does not remove the entry from the hash table. */
+static void free_entry(struct ram_cache *rc, struct ram_entry *ent)
+{
+    g_queue_unlink(&rc->lists[ent->list], ent->link);
+    g_list_free_1(ent->link);
+    g_free(ent->data);
+    g_slice_free(struct ram_entry, ent);
+}
+
+static void remove_entry(struct ram_cache *rc, struct ram_entry *ent)
+{
+    g_hash_table_remove(rc->entries, &ent->chunk);
+    free_entry(rc, ent);
+}
+
+/* Demote the LRU entry of T1 or T2 to the corresponding ghost list and
+   return its buffer for reuse. */
+static char *replace(struct vmnetfs_image *img, bool in_b2)
+{
+    struct ram_cache *rc = img->ram_cache;
+    struct ram_entry *ent;
+    uint64_t t1 = list_length(rc, ARC_T1);
+    char *buf;
+
+    if (t1 > 0 && (t1 > rc->target || (in_b2 && t1 == rc->target))) {
+        ent = g_queue_peek_tail(&rc->lists[ARC_T1]);
+        move_entry(rc, ent, ARC_B1);
+    } else {
+        ent = g_queue_peek_tail(&rc->lists[ARC_T2]);
+        if (ent == NULL) {
+            return NULL;
+        }
+        move_entry(rc, ent, ARC_B2);
+    }
+    buf = ent->data;
+    ent->data = NULL;
+    _vmnetfs_u64_stat_increment(img->ram_cache_evictions, 1);
+    return buf;
+}
+
+void _vmnetfs_ramcache_init(struct vmnetfs_image *img)
+{
+    struct ram_cache *rc;
+    int i;
+
+    if (img->ram_cache_size / img->chunk_size == 0) {
+        return;
+    }
+    rc = g_slice_new0(struct ram_cache);
+    rc->lock = g_mutex_new();
+    rc->entries = g_hash_table_new(g_int64_hash, g_int64_equal);
+    for (i = 0; i < ARC_LISTS; i++) {
+        g_queue_init(&rc->lists[i]);
+    }
+    rc->capacity = img->ram_cache_size / img->chunk_size;
+    img->ram_cache = rc;
+}
+
+static gboolean free_one(void *key G_GNUC_UNUSED, void *value, void *data)
+{
+    free_entry(data, value);
+    return TRUE;
+}
+
+void _vmnetfs_ramcache_destroy(struct vmnetfs_image *img)
+{
+    struct ram_cache *rc = img->ram_cache;
+
+    if (rc == NULL) {
+        return;
+    }
+    g_hash_table_foreach_remove(rc->entries, free_one, rc);
+    g_hash_table_destroy(rc->entries);
+    g_mutex_free(rc->lock);
+    g_slice_free(struct ram_cache, rc);
+}
+
+bool _vmnetfs_ramcache_enabled(struct vmnetfs_image *img)
+{
+    return img->ram_cache != NULL;
+}
+
+/* Returns true if the requested range of the chunk's pristine or modified
+   contents was in the cache.  chunk lock must be held. */
+bool _vmnetfs_ramcache_read(struct vmnetfs_image *img, void *data,
+        uint64_t chunk, bool modified, uint32_t offset, uint32_t length)
+{
+    struct ram_cache *rc = img->ram_cache;
+    struct ram_entry *ent;
+    bool hit;
+
+    if (rc == NULL) {
+        return false;
+    }
+    g_mutex_lock(rc->lock);
+    ent = g_hash_table_lookup(rc->entries, &chunk);
+    hit = ent != NULL && ent->data != NULL && ent->modified == modified &&
+            offset + length <= ent->length;
+    if (hit) {
+        memcpy(data, ent->data + offset, length);
+        move_entry(rc, ent, ARC_T2);
+    }
+    g_mutex_unlock(rc->lock);
+    _vmnetfs_u64_stat_increment(hit ? img->ram_cache_hits :
+            img->ram_cache_misses, 1);
+    return hit;
+}
+
+/* Cache the first @length bytes of the chunk's pristine or modified
+   contents after a miss.  chunk lock must be held. */
+void _vmnetfs_ramcache_insert(struct vmnetfs_image *img, const void *data,
+        uint64_t chunk, bool modified, uint32_t length)
+{
+    struct ram_cache *rc = img->ram_cache;
+    struct ram_entry *ent;
+    uint64_t b1;
+    uint64_t b2;
+    uint64_t delta;
+    uint64_t t1_b1;
+    uint64_t total;
+    char *buf = NULL;
+
+    if (rc == NULL) {
+        return;
+    }
+    g_mutex_lock(rc->lock);
+    ent = g_hash_table_lookup(rc->entries, &chunk);
+    b1 = list_length(rc, ARC_B1);
+    b2 = list_length(rc, ARC_B2);
+    if (ent != NULL && ent->data != NULL) {
+        /* Cached from the other layer */
+        buf = ent->data;
+        move_entry(rc, ent, ARC_T2);
+    } else if (ent != NULL && ent->list == ARC_B1) {
+        /* Recently evicted after one use; favor recency */
+        delta = MAX(b2 / b1, 1);
+        rc->target = MIN(rc->target + delta, rc->capacity);
+        if (resident(rc) >= rc->capacity) {
+            buf = replace(img, false);
+        }
+        move_entry(rc, ent, ARC_T2);
+    } else if (ent != NULL) {
+        /* Recently evicted from T2; favor frequency */
+        delta = MAX(b1 / b2, 1);
+        rc->target = rc->target > delta ? rc->target - delta : 0;
+        if (resident(rc) >= rc->capacity) {
+            buf = replace(img, true);
+        }
+        move_entry(rc, ent, ARC_T2);
+    } else {
+        t1_b1 = list_length(rc, ARC_T1) + b1;
+        total = t1_b1 + list_length(rc, ARC_T2) + b2;
+        if (t1_b1 >= rc->capacity) {
+            if (b1 > 0) {
+                remove_entry(rc, g_queue_peek_tail(&rc->lists[ARC_B1]));
+                if (resident(rc) >= rc->capacity) {
+                    buf = replace(img, false);
+                }
+            } else {
+                /* T1 fills the cache; drop its LRU entry entirely */
+                ent = g_queue_peek_tail(&rc->lists[ARC_T1]);
+                buf = ent->data;
+                ent->data = NULL;
+                remove_entry(rc, ent);
+                _vmnetfs_u64_stat_increment(img->ram_cache_evictions, 1);
+            }
+        } else if (total >= rc->capacity) {
+            if (total >= 2 * rc->capacity) {
+                remove_entry(rc, g_queue_peek_tail(&rc->lists[ARC_B2]));
+            }
+            if (resident(rc) >= rc->capacity) {
+                buf = replace(img, false);
+            }
+        }
+        ent = g_slice_new0(struct ram_entry);
+        ent->chunk = chunk;
+        ent->list = ARC_T1;
+        ent->link = g_list_alloc();
+        ent->link->data = ent;
+        g_queue_push_head_link(&rc->lists[ARC_T1], ent->link);
+        g_hash_table_replace(rc->entries, &ent->chunk, ent);
+    }
+    if (buf == NULL) {
+        buf = g_malloc(img->chunk_size);
+    }
+    memcpy(buf, data, length);
+    ent->data = buf;
+    ent->length = length;
+    ent->modified = modified;
+    g_mutex_unlock(rc->lock);
+}
+
+/* Forget the chunk.  chunk lock must be held. */
+void _vmnetfs_ramcache_invalidate(struct vmnetfs_image *img, uint64_t chunk)
+{
+    struct ram_cache *rc = img->ram_cache;
+    struct ram_entry *ent;
+
+    if (rc == NULL) {
+        return;
+    }
+    g_mutex_lock(rc->lock);
+    ent = g_hash_table_lookup(rc->entries, &chunk);
+    if (ent != NULL) {
+        remove_entry(rc, ent);
+    }
+    g_mutex_unlock(rc->lock);
+}
+
+struct truncate_args {
+    struct ram_cache *rc;
+    uint64_t first_chunk;
+};
+
+static gboolean truncated(void *key G_GNUC_UNUSED, void *value, void *data)
+{
+    struct ram_entry *ent = value;
+    struct truncate_args *args = data;
+
+    if (ent->chunk < args->first_chunk) {
+        return FALSE;
+    }
+    free_entry(args->rc, ent);
+    return TRUE;
+}
+
+/* Forget @first_chunk and every chunk after it, after a change in image
+   size. */
+void _vmnetfs_ramcache_truncate(struct vmnetfs_image *img,
+        uint64_t first_chunk)
+{
+    struct truncate_args args = {
+        .rc = img->ram_cache,
+        .first_chunk = first_chunk,
+    };
+
+    if (args.rc == NULL) {
+        return;
+    }
+    g_mutex_lock(args.rc->lock);
+    g_hash_table_foreach_remove(args.rc->entries, truncated, &args);
+    g_mutex_unlock(args.rc->lock);
+}
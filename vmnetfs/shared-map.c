@@ -0,0 +1,278 @@
+/*
+ * vmnetfs - virtual machine network execution virtual filesystem
+ *
+ * Copyright (C) 2006-2014 Carnegie Mellon University
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of version 2 of the GNU General Public License as published
+ * by the Free Software Foundation.  A copy of the GNU General Public License
+ * should have been distributed along with this program in the file
+ * COPYING.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ */
+
+/* Present map shared between vmnetfs processes using the same pristine
+   cache.
+
+   Each pristine cache directory contains a "present" file, which every
+   process using the cache maps into memory.  After a header page, it
+   holds one bit per chunk, set with atomic operations once the chunk
+   file has been written and cleared before it is removed.  A bit may be
+   stale if a process dies or the cache is pruned while nobody has it
+   open, so readers treat it as a hint and check for the chunk file.
+
+   Before fetching a chunk, a process takes a lease on it: an OFD write
+   lock on one byte of the file, far beyond its end, at an offset given
+   by the chunk number.  The lease is held until the chunk has been
+   written to the pristine cache, so a process waiting for the lease
+   finds the chunk present when it gets it.  OFD locks belong to the
+   open file rather than to a thread, so the lease can be released by
+   the writeback thread, and they vanish if the process dies.
+
+   Process-wide state is protected by two more locks on the file.  A
+   write lock on the first byte serializes setup.  Every process holds a
+   read lock on the second byte while it has the map open; a process
+   that can upgrade it to a write lock during setup is the only user,
+   and rebuilds the map from its own scan of the cache directory. */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include "vmnetfs-private.h"
+
+#define SHARED_MAP_FILE "present"
+#define SHARED_MAP_MAGIC 0x564d4e4650524553ULL  /* "VMNFPRES" */
+#define HEADER_SIZE 4096
+#define SETUP_LOCK 0
+#define USERS_LOCK 1
+#define LEASE_BASE ((off_t) 1 << 40)
+#define LEASE_POLL_USEC 10000
+
+struct shared_map_header {
+    uint64_t magic;
+    uint64_t chunks;
+    uint32_t chunk_size;
+};
+
+struct shared_map {
+    int fd;
+    void *region;
+    size_t len;
+    uint64_t *words;
+    uint64_t chunks;
+};
+
+/* Returns 0 or an errno value. */
+static int lock_byte(int fd, short type, off_t offset, bool wait)
+{
+    struct flock fl = {
+        .l_type = type,
+        .l_whence = SEEK_SET,
+        .l_start = offset,
+        .l_len = 1,
+    };
+
+    while (fcntl(fd, wait ? F_OFD_SETLKW : F_OFD_SETLK, &fl)) {
+        if (errno != EINTR) {
+            return errno;
+        }
+    }
+    return 0;
+}
+
+static bool map_file(struct shared_map *map, const char *path, bool reset,
+        struct vmnetfs_image *img, GError **err)
+{
+    struct shared_map_header *hdr;
+    struct stat st;
+
+    if (reset && (ftruncate(map->fd, 0) ||
+            ftruncate(map->fd, map->len))) {
+        g_set_error(err, G_FILE_ERROR, g_file_error_from_errno(errno),
+                "Couldn't initialize %s: %s", path, strerror(errno));
+        return false;
+    }
+    if (fstat(map->fd, &st)) {
+        g_set_error(err, G_FILE_ERROR, g_file_error_from_errno(errno),
+                "Couldn't stat %s: %s", path, strerror(errno));
+        return false;
+    }
+    if ((uint64_t) st.st_size != map->len) {
+        g_set_error(err, VMNETFS_IO_ERROR, VMNETFS_IO_ERROR_INVALID_CACHE,
+                "%s has the wrong size", path);
+        return false;
+    }
+    map->region = mmap(NULL, map->len, PROT_READ | PROT_WRITE, MAP_SHARED,
+            map->fd, 0);
+    if (map->region == MAP_FAILED) {
+        g_set_error(err, G_FILE_ERROR, g_file_error_from_errno(errno),
+                "Couldn't map %s: %s", path, strerror(errno));
+        return false;
+    }
+    hdr = map->region;
+    map->words = map->region + HEADER_SIZE;
+    if (reset) {
+        hdr->chunks = map->chunks;
+        hdr->chunk_size = img->chunk_size;
+        /* Publish the header only once it is complete */
+        __sync_synchronize();
+        hdr->magic = SHARED_MAP_MAGIC;
+    } else if (hdr->magic != SHARED_MAP_MAGIC ||
+            hdr->chunks != map->chunks ||
+            hdr->chunk_size != img->chunk_size) {
+        g_set_error(err, VMNETFS_IO_ERROR, VMNETFS_IO_ERROR_INVALID_CACHE,
+                "%s does not match the image", path);
+        munmap(map->region, map->len);
+        return false;
+    }
+    return true;
+}
+
+/* Map the shared present map, and publish the chunks in our present map.
+   Must be called after the cache directory has been scanned. */
+bool _vmnetfs_shared_map_init(struct vmnetfs_image *img, GError **err)
+{
+    struct shared_map *map;
+    char *path;
+    uint64_t chunk;
+    bool reset;
+    int ret;
+
+    map = g_slice_new0(struct shared_map);
+    map->chunks = (img->initial_size + img->chunk_size - 1) /
+            img->chunk_size;
+    map->len = HEADER_SIZE + (map->chunks + 63) / 64 * sizeof(uint64_t);
+    path = g_strdup_printf("%s/%s", img->read_base, SHARED_MAP_FILE);
+    map->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (map->fd == -1) {
+        g_set_error(err, G_FILE_ERROR, g_file_error_from_errno(errno),
+                "Couldn't open %s: %s", path, strerror(errno));
+        goto bad_free;
+    }
+    ret = lock_byte(map->fd, F_WRLCK, SETUP_LOCK, true);
+    if (ret) {
+        g_set_error(err, G_FILE_ERROR, g_file_error_from_errno(ret),
+                "Couldn't lock %s: %s", path, strerror(ret));
+        goto bad_close;
+    }
+    reset = lock_byte(map->fd, F_WRLCK, USERS_LOCK, false) == 0;
+    if (!map_file(map, path, reset, img, err)) {
+        goto bad_close;
+    }
+    /* Downgrades our write lock, if any */
+    ret = lock_byte(map->fd, F_RDLCK, USERS_LOCK, true);
+    if (ret) {
+        g_set_error(err, G_FILE_ERROR, g_file_error_from_errno(ret),
+                "Couldn't lock %s: %s", path, strerror(ret));
+        munmap(map->region, map->len);
+        goto bad_close;
+    }
+    img->shared_map = map;
+    for (chunk = 0; chunk < map->chunks; chunk++) {
+        if (_vmnetfs_bit_test(img->present_map, chunk)) {
+            _vmnetfs_shared_map_set(img, chunk);
+        }
+    }
+    lock_byte(map->fd, F_UNLCK, SETUP_LOCK, false);
+    g_free(path);
+    return true;
+
+bad_close:
+    /* Releases our locks */
+    close(map->fd);
+bad_free:
+    g_free(path);
+    g_slice_free(struct shared_map, map);
+    return false;
+}
+
+void _vmnetfs_shared_map_destroy(struct vmnetfs_image *img)
+{
+    struct shared_map *map = img->shared_map;
+
+    if (map == NULL) {
+        return;
+    }
+    munmap(map->region, map->len);
+    close(map->fd);
+    g_slice_free(struct shared_map, map);
+    img->shared_map = NULL;
+}
+
+/* Returns true if another process may have written the chunk to the
+   pristine cache. */
+bool _vmnetfs_shared_map_test(struct vmnetfs_image *img, uint64_t chunk)
+{
+    struct shared_map *map = img->shared_map;
+
+    if (map == NULL || chunk >= map->chunks) {
+        return false;
+    }
+    return __sync_fetch_and_or(&map->words[chunk / 64], 0) &
+            (1ULL << (chunk % 64));
+}
+
+/* The chunk file has been written. */
+void _vmnetfs_shared_map_set(struct vmnetfs_image *img, uint64_t chunk)
+{
+    struct shared_map *map = img->shared_map;
+
+    if (map == NULL || chunk >= map->chunks) {
+        return;
+    }
+    __sync_fetch_and_or(&map->words[chunk / 64], 1ULL << (chunk % 64));
+}
+
+/* The chunk file is about to be removed, or was found missing. */
+void _vmnetfs_shared_map_clear(struct vmnetfs_image *img, uint64_t chunk)
+{
+    struct shared_map *map = img->shared_map;
+
+    if (map == NULL || chunk >= map->chunks) {
+        return;
+    }
+    __sync_fetch_and_and(&map->words[chunk / 64], ~(1ULL << (chunk % 64)));
+}
+
+/* Wait until no other process is fetching the chunk, and take the lease
+   on fetching it.  Polls, so that @should_stop can cancel the wait.
+   Returns false if cancelled.  If the lease can't be taken for some
+   other reason, returns true without it; the cost is at most a redundant
+   fetch. */
+bool _vmnetfs_shared_map_lease(struct vmnetfs_image *img, uint64_t chunk,
+        bool (*should_stop)(void *arg), void *arg)
+{
+    struct shared_map *map = img->shared_map;
+    int ret;
+
+    if (map == NULL) {
+        return true;
+    }
+    while ((ret = lock_byte(map->fd, F_WRLCK, LEASE_BASE + chunk,
+            false)) == EAGAIN || ret == EACCES) {
+        if (should_stop(arg)) {
+            return false;
+        }
+        g_usleep(LEASE_POLL_USEC);
+    }
+    return true;
+}
+
+/* Release the lease, if we hold it. */
+void _vmnetfs_shared_map_release(struct vmnetfs_image *img, uint64_t chunk)
+{
+    struct shared_map *map = img->shared_map;
+
+    if (map == NULL) {
+        return;
+    }
+    lock_byte(map->fd, F_UNLCK, LEASE_BASE + chunk, false);
+}
@@ -0,0 +1,205 @@
+/*
+ * vmnetfs - virtual machine network execution virtual filesystem
+ *
+ * Copyright (C) 2006-2014 Carnegie Mellon University
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of version 2 of the GNU General Public License as published
+ * by the Free Software Foundation.  A copy of the GNU General Public License
+ * should have been distributed along with this program in the file
+ * COPYING.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ */
+
+/* The content store is a directory of chunk files named by their BLAKE2b
+   digest, shared by every image cache on the system.  Entries are hard
+   links to files in the pristine caches, so the link count of a store
+   file is its reference count: an entry with a single link is no longer
+   used by any image and can be deleted.  A chunk enters the store only
+   after its digest has been checked against the package's chunk index,
+   so store contents can be trusted without rehashing.  Compressed chunk
+   files are stored under a separate name, since they can only be shared
+   with images that can decompress them. */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include "vmnetfs-private.h"
+
+struct chunk_store {
+    char *path;
+    gchar *digests;  /* VMNETFS_DIGEST_LEN bytes per chunk */
+    uint64_t chunks;
+};
+
+static const uint8_t *get_digest(struct chunk_store *store, uint64_t chunk)
+{
+    return (const uint8_t *) store->digests + chunk * VMNETFS_DIGEST_LEN;
+}
+
+static char *get_store_file(struct chunk_store *store,
+        const uint8_t *digest, bool compressed, char **dir)
+{
+    char hex[2 * VMNETFS_DIGEST_LEN + 1];
+    int i;
+
+    for (i = 0; i < VMNETFS_DIGEST_LEN; i++) {
+        g_snprintf(hex + 2 * i, 3, "%.2x", digest[i]);
+    }
+    *dir = g_strdup_printf("%s/%.2s", store->path, hex);
+    return g_strdup_printf("%s/%s%s", *dir, hex,
+            compressed ? VMNETFS_COMPRESSED_SUFFIX : "");
+}
+
+bool _vmnetfs_store_init(struct vmnetfs_image *img, GError **err)
+{
+    struct chunk_store *store;
+    gsize len;
+
+    if (img->store_path == NULL) {
+        return true;
+    }
+
+    store = g_slice_new0(struct chunk_store);
+    store->path = g_strdup(img->store_path);
+    store->chunks = (img->initial_size + img->chunk_size - 1) /
+            img->chunk_size;
+    if (!g_file_get_contents(img->store_index, &store->digests, &len,
+            err)) {
+        goto bad;
+    }
+    if (len != store->chunks * VMNETFS_DIGEST_LEN) {
+        g_set_error(err, VMNETFS_CONFIG_ERROR,
+                VMNETFS_CONFIG_ERROR_INVALID_CONFIG,
+                "Chunk index %s has incorrect length", img->store_index);
+        goto bad;
+    }
+    if (g_mkdir_with_parents(store->path, 0700)) {
+        g_set_error(err, G_FILE_ERROR, g_file_error_from_errno(errno),
+                "Couldn't create %s: %s", store->path, strerror(errno));
+        goto bad;
+    }
+    img->store = store;
+    return true;
+
+bad:
+    g_free(store->digests);
+    g_free(store->path);
+    g_slice_free(struct chunk_store, store);
+    return false;
+}
+
+void _vmnetfs_store_destroy(struct vmnetfs_image *img)
+{
+    struct chunk_store *store = img->store;
+
+    if (store == NULL) {
+        return;
+    }
+    g_free(store->digests);
+    g_free(store->path);
+    g_slice_free(struct chunk_store, store);
+}
+
+/* Try to create @file as a link to the (possibly compressed) store entry
+   for @chunk.  Returns false if the store doesn't have it. */
+bool _vmnetfs_store_link_chunk(struct vmnetfs_image *img, uint64_t chunk,
+        uint32_t length, bool compressed, const char *file)
+{
+    struct chunk_store *store = img->store;
+    struct stat st;
+    char *dir;
+    char *path;
+    bool ret = false;
+
+    if (store == NULL) {
+        return false;
+    }
+    path = get_store_file(store, get_digest(store, chunk), compressed,
+            &dir);
+    if (stat(path, &st)) {
+        if (errno != ENOENT) {
+            g_warning("Couldn't stat %s: %s", path, strerror(errno));
+        }
+        goto out;
+    }
+    if (!compressed && st.st_size != length) {
+        /* Index and image disagree about the chunk boundaries */
+        goto out;
+    }
+    if (link(path, file) && errno != EEXIST) {
+        g_warning("Couldn't link %s to %s: %s", path, file,
+                strerror(errno));
+        goto out;
+    }
+    _vmnetfs_u64_stat_increment(img->chunk_store_hits, 1);
+    ret = true;
+
+out:
+    g_free(path);
+    g_free(dir);
+    return ret;
+}
+
+/* Add @file, containing the pristine contents of @chunk, to the store.
+   @data is the uncompressed chunk.  Best effort. */
+void _vmnetfs_store_add_chunk(struct vmnetfs_image *img, uint64_t chunk,
+        const void *data, uint32_t length, bool compressed,
+        const char *file)
+{
+    struct chunk_store *store = img->store;
+    uint8_t digest[VMNETFS_DIGEST_LEN];
+    char *dir;
+    char *path;
+    int ret;
+
+    if (store == NULL) {
+        return;
+    }
+    _vmnetfs_blake2b(digest, data, length);
+    if (memcmp(digest, get_digest(store, chunk), VMNETFS_DIGEST_LEN)) {
+        g_warning("Chunk %"G_GUINT64_FORMAT" does not match chunk index",
+                chunk);
+        return;
+    }
+    path = get_store_file(store, digest, compressed, &dir);
+    ret = link(file, path);
+    if (ret && errno == ENOENT) {
+        if (g_mkdir_with_parents(dir, 0700)) {
+            g_warning("Couldn't create %s: %s", dir, strerror(errno));
+            goto out;
+        }
+        ret = link(file, path);
+    }
+    /* If the entry already exists, another image got there first.  If
+       the store is on a different filesystem, we can't share. */
+    if (ret && errno != EEXIST && errno != EXDEV) {
+        g_warning("Couldn't add %s to chunk store: %s", file,
+                strerror(errno));
+    }
+
+out:
+    g_free(path);
+    g_free(dir);
+}
+
+/* Check @data against the chunk index.  Returns false if there is no
+   index. */
+bool _vmnetfs_store_verify_chunk(struct vmnetfs_image *img, uint64_t chunk,
+        const void *data, uint32_t length)
+{
+    struct chunk_store *store = img->store;
+    uint8_t digest[VMNETFS_DIGEST_LEN];
+
+    if (store == NULL || chunk >= store->chunks) {
+        return false;
+    }
+    _vmnetfs_blake2b(digest, data, length);
+    return !memcmp(digest, get_digest(store, chunk), VMNETFS_DIGEST_LEN);
+}
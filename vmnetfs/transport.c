@@ -419,6 +419,35 @@ bool _vmnetfs_transport_pool_set_cookie(struct connection_pool *cpool,
     return ret;
 }
 
+static void set_curl_error(struct connection *conn, CURLcode code,
+        GError **err)
+{
+    switch (code) {
+    case CURLE_COULDNT_RESOLVE_PROXY:
+    case CURLE_COULDNT_RESOLVE_HOST:
+    case CURLE_COULDNT_CONNECT:
+    case CURLE_HTTP_RETURNED_ERROR:
+    case CURLE_OPERATION_TIMEDOUT:
+    case CURLE_GOT_NOTHING:
+    case CURLE_SEND_ERROR:
+    case CURLE_RECV_ERROR:
+    case CURLE_BAD_CONTENT_ENCODING:
+        g_set_error(err, VMNETFS_TRANSPORT_ERROR,
+                VMNETFS_TRANSPORT_ERROR_NETWORK,
+                "curl error %d: %s", code, conn->errbuf);
+        break;
+    case CURLE_ABORTED_BY_CALLBACK:
+        g_set_error(err, VMNETFS_IO_ERROR, VMNETFS_IO_ERROR_INTERRUPTED,
+                "Operation interrupted");
+        break;
+    default:
+        g_set_error(err, VMNETFS_TRANSPORT_ERROR,
+                VMNETFS_TRANSPORT_ERROR_FATAL,
+                "curl error %d: %s", code, conn->errbuf);
+        break;
+    }
+}
+
 /* Make one attempt to fetch the specified byte range from the URL. */
 static bool fetch(struct connection_pool *cpool, const char *url,
         const char *username, const char *password, const char *etag,
@@ -485,8 +514,7 @@ static bool fetch(struct connection_pool *cpool, const char *url,
         conn->err = NULL;
         goto out;
     }
-    switch (code) {
-    case CURLE_OK:
+    if (code == CURLE_OK) {
         if (conn->offset != length) {
             g_set_error(err, VMNETFS_TRANSPORT_ERROR,
                     VMNETFS_TRANSPORT_ERROR_FATAL,
@@ -494,29 +522,8 @@ static bool fetch(struct connection_pool *cpool, const char *url,
                     conn->offset, length);
         }
         ret = true;
-        break;
-    case CURLE_COULDNT_RESOLVE_PROXY:
-    case CURLE_COULDNT_RESOLVE_HOST:
-    case CURLE_COULDNT_CONNECT:
-    case CURLE_HTTP_RETURNED_ERROR:
-    case CURLE_OPERATION_TIMEDOUT:
-    case CURLE_GOT_NOTHING:
-    case CURLE_SEND_ERROR:
-    case CURLE_RECV_ERROR:
-    case CURLE_BAD_CONTENT_ENCODING:
-        g_set_error(err, VMNETFS_TRANSPORT_ERROR,
-                VMNETFS_TRANSPORT_ERROR_NETWORK,
-                "curl error %d: %s", code, conn->errbuf);
-        break;
-    case CURLE_ABORTED_BY_CALLBACK:
-        g_set_error(err, VMNETFS_IO_ERROR, VMNETFS_IO_ERROR_INTERRUPTED,
-                "Operation interrupted");
-        break;
-    default:
-        g_set_error(err, VMNETFS_TRANSPORT_ERROR,
-                VMNETFS_TRANSPORT_ERROR_FATAL,
-                "curl error %d: %s", code, conn->errbuf);
-        break;
+    } else {
+        set_curl_error(conn, code, err);
     }
 out:
     conn_put(conn);
@@ -554,6 +561,18 @@ bool _vmnetfs_transport_fetch(struct connection_pool *cpool, const char *url,
     return false;
 }
 
+/* Make one attempt to fetch the specified byte range from the URL. */
+bool _vmnetfs_transport_fetch_once(struct connection_pool *cpool,
+        const char *url, const char *username, const char *password,
+        const char *etag, time_t last_modified, void *buf, uint64_t offset,
+        uint64_t length, should_cancel_fn *should_cancel,
+        void *should_cancel_arg, GError **err)
+{
+    return fetch(cpool, url, username, password, etag, last_modified, buf,
+            NULL, NULL, offset, length, should_cancel, should_cancel_arg,
+            err);
+}
+
 /* Attempt to stream the specified URL.  Do not retry. */
 bool _vmnetfs_transport_fetch_stream_once(struct connection_pool *cpool,
         const char *url, const char *username, const char *password,
@@ -566,3 +585,67 @@ bool _vmnetfs_transport_fetch_stream_once(struct connection_pool *cpool,
             callback, arg, offset, length, should_cancel, should_cancel_arg,
             err);
 }
+
+/* Look up the size and validators of the resource at @url with a HEAD
+   request.  @etag is set to NULL and @last_modified to 0 if the server
+   doesn't provide them.  Does not retry. */
+bool _vmnetfs_transport_get_info(struct connection_pool *cpool,
+        const char *url, uint64_t *size, char **etag, time_t *last_modified,
+        GError **err)
+{
+    struct connection *conn;
+#if LIBCURL_VERSION_NUM >= 0x073700
+    curl_off_t length;
+#else
+    double length;
+#endif
+    long filetime;
+    bool ret = false;
+    CURLcode code;
+
+    conn = conn_get(cpool, err);
+    if (conn == NULL) {
+        return false;
+    }
+    if (curl_easy_setopt(conn->curl, CURLOPT_URL, url) ||
+            curl_easy_setopt(conn->curl, CURLOPT_USERNAME, NULL) ||
+            curl_easy_setopt(conn->curl, CURLOPT_PASSWORD, NULL) ||
+            curl_easy_setopt(conn->curl, CURLOPT_RANGE, NULL) ||
+            curl_easy_setopt(conn->curl, CURLOPT_NOBODY, 1L)) {
+        g_set_error(err, VMNETFS_TRANSPORT_ERROR,
+                VMNETFS_TRANSPORT_ERROR_FATAL,
+                "Couldn't configure HEAD request");
+        goto out;
+    }
+    conn->should_cancel = NULL;
+    code = curl_easy_perform(conn->curl);
+    if (code != CURLE_OK) {
+        set_curl_error(conn, code, err);
+        goto out;
+    }
+#if LIBCURL_VERSION_NUM >= 0x073700
+    if (curl_easy_getinfo(conn->curl, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T,
+            &length) || length < 0) {
+#else
+    if (curl_easy_getinfo(conn->curl, CURLINFO_CONTENT_LENGTH_DOWNLOAD,
+            &length) || length < 0) {
+#endif
+        g_set_error(err, VMNETFS_TRANSPORT_ERROR,
+                VMNETFS_TRANSPORT_ERROR_FATAL,
+                "Server did not return Content-Length");
+        goto out;
+    }
+    if (curl_easy_getinfo(conn->curl, CURLINFO_FILETIME, &filetime)) {
+        filetime = -1;
+    }
+    *size = length;
+    *etag = g_strdup(conn->etag);
+    *last_modified = filetime > 0 ? filetime : 0;
+    ret = true;
+
+out:
+    /* Later fetches from this connection expect a GET */
+    curl_easy_setopt(conn->curl, CURLOPT_HTTPGET, 1L);
+    conn_put(conn);
+    return ret;
+}
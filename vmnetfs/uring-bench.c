@@ -0,0 +1,236 @@
+/*
+ * vmnetfs - virtual machine network execution virtual filesystem
+ *
+ * Copyright (C) 2006-2014 Carnegie Mellon University
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of version 2 of the GNU General Public License as published
+ * by the Free Software Foundation.  A copy of the GNU General Public License
+ * should have been distributed along with this program in the file
+ * COPYING.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ */
+
+/* Compare the synchronous open/pread/close path against batched io_uring
+   submission for reading every chunk file in a pristine cache directory.
+
+   Usage: uring-bench <chunk-dir> <chunk-size> [passes]
+
+   Both methods run once untimed first, so the results compare syscall
+   overhead against a warm page cache rather than disk speed. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/time.h>
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#endif
+
+#define BATCH 16
+
+static char **paths;
+static unsigned path_count;
+static char *buf;
+static uint32_t chunk_size;
+
+static void die(const char *msg, int err)
+{
+    fprintf(stderr, "%s: %s\n", msg, strerror(err));
+    exit(1);
+}
+
+static double now(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static void scan(const char *dir)
+{
+    DIR *d;
+    struct dirent *dent;
+    unsigned alloc = 0;
+
+    d = opendir(dir);
+    if (d == NULL) {
+        die(dir, errno);
+    }
+    while ((dent = readdir(d)) != NULL) {
+        if (dent->d_name[0] == '.') {
+            continue;
+        }
+        if (path_count == alloc) {
+            alloc = alloc ? 2 * alloc : 256;
+            paths = realloc(paths, alloc * sizeof(*paths));
+        }
+        if (asprintf(&paths[path_count++], "%s/%s", dir,
+                dent->d_name) == -1) {
+            die("asprintf", ENOMEM);
+        }
+    }
+    closedir(d);
+}
+
+static uint64_t read_sync(void)
+{
+    uint64_t total = 0;
+    ssize_t count;
+    unsigned i;
+    int fd;
+
+    for (i = 0; i < path_count; i++) {
+        fd = open(paths[i], O_RDONLY);
+        if (fd == -1) {
+            die(paths[i], errno);
+        }
+        count = pread(fd, buf, chunk_size, 0);
+        if (count == -1) {
+            die(paths[i], errno);
+        }
+        total += count;
+        close(fd);
+    }
+    return total;
+}
+
+#ifdef HAVE_LIBURING
+static struct io_uring ring;
+
+static uint64_t read_uring(void)
+{
+    struct io_uring_sqe *sqe;
+    struct io_uring_cqe *cqe;
+    uint64_t total = 0;
+    unsigned start;
+    unsigned count;
+    unsigned i;
+    int ret;
+
+    for (start = 0; start < path_count; start += count) {
+        count = path_count - start < BATCH ? path_count - start : BATCH;
+        for (i = 0; i < count; i++) {
+            sqe = io_uring_get_sqe(&ring);
+            io_uring_prep_openat_direct(sqe, AT_FDCWD, paths[start + i],
+                    O_RDONLY, 0, i);
+            sqe->flags |= IOSQE_IO_LINK;
+            sqe->user_data = 0;
+            sqe = io_uring_get_sqe(&ring);
+            io_uring_prep_read_fixed(sqe, i, buf + i * chunk_size,
+                    chunk_size, 0, 0);
+            sqe->flags |= IOSQE_FIXED_FILE | IOSQE_IO_HARDLINK;
+            sqe->user_data = 1;
+            sqe = io_uring_get_sqe(&ring);
+            io_uring_prep_close_direct(sqe, i);
+            sqe->user_data = 0;
+        }
+        ret = io_uring_submit_and_wait(&ring, 3 * count);
+        if (ret < 0) {
+            die("io_uring_submit_and_wait", -ret);
+        }
+        for (i = 0; i < 3 * count; i++) {
+            ret = io_uring_wait_cqe(&ring, &cqe);
+            if (ret < 0) {
+                die("io_uring_wait_cqe", -ret);
+            }
+            if (cqe->res < 0) {
+                die("io_uring", -cqe->res);
+            }
+            if (cqe->user_data) {
+                total += cqe->res;
+            }
+            io_uring_cqe_seen(&ring, cqe);
+        }
+    }
+    return total;
+}
+
+static void init_uring(void)
+{
+    struct iovec iov = {
+        .iov_base = buf,
+        .iov_len = (size_t) BATCH * chunk_size,
+    };
+    int ret;
+
+    ret = io_uring_queue_init(4 * BATCH, &ring, 0);
+    if (ret < 0) {
+        die("io_uring_queue_init", -ret);
+    }
+    ret = io_uring_register_files_sparse(&ring, BATCH);
+    if (ret < 0) {
+        die("io_uring_register_files_sparse", -ret);
+    }
+    ret = io_uring_register_buffers(&ring, &iov, 1);
+    if (ret < 0) {
+        die("io_uring_register_buffers", -ret);
+    }
+}
+#endif
+
+static void run(const char *name, uint64_t (*fn)(void), unsigned passes)
+{
+    uint64_t bytes = 0;
+    double start;
+    double elapsed;
+    unsigned i;
+
+    fn();
+    start = now();
+    for (i = 0; i < passes; i++) {
+        bytes += fn();
+    }
+    elapsed = now() - start;
+    printf("%-8s %10.1f chunks/s %10.1f MB/s\n", name,
+            passes * path_count / elapsed, bytes / elapsed / (1 << 20));
+}
+
+int main(int argc, char **argv)
+{
+    unsigned passes = 10;
+
+    if (argc < 3 || argc > 4) {
+        fprintf(stderr, "Usage: %s <chunk-dir> <chunk-size> [passes]\n",
+                argv[0]);
+        return 1;
+    }
+    chunk_size = strtoul(argv[2], NULL, 10);
+    if (argc == 4) {
+        passes = strtoul(argv[3], NULL, 10);
+    }
+    if (chunk_size == 0 || passes == 0) {
+        fprintf(stderr, "Invalid argument\n");
+        return 1;
+    }
+    scan(argv[1]);
+    if (path_count == 0) {
+        fprintf(stderr, "No chunks found in %s\n", argv[1]);
+        return 1;
+    }
+    if (posix_memalign((void **) &buf, 4096,
+            (size_t) BATCH * chunk_size)) {
+        die("posix_memalign", ENOMEM);
+    }
+
+    printf("%u chunks, %u passes\n", path_count, passes);
+    run("sync", read_sync, passes);
+#ifdef HAVE_LIBURING
+    init_uring();
+    run("io_uring", read_uring, passes);
+#else
+    printf("io_uring  not available (built without liburing)\n");
+#endif
+    return 0;
+}
@@ -0,0 +1,458 @@
+/*
+ * vmnetfs - virtual machine network execution virtual filesystem
+ *
+ * Copyright (C) 2006-2014 Carnegie Mellon University
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of version 2 of the GNU General Public License as published
+ * by the Free Software Foundation.  A copy of the GNU General Public License
+ * should have been distributed along with this program in the file
+ * COPYING.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ */
+
+/* Reads from the cache files can be batched through io_uring, so that an
+   image read spanning several chunks costs one system call rather than
+   an open/pread/close per chunk.  Each ring registers the modified image
+   and the buffer pool; pristine chunk files are opened directly into the
+   ring's file table by linked requests.  Rings are created on demand and
+   kept for reuse, so there is one per concurrent reader.  If the kernel
+   can't do what we need, io_uring is disabled for the image and callers
+   use the synchronous path. */
+
+#include <fcntl.h>
+#include <string.h>
+#include <errno.h>
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#endif
+#include "vmnetfs-private.h"
+
+#ifdef HAVE_LIBURING
+
+/* Fixed file table: the modified image, then one slot per batch op */
+#define MODIFIED_SLOT 0
+#define OP_SLOT(op) ((op) + 1)
+/* Open, read, and close for each op */
+#define RING_ENTRIES (3 * VMNETFS_URING_BATCH_OPS)
+
+enum step {
+    STEP_OPEN,
+    STEP_READ,
+    STEP_CLOSE,
+};
+
+struct uring_state {
+    GMutex *lock;
+    GSList *idle;
+    gint disabled;  /* atomic operations only */
+};
+
+struct ring {
+    struct io_uring ring;
+    bool have_buffers;
+    bool broken;  /* has stale submissions */
+};
+
+struct uring_op {
+    char *path;  /* NULL for the modified image */
+    void *buf;
+    uint32_t length;
+    uint64_t offset;
+    int open_result;
+    int read_result;
+};
+
+struct vmnetfs_uring_batch {
+    struct vmnetfs_image *img;
+    struct ring *ring;
+    struct uring_op ops[VMNETFS_URING_BATCH_OPS];
+    int count;
+    int submitted;
+};
+
+static bool probe_ring(struct io_uring *ring)
+{
+    struct io_uring_probe *probe;
+    bool ret;
+
+    probe = io_uring_get_probe_ring(ring);
+    if (probe == NULL) {
+        return false;
+    }
+    ret = io_uring_opcode_supported(probe, IORING_OP_OPENAT) &&
+            io_uring_opcode_supported(probe, IORING_OP_READ) &&
+            io_uring_opcode_supported(probe, IORING_OP_READ_FIXED) &&
+            io_uring_opcode_supported(probe, IORING_OP_CLOSE);
+    io_uring_free_probe(probe);
+    return ret;
+}
+
+static struct ring *ring_new(struct vmnetfs_image *img)
+{
+    struct ring *r;
+    struct iovec iov;
+    uint64_t len;
+    int fds[OP_SLOT(VMNETFS_URING_BATCH_OPS)];
+    int i;
+
+    r = g_slice_new0(struct ring);
+    if (io_uring_queue_init(RING_ENTRIES, &r->ring, 0)) {
+        g_slice_free(struct ring, r);
+        return NULL;
+    }
+    if (!probe_ring(&r->ring)) {
+        goto bad;
+    }
+    fds[MODIFIED_SLOT] = img->write_fd;
+    for (i = 0; i < VMNETFS_URING_BATCH_OPS; i++) {
+        fds[OP_SLOT(i)] = -1;
+    }
+    if (io_uring_register_files(&r->ring, fds, G_N_ELEMENTS(fds))) {
+        goto bad;
+    }
+    /* May fail if RLIMIT_MEMLOCK is small; then we just don't use fixed
+       buffers */
+    iov.iov_base = _vmnetfs_pool_get_region(img, &len);
+    iov.iov_len = len;
+    r->have_buffers = !io_uring_register_buffers(&r->ring, &iov, 1);
+    return r;
+
+bad:
+    io_uring_queue_exit(&r->ring);
+    g_slice_free(struct ring, r);
+    return NULL;
+}
+
+static void ring_free(struct ring *r)
+{
+    io_uring_queue_exit(&r->ring);
+    g_slice_free(struct ring, r);
+}
+
+static void disable(struct vmnetfs_image *img, const char *reason)
+{
+    if (!g_atomic_int_get(&img->uring->disabled)) {
+        g_atomic_int_set(&img->uring->disabled, 1);
+        g_message("Not using io_uring: %s", reason);
+    }
+}
+
+void _vmnetfs_uring_init(struct vmnetfs_image *img)
+{
+    struct uring_state *us;
+    struct ring *r;
+
+    us = g_slice_new0(struct uring_state);
+    us->lock = g_mutex_new();
+    img->uring = us;
+    /* Find out now whether it works */
+    r = ring_new(img);
+    if (r == NULL) {
+        disable(img, "not supported by kernel");
+        return;
+    }
+    us->idle = g_slist_prepend(us->idle, r);
+}
+
+void _vmnetfs_uring_destroy(struct vmnetfs_image *img)
+{
+    struct uring_state *us = img->uring;
+    GSList *cur;
+
+    for (cur = us->idle; cur != NULL; cur = cur->next) {
+        ring_free(cur->data);
+    }
+    g_slist_free(us->idle);
+    g_mutex_free(us->lock);
+    g_slice_free(struct uring_state, us);
+}
+
+/* Returns NULL if io_uring can't be used. */
+struct vmnetfs_uring_batch *_vmnetfs_uring_batch_new(
+        struct vmnetfs_image *img)
+{
+    struct uring_state *us = img->uring;
+    struct vmnetfs_uring_batch *batch;
+    struct ring *r = NULL;
+
+    if (g_atomic_int_get(&us->disabled)) {
+        return NULL;
+    }
+    g_mutex_lock(us->lock);
+    if (us->idle != NULL) {
+        r = us->idle->data;
+        us->idle = g_slist_delete_link(us->idle, us->idle);
+    }
+    g_mutex_unlock(us->lock);
+    if (r == NULL) {
+        r = ring_new(img);
+        if (r == NULL) {
+            return NULL;
+        }
+    }
+    batch = g_slice_new0(struct vmnetfs_uring_batch);
+    batch->img = img;
+    batch->ring = r;
+    return batch;
+}
+
+/* Forget the submitted ops, so that the batch can be reused. */
+void _vmnetfs_uring_batch_clear(struct vmnetfs_uring_batch *batch)
+{
+    int i;
+
+    for (i = 0; i < batch->count; i++) {
+        g_free(batch->ops[i].path);
+    }
+    memset(batch->ops, 0, sizeof(batch->ops));
+    batch->count = 0;
+    batch->submitted = 0;
+}
+
+void _vmnetfs_uring_batch_free(struct vmnetfs_uring_batch *batch)
+{
+    struct uring_state *us;
+
+    if (batch == NULL) {
+        return;
+    }
+    us = batch->img->uring;
+    _vmnetfs_uring_batch_clear(batch);
+    if (batch->ring->broken) {
+        ring_free(batch->ring);
+    } else {
+        g_mutex_lock(us->lock);
+        us->idle = g_slist_prepend(us->idle, batch->ring);
+        g_mutex_unlock(us->lock);
+    }
+    g_slice_free(struct vmnetfs_uring_batch, batch);
+}
+
+static int add_op(struct vmnetfs_uring_batch *batch, const char *path,
+        void *buf, uint32_t length, uint64_t offset)
+{
+    struct uring_op *op;
+
+    g_assert(batch->count < VMNETFS_URING_BATCH_OPS);
+    op = &batch->ops[batch->count];
+    op->path = g_strdup(path);
+    op->buf = buf;
+    op->length = length;
+    op->offset = offset;
+    /* In case it is never submitted */
+    op->read_result = -ECANCELED;
+    return batch->count++;
+}
+
+/* Queue a read from a pristine chunk file.  Returns the op number. */
+int _vmnetfs_uring_batch_read_file(struct vmnetfs_uring_batch *batch,
+        const char *path, void *buf, uint32_t length, uint64_t offset)
+{
+    return add_op(batch, path, buf, length, offset);
+}
+
+/* Queue a read from the modified image.  Returns the op number. */
+int _vmnetfs_uring_batch_read_image(struct vmnetfs_uring_batch *batch,
+        void *buf, uint32_t length, uint64_t offset)
+{
+    return add_op(batch, NULL, buf, length, offset);
+}
+
+static uint64_t encode(int op, enum step step)
+{
+    return (uint64_t) op << 2 | step;
+}
+
+static void prep_read(struct vmnetfs_uring_batch *batch,
+        struct io_uring_sqe *sqe, int slot, struct uring_op *op)
+{
+    if (batch->ring->have_buffers && _vmnetfs_pool_contains(batch->img,
+            op->buf)) {
+        io_uring_prep_read_fixed(sqe, slot, op->buf, op->length,
+                op->offset, 0);
+    } else {
+        io_uring_prep_read(sqe, slot, op->buf, op->length, op->offset);
+    }
+}
+
+/* Submit the queued ops and wait for all of them to complete. */
+void _vmnetfs_uring_batch_submit(struct vmnetfs_uring_batch *batch)
+{
+    struct io_uring *ring = &batch->ring->ring;
+    struct io_uring_sqe *sqe;
+    struct io_uring_cqe *cqe;
+    struct uring_op *op;
+    unsigned queued = 0;
+    unsigned pending;
+    uint64_t data;
+    int i;
+    int ret;
+
+    for (i = batch->submitted; i < batch->count; i++) {
+        op = &batch->ops[i];
+        if (op->path != NULL) {
+            sqe = io_uring_get_sqe(ring);
+            io_uring_prep_openat_direct(sqe, AT_FDCWD, op->path, O_RDONLY,
+                    0, OP_SLOT(i));
+            io_uring_sqe_set_flags(sqe, IOSQE_IO_LINK);
+            io_uring_sqe_set_data64(sqe, encode(i, STEP_OPEN));
+            sqe = io_uring_get_sqe(ring);
+            prep_read(batch, sqe, OP_SLOT(i), op);
+            /* Close even if the read fails */
+            io_uring_sqe_set_flags(sqe, IOSQE_FIXED_FILE |
+                    IOSQE_IO_HARDLINK);
+            io_uring_sqe_set_data64(sqe, encode(i, STEP_READ));
+            sqe = io_uring_get_sqe(ring);
+            io_uring_prep_close_direct(sqe, OP_SLOT(i));
+            io_uring_sqe_set_data64(sqe, encode(i, STEP_CLOSE));
+            queued += 3;
+        } else {
+            sqe = io_uring_get_sqe(ring);
+            prep_read(batch, sqe, MODIFIED_SLOT, op);
+            io_uring_sqe_set_flags(sqe, IOSQE_FIXED_FILE);
+            io_uring_sqe_set_data64(sqe, encode(i, STEP_READ));
+            queued++;
+        }
+    }
+    batch->submitted = batch->count;
+
+    do {
+        ret = io_uring_submit(ring);
+    } while (ret == -EINTR);
+    pending = MAX(ret, 0);
+    if (pending < queued) {
+        /* The kernel refused some of the submissions and they are still
+           in the queue.  Ops that didn't run will be retried
+           synchronously; don't reuse the ring. */
+        batch->ring->broken = true;
+    }
+
+    /* Every consumed submission produces a completion, and we must
+       reap them all before the buffers can be reused */
+    while (pending > 0) {
+        ret = io_uring_wait_cqe(ring, &cqe);
+        if (ret == -EINTR) {
+            continue;
+        }
+        g_assert(ret == 0);
+        data = io_uring_cqe_get_data64(cqe);
+        op = &batch->ops[data >> 2];
+        switch (data & 3) {
+        case STEP_OPEN:
+            op->open_result = cqe->res;
+            break;
+        case STEP_READ:
+            op->read_result = cqe->res;
+            break;
+        }
+        io_uring_cqe_seen(ring, cqe);
+        pending--;
+    }
+    _vmnetfs_u64_stat_increment(batch->img->uring_submits, 1);
+}
+
+/* Returns the outcome of a submitted op.  Returns false without setting
+   @err if io_uring couldn't perform the read; the caller should then
+   retry it synchronously. */
+bool _vmnetfs_uring_batch_result(struct vmnetfs_uring_batch *batch,
+        int opnum, GError **err)
+{
+    struct uring_op *op = &batch->ops[opnum];
+    const char *file = op->path ?: "image";
+    int result;
+
+    g_assert(opnum < batch->submitted);
+    if (op->open_result == -EINVAL) {
+        /* Kernel too old to open into the fixed file table */
+        disable(batch->img, "direct open not supported by kernel");
+        return false;
+    } else if (op->open_result < 0) {
+        g_set_error(err, G_FILE_ERROR,
+                g_file_error_from_errno(-op->open_result),
+                "Couldn't open %s: %s", file, strerror(-op->open_result));
+        return false;
+    }
+    result = op->read_result;
+    if (result == -EINVAL || result == -EOPNOTSUPP ||
+            result == -EAGAIN || result == -EINTR ||
+            result == -ECANCELED) {
+        return false;
+    } else if (result < 0) {
+        g_set_error(err, G_FILE_ERROR, g_file_error_from_errno(-result),
+                "Couldn't read %s: %s", file, strerror(-result));
+        return false;
+    } else if ((uint32_t) result < op->length) {
+        /* Short read; let the synchronous path sort it out */
+        return false;
+    }
+    _vmnetfs_u64_stat_increment(batch->img->uring_reads, 1);
+    return true;
+}
+
+#else
+
+/* The batch functions are never called, since there are no batches. */
+
+void _vmnetfs_uring_init(struct vmnetfs_image *img G_GNUC_UNUSED)
+{
+}
+
+void _vmnetfs_uring_destroy(struct vmnetfs_image *img G_GNUC_UNUSED)
+{
+}
+
+struct vmnetfs_uring_batch *_vmnetfs_uring_batch_new(
+        struct vmnetfs_image *img G_GNUC_UNUSED)
+{
+    return NULL;
+}
+
+void _vmnetfs_uring_batch_free(
+        struct vmnetfs_uring_batch *batch G_GNUC_UNUSED)
+{
+}
+
+int _vmnetfs_uring_batch_read_file(
+        struct vmnetfs_uring_batch *batch G_GNUC_UNUSED,
+        const char *path G_GNUC_UNUSED, void *buf G_GNUC_UNUSED,
+        uint32_t length G_GNUC_UNUSED, uint64_t offset G_GNUC_UNUSED)
+{
+    g_assert_not_reached();
+    return -1;
+}
+
+int _vmnetfs_uring_batch_read_image(
+        struct vmnetfs_uring_batch *batch G_GNUC_UNUSED,
+        void *buf G_GNUC_UNUSED, uint32_t length G_GNUC_UNUSED,
+        uint64_t offset G_GNUC_UNUSED)
+{
+    g_assert_not_reached();
+    return -1;
+}
+
+void _vmnetfs_uring_batch_submit(
+        struct vmnetfs_uring_batch *batch G_GNUC_UNUSED)
+{
+    g_assert_not_reached();
+}
+
+void _vmnetfs_uring_batch_clear(
+        struct vmnetfs_uring_batch *batch G_GNUC_UNUSED)
+{
+    g_assert_not_reached();
+}
+
+bool _vmnetfs_uring_batch_result(
+        struct vmnetfs_uring_batch *batch G_GNUC_UNUSED,
+        int opnum G_GNUC_UNUSED, GError **err G_GNUC_UNUSED)
+{
+    g_assert_not_reached();
+    return false;
+}
+
+#endif
@@ -18,6 +18,9 @@
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #include "vmnetfs-private.h"
 
 GQuark _vmnetfs_config_error_quark(void)
@@ -86,6 +89,41 @@ bool _vmnetfs_safe_pwrite(const char *file, int fd, const void *buf,
     return true;
 }
 
+/* Returns true if the buffer contains only zero bytes. */
+bool _vmnetfs_buffer_is_zero(const void *buf, uint64_t count)
+{
+    const char *p = buf;
+    uint64_t word;
+
+#ifdef __SSE2__
+    const __m128i zero = _mm_setzero_si128();
+    __m128i acc;
+
+    for (; count >= 64; p += 64, count -= 64) {
+        acc = _mm_or_si128(
+                _mm_or_si128(_mm_loadu_si128((const __m128i *) p),
+                _mm_loadu_si128((const __m128i *) (p + 16))),
+                _mm_or_si128(_mm_loadu_si128((const __m128i *) (p + 32)),
+                _mm_loadu_si128((const __m128i *) (p + 48))));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(acc, zero)) != 0xffff) {
+            return false;
+        }
+    }
+#endif
+    for (; count >= sizeof(word); p += sizeof(word), count -= sizeof(word)) {
+        memcpy(&word, p, sizeof(word));
+        if (word) {
+            return false;
+        }
+    }
+    for (; count > 0; p++, count--) {
+        if (*p) {
+            return false;
+        }
+    }
+    return true;
+}
+
 /* The cursor is assumed to be allocated on the stack; this just fills
    it in. */
 void _vmnetfs_cursor_start(struct vmnetfs_image *img,
@@ -24,12 +24,52 @@
 #include <glib.h>
 #include "config.h"
 
+#define VMNETFS_DIGEST_LEN 32
+#define VMNETFS_COMPRESSED_SUFFIX ".lz4"
+#define VMNETFS_URING_BATCH_OPS 16
+
 struct vmnetfs {
     GHashTable *images;
     struct vmnetfs_fuse *fuse;
     struct vmnetfs_log *log;
     GMainLoop *glib_loop;
     char *censored_config;
+
+    /* images attached through the control socket */
+    char *control_socket;
+    struct control_state *control;
+    GMutex *images_lock;  /* for instances and origins */
+    GHashTable *instances;  /* name -> struct vmnetfs_instance */
+    GHashTable *origins;  /* read_base -> struct vmnetfs_origin */
+    GCond *origin_destroyed;
+
+    /* cache proxy */
+    char *proxy_address;
+    char *proxy_port;
+    char *proxy_path;
+    uint32_t proxy_chunk_size;
+    GList *proxy_origins;  /* allowed URL prefixes */
+    struct proxy_state *proxy;
+
+    /* peers */
+    char *peer_group;
+    uint32_t peer_port;
+    char *peer_interface;
+    struct peer_state *peer;
+
+    /* fuse */
+    uint32_t fuse_max_threads;
+    uint32_t fuse_max_idle_threads;
+    bool fuse_writeback_cache;
+
+    /* cache */
+    char *cache_root;
+    char *cache_store;
+    uint64_t cache_limit;
+    struct cache_manager *cache;
+    struct vmnetfs_stat *cache_bytes;
+    struct vmnetfs_stat *cache_evictions;
+    struct vmnetfs_stat *cache_bytes_evicted;
 };
 
 enum fetch_mode {
@@ -37,18 +77,51 @@ enum fetch_mode {
     FETCH_MODE_STREAM,
 };
 
+/* Most urgent first */
+enum fetch_priority {
+    FETCH_PRIORITY_DEMAND,  /* the guest is waiting */
+    FETCH_PRIORITY_PREFETCH,
+    FETCH_PRIORITY_FILL,
+    FETCH_PRIORITIES,
+};
+
+enum pool_hugepages {
+    POOL_HUGEPAGES_TRANSPARENT,
+    POOL_HUGEPAGES_EXPLICIT,
+    POOL_HUGEPAGES_NONE,
+};
+
 struct vmnetfs_image {
     char *url;
+    char *proxy_url;  /* base URL of a cache proxy */
     char *username;
     char *password;
     GList *cookies;
     char *read_base;
+    char *zero_chunks;
+    char *store_path;
+    char *store_index;
+    char *peer_key;  /* identifies the image to peers */
+    bool compress;
     uint64_t fetch_offset;
     uint64_t initial_size;
     uint32_t chunk_size;
     char *etag;
     time_t last_modified;
     enum fetch_mode fetch_mode;
+    bool background_fill;
+    uint64_t fill_threshold;  /* demand bytes/second that pause the fill */
+    bool fs_prefetch;
+    uint64_t fs_prefetch_limit;  /* bytes; 0 for the default */
+    uint32_t pool_buffers;
+    enum pool_hugepages pool_hugepages;
+    uint64_t ram_cache_size;
+    bool kernel_cache;
+    char *nbd_socket;
+
+    /* Shared pristine state, if attached through the control socket */
+    struct vmnetfs_image *origin;
+    struct vmnetfs_instance *instance;
 
     /* io */
     struct connection_pool *cpool;
@@ -57,13 +130,70 @@ struct vmnetfs_image {
     struct bitmap_group *bitmaps;
     struct bitmap *accessed_map;
     struct bitmap *fetched_map;
+    struct bitmap *discarded_map;
 
     /* ll_pristine */
     struct bitmap *present_map;
+    struct bitmap *zero_map;
+    struct bitmap *compressed_map;
+
+    /* shared_map */
+    struct shared_map *shared_map;
+
+    /* writeback */
+    struct writeback_state *writeback;
+
+    /* fetch */
+    struct fetch_state *fetch;
+
+    /* pool */
+    struct buffer_pool *pool;
+
+    /* ramcache */
+    struct ram_cache *ram_cache;
+
+    /* nbd */
+    struct nbd_state *nbd;
+
+    /* fuse_image */
+    time_t mtime;
+    void *fuse_ino;  /* of the image file once opened with kernel cache */
+
+    /* uring */
+    struct uring_state *uring;
+
+    /* store */
+    struct chunk_store *store;
+
+    /* peer */
+    struct peer_state *peer;
+
+    /* prefetch */
+    struct prefetch_state *prefetch;
+    struct bitmap *pinned_map;
+
+    /* fill */
+    struct fill_state *fill;
+
+    /* fsmap */
+    struct fsmap_state *fsmap;
+
+    /* cache */
+    struct cache_manager *cache;
+    int access_fd;
+    dev_t access_dev;
+    ino_t access_ino;
+    uint8_t *access_recorded;
+    uint8_t *access_filled;  /* fetched by the fill since the last flush */
+    GMutex *access_lock;
 
     /* ll_modified */
     int write_fd;
     struct bitmap *modified_map;
+    gint modified_no_reflink;  /* atomic operations only */
+    gint modified_no_copy_range;  /* atomic operations only */
+    GMutex *incomplete_lock;
+    GHashTable *incomplete_chunks;
 
     /* stats */
     struct vmnetfs_stream_group *io_stream;
@@ -73,23 +203,56 @@ struct vmnetfs_image {
     struct vmnetfs_stat *chunk_fetches;
     struct vmnetfs_stat *chunk_dirties;
     struct vmnetfs_stat *io_errors;
+    struct vmnetfs_stat *bytes_salvaged;
+    struct vmnetfs_stat *buffer_pool_used;
+    struct vmnetfs_stat *buffer_pool_misses;
+    struct vmnetfs_stat *chunk_copies_reflink;
+    struct vmnetfs_stat *chunk_copies_kernel;
+    struct vmnetfs_stat *chunk_copies_user;
+    struct vmnetfs_stat *chunk_discards;
+    struct vmnetfs_stat *chunks_zero;
+    struct vmnetfs_stat *chunk_store_hits;
+    struct vmnetfs_stat *chunk_shared_hits;
+    struct vmnetfs_stat *bytes_fetched_peer;
+    struct vmnetfs_stat *bytes_fetched_origin;
+    struct vmnetfs_stat *compressed_bytes_raw;
+    struct vmnetfs_stat *compressed_bytes_stored;
+    struct vmnetfs_stat *chunk_decompressions;
+    struct vmnetfs_stat *decompress_usecs;
+    struct vmnetfs_stat *ram_cache_hits;
+    struct vmnetfs_stat *ram_cache_misses;
+    struct vmnetfs_stat *ram_cache_evictions;
+    struct vmnetfs_stat *uring_submits;
+    struct vmnetfs_stat *uring_reads;
+    struct vmnetfs_stat *bytes_spliced;
+    struct vmnetfs_stat *fill_rate;
 };
 
 struct vmnetfs_fuse {
     struct vmnetfs *fs;
     char *mountpoint;
     struct vmnetfs_fuse_dentry *root;
-    struct fuse *fuse;
-    struct fuse_chan *chan;
+    GPtrArray *inodes;  /* dentries, indexed by inode number */
+    GMutex *tree_lock;  /* for inodes and the root's children */
+    GSList *attachments;
+    struct fuse_session *session;
+    uint32_t max_io;
+    GThreadPool *reply_pool;
+    GMutex *pending_lock;
+    GCond *pending_drained;
+    uint32_t pending_reads;
 };
 
 struct vmnetfs_fuse_fh {
     const struct vmnetfs_fuse_ops *ops;
+    struct vmnetfs_fuse_dentry *dentry;
+    uint64_t ino;
     void *data;
     void *buf;
     uint64_t length;
     uint64_t change_cookie;
     bool blocking;
+    bool kernel_cache;
 };
 
 struct fuse_pollhandle;
@@ -99,10 +262,20 @@ struct vmnetfs_fuse_ops {
     int (*open)(void *dentry_ctx, struct vmnetfs_fuse_fh *fh);
     int (*read)(struct vmnetfs_fuse_fh *fh, void *buf, uint64_t start,
             uint64_t count);
+    int (*read_defer)(struct vmnetfs_fuse_fh *fh, uint64_t start,
+            uint64_t count, void (*ready)(void *arg), void *arg);
+    /* Alternative to read that can point at file contents; segs holds
+       struct vmnetfs_segment and is passed to release_segments after
+       the reply */
+    int (*read_segments)(struct vmnetfs_fuse_fh *fh, GArray *segs,
+            uint64_t start, uint64_t count);
+    void (*release_segments)(struct vmnetfs_fuse_fh *fh, GArray *segs);
     int (*write)(struct vmnetfs_fuse_fh *fh, const void *buf,
             uint64_t start, uint64_t count);
     int (*poll)(struct vmnetfs_fuse_fh *fh, struct fuse_pollhandle *ph,
             bool *readable);
+    int (*fallocate)(struct vmnetfs_fuse_fh *fh, int mode, uint64_t start,
+            uint64_t count);
     void (*release)(struct vmnetfs_fuse_fh *fh);
     bool nonseekable;
 };
@@ -119,6 +292,16 @@ struct vmnetfs_cursor {
     uint64_t count;
 };
 
+/* Part of a read: either a range of an open file or a buffer */
+struct vmnetfs_segment {
+    int fd;  // -1 if the data is in buf
+    bool close_fd;
+    uint64_t pos;
+    void *buf;
+    uint64_t length;
+    uint64_t chunk;  // held locked until the segment is released
+};
+
 #define VMNETFS_CONFIG_ERROR _vmnetfs_config_error_quark()
 #define VMNETFS_FUSE_ERROR _vmnetfs_fuse_error_quark()
 #define VMNETFS_IO_ERROR _vmnetfs_io_error_quark()
@@ -133,6 +316,8 @@ enum VMNetFSConfigError {
 enum VMNetFSFUSEError {
     VMNETFS_FUSE_ERROR_FAILED,
     VMNETFS_FUSE_ERROR_BAD_MOUNTPOINT,
+    VMNETFS_FUSE_ERROR_EXISTS,
+    VMNETFS_FUSE_ERROR_NOT_FOUND,
 };
 
 enum VMNetFSIOError {
@@ -157,14 +342,24 @@ struct vmnetfs_fuse *_vmnetfs_fuse_new(struct vmnetfs *fs, GError **err);
 void _vmnetfs_fuse_run(struct vmnetfs_fuse *fuse);
 void _vmnetfs_fuse_terminate(struct vmnetfs_fuse *fuse);
 void _vmnetfs_fuse_free(struct vmnetfs_fuse *fuse);
+bool _vmnetfs_fuse_attach(struct vmnetfs_fuse *fuse, const char *name,
+        GHashTable *images, void (*destroy)(void *data), void *data,
+        GError **err);
+bool _vmnetfs_fuse_exists(struct vmnetfs_fuse *fuse, const char *name);
+bool _vmnetfs_fuse_detach(struct vmnetfs_fuse *fuse, const char *name,
+        GError **err);
 struct vmnetfs_fuse_dentry *_vmnetfs_fuse_add_dir(
         struct vmnetfs_fuse_dentry *parent, const char *name);
 void _vmnetfs_fuse_add_file(struct vmnetfs_fuse_dentry *parent,
         const char *name, const struct vmnetfs_fuse_ops *ops, void *ctx);
 void _vmnetfs_fuse_image_populate(struct vmnetfs_fuse_dentry *dir,
         struct vmnetfs_image *img);
+void _vmnetfs_fuse_image_invalidate(struct vmnetfs_image *img,
+        uint64_t start, uint64_t count);
 void _vmnetfs_fuse_stats_populate(struct vmnetfs_fuse_dentry *dir,
         struct vmnetfs_image *img);
+void _vmnetfs_fuse_stats_populate_root(struct vmnetfs_fuse_dentry *dir,
+        struct vmnetfs *fs);
 void _vmnetfs_fuse_stream_populate(struct vmnetfs_fuse_dentry *dir,
         struct vmnetfs_image *img);
 void _vmnetfs_fuse_stream_populate_root(struct vmnetfs_fuse_dentry *dir,
@@ -172,22 +367,105 @@ void _vmnetfs_fuse_stream_populate_root(struct vmnetfs_fuse_dentry *dir,
 void _vmnetfs_fuse_misc_populate_root(struct vmnetfs_fuse_dentry *dir,
         struct vmnetfs *fs);
 bool _vmnetfs_fuse_interrupted(void);
+void _vmnetfs_fuse_invalidate(uint64_t ino, uint64_t start, uint64_t count);
 int _vmnetfs_fuse_readonly_pseudo_file_getattr(void *dentry_ctx,
         struct stat *st);
 int _vmnetfs_fuse_buffered_file_read(struct vmnetfs_fuse_fh *fh, void *buf,
         uint64_t start, uint64_t count);
 void _vmnetfs_fuse_buffered_file_release(struct vmnetfs_fuse_fh *fh);
 
+struct vmnetfs_uring_batch;
+
+/* vmnetfs */
+void _vmnetfs_images_foreach(struct vmnetfs *fs, GHFunc func, void *data);
+GSList *_vmnetfs_images_hold(struct vmnetfs *fs);
+void _vmnetfs_images_release(struct vmnetfs *fs, GSList *imgs);
+char *_vmnetfs_attach(struct vmnetfs *fs, const char *name,
+        GIOChannel *chan, GError **err);
+bool _vmnetfs_detach(struct vmnetfs *fs, const char *name, GError **err);
+struct vmnetfs_image *_vmnetfs_proxy_origin_get(struct vmnetfs *fs,
+        const char *url, const char *read_base, uint64_t size,
+        uint32_t chunk_size, const char *etag, time_t last_modified,
+        GError **err);
+void _vmnetfs_proxy_origin_put(struct vmnetfs *fs,
+        struct vmnetfs_image *origin);
+
+/* control */
+bool _vmnetfs_control_init(struct vmnetfs *fs, GError **err);
+void _vmnetfs_control_close(struct vmnetfs *fs);
+void _vmnetfs_control_destroy(struct vmnetfs *fs);
+
+/* proxy */
+bool _vmnetfs_proxy_init(struct vmnetfs *fs, GError **err);
+void _vmnetfs_proxy_close(struct vmnetfs *fs);
+void _vmnetfs_proxy_destroy(struct vmnetfs *fs);
+void _vmnetfs_proxy_prune(struct vmnetfs *fs);
+
+/* peer */
+bool _vmnetfs_peer_init(struct vmnetfs *fs, GError **err);
+void _vmnetfs_peer_close(struct vmnetfs *fs);
+void _vmnetfs_peer_destroy(struct vmnetfs *fs);
+void _vmnetfs_peer_add_image(struct vmnetfs *fs, struct vmnetfs_image *img);
+void _vmnetfs_peer_remove_image(struct vmnetfs *fs,
+        struct vmnetfs_image *img);
+bool _vmnetfs_peer_fetch(struct vmnetfs_image *img, void *buf,
+        uint64_t chunk, uint32_t length, bool (*should_stop)(void *arg),
+        void *arg);
+
+/* prefetch */
+void _vmnetfs_prefetch_init(struct vmnetfs_image *img);
+void _vmnetfs_prefetch_close(struct vmnetfs_image *img);
+void _vmnetfs_prefetch_destroy(struct vmnetfs_image *img);
+bool _vmnetfs_prefetch_queue(struct vmnetfs_image *img, uint64_t start,
+        uint64_t count, int priority, uint32_t *id, GError **err);
+bool _vmnetfs_prefetch_cancel(struct vmnetfs_image *img, uint32_t id);
+void _vmnetfs_prefetch_cancel_all(struct vmnetfs_image *img);
+void _vmnetfs_prefetch_pin(struct vmnetfs_image *img, uint64_t start,
+        uint64_t count, bool pinned);
+struct vmnetfs_stream_group *_vmnetfs_prefetch_get_stream_group(
+        struct vmnetfs_image *img);
+bool _vmnetfs_prefetch_is_idle(struct vmnetfs_image *img);
+
+/* fill */
+bool _vmnetfs_fill_start(struct vmnetfs_image *img, GError **err);
+void _vmnetfs_fill_stop(struct vmnetfs_image *img);
+void _vmnetfs_fill_destroy(struct vmnetfs_image *img);
+void _vmnetfs_fill_note_demand(struct vmnetfs_image *img, uint64_t bytes);
+
+/* fsmap */
+bool _vmnetfs_fsmap_start(struct vmnetfs_image *img, GError **err);
+void _vmnetfs_fsmap_stop(struct vmnetfs_image *img);
+void _vmnetfs_fsmap_destroy(struct vmnetfs_image *img);
+void _vmnetfs_fsmap_note_read(struct vmnetfs_image *img, uint64_t start,
+        uint64_t count);
+
 /* io */
 bool _vmnetfs_io_init(struct vmnetfs_image *img, GError **err);
+bool _vmnetfs_io_init_origin(struct vmnetfs_image *img, GError **err);
+void _vmnetfs_io_destroy_origin(struct vmnetfs_image *img);
 void _vmnetfs_io_open(struct vmnetfs_image *img);
 void _vmnetfs_io_close(struct vmnetfs_image *img);
 bool _vmnetfs_io_image_is_closed(struct vmnetfs_image *img);
 void _vmnetfs_io_destroy(struct vmnetfs_image *img);
+uint64_t _vmnetfs_io_read(struct vmnetfs_image *img, void *data,
+        uint64_t start, uint64_t count, GError **err);
 uint64_t _vmnetfs_io_read_chunk(struct vmnetfs_image *img, void *data,
         uint64_t chunk, uint32_t offset, uint32_t length, GError **err);
+uint64_t _vmnetfs_io_peek_chunk(struct vmnetfs_image *img, void *data,
+        uint64_t chunk, uint32_t offset, uint32_t length, GError **err);
+uint64_t _vmnetfs_io_read_segments(struct vmnetfs_image *img, GArray *segs,
+        uint64_t start, uint64_t count, GError **err);
+void _vmnetfs_io_release_segments(struct vmnetfs_image *img, GArray *segs);
+int _vmnetfs_io_fetch_async(struct vmnetfs_image *img, uint64_t start,
+        uint64_t count, enum fetch_priority priority,
+        void (*ready)(void *arg), void *arg);
 uint64_t _vmnetfs_io_write_chunk(struct vmnetfs_image *img, const void *data,
         uint64_t chunk, uint32_t offset, uint32_t length, GError **err);
+bool _vmnetfs_io_discard_chunk(struct vmnetfs_image *img, uint64_t chunk,
+        uint32_t offset, uint32_t length, GError **err);
+bool _vmnetfs_io_evict_chunk(GSList *imgs, uint64_t chunk);
+void _vmnetfs_io_notify_changed(struct vmnetfs_image *img, uint64_t start,
+        uint64_t count);
 uint64_t _vmnetfs_io_get_image_size(struct vmnetfs_image *img,
         uint64_t *change_cookie);
 bool _vmnetfs_io_set_image_size(struct vmnetfs_image *img, uint64_t size,
@@ -198,20 +476,143 @@ bool _vmnetfs_io_image_size_add_poll_handle(struct vmnetfs_image *img,
 /* ll_pristine */
 bool _vmnetfs_ll_pristine_init(struct vmnetfs_image *img, GError **err);
 void _vmnetfs_ll_pristine_destroy(struct vmnetfs_image *img);
+int _vmnetfs_ll_pristine_open_chunk(struct vmnetfs_image *img,
+        uint64_t chunk, GError **err);
 bool _vmnetfs_ll_pristine_read_chunk(struct vmnetfs_image *img, void *data,
         uint64_t chunk, uint32_t offset, uint32_t length, GError **err);
+int _vmnetfs_ll_pristine_queue_read(struct vmnetfs_image *img,
+        struct vmnetfs_uring_batch *batch, void *data, uint64_t chunk,
+        uint32_t offset, uint32_t length);
 bool _vmnetfs_ll_pristine_write_chunk(struct vmnetfs_image *img, void *data,
         uint64_t chunk, uint32_t length, GError **err);
+bool _vmnetfs_ll_pristine_import_chunk(struct vmnetfs_image *img,
+        uint64_t chunk);
+bool _vmnetfs_ll_pristine_adopt_chunk(struct vmnetfs_image *img,
+        uint64_t chunk);
+bool _vmnetfs_ll_pristine_evict_chunk(struct vmnetfs_image *img,
+        uint64_t chunk);
+
+/* shared_map */
+bool _vmnetfs_shared_map_init(struct vmnetfs_image *img, GError **err);
+void _vmnetfs_shared_map_destroy(struct vmnetfs_image *img);
+bool _vmnetfs_shared_map_test(struct vmnetfs_image *img, uint64_t chunk);
+void _vmnetfs_shared_map_set(struct vmnetfs_image *img, uint64_t chunk);
+void _vmnetfs_shared_map_clear(struct vmnetfs_image *img, uint64_t chunk);
+bool _vmnetfs_shared_map_lease(struct vmnetfs_image *img, uint64_t chunk,
+        bool (*should_stop)(void *arg), void *arg);
+void _vmnetfs_shared_map_release(struct vmnetfs_image *img, uint64_t chunk);
+
+/* writeback */
+bool _vmnetfs_writeback_init(struct vmnetfs_image *img, GError **err);
+void _vmnetfs_writeback_destroy(struct vmnetfs_image *img);
+void _vmnetfs_writeback_throttle(struct vmnetfs_image *img);
+void _vmnetfs_writeback_queue(struct vmnetfs_image *img, void *buf,
+        uint64_t chunk, uint32_t length);
+bool _vmnetfs_writeback_read_chunk(struct vmnetfs_image *img, void *data,
+        uint64_t chunk, uint32_t offset, uint32_t length);
+bool _vmnetfs_writeback_contains(struct vmnetfs_image *img, uint64_t chunk);
+
+/* fetch */
+bool _vmnetfs_fetch_init(struct vmnetfs_image *img, GError **err);
+void _vmnetfs_fetch_destroy(struct vmnetfs_image *img);
+bool _vmnetfs_fetch_chunk(struct vmnetfs_image *img, void *data,
+        uint64_t chunk, uint32_t offset, uint32_t length,
+        enum fetch_priority priority, GError **err);
+bool _vmnetfs_fetch_chunk_async(struct vmnetfs_image *img, uint64_t chunk,
+        enum fetch_priority priority, void (*ready)(void *arg), void *arg);
+
+/* pool */
+bool _vmnetfs_pool_init(struct vmnetfs_image *img, GError **err);
+void _vmnetfs_pool_destroy(struct vmnetfs_image *img);
+void *_vmnetfs_pool_get(struct vmnetfs_image *img);
+void _vmnetfs_pool_put(struct vmnetfs_image *img, void *buf);
+void *_vmnetfs_pool_get_region(struct vmnetfs_image *img, uint64_t *len);
+bool _vmnetfs_pool_contains(struct vmnetfs_image *img, const void *buf);
+
+/* ramcache */
+void _vmnetfs_ramcache_init(struct vmnetfs_image *img);
+void _vmnetfs_ramcache_destroy(struct vmnetfs_image *img);
+bool _vmnetfs_ramcache_enabled(struct vmnetfs_image *img);
+bool _vmnetfs_ramcache_read(struct vmnetfs_image *img, void *data,
+        uint64_t chunk, bool modified, uint32_t offset, uint32_t length);
+void _vmnetfs_ramcache_insert(struct vmnetfs_image *img, const void *data,
+        uint64_t chunk, bool modified, uint32_t length);
+void _vmnetfs_ramcache_invalidate(struct vmnetfs_image *img, uint64_t chunk);
+void _vmnetfs_ramcache_truncate(struct vmnetfs_image *img,
+        uint64_t first_chunk);
+
+/* uring */
+void _vmnetfs_uring_init(struct vmnetfs_image *img);
+void _vmnetfs_uring_destroy(struct vmnetfs_image *img);
+struct vmnetfs_uring_batch *_vmnetfs_uring_batch_new(
+        struct vmnetfs_image *img);
+void _vmnetfs_uring_batch_free(struct vmnetfs_uring_batch *batch);
+int _vmnetfs_uring_batch_read_file(struct vmnetfs_uring_batch *batch,
+        const char *path, void *buf, uint32_t length, uint64_t offset);
+int _vmnetfs_uring_batch_read_image(struct vmnetfs_uring_batch *batch,
+        void *buf, uint32_t length, uint64_t offset);
+void _vmnetfs_uring_batch_submit(struct vmnetfs_uring_batch *batch);
+bool _vmnetfs_uring_batch_result(struct vmnetfs_uring_batch *batch,
+        int opnum, GError **err);
+void _vmnetfs_uring_batch_clear(struct vmnetfs_uring_batch *batch);
+
+/* store */
+bool _vmnetfs_store_init(struct vmnetfs_image *img, GError **err);
+void _vmnetfs_store_destroy(struct vmnetfs_image *img);
+bool _vmnetfs_store_link_chunk(struct vmnetfs_image *img, uint64_t chunk,
+        uint32_t length, bool compressed, const char *file);
+void _vmnetfs_store_add_chunk(struct vmnetfs_image *img, uint64_t chunk,
+        const void *data, uint32_t length, bool compressed,
+        const char *file);
+bool _vmnetfs_store_verify_chunk(struct vmnetfs_image *img, uint64_t chunk,
+        const void *data, uint32_t length);
+
+/* nbd */
+bool _vmnetfs_nbd_init(struct vmnetfs_image *img, GError **err);
+void _vmnetfs_nbd_close(struct vmnetfs_image *img);
+void _vmnetfs_nbd_destroy(struct vmnetfs_image *img);
+
+/* blake2b */
+void _vmnetfs_blake2b(void *out, const void *data, uint64_t len);
+
+/* cache */
+bool _vmnetfs_cache_init(struct vmnetfs *fs, GError **err);
+void _vmnetfs_cache_close(struct vmnetfs *fs);
+void _vmnetfs_cache_stop(struct vmnetfs *fs);
+void _vmnetfs_cache_destroy(struct vmnetfs *fs);
+bool _vmnetfs_cache_open_image(struct vmnetfs_image *img, GError **err);
+void _vmnetfs_cache_close_image(struct vmnetfs_image *img);
+void _vmnetfs_cache_note_write(struct vmnetfs_image *img, uint64_t bytes);
+void _vmnetfs_cache_note_fill(struct vmnetfs_image *img, uint64_t chunk);
+bool _vmnetfs_cache_is_full(struct vmnetfs_image *img);
+GArray *_vmnetfs_cache_get_used_chunks(struct vmnetfs_image *img);
 
 /* ll_modified */
 bool _vmnetfs_ll_modified_init(struct vmnetfs_image *img, GError **err);
 void _vmnetfs_ll_modified_destroy(struct vmnetfs_image *img);
+bool _vmnetfs_ll_modified_chunk_is_incomplete(struct vmnetfs_image *img,
+        uint64_t chunk);
+bool _vmnetfs_ll_modified_can_write_sectors(struct vmnetfs_image *img,
+        uint64_t chunk, uint32_t offset, uint32_t length);
+bool _vmnetfs_ll_modified_range_is_dirty(struct vmnetfs_image *img,
+        uint64_t chunk, uint32_t offset, uint32_t length);
 bool _vmnetfs_ll_modified_read_chunk(struct vmnetfs_image *img,
         uint64_t image_size, void *data, uint64_t chunk, uint32_t offset,
         uint32_t length, GError **err);
+int _vmnetfs_ll_modified_queue_read(struct vmnetfs_image *img,
+        struct vmnetfs_uring_batch *batch, void *data, uint64_t chunk,
+        uint32_t offset, uint32_t length);
 bool _vmnetfs_ll_modified_write_chunk(struct vmnetfs_image *img,
         uint64_t image_size, const void *data, uint64_t chunk,
         uint32_t offset, uint32_t length, GError **err);
+bool _vmnetfs_ll_modified_discard_chunk(struct vmnetfs_image *img,
+        uint64_t image_size, uint64_t chunk, uint32_t length, GError **err);
+bool _vmnetfs_ll_modified_complete_chunk(struct vmnetfs_image *img,
+        uint64_t image_size, const void *pristine, uint64_t chunk,
+        GError **err);
+bool _vmnetfs_ll_modified_clone_chunk(struct vmnetfs_image *img,
+        uint64_t image_size, int fd, uint64_t chunk, uint32_t length,
+        GError **err);
 bool _vmnetfs_ll_modified_set_size(struct vmnetfs_image *img,
         uint64_t current_size, uint64_t new_size, GError **err);
 
@@ -229,12 +630,20 @@ bool _vmnetfs_transport_fetch(struct connection_pool *cpool, const char *url,
         time_t last_modified, void *buf, uint64_t offset, uint64_t length,
         should_cancel_fn *should_cancel, void *should_cancel_arg,
         GError **err);
+bool _vmnetfs_transport_fetch_once(struct connection_pool *cpool,
+        const char *url, const char *username, const char *password,
+        const char *etag, time_t last_modified, void *buf, uint64_t offset,
+        uint64_t length, should_cancel_fn *should_cancel,
+        void *should_cancel_arg, GError **err);
 bool _vmnetfs_transport_fetch_stream_once(struct connection_pool *cpool,
         const char *url, const char *username, const char *password,
         const char *etag, time_t last_modified, stream_fn *callback,
         void *arg, uint64_t offset, uint64_t length,
         should_cancel_fn *should_cancel, void *should_cancel_arg,
         GError **err);
+bool _vmnetfs_transport_get_info(struct connection_pool *cpool,
+        const char *url, uint64_t *size, char **etag, time_t *last_modified,
+        GError **err);
 
 /* bitmap */
 struct bitmap_group *_vmnetfs_bit_group_new(uint64_t initial_bits);
@@ -244,6 +653,7 @@ void _vmnetfs_bit_group_close(struct bitmap_group *mgrp);
 struct bitmap *_vmnetfs_bit_new(struct bitmap_group *mgrp, bool set_on_extend);
 void _vmnetfs_bit_free(struct bitmap *map);
 void _vmnetfs_bit_set(struct bitmap *map, uint64_t bit);
+void _vmnetfs_bit_clear(struct bitmap *map, uint64_t bit);
 bool _vmnetfs_bit_test(struct bitmap *map, uint64_t bit);
 struct vmnetfs_stream_group *_vmnetfs_bit_get_stream_group(struct bitmap *map);
 
@@ -273,6 +683,8 @@ void _vmnetfs_stat_free(struct vmnetfs_stat *stat);
 bool _vmnetfs_stat_add_poll_handle(struct vmnetfs_stat *stat,
         struct fuse_pollhandle *ph, uint64_t change_cookie);
 void _vmnetfs_u64_stat_increment(struct vmnetfs_stat *stat, uint64_t val);
+void _vmnetfs_u64_stat_decrement(struct vmnetfs_stat *stat, uint64_t val);
+void _vmnetfs_u64_stat_set(struct vmnetfs_stat *stat, uint64_t val);
 uint64_t _vmnetfs_u64_stat_get(struct vmnetfs_stat *stat,
         uint64_t *change_cookie);
 
@@ -311,6 +723,7 @@ bool _vmnetfs_safe_pread(const char *file, int fd, void *buf, uint64_t count,
         uint64_t offset, GError **err);
 bool _vmnetfs_safe_pwrite(const char *file, int fd, const void *buf,
         uint64_t count, uint64_t offset, GError **err);
+bool _vmnetfs_buffer_is_zero(const void *buf, uint64_t count);
 void _vmnetfs_cursor_start(struct vmnetfs_image *img,
         struct vmnetfs_cursor *cur, uint64_t start, uint64_t count);
 bool _vmnetfs_cursor_chunk(struct vmnetfs_cursor *cur, uint64_t count);
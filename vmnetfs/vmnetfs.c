@@ -30,6 +30,62 @@
 #include <libxml/xpathInternals.h>
 #include "vmnetfs-private.h"
 
+/* Pristine state shared by the attached images using one cache
+   directory.  Protected by the images_lock. */
+struct vmnetfs_origin {
+    struct vmnetfs_image *img;
+    uint32_t refs;
+    bool dying;  /* being destroyed outside the lock */
+};
+
+/* A set of images attached through the control socket */
+struct vmnetfs_instance {
+    struct vmnetfs *fs;
+    char *name;
+    GHashTable *images;
+    /* Protected by the images_lock */
+    uint32_t refs;  /* images in lists from _vmnetfs_images_hold() */
+    bool freed;  /* destroy when the last reference is released */
+};
+
+static struct vmnetfs_image *image_new(void)
+{
+    struct vmnetfs_image *img;
+
+    img = g_slice_new0(struct vmnetfs_image);
+    img->io_stream = _vmnetfs_stream_group_new(NULL, NULL);
+    img->bytes_read = _vmnetfs_stat_new();
+    img->bytes_written = _vmnetfs_stat_new();
+    img->chunk_fetch_skips = _vmnetfs_stat_new();
+    img->chunk_fetches = _vmnetfs_stat_new();
+    img->chunk_dirties = _vmnetfs_stat_new();
+    img->io_errors = _vmnetfs_stat_new();
+    img->bytes_salvaged = _vmnetfs_stat_new();
+    img->buffer_pool_used = _vmnetfs_stat_new();
+    img->buffer_pool_misses = _vmnetfs_stat_new();
+    img->chunk_copies_reflink = _vmnetfs_stat_new();
+    img->chunk_copies_kernel = _vmnetfs_stat_new();
+    img->chunk_copies_user = _vmnetfs_stat_new();
+    img->chunk_discards = _vmnetfs_stat_new();
+    img->chunks_zero = _vmnetfs_stat_new();
+    img->chunk_store_hits = _vmnetfs_stat_new();
+    img->chunk_shared_hits = _vmnetfs_stat_new();
+    img->bytes_fetched_peer = _vmnetfs_stat_new();
+    img->bytes_fetched_origin = _vmnetfs_stat_new();
+    img->compressed_bytes_raw = _vmnetfs_stat_new();
+    img->compressed_bytes_stored = _vmnetfs_stat_new();
+    img->chunk_decompressions = _vmnetfs_stat_new();
+    img->decompress_usecs = _vmnetfs_stat_new();
+    img->ram_cache_hits = _vmnetfs_stat_new();
+    img->ram_cache_misses = _vmnetfs_stat_new();
+    img->ram_cache_evictions = _vmnetfs_stat_new();
+    img->uring_submits = _vmnetfs_stat_new();
+    img->uring_reads = _vmnetfs_stat_new();
+    img->bytes_spliced = _vmnetfs_stat_new();
+    img->fill_rate = _vmnetfs_stat_new();
+    return img;
+}
+
 static void _image_free(struct vmnetfs_image *img)
 {
     _vmnetfs_stream_group_free(img->io_stream);
@@ -39,7 +95,31 @@ static void _image_free(struct vmnetfs_image *img)
     _vmnetfs_stat_free(img->chunk_fetches);
     _vmnetfs_stat_free(img->chunk_dirties);
     _vmnetfs_stat_free(img->io_errors);
+    _vmnetfs_stat_free(img->bytes_salvaged);
+    _vmnetfs_stat_free(img->buffer_pool_used);
+    _vmnetfs_stat_free(img->buffer_pool_misses);
+    _vmnetfs_stat_free(img->chunk_copies_reflink);
+    _vmnetfs_stat_free(img->chunk_copies_kernel);
+    _vmnetfs_stat_free(img->chunk_copies_user);
+    _vmnetfs_stat_free(img->chunk_discards);
+    _vmnetfs_stat_free(img->chunks_zero);
+    _vmnetfs_stat_free(img->chunk_store_hits);
+    _vmnetfs_stat_free(img->chunk_shared_hits);
+    _vmnetfs_stat_free(img->bytes_fetched_peer);
+    _vmnetfs_stat_free(img->bytes_fetched_origin);
+    _vmnetfs_stat_free(img->compressed_bytes_raw);
+    _vmnetfs_stat_free(img->compressed_bytes_stored);
+    _vmnetfs_stat_free(img->chunk_decompressions);
+    _vmnetfs_stat_free(img->decompress_usecs);
+    _vmnetfs_stat_free(img->ram_cache_hits);
+    _vmnetfs_stat_free(img->ram_cache_misses);
+    _vmnetfs_stat_free(img->ram_cache_evictions);
+    _vmnetfs_stat_free(img->uring_submits);
+    _vmnetfs_stat_free(img->uring_reads);
+    _vmnetfs_stat_free(img->bytes_spliced);
+    _vmnetfs_stat_free(img->fill_rate);
     g_free(img->url);
+    g_free(img->proxy_url);
     g_free(img->username);
     g_free(img->password);
     while (img->cookies) {
@@ -47,7 +127,12 @@ static void _image_free(struct vmnetfs_image *img)
         img->cookies = g_list_delete_link(img->cookies, img->cookies);
     }
     g_free(img->read_base);
+    g_free(img->zero_chunks);
+    g_free(img->store_path);
+    g_free(img->store_index);
+    g_free(img->peer_key);
     g_free(img->etag);
+    g_free(img->nbd_socket);
     g_slice_free(struct vmnetfs_image, img);
 }
 
@@ -55,6 +140,7 @@ static void image_free(void *data)
 {
     struct vmnetfs_image *img = data;
 
+    _vmnetfs_nbd_destroy(img);
     _vmnetfs_io_destroy(img);
     _image_free(img);
 }
@@ -286,8 +372,181 @@ static void xpath_censor(xmlXPathContextPtr ctx, const char *xpath)
     xmlXPathFreeObject(result);
 }
 
-static bool image_add(GHashTable *images, xmlDocPtr args,
-        xmlNodePtr image_args, GError **err)
+static bool origin_compatible(struct vmnetfs_image *origin,
+        struct vmnetfs_image *img)
+{
+    return !strcmp(origin->url, img->url) &&
+            origin->fetch_offset == img->fetch_offset &&
+            origin->initial_size == img->initial_size &&
+            origin->chunk_size == img->chunk_size &&
+            origin->compress == img->compress &&
+            !g_strcmp0(origin->store_path, img->store_path) &&
+            !g_strcmp0(origin->etag, img->etag) &&
+            origin->last_modified == img->last_modified;
+}
+
+/* The origin fetches with the credentials and cookies of the first image
+   attached to it. */
+static struct vmnetfs_image *origin_new(struct vmnetfs *fs,
+        struct vmnetfs_image *img, GError **err)
+{
+    struct vmnetfs_image *origin;
+    GList *cur;
+
+    origin = image_new();
+    origin->url = g_strdup(img->url);
+    origin->proxy_url = g_strdup(img->proxy_url);
+    origin->username = g_strdup(img->username);
+    origin->password = g_strdup(img->password);
+    for (cur = g_list_last(img->cookies); cur != NULL; cur = cur->prev) {
+        origin->cookies = g_list_prepend(origin->cookies,
+                g_strdup(cur->data));
+    }
+    origin->read_base = g_strdup(img->read_base);
+    origin->zero_chunks = g_strdup(img->zero_chunks);
+    origin->store_path = g_strdup(img->store_path);
+    origin->store_index = g_strdup(img->store_index);
+    origin->peer_key = g_strdup(img->peer_key);
+    origin->compress = img->compress;
+    origin->fetch_offset = img->fetch_offset;
+    origin->initial_size = img->initial_size;
+    origin->chunk_size = img->chunk_size;
+    origin->etag = g_strdup(img->etag);
+    origin->last_modified = img->last_modified;
+    origin->pool_buffers = img->pool_buffers;
+    origin->pool_hugepages = img->pool_hugepages;
+    origin->cache = fs->cache;
+    if (!_vmnetfs_io_init_origin(origin, err)) {
+        _image_free(origin);
+        return NULL;
+    }
+    _vmnetfs_peer_add_image(fs, origin);
+    return origin;
+}
+
+/* Point an attached image at the origin for its cache directory,
+   creating the origin if necessary.  Attaches must be serialized. */
+static bool origin_get(struct vmnetfs *fs, struct vmnetfs_image *img,
+        GError **err)
+{
+    struct vmnetfs_origin *origin;
+    struct vmnetfs_image *origin_img;
+    GHashTableIter iter;
+    void *value;
+
+    /* Images from the startup config are not shared */
+    g_hash_table_iter_init(&iter, fs->images);
+    while (g_hash_table_iter_next(&iter, NULL, &value)) {
+        if (!strcmp(((struct vmnetfs_image *) value)->read_base,
+                img->read_base)) {
+            g_set_error(err, VMNETFS_CONFIG_ERROR,
+                    VMNETFS_CONFIG_ERROR_INVALID_CONFIG,
+                    "Cache %s is in use by another image", img->read_base);
+            return false;
+        }
+    }
+
+    g_mutex_lock(fs->images_lock);
+    /* A new origin can't use the cache until the old one is gone */
+    while ((origin = g_hash_table_lookup(fs->origins, img->read_base)) !=
+            NULL && origin->dying) {
+        g_cond_wait(fs->origin_destroyed, fs->images_lock);
+    }
+    if (origin != NULL) {
+        if (!origin_compatible(origin->img, img)) {
+            g_mutex_unlock(fs->images_lock);
+            g_set_error(err, VMNETFS_CONFIG_ERROR,
+                    VMNETFS_CONFIG_ERROR_INVALID_CONFIG,
+                    "Cache %s is in use by a different image",
+                    img->read_base);
+            return false;
+        }
+        origin->refs++;
+        img->origin = origin->img;
+        g_mutex_unlock(fs->images_lock);
+        return true;
+    }
+    g_mutex_unlock(fs->images_lock);
+
+    origin_img = origin_new(fs, img, err);
+    if (origin_img == NULL) {
+        return false;
+    }
+    origin = g_slice_new0(struct vmnetfs_origin);
+    origin->img = origin_img;
+    origin->refs = 1;
+    g_mutex_lock(fs->images_lock);
+    g_hash_table_insert(fs->origins, origin_img->read_base, origin);
+    g_mutex_unlock(fs->images_lock);
+    img->origin = origin_img;
+    return true;
+}
+
+/* The last image using an origin must already have been destroyed.  The
+   origin is destroyed outside the lock, since that waits for its fetches
+   and writeback, but stays in the table until it is gone so that a new
+   origin for the same cache can't be created in the meantime. */
+static void origin_put(struct vmnetfs *fs, struct vmnetfs_image *img)
+{
+    struct vmnetfs_origin *origin;
+
+    g_mutex_lock(fs->images_lock);
+    origin = g_hash_table_lookup(fs->origins, img->read_base);
+    g_assert(origin != NULL && origin->img == img && !origin->dying);
+    if (--origin->refs > 0) {
+        g_mutex_unlock(fs->images_lock);
+        return;
+    }
+    origin->dying = true;
+    g_mutex_unlock(fs->images_lock);
+
+    _vmnetfs_peer_remove_image(fs, img);
+    _vmnetfs_io_destroy_origin(img);
+
+    g_mutex_lock(fs->images_lock);
+    g_hash_table_remove(fs->origins, img->read_base);
+    g_cond_broadcast(fs->origin_destroyed);
+    g_mutex_unlock(fs->images_lock);
+    _image_free(img);
+    g_slice_free(struct vmnetfs_origin, origin);
+}
+
+/* Get the pristine state for a resource served by the cache proxy.
+   Calls must be serialized with each other. */
+struct vmnetfs_image *_vmnetfs_proxy_origin_get(struct vmnetfs *fs,
+        const char *url, const char *read_base, uint64_t size,
+        uint32_t chunk_size, const char *etag, time_t last_modified,
+        GError **err)
+{
+    struct vmnetfs_image *img;
+    struct vmnetfs_image *origin = NULL;
+
+    img = image_new();
+    img->url = g_strdup(url);
+    img->read_base = g_strdup(read_base);
+    img->initial_size = size;
+    img->chunk_size = chunk_size;
+    img->etag = g_strdup(etag);
+    img->last_modified = last_modified;
+    /* Chunks stay uncompressed so they can be sent with sendfile() */
+    img->compress = false;
+    if (origin_get(fs, img, err)) {
+        origin = img->origin;
+    }
+    _image_free(img);
+    return origin;
+}
+
+void _vmnetfs_proxy_origin_put(struct vmnetfs *fs,
+        struct vmnetfs_image *origin)
+{
+    origin_put(fs, origin);
+}
+
+/* Images attached through the control socket share pristine state with
+   other attached images using the same cache directory. */
+static bool image_add(struct vmnetfs *fs, GHashTable *images,
+        xmlDocPtr args, xmlNodePtr image_args, bool shared, GError **err)
 {
     struct vmnetfs_image *img;
     xmlXPathContextPtr ctx;
@@ -299,8 +558,9 @@ static bool image_add(GHashTable *images, xmlDocPtr args,
     ctx = make_xpath_context(args);
     ctx->node = image_args;
 
-    img = g_slice_new0(struct vmnetfs_image);
+    img = image_new();
     img->url = xpath_get_str(ctx, "v:origin/v:url/text()");
+    img->proxy_url = xpath_get_str(ctx, "v:origin/v:cache-proxy/text()");
     img->username = xpath_get_str(ctx,
             "v:origin/v:credentials/v:username/text()");
     img->password = xpath_get_str(ctx,
@@ -310,10 +570,21 @@ static bool image_add(GHashTable *images, xmlDocPtr args,
     img->fetch_offset = xpath_get_uint(ctx, "v:origin/v:offset/text()");
     img->initial_size = xpath_get_uint(ctx, "v:size/text()");
     img->chunk_size = xpath_get_uint(ctx, "v:cache/v:chunk-size/text()");
+    img->store_path = xpath_get_str(ctx, "v:cache/v:store/v:path/text()");
+    img->store_index = xpath_get_str(ctx,
+            "v:cache/v:store/v:index/text()");
+    img->peer_key = xpath_get_str(ctx, "v:cache/v:peer-key/text()");
+    str = xpath_get_str(ctx, "v:cache/v:compression/text()");
+#ifdef HAVE_LZ4
+    img->compress = str && !strcmp(str, "lz4");
+#endif
+    g_free(str);
     img->etag = xpath_get_str(ctx, "v:origin/v:validators/v:etag/text()");
     img->last_modified = xpath_get_uint(ctx,
             "v:origin/v:validators/v:last-modified/text()");
 
+    img->zero_chunks = xpath_get_str(ctx, "v:zero-chunks/text()");
+
     str = xpath_get_str(ctx, "v:fetch/v:mode/text()");
     if (str && !strcmp(str, "stream")) {
         img->fetch_mode = FETCH_MODE_STREAM;
@@ -321,6 +592,35 @@ static bool image_add(GHashTable *images, xmlDocPtr args,
         img->fetch_mode = FETCH_MODE_DEMAND;
     }
     g_free(str);
+    if (img->fetch_mode == FETCH_MODE_DEMAND) {
+        str = xpath_get_str(ctx, "v:fetch/v:fill");
+        img->background_fill = str != NULL;
+        g_free(str);
+        img->fill_threshold = xpath_get_uint(ctx,
+                "v:fetch/v:fill/v:threshold/text()");
+        str = xpath_get_str(ctx, "v:fetch/v:fs-prefetch");
+        img->fs_prefetch = str != NULL;
+        g_free(str);
+        img->fs_prefetch_limit = xpath_get_uint(ctx,
+                "v:fetch/v:fs-prefetch/v:limit/text()");
+    }
+
+    img->pool_buffers = xpath_get_uint(ctx, "v:memory/v:buffers/text()");
+    img->ram_cache_size = xpath_get_uint(ctx,
+            "v:memory/v:ram-cache/text()");
+    str = xpath_get_str(ctx, "v:memory/v:hugepages/text()");
+    if (str && !strcmp(str, "none")) {
+        img->pool_hugepages = POOL_HUGEPAGES_NONE;
+    } else if (str && !strcmp(str, "explicit")) {
+        img->pool_hugepages = POOL_HUGEPAGES_EXPLICIT;
+    } else {
+        img->pool_hugepages = POOL_HUGEPAGES_TRANSPARENT;
+    }
+    g_free(str);
+    str = xpath_get_str(ctx, "v:memory/v:kernel-cache/text()");
+    img->kernel_cache = str && (!strcmp(str, "true") || !strcmp(str, "1"));
+    g_free(str);
+    img->nbd_socket = xpath_get_str(ctx, "v:nbd/v:socket/text()");
 
     obj = xmlXPathEval(BAD_CAST "v:origin/v:cookies/v:cookie/text()", ctx);
     for (i = 0; obj && obj->nodesetval && i < obj->nodesetval->nodeNr; i++) {
@@ -332,23 +632,32 @@ static bool image_add(GHashTable *images, xmlDocPtr args,
     xmlXPathFreeObject(obj);
     xpath_censor(ctx, "v:origin/v:cookies/v:cookie/text()");
 
-    img->io_stream = _vmnetfs_stream_group_new(NULL, NULL);
-    img->bytes_read = _vmnetfs_stat_new();
-    img->bytes_written = _vmnetfs_stat_new();
-    img->chunk_fetch_skips = _vmnetfs_stat_new();
-    img->chunk_fetches = _vmnetfs_stat_new();
-    img->chunk_dirties = _vmnetfs_stat_new();
-    img->io_errors = _vmnetfs_stat_new();
-
+    if (shared) {
+        img->cache = fs->cache;
+        if (!origin_get(fs, img, err)) {
+            goto bad;
+        }
+    }
     if (!_vmnetfs_io_init(img, err)) {
-        _image_free(img);
-        xmlXPathFreeContext(ctx);
-        return false;
+        goto bad;
+    }
+    if (!_vmnetfs_nbd_init(img, err)) {
+        goto bad_io;
     }
 
     g_hash_table_insert(images, xpath_get_str(ctx, "v:name/text()"), img);
     xmlXPathFreeContext(ctx);
     return true;
+
+bad_io:
+    _vmnetfs_io_destroy(img);
+bad:
+    if (img->origin != NULL) {
+        origin_put(fs, img->origin);
+    }
+    _image_free(img);
+    xmlXPathFreeContext(ctx);
+    return false;
 }
 
 static void image_open(void *key G_GNUC_UNUSED, void *value,
@@ -364,6 +673,7 @@ static void image_close(void *key G_GNUC_UNUSED, void *value,
 {
     struct vmnetfs_image *img = value;
 
+    _vmnetfs_nbd_close(img);
     _vmnetfs_io_close(img);
     _vmnetfs_stat_close(img->bytes_read);
     _vmnetfs_stat_close(img->bytes_written);
@@ -371,9 +681,251 @@ static void image_close(void *key G_GNUC_UNUSED, void *value,
     _vmnetfs_stat_close(img->chunk_fetches);
     _vmnetfs_stat_close(img->chunk_dirties);
     _vmnetfs_stat_close(img->io_errors);
+    _vmnetfs_stat_close(img->bytes_salvaged);
+    _vmnetfs_stat_close(img->buffer_pool_used);
+    _vmnetfs_stat_close(img->buffer_pool_misses);
+    _vmnetfs_stat_close(img->chunk_copies_reflink);
+    _vmnetfs_stat_close(img->chunk_copies_kernel);
+    _vmnetfs_stat_close(img->chunk_copies_user);
+    _vmnetfs_stat_close(img->chunk_discards);
+    _vmnetfs_stat_close(img->chunks_zero);
+    _vmnetfs_stat_close(img->chunk_store_hits);
+    _vmnetfs_stat_close(img->chunk_shared_hits);
+    _vmnetfs_stat_close(img->bytes_fetched_peer);
+    _vmnetfs_stat_close(img->bytes_fetched_origin);
+    _vmnetfs_stat_close(img->compressed_bytes_raw);
+    _vmnetfs_stat_close(img->compressed_bytes_stored);
+    _vmnetfs_stat_close(img->chunk_decompressions);
+    _vmnetfs_stat_close(img->decompress_usecs);
+    _vmnetfs_stat_close(img->ram_cache_hits);
+    _vmnetfs_stat_close(img->ram_cache_misses);
+    _vmnetfs_stat_close(img->ram_cache_evictions);
+    _vmnetfs_stat_close(img->uring_submits);
+    _vmnetfs_stat_close(img->uring_reads);
+    _vmnetfs_stat_close(img->bytes_spliced);
+    _vmnetfs_stat_close(img->fill_rate);
     _vmnetfs_stream_group_close(img->io_stream);
 }
 
+/* Call @func for every image, including attached ones.  images_lock
+   must be held. */
+void _vmnetfs_images_foreach(struct vmnetfs *fs, GHFunc func, void *data)
+{
+    GHashTableIter iter;
+    struct vmnetfs_instance *inst;
+    void *value;
+
+    g_hash_table_foreach(fs->images, func, data);
+    g_hash_table_iter_init(&iter, fs->instances);
+    while (g_hash_table_iter_next(&iter, NULL, &value)) {
+        inst = value;
+        g_hash_table_foreach(inst->images, func, data);
+    }
+}
+
+static void hold_image(void *key G_GNUC_UNUSED, void *value, void *data)
+{
+    struct vmnetfs_image *img = value;
+    GSList **imgs = data;
+
+    if (img->instance != NULL) {
+        img->instance->refs++;
+    }
+    *imgs = g_slist_prepend(*imgs, img);
+}
+
+/* Return a list of every image, including attached ones.  Detached
+   images are not destroyed until the list is passed to
+   _vmnetfs_images_release(), so the list can be walked without holding
+   the images_lock. */
+GSList *_vmnetfs_images_hold(struct vmnetfs *fs)
+{
+    GSList *imgs = NULL;
+
+    g_mutex_lock(fs->images_lock);
+    _vmnetfs_images_foreach(fs, hold_image, &imgs);
+    g_mutex_unlock(fs->images_lock);
+    return imgs;
+}
+
+static void collect_origin(void *key G_GNUC_UNUSED, void *value,
+        void *data)
+{
+    struct vmnetfs_image *img = value;
+    GSList **origins = data;
+
+    *origins = g_slist_prepend(*origins, img->origin);
+}
+
+static void instance_destroy(struct vmnetfs_instance *inst)
+{
+    struct vmnetfs *fs = inst->fs;
+    GSList *origins = NULL;
+
+    g_hash_table_foreach(inst->images, collect_origin, &origins);
+    g_hash_table_destroy(inst->images);
+    while (origins != NULL) {
+        origin_put(fs, origins->data);
+        origins = g_slist_delete_link(origins, origins);
+    }
+    g_free(inst->name);
+    g_slice_free(struct vmnetfs_instance, inst);
+}
+
+/* Called by the FUSE layer once the instance has been detached and
+   nothing in the filesystem refers to it, or at shutdown.  If the cache
+   manager still holds the images, they are destroyed when it releases
+   them. */
+static void instance_free(void *data)
+{
+    struct vmnetfs_instance *inst = data;
+    struct vmnetfs *fs = inst->fs;
+    bool held;
+
+    g_mutex_lock(fs->images_lock);
+    if (g_hash_table_lookup(fs->instances, inst->name) == inst) {
+        g_hash_table_remove(fs->instances, inst->name);
+    }
+    inst->freed = true;
+    held = inst->refs > 0;
+    g_mutex_unlock(fs->images_lock);
+    if (!held) {
+        instance_destroy(inst);
+    }
+}
+
+/* Release a list from _vmnetfs_images_hold(). */
+void _vmnetfs_images_release(struct vmnetfs *fs, GSList *imgs)
+{
+    struct vmnetfs_image *img;
+    struct vmnetfs_instance *inst;
+    GSList *dead = NULL;
+    GSList *cur;
+
+    g_mutex_lock(fs->images_lock);
+    for (cur = imgs; cur != NULL; cur = cur->next) {
+        img = cur->data;
+        inst = img->instance;
+        if (inst != NULL && --inst->refs == 0 && inst->freed) {
+            dead = g_slist_prepend(dead, inst);
+        }
+    }
+    g_mutex_unlock(fs->images_lock);
+    g_slist_free(imgs);
+    while (dead != NULL) {
+        instance_destroy(dead->data);
+        dead = g_slist_delete_link(dead, dead);
+    }
+}
+
+static void set_instance(void *key G_GNUC_UNUSED, void *value, void *data)
+{
+    struct vmnetfs_image *img = value;
+
+    img->instance = data;
+}
+
+static bool instance_name_valid(const char *name)
+{
+    return *name != 0 && strchr(name, '/') == NULL && strcmp(name, ".") &&
+            strcmp(name, "..") && strlen(name) < 256;
+}
+
+/* Read a config document from @chan and attach its images in a new
+   directory @name under the mountpoint.  Returns the path of the
+   directory.  Calls must be serialized. */
+char *_vmnetfs_attach(struct vmnetfs *fs, const char *name,
+        GIOChannel *chan, GError **err)
+{
+    struct vmnetfs_instance *inst;
+    xmlDocPtr args;
+    xmlXPathContextPtr xpath;
+    xmlXPathObjectPtr obj;
+    bool exists;
+    int i;
+
+    if (!instance_name_valid(name)) {
+        g_set_error(err, VMNETFS_CONFIG_ERROR,
+                VMNETFS_CONFIG_ERROR_INVALID_CONFIG,
+                "Invalid instance name");
+        return NULL;
+    }
+    /* Attach and detach are serialized, so the name stays free while we
+       build the instance */
+    g_mutex_lock(fs->images_lock);
+    exists = g_hash_table_lookup(fs->instances, name) != NULL;
+    g_mutex_unlock(fs->images_lock);
+    if (exists || _vmnetfs_fuse_exists(fs->fuse, name)) {
+        g_set_error(err, VMNETFS_FUSE_ERROR, VMNETFS_FUSE_ERROR_EXISTS,
+                "%s already exists", name);
+        return NULL;
+    }
+    args = read_arguments_from_chan(chan, err);
+    if (args == NULL) {
+        return NULL;
+    }
+
+    inst = g_slice_new0(struct vmnetfs_instance);
+    inst->fs = fs;
+    inst->name = g_strdup(name);
+    inst->images = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+            image_free);
+
+    /* Set up images.  Daemon-wide settings in the document are
+       ignored. */
+    xpath = make_xpath_context(args);
+    obj = xmlXPathEval(BAD_CAST "/v:config/v:image", xpath);
+    for (i = 0; obj && obj->nodesetval && i < obj->nodesetval->nodeNr; i++) {
+        if (!image_add(fs, inst->images, args, obj->nodesetval->nodeTab[i],
+                true, err)) {
+            xmlXPathFreeObject(obj);
+            xmlXPathFreeContext(xpath);
+            xmlFreeDoc(args);
+            instance_free(inst);
+            return NULL;
+        }
+    }
+    xmlXPathFreeObject(obj);
+    xmlXPathFreeContext(xpath);
+    xmlFreeDoc(args);
+    g_hash_table_foreach(inst->images, set_instance, inst);
+
+    /* Start image runtimes before the images become visible */
+    g_hash_table_foreach(inst->images, image_open, NULL);
+    if (!_vmnetfs_fuse_attach(fs->fuse, name, inst->images, instance_free,
+            inst, err)) {
+        g_hash_table_foreach(inst->images, image_close, NULL);
+        instance_free(inst);
+        return NULL;
+    }
+    g_mutex_lock(fs->images_lock);
+    g_hash_table_insert(fs->instances, inst->name, inst);
+    g_mutex_unlock(fs->images_lock);
+    return g_strdup_printf("%s/%s", fs->fuse->mountpoint, name);
+}
+
+/* Close the images attached as @name and remove their directory.  They
+   are destroyed once their open files are closed.  Calls must be
+   serialized. */
+bool _vmnetfs_detach(struct vmnetfs *fs, const char *name, GError **err)
+{
+    struct vmnetfs_instance *inst;
+
+    g_mutex_lock(fs->images_lock);
+    inst = g_hash_table_lookup(fs->instances, name);
+    if (inst != NULL) {
+        g_hash_table_remove(fs->instances, name);
+    }
+    g_mutex_unlock(fs->images_lock);
+    if (inst == NULL) {
+        g_set_error(err, VMNETFS_FUSE_ERROR, VMNETFS_FUSE_ERROR_NOT_FOUND,
+                "No instance named %s", name);
+        return false;
+    }
+    g_hash_table_foreach(inst->images, image_close, NULL);
+    return _vmnetfs_fuse_detach(fs->fuse, name, err);
+}
+
 static void *glib_loop_thread(void *data)
 {
     struct vmnetfs *fs = data;
@@ -404,8 +956,14 @@ static gboolean read_stdin(GIOChannel *source G_GNUC_UNUSED,
        blocking forever) and lazy-unmount the filesystem.  For complete
        correctness, this should disallow new image opens, wait for existing
        image fds to close, disallow new stream opens and blocking reads,
-       then lazy unmount. */
-    g_hash_table_foreach(fs->images, image_close, NULL);
+       then lazy unmount.  Finish any control command first, so that it
+       doesn't attach images we have no chance to close. */
+    _vmnetfs_proxy_close(fs);
+    _vmnetfs_control_close(fs);
+    g_mutex_lock(fs->images_lock);
+    _vmnetfs_images_foreach(fs, image_close, NULL);
+    g_mutex_unlock(fs->images_lock);
+    _vmnetfs_cache_close(fs);
     _vmnetfs_log_close(fs->log);
     _vmnetfs_fuse_terminate(fs->fuse);
     return FALSE;
@@ -429,6 +987,7 @@ static void run(FILE *pipe, const char *config_file)
     xmlXPathContextPtr xpath;
     xmlXPathObjectPtr obj;
     xmlChar *xstr;
+    char *str;
     int i;
     GError *err = NULL;
 
@@ -460,12 +1019,17 @@ static void run(FILE *pipe, const char *config_file)
     fs = g_slice_new0(struct vmnetfs);
     fs->images = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
             image_free);
+    fs->images_lock = g_mutex_new();
+    fs->origin_destroyed = g_cond_new();
+    fs->instances = g_hash_table_new(g_str_hash, g_str_equal);
+    fs->origins = g_hash_table_new(g_str_hash, g_str_equal);
 
     /* Set up images */
     xpath = make_xpath_context(args);
     obj = xmlXPathEval(BAD_CAST "/v:config/v:image", xpath);
     for (i = 0; obj && obj->nodesetval && i < obj->nodesetval->nodeNr; i++) {
-        if (!image_add(fs->images, args, obj->nodesetval->nodeTab[i], &err)) {
+        if (!image_add(fs, fs->images, args, obj->nodesetval->nodeTab[i],
+                false, &err)) {
             fprintf(pipe, "%s\n", err->message);
             xmlXPathFreeObject(obj);
             xmlXPathFreeContext(xpath);
@@ -474,6 +1038,45 @@ static void run(FILE *pipe, const char *config_file)
         }
     }
     xmlXPathFreeObject(obj);
+    fs->cache_root = xpath_get_str(xpath,
+            "/v:config/v:cache-budget/v:path/text()");
+    fs->cache_store = xpath_get_str(xpath,
+            "/v:config/v:cache-budget/v:store/text()");
+    fs->cache_limit = xpath_get_uint(xpath,
+            "/v:config/v:cache-budget/v:size/text()");
+    fs->fuse_max_threads = xpath_get_uint(xpath,
+            "/v:config/v:fuse/v:max-threads/text()");
+    fs->fuse_max_idle_threads = xpath_get_uint(xpath,
+            "/v:config/v:fuse/v:max-idle-threads/text()");
+    str = xpath_get_str(xpath, "/v:config/v:fuse/v:writeback-cache/text()");
+    fs->fuse_writeback_cache = str && (!strcmp(str, "true") ||
+            !strcmp(str, "1"));
+    g_free(str);
+    fs->control_socket = xpath_get_str(xpath,
+            "/v:config/v:control/v:socket/text()");
+    fs->proxy_address = xpath_get_str(xpath,
+            "/v:config/v:cache-proxy/v:address/text()");
+    fs->proxy_port = xpath_get_str(xpath,
+            "/v:config/v:cache-proxy/v:port/text()");
+    fs->proxy_path = xpath_get_str(xpath,
+            "/v:config/v:cache-proxy/v:path/text()");
+    fs->proxy_chunk_size = xpath_get_uint(xpath,
+            "/v:config/v:cache-proxy/v:chunk-size/text()");
+    obj = xmlXPathEval(BAD_CAST
+            "/v:config/v:cache-proxy/v:origins/v:origin/text()", xpath);
+    for (i = 0; obj && obj->nodesetval && i < obj->nodesetval->nodeNr; i++) {
+        xstr = xmlNodeGetContent(obj->nodesetval->nodeTab[i]);
+        fs->proxy_origins = g_list_prepend(fs->proxy_origins,
+                g_strdup((const char *) xstr));
+        xmlFree(xstr);
+    }
+    xmlXPathFreeObject(obj);
+    fs->peer_group = xpath_get_str(xpath,
+            "/v:config/v:peers/v:group/text()");
+    fs->peer_port = xpath_get_uint(xpath,
+            "/v:config/v:peers/v:port/text()");
+    fs->peer_interface = xpath_get_str(xpath,
+            "/v:config/v:peers/v:interface/text()");
     xmlXPathFreeContext(xpath);
 
     /* Serialize config to string.  Sensitive information has already been
@@ -488,6 +1091,18 @@ static void run(FILE *pipe, const char *config_file)
     /* Set up logging.  Log to stderr if running in foreground. */
     fs->log = _vmnetfs_log_init(config_file != NULL);
 
+    /* Start cache manager */
+    if (!_vmnetfs_cache_init(fs, &err)) {
+        fprintf(pipe, "%s\n", err->message);
+        goto out;
+    }
+
+    /* Exchange chunks with peers */
+    if (!_vmnetfs_peer_init(fs, &err)) {
+        fprintf(pipe, "%s\n", err->message);
+        goto out;
+    }
+
     /* Set up fuse */
     fs->fuse = _vmnetfs_fuse_new(fs, &err);
     if (err) {
@@ -495,6 +1110,18 @@ static void run(FILE *pipe, const char *config_file)
         goto out;
     }
 
+    /* Accept attach commands */
+    if (!_vmnetfs_control_init(fs, &err)) {
+        fprintf(pipe, "%s\n", err->message);
+        goto out;
+    }
+
+    /* Serve other clients from our caches */
+    if (!_vmnetfs_proxy_init(fs, &err)) {
+        fprintf(pipe, "%s\n", err->message);
+        goto out;
+    }
+
     /* Start main loop thread */
     loop_thread = g_thread_create(glib_loop_thread, fs, TRUE, &err);
     if (err) {
@@ -535,10 +1162,35 @@ out:
         g_idle_add(shutdown_callback, fs);
         g_thread_join(loop_thread);
     }
+    /* The evictor prunes the proxy's resources */
+    _vmnetfs_cache_stop(fs);
+    _vmnetfs_proxy_destroy(fs);
+    _vmnetfs_control_destroy(fs);
+    _vmnetfs_peer_close(fs);
+    /* Destroys attached images */
     _vmnetfs_fuse_free(fs->fuse);
+    _vmnetfs_cache_destroy(fs);
     g_hash_table_destroy(fs->images);
+    _vmnetfs_peer_destroy(fs);
+    g_hash_table_destroy(fs->instances);
+    g_hash_table_destroy(fs->origins);
+    g_cond_free(fs->origin_destroyed);
+    g_mutex_free(fs->images_lock);
     _vmnetfs_log_destroy(fs->log);
     g_free(fs->censored_config);
+    g_free(fs->cache_root);
+    g_free(fs->cache_store);
+    g_free(fs->control_socket);
+    g_free(fs->proxy_address);
+    g_free(fs->proxy_port);
+    g_free(fs->proxy_path);
+    while (fs->proxy_origins) {
+        g_free(fs->proxy_origins->data);
+        fs->proxy_origins = g_list_delete_link(fs->proxy_origins,
+                fs->proxy_origins);
+    }
+    g_free(fs->peer_group);
+    g_free(fs->peer_interface);
     g_slice_free(struct vmnetfs, fs);
     g_io_channel_unref(chan);
 }
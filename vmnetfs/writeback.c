@@ -0,0 +1,209 @@
+/*
+ * vmnetfs - virtual machine network execution virtual filesystem
+ *
+ * Copyright (C) 2006-2014 Carnegie Mellon University
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of version 2 of the GNU General Public License as published
+ * by the Free Software Foundation.  A copy of the GNU General Public License
+ * should have been distributed along with this program in the file
+ * COPYING.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ */
+
+/* Chunks fetched on demand are returned to the caller straight from the
+   fetch buffer, and are written to the pristine cache later by a
+   background thread.  Until the write lands, the chunk is not marked
+   present, and readers are served from the queued buffer.  The fetch
+   lease in the shared present map is released once the write is done,
+   successful or not. */
+
+#include <string.h>
+#include "vmnetfs-private.h"
+
+/* Amount of fetched data that may be waiting for the pristine cache
+   before fetchers are throttled */
+#define WRITEBACK_MAX_BYTES (32 << 20)
+
+struct writeback_state {
+    GMutex *lock;
+    GCond *queued;
+    GCond *retired;
+    GQueue *queue;
+    GHashTable *pending;  /* includes the item currently being written */
+    uint32_t max_items;
+    GThread *thread;
+    bool stop;
+};
+
+struct writeback_item {
+    uint64_t chunk;
+    void *buf;
+    uint32_t length;
+};
+
+static void *writeback_thread(void *data)
+{
+    struct vmnetfs_image *img = data;
+    struct writeback_state *wb = img->writeback;
+    struct writeback_item *item;
+    GError *err = NULL;
+
+    g_mutex_lock(wb->lock);
+    while (true) {
+        item = g_queue_pop_head(wb->queue);
+        if (item == NULL) {
+            /* Drain the queue before honoring a stop request */
+            if (wb->stop) {
+                break;
+            }
+            g_cond_wait(wb->queued, wb->lock);
+            continue;
+        }
+        g_mutex_unlock(wb->lock);
+
+        /* Sets the present bit on success.  On failure, the chunk will
+           simply be fetched again next time. */
+        if (!_vmnetfs_ll_pristine_write_chunk(img, item->buf, item->chunk,
+                item->length, &err)) {
+            g_warning("Couldn't write chunk %"G_GUINT64_FORMAT
+                    " to pristine cache: %s", item->chunk, err->message);
+            g_clear_error(&err);
+        }
+        _vmnetfs_shared_map_release(img, item->chunk);
+
+        g_mutex_lock(wb->lock);
+        g_hash_table_remove(wb->pending, &item->chunk);
+        g_cond_broadcast(wb->retired);
+        g_mutex_unlock(wb->lock);
+        _vmnetfs_pool_put(img, item->buf);
+        g_slice_free(struct writeback_item, item);
+        g_mutex_lock(wb->lock);
+    }
+    g_mutex_unlock(wb->lock);
+    return NULL;
+}
+
+bool _vmnetfs_writeback_init(struct vmnetfs_image *img, GError **err)
+{
+    struct writeback_state *wb;
+
+    wb = g_slice_new0(struct writeback_state);
+    wb->lock = g_mutex_new();
+    wb->queued = g_cond_new();
+    wb->retired = g_cond_new();
+    wb->queue = g_queue_new();
+    wb->pending = g_hash_table_new(g_int64_hash, g_int64_equal);
+    wb->max_items = MAX(WRITEBACK_MAX_BYTES / img->chunk_size, 1);
+    img->writeback = wb;
+
+    wb->thread = g_thread_create(writeback_thread, img, TRUE, err);
+    if (wb->thread == NULL) {
+        g_hash_table_destroy(wb->pending);
+        g_queue_free(wb->queue);
+        g_cond_free(wb->retired);
+        g_cond_free(wb->queued);
+        g_mutex_free(wb->lock);
+        g_slice_free(struct writeback_state, wb);
+        img->writeback = NULL;
+        return false;
+    }
+    return true;
+}
+
+/* Waits for queued chunks to reach the pristine cache. */
+void _vmnetfs_writeback_destroy(struct vmnetfs_image *img)
+{
+    struct writeback_state *wb = img->writeback;
+
+    g_mutex_lock(wb->lock);
+    wb->stop = true;
+    g_cond_broadcast(wb->queued);
+    g_mutex_unlock(wb->lock);
+    g_thread_join(wb->thread);
+
+    g_assert(g_hash_table_size(wb->pending) == 0);
+    g_hash_table_destroy(wb->pending);
+    g_queue_free(wb->queue);
+    g_cond_free(wb->retired);
+    g_cond_free(wb->queued);
+    g_mutex_free(wb->lock);
+    g_slice_free(struct writeback_state, wb);
+}
+
+/* Blocks while the queue is full.  This is not interruptible, but the
+   wait is bounded by local disk throughput.  Call without holding any
+   locks. */
+void _vmnetfs_writeback_throttle(struct vmnetfs_image *img)
+{
+    struct writeback_state *wb = img->writeback;
+
+    g_mutex_lock(wb->lock);
+    while (g_hash_table_size(wb->pending) >= wb->max_items) {
+        g_cond_wait(wb->retired, wb->lock);
+    }
+    g_mutex_unlock(wb->lock);
+}
+
+/* Takes ownership of @buf, which must have come from _vmnetfs_pool_get().
+   Does not block; callers should apply _vmnetfs_writeback_throttle()
+   beforehand. */
+void _vmnetfs_writeback_queue(struct vmnetfs_image *img, void *buf,
+        uint64_t chunk, uint32_t length)
+{
+    struct writeback_state *wb = img->writeback;
+    struct writeback_item *item;
+
+    g_mutex_lock(wb->lock);
+    if (g_hash_table_lookup(wb->pending, &chunk) != NULL) {
+        /* A redundant fetch of a chunk that is already queued */
+        g_mutex_unlock(wb->lock);
+        _vmnetfs_pool_put(img, buf);
+        return;
+    }
+    item = g_slice_new0(struct writeback_item);
+    item->chunk = chunk;
+    item->buf = buf;
+    item->length = length;
+    g_hash_table_replace(wb->pending, &item->chunk, item);
+    g_queue_push_tail(wb->queue, item);
+    g_cond_signal(wb->queued);
+    g_mutex_unlock(wb->lock);
+}
+
+/* If the chunk is waiting to be written to the pristine cache, copy the
+   requested range into @data and return true.  If this returns false,
+   any write of the chunk has already set the present bit.  Chunk lock
+   must be held. */
+bool _vmnetfs_writeback_read_chunk(struct vmnetfs_image *img, void *data,
+        uint64_t chunk, uint32_t offset, uint32_t length)
+{
+    struct writeback_state *wb = img->writeback;
+    struct writeback_item *item;
+
+    g_mutex_lock(wb->lock);
+    item = g_hash_table_lookup(wb->pending, &chunk);
+    if (item != NULL) {
+        g_assert(offset + length <= item->length);
+        memcpy(data, item->buf + offset, length);
+    }
+    g_mutex_unlock(wb->lock);
+    return item != NULL;
+}
+
+/* Returns true if the chunk is waiting to be written to the pristine
+   cache.  Chunk lock must be held. */
+bool _vmnetfs_writeback_contains(struct vmnetfs_image *img, uint64_t chunk)
+{
+    struct writeback_state *wb = img->writeback;
+    bool ret;
+
+    g_mutex_lock(wb->lock);
+    ret = g_hash_table_lookup(wb->pending, &chunk) != NULL;
+    g_mutex_unlock(wb->lock);
+    return ret;
+}
@@ -30,10 +30,11 @@ import os
 import pipes
 import pwd
 import re
+import shutil
 import signal
 import subprocess
 import sys
-from tempfile import NamedTemporaryFile
+from tempfile import NamedTemporaryFile, mkdtemp
 import threading
 import time
 from urlparse import urlsplit, urlunsplit
@@ -43,7 +44,7 @@ from wsgiref.handlers import format_date_time as format_rfc1123_date
 from ...domain import DomainXML
 from ...generate import copy_memory
 from ...memory import LibvirtQemuMemoryHeader
-from ...package import Package
+from ...package import Package, index_zero_chunks
 from ...source import source_open, SourceRange
 from ...util import ErrorBuffer, ensure_dir, get_cache_dir, setup_libvirt
 from .. import Controller, MachineExecutionError, MachineStateError, Statistic
@@ -63,7 +64,9 @@ LibvirtEventImpl().register()
 
 class _Image(object):
     def __init__(self, label, range, username=None, password=None,
-            chunk_size=131072, stream=False):
+            chunk_size=131072, stream=False, index=None, ram_cache=0,
+            kernel_cache=False, nbd_socket=None, cache_proxy=None,
+            fill=False, fs_prefetch=False, compress=False):
         self.label = label
         self.username = username
         self.password = password
@@ -73,6 +76,13 @@ class _Image(object):
         self.offset = range.offset
         self.size = range.length
         self.chunk_size = chunk_size
+        self.ram_cache = ram_cache
+        self.kernel_cache = kernel_cache
+        self.nbd_socket = nbd_socket
+        self.cache_proxy = cache_proxy
+        self.fill = fill
+        self.fs_prefetch = fs_prefetch
+        self.compress = compress
         self.etag = range.source.etag
         self.last_modified = range.source.last_modified
 
@@ -85,10 +95,21 @@ class _Image(object):
             'last-modified': self.last_modified.isoformat()
                     if self.last_modified else None,
         }, indent=2, sort_keys=True)
-        self._urlpath = os.path.join(get_cache_dir(), 'chunks',
-                sha256(self._cache_info).hexdigest())
+        cache_key = sha256(self._cache_info).hexdigest()
+        self._urlpath = os.path.join(get_cache_dir(), 'chunks', cache_key)
         # Hash collisions will allow cache poisoning!
         self.cache = os.path.join(self._urlpath, label, str(chunk_size))
+        # Names the cache contents to vmnetfs peers on other hosts
+        self._peer_key = '%s/%s/%d' % (cache_key, label, chunk_size)
+
+        # The chunk index is only useful if its chunks are ours
+        if index is not None and index.chunk_size == chunk_size:
+            self._index = index
+        else:
+            self._index = None
+        self._index_path = os.path.join(self._urlpath, label,
+                'index.%d' % chunk_size)
+        self._store = os.path.join(get_cache_dir(), 'store')
 
     def get_recompressed_path(self, algorithm):
         return os.path.join(self._urlpath, self.label,
@@ -107,6 +128,22 @@ class _Image(object):
             with open(info_file, 'w') as fh:
                 fh.write(self._cache_info)
 
+        # Make a local copy of the chunk index
+        if self._index is not None and not os.path.exists(self._index_path):
+            dirname = os.path.dirname(self._index_path)
+            ensure_dir(dirname)
+            with NamedTemporaryFile(dir=dirname, delete=False) as fh:
+                self._index.write_to_file(fh)
+            os.rename(fh.name, self._index_path)
+
+        # Tell vmnetfs which chunks it need never fetch
+        zero_chunks = None
+        if self._index is not None:
+            zero_chunks = ','.join(('%d' % first if first == last else
+                    '%d-%d' % (first, last)) for first, last in
+                    index_zero_chunks(self._index_path, self.chunk_size,
+                    self.size))
+
         # Return XML image element
         e = ElementMaker(namespace=VMNETFS_NS, nsmap={None: VMNETFS_NS})
         origin = e.origin(
@@ -140,18 +177,45 @@ class _Image(object):
                     c += '; HttpOnly'
                 cookies.append(e.cookie(c))
             origin.append(cookies)
-        return e.image(
+        if self.cache_proxy:
+            origin.append(e('cache-proxy', self.cache_proxy))
+        cache = e.cache(
+            e.path(self.cache),
+            e('chunk-size', str(self.chunk_size)),
+        )
+        if self.compress:
+            cache.append(e.compression('lz4'))
+        if self._index is not None:
+            cache.append(e.store(
+                e.path(self._store),
+                e.index(self._index_path),
+            ))
+            # Don't let peers share images the server wouldn't give them
+            if not self.username and not self.cookies:
+                cache.append(e('peer-key', self._peer_key))
+        fetch = e.fetch(
+            e.mode('stream' if self.stream else 'demand'),
+        )
+        if self.fill and not self.stream:
+            fetch.append(e.fill())
+        if self.fs_prefetch and not self.stream:
+            fetch.append(e('fs-prefetch'))
+        image = e.image(
             e.name(self.label),
             e.size(str(self.size)),
             origin,
-            e.cache(
-                e.path(self.cache),
-                e('chunk-size', str(self.chunk_size)),
-            ),
-            e.fetch(
-                e.mode('stream' if self.stream else 'demand'),
+            cache,
+            fetch,
+            e.memory(
+                e('ram-cache', str(self.ram_cache)),
+                e('kernel-cache', 'true' if self.kernel_cache else 'false'),
             ),
         )
+        if zero_chunks:
+            image.append(e('zero-chunks', zero_chunks))
+        if self.nbd_socket is not None:
+            image.append(e.nbd(e.socket(self.nbd_socket)))
+        return image
     # pylint: enable=protected-access
 
 
@@ -316,10 +380,48 @@ class LocalController(Controller):
     STATS = ('bytes_read', 'bytes_written', 'chunk_dirties', 'chunk_fetches',
             'io_errors')
     RECOMPRESSION_ALGORITHM = 'lzop'
+    # Whether vmnetfs should evict least-recently-used chunks to keep the
+    # chunk caches within a budget when no cache limit is set.  Off by
+    # default, since evicted chunks must be fetched again.
+    CACHE_BUDGET = False
+    # Default limit on the size of the chunk caches, as a fraction of the
+    # size of their filesystem
+    CACHE_LIMIT_FRACTION = 0.25
+    # Size of vmnetfs's in-memory chunk cache for the disk image, since
+    # guest disk reads bypass the host page cache
+    DISK_RAM_CACHE = 64 << 20
+    # Whether the host page cache may hold disk image data.  Off by
+    # default, since guest reads served from it would not show up in
+    # the vmnetfs statistics.
+    DISK_KERNEL_CACHE = False
+    # Whether qemu should reach the disk image through vmnetfs's NBD
+    # export rather than through the FUSE filesystem
+    DISK_NBD = False
+    # Base URL of a vmnetfs cache proxy shared by the machines at this
+    # site, if any
+    CACHE_PROXY = None
+    # (multicast group, port) on which to exchange chunks with vmnetfs
+    # instances on other hosts, if any
+    PEER_DISCOVERY = None
+    # Whether to fetch the disk image in the background while the memory
+    # image is restoring.  Costs bandwidth for disk chunks the guest may
+    # never read.
+    DISK_WARM = False
+    # Whether to fetch the rest of the disk image into the cache while
+    # the network is otherwise idle, so that later sessions don't stall
+    # on chunks this one never read
+    DISK_FILL = False
+    # Whether to parse the guest filesystems in the disk image and
+    # prefetch the rest of a file when the guest starts reading it
+    DISK_FS_PREFETCH = False
+    # Whether vmnetfs should store the disk image cache LZ4-compressed.
+    # Saves space, but every read of a compressed chunk decompresses the
+    # whole chunk.
+    DISK_CACHE_COMPRESS = False
     _environment_ready = False
 
     def __init__(self, url=None, package=None, use_spice=True,
-            viewer_password=None):
+            viewer_password=None, vmnetfs=None):
         Controller.__init__(self)
         self._url = url
         self._want_spice = use_spice
@@ -327,7 +429,11 @@ class LocalController(Controller):
         self._package = package
         self._have_memory = False
         self._memory_image_path = None
+        # Shared vmnetfs daemon from start_vmnetfs_daemon(), or None to
+        # run a private one
+        self._vmnetfs = vmnetfs
         self._fs = None
+        self._nbd_dir = None
         self._conn = None
         self._conn_callbacks = []
         self._startup_running = False
@@ -337,6 +443,51 @@ class LocalController(Controller):
         self._monitors = []
         self._load_monitor = None
         self.viewer_password = viewer_password
+        # Maximum size of the chunk caches in bytes, or None for the default
+        # given by CACHE_BUDGET
+        self.cache_limit = None
+
+    @classmethod
+    def _get_cache_budget(cls, limit=None):
+        if limit is None and not cls.CACHE_BUDGET:
+            return None
+        cache_dir = get_cache_dir()
+        chunk_dir = os.path.join(cache_dir, 'chunks')
+        if limit is None:
+            st = os.statvfs(cache_dir)
+            limit = int(st.f_blocks * st.f_frsize * cls.CACHE_LIMIT_FRACTION)
+        e = ElementMaker(namespace=VMNETFS_NS, nsmap={None: VMNETFS_NS})
+        return e('cache-budget',
+            e.path(chunk_dir),
+            e.store(os.path.join(cache_dir, 'store')),
+            e.size(str(limit)),
+        )
+
+    @classmethod
+    def _get_peers(cls):
+        group, port = cls.PEER_DISCOVERY
+        e = ElementMaker(namespace=VMNETFS_NS, nsmap={None: VMNETFS_NS})
+        return e.peers(
+            e.group(group),
+            e.port(str(port)),
+        )
+
+    @classmethod
+    def start_vmnetfs_daemon(cls, control_socket, cache_limit=None):
+        '''Start a vmnetfs with no images of its own, listening for
+        controllers on @control_socket.  Controllers given the returned
+        VMNetFS share its pristine caches and fetches, so that many VMs
+        running the same package only download each chunk once.'''
+        e = ElementMaker(namespace=VMNETFS_NS, nsmap={None: VMNETFS_NS})
+        config = e.config(e.control(e.socket(control_socket)))
+        budget = cls._get_cache_budget(cache_limit)
+        if budget is not None:
+            config.insert(0, budget)
+        if cls.PEER_DISCOVERY is not None:
+            config.append(cls._get_peers())
+        fs = VMNetFS(config)
+        fs.start()
+        return fs
 
     @Controller._ensure_state(Controller.STATE_UNINITIALIZED)
     def initialize(self):
@@ -357,11 +508,26 @@ class LocalController(Controller):
         # Create vmnetfs config
         e = ElementMaker(namespace=VMNETFS_NS, nsmap={None: VMNETFS_NS})
         vmnetfs_config = e.config()
+        if self.DISK_NBD:
+            self._nbd_dir = mkdtemp(prefix='vmnetx-nbd-')
+            disk_nbd_socket = os.path.join(self._nbd_dir, 'disk')
+        else:
+            disk_nbd_socket = None
         vmnetfs_config.append(_Image('disk', package.disk,
-                username=self.username, password=self.password).vmnetfs_config)
+                username=self.username, password=self.password,
+                index=package.disk.index,
+                ram_cache=self.DISK_RAM_CACHE,
+                kernel_cache=self.DISK_KERNEL_CACHE,
+                nbd_socket=disk_nbd_socket,
+                cache_proxy=self.CACHE_PROXY,
+                fill=self.DISK_FILL,
+                fs_prefetch=self.DISK_FS_PREFETCH,
+                compress=self.DISK_CACHE_COMPRESS).vmnetfs_config)
         if package.memory:
             image = _Image('memory', package.memory, username=self.username,
-                    password=self.password, stream=True)
+                    password=self.password, stream=True,
+                    index=package.memory.index,
+                    cache_proxy=self.CACHE_PROXY)
             # Use recompressed memory image if available
             recompressed_path = image.get_recompressed_path(
                     self.RECOMPRESSION_ALGORITHM)
@@ -374,10 +540,19 @@ class LocalController(Controller):
                         stream=True)
             vmnetfs_config.append(image.vmnetfs_config)
 
-        # Start vmnetfs
-        self._fs = VMNetFS(vmnetfs_config)
-        self._fs.start()
-        log_path = os.path.join(self._fs.mountpoint, 'log')
+        # Start vmnetfs, or attach to the shared one
+        if self._vmnetfs is not None:
+            self._fs = self._vmnetfs.attach(self._domain_name,
+                    vmnetfs_config)
+        else:
+            budget = self._get_cache_budget(self.cache_limit)
+            if budget is not None:
+                vmnetfs_config.append(budget)
+            if self.PEER_DISCOVERY is not None:
+                vmnetfs_config.append(self._get_peers())
+            self._fs = VMNetFS(vmnetfs_config)
+            self._fs.start()
+        log_path = self._fs.log_path
         disk_path = os.path.join(self._fs.mountpoint, 'disk')
         disk_image_path = os.path.join(disk_path, 'image')
         if package.memory:
@@ -389,6 +564,8 @@ class LocalController(Controller):
                         self._memory_image_path, recompressed_path)
         else:
             memory_path = self._memory_image_path = None
+        self._disk_control_path = os.path.join(disk_path, 'control')
+        self._disk_image_size = os.stat(disk_image_path).st_size
 
         # Set up libvirt connection
         self._conn = libvirt.open('qemu:///session')
@@ -413,7 +590,8 @@ class LocalController(Controller):
         self._domain_xml = domain_xml.get_for_execution(self._domain_name,
                 emulator, disk_image_path, self.viewer_password,
                 use_spice=self.use_spice,
-                allow_qxl=self._qxl_is_usable(emulator)).xml
+                allow_qxl=self._qxl_is_usable(emulator),
+                disk_nbd_socket=disk_nbd_socket).xml
 
         # Write domain XML to memory image
         if self._memory_image_path is not None:
@@ -557,6 +735,12 @@ class LocalController(Controller):
             have_memory = self._have_memory
             try:
                 if have_memory:
+                    if self.DISK_WARM:
+                        # Low priority, below other prefetch requests.
+                        # vmnetfs runs demand fetches ahead of queued
+                        # prefetch chunks, but not of ones in flight.
+                        self._disk_control('prefetch 0+%d -1' %
+                                self._disk_image_size)
                     watchdog = _QemuWatchdog(self._domain_name)
                     try:
                         # Does not return domain handle
@@ -566,6 +750,8 @@ class LocalController(Controller):
                                 libvirt.VIR_DOMAIN_SAVE_RUNNING)
                     finally:
                         watchdog.stop()
+                        if self.DISK_WARM:
+                            self._disk_control('cancel')
                     domain = self._conn.lookupByName(self._domain_name)
                 else:
                     domain = self._conn.createXML(self._domain_xml,
@@ -603,6 +789,14 @@ class LocalController(Controller):
             self._startup_running = False
     # pylint: enable=bare-except
 
+    def _disk_control(self, command):
+        try:
+            with open(self._disk_control_path, 'w') as fh:
+                fh.write(command + '\n')
+        except IOError, e:
+            _log.warning('Disk control command "%s" failed: %s', command,
+                    e)
+
     def _load_progress(self, _obj, count, total):
         if self._have_memory and self.state == self.STATE_STARTING:
             self.emit('startup-progress', count, total)
@@ -660,5 +854,8 @@ class LocalController(Controller):
         if self._fs is not None:
             self._fs.terminate()
             self._fs = None
+        if self._nbd_dir is not None:
+            shutil.rmtree(self._nbd_dir, ignore_errors=True)
+            self._nbd_dir = None
         self.state = self.STATE_DESTROYED
 gobject.type_register(LocalController)
@@ -17,6 +17,7 @@
 
 from lxml import etree
 import os
+import socket
 import subprocess
 
 from ...util import DetailException
@@ -42,19 +43,31 @@ class VMNetFSError(DetailException):
     pass
 
 
+def _serialize(tree):
+    try:
+        schema.assertValid(tree)
+    except etree.DocumentInvalid, e:
+        raise VMNetFSError('Argument XML does not validate', str(e))
+    return etree.tostring(tree, pretty_print=True, encoding='UTF-8',
+            xml_declaration=True)
+
+
 class VMNetFS(object):
     def __init__(self, tree):
-        try:
-            schema.assertValid(tree)
-        except etree.DocumentInvalid, e:
-            raise VMNetFSError('Argument XML does not validate', str(e))
-
         self._vmnetfs_path = os.path.join(libexecdir, 'vmnetfs')
-        self._args = etree.tostring(tree, pretty_print=True, encoding='UTF-8',
-                xml_declaration=True)
+        self._args = _serialize(tree)
+        control = tree.find(NSP + 'control')
+        if control is not None:
+            self._control_path = control.find(NSP + 'socket').text
+        else:
+            self._control_path = None
         self._pipe = None
         self.mountpoint = None
 
+    @property
+    def log_path(self):
+        return os.path.join(self.mountpoint, 'log')
+
     def start(self):
         read, write = os.pipe()
         try:
@@ -85,3 +98,54 @@ class VMNetFS(object):
         if self._pipe is not None:
             self._pipe.close()
             self._pipe = None
+
+    def _command(self, command, want_path=False):
+        if self._control_path is None:
+            raise VMNetFSError('vmnetfs has no control socket')
+        sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        try:
+            sock.connect(self._control_path)
+            sock.sendall(command)
+            fh = sock.makefile('r')
+            status = fh.readline()
+            if status != '\n':
+                raise VMNetFSError(status.strip() or
+                        'vmnetfs closed the control connection')
+            if want_path:
+                return fh.readline().strip()
+        except socket.error, e:
+            raise VMNetFSError('Could not contact vmnetfs', str(e))
+        finally:
+            sock.close()
+
+    def attach(self, name, tree):
+        '''Attach the images in the config @tree in a directory @name,
+        sharing pristine caches with other attached images.  Returns a
+        VMNetFSAttachment.'''
+        args = _serialize(tree)
+        mountpoint = self._command('attach %s\n%d\n%s' % (name,
+                len(args), args), want_path=True)
+        return VMNetFSAttachment(self, name, mountpoint)
+
+    def detach(self, name):
+        self._command('detach %s\n' % name)
+
+
+class VMNetFSAttachment(object):
+    '''A set of images attached to a running VMNetFS, with the same
+    interface as a VMNetFS of its own.'''
+
+    def __init__(self, fs, name, mountpoint):
+        self._fs = fs
+        self._name = name
+        self.mountpoint = mountpoint
+        self.log_path = fs.log_path
+
+    def terminate(self):
+        if self._fs is not None:
+            try:
+                self._fs.detach(self._name)
+            except VMNetFSError:
+                # The daemon may already be gone
+                pass
+            self._fs = None
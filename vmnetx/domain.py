@@ -61,10 +61,15 @@ class DomainXML(object):
         self.xml = xml
         self._validate(mode=validate, safe=safe)
 
-        # Get disk path and type
+        # Get disk path and type.  A disk attached over NBD (see
+        # get_for_execution()) has the path of the NBD socket instead.
         tree = etree.fromstring(xml)
         in_disk = self._xpath_one(tree, '/domain/devices/disk[@device="disk"]')
-        self.disk_path = self._xpath_one(in_disk, 'source/@file')
+        if in_disk.get('type') == 'network':
+            self.disk_path = self._xpath_one(in_disk,
+                    'source[@protocol="nbd"]/host/@socket')
+        else:
+            self.disk_path = self._xpath_one(in_disk, 'source/@file')
         self.disk_type = self._xpath_one(in_disk, 'driver/@type')
 
         # Extract vmnetx-specific metadata
@@ -186,7 +191,8 @@ class DomainXML(object):
                 etree.fromstring(self.xml)).path
 
     def get_for_execution(self, name, emulator, disk_image_path,
-            viewer_password, use_spice=True, allow_qxl=True):
+            viewer_password, use_spice=True, allow_qxl=True,
+            disk_nbd_socket=None):
         # Parse XML
         tree = etree.fromstring(self.xml)
 
@@ -201,9 +207,25 @@ class DomainXML(object):
         self._xpath_one(tree, '/domain/devices/emulator').text = emulator
 
         # Update path to hard disk
+        source_node = self._xpath_one(tree,
+                '/domain/devices/disk[@device="disk"]/source')
+        if disk_nbd_socket is None:
+            source_node.set('file', disk_image_path)
+        else:
+            # Attach the disk to vmnetfs's NBD export instead
+            source_node.getparent().set('type', 'network')
+            for attr in source_node.keys():
+                del source_node.attrib[attr]
+            source_node.set('protocol', 'nbd')
+            host_node = etree.SubElement(source_node, 'host')
+            host_node.set('transport', 'unix')
+            host_node.set('socket', disk_nbd_socket)
+
+        # Pass guest discards through to vmnetfs, so that freed chunks
+        # are dropped from the modified cache and never fetched
         self._xpath_one(tree,
-                '/domain/devices/disk[@device="disk"]/source').set('file',
-                disk_image_path)
+                '/domain/devices/disk[@device="disk"]/driver').set('discard',
+                'unmap')
 
         # Remove graphics declarations
         devices_node = self._xpath_one(tree, '/domain/devices')
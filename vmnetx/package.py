@@ -15,6 +15,13 @@
 # for more details.
 #
 
+try:
+    from hashlib import blake2b
+except ImportError:
+    try:
+        from pyblake2 import blake2b
+    except ImportError:
+        blake2b = None
 from lxml import etree
 from lxml.builder import ElementMaker
 import os
@@ -33,6 +40,12 @@ MANIFEST_FILENAME = 'vmnetx-package.xml'
 DOMAIN_FILENAME = 'domain.xml'
 DISK_FILENAME = 'disk.img'
 MEMORY_FILENAME = 'memory.img'
+DISK_INDEX_FILENAME = 'disk.index'
+MEMORY_INDEX_FILENAME = 'memory.index'
+
+# Must match the chunk size used by the local controller
+INDEX_CHUNK_SIZE = 131072
+INDEX_DIGEST_SIZE = 32
 
 
 # We want this to be a public attribute
@@ -45,6 +58,31 @@ class BadPackageError(DetailException):
     pass
 
 
+def index_zero_chunks(path, chunk_size, image_size):
+    # Return a list of (first, last) ranges of chunks that the index at
+    # path says contain only zero bytes
+    if blake2b is None:
+        return []
+    chunks = (image_size + chunk_size - 1) // chunk_size
+    full = blake2b('\0' * chunk_size,
+            digest_size=INDEX_DIGEST_SIZE).digest()
+    tail = blake2b('\0' * (image_size - (chunks - 1) * chunk_size),
+            digest_size=INDEX_DIGEST_SIZE).digest()
+    ranges = []
+    with open(path, 'rb') as fh:
+        for chunk in xrange(chunks):
+            digest = fh.read(INDEX_DIGEST_SIZE)
+            if len(digest) < INDEX_DIGEST_SIZE:
+                break
+            if digest != (tail if chunk == chunks - 1 else full):
+                continue
+            if ranges and ranges[-1][1] == chunk - 1:
+                ranges[-1] = (ranges[-1][0], chunk)
+            else:
+                ranges.append((chunk, chunk))
+    return ranges
+
+
 class _PackageMember(SourceRange):
     def __init__(self, zip, path, load_data=False):
         source = zip.fp
@@ -72,6 +110,23 @@ class _PackageMember(SourceRange):
                 info.file_size, load_data)
 
 
+class _PackageIndex(_PackageMember):
+    def __init__(self, zip, path, chunk_size):
+        _PackageMember.__init__(self, zip, path)
+        self.chunk_size = chunk_size
+
+
+class _PackageImage(_PackageMember):
+    def __init__(self, zip, element):
+        _PackageMember.__init__(self, zip, element.get('path'))
+        index_path = element.get('index-path')
+        chunk_size = element.get('index-chunk-size')
+        if index_path is not None and chunk_size is not None:
+            self.index = _PackageIndex(zip, index_path, int(chunk_size))
+        else:
+            self.index = None
+
+
 class Package(object):
     def __init__(self, source):
         self.url = source.url
@@ -89,11 +144,10 @@ class Package(object):
             self.name = tree.get('name')
             self.domain = _PackageMember(zip,
                     tree.find(NSP + 'domain').get('path'), True)
-            self.disk = _PackageMember(zip,
-                    tree.find(NSP + 'disk').get('path'))
+            self.disk = _PackageImage(zip, tree.find(NSP + 'disk'))
             memory = tree.find(NSP + 'memory')
             if memory is not None:
-                self.memory = _PackageMember(zip, memory.get('path'))
+                self.memory = _PackageImage(zip, memory)
             else:
                 self.memory = None
         except etree.XMLSyntaxError, e:
@@ -101,17 +155,41 @@ class Package(object):
         except (zipfile.BadZipfile, SourceError), e:
             raise BadPackageError(str(e))
 
+    @staticmethod
+    def _build_index(path):
+        # Digest of each chunk, for lookups in the vmnetfs content store
+        digests = []
+        with open(path, 'rb') as fh:
+            while True:
+                buf = fh.read(INDEX_CHUNK_SIZE)
+                if not buf:
+                    break
+                digests.append(blake2b(buf,
+                        digest_size=INDEX_DIGEST_SIZE).digest())
+        return ''.join(digests)
+
     @classmethod
     def create(cls, out, name, domain_xml, disk_path, memory_path=None):
+        # Build chunk indexes if we can
+        indexes = blake2b is not None
+        if indexes:
+            index_attrs = lambda path: {
+                'index-path': path,
+                'index-chunk-size': str(INDEX_CHUNK_SIZE),
+            }
+        else:
+            index_attrs = lambda path: {}
+
         # Generate manifest XML
         e = ElementMaker(namespace=NS, nsmap={None: NS})
         tree = e.image(
             e.domain(path=DOMAIN_FILENAME),
-            e.disk(path=DISK_FILENAME),
+            e.disk(path=DISK_FILENAME, **index_attrs(DISK_INDEX_FILENAME)),
             name=name,
         )
         if memory_path:
-            tree.append(e.memory(path=MEMORY_FILENAME))
+            tree.append(e.memory(path=MEMORY_FILENAME,
+                    **index_attrs(MEMORY_INDEX_FILENAME)))
         schema.assertValid(tree)
         xml = etree.tostring(tree, encoding='UTF-8', pretty_print=True,
                 xml_declaration=True)
@@ -121,6 +199,11 @@ class Package(object):
         zip.comment = 'VMNetX package'
         zip.writestr(MANIFEST_FILENAME, xml)
         zip.writestr(DOMAIN_FILENAME, domain_xml)
+        if indexes:
+            if memory_path is not None:
+                zip.writestr(MEMORY_INDEX_FILENAME,
+                        cls._build_index(memory_path))
+            zip.writestr(DISK_INDEX_FILENAME, cls._build_index(disk_path))
         if memory_path is not None:
             zip.write(memory_path, MEMORY_FILENAME)
         zip.write(disk_path, DISK_FILENAME)
@@ -25,7 +25,9 @@ import glib
 import gobject
 import logging
 import os
+import shutil
 import socket
+from tempfile import mkdtemp
 from threading import Thread, Lock, Event
 import time
 
@@ -242,7 +244,7 @@ class _Instance(gobject.GObject):
         'destroy': (gobject.SIGNAL_RUN_LAST, gobject.TYPE_NONE, ()),
     }
 
-    def __init__(self, package, username, password, user_ident):
+    def __init__(self, package, username, password, user_ident, vmnetfs):
         # Called from HTTP worker thread
         gobject.GObject.__init__(self)
         self.id = base64.b32encode(os.urandom(10))
@@ -251,6 +253,7 @@ class _Instance(gobject.GObject):
         self._package = package
         self._username = username
         self._password = password
+        self._vmnetfs = vmnetfs
         self._controller_future = None
         self._controller = None
         self._conns = set()
@@ -285,7 +288,7 @@ class _Instance(gobject.GObject):
         assert self._controller is None
         try:
             controller = LocalController(package=self._package,
-                    viewer_password=self.token)
+                    viewer_password=self.token, vmnetfs=self._vmnetfs)
             controller.username = self._username
             controller.password = self._password
             controller.initialize()
@@ -420,6 +423,8 @@ class VMNetXServer(gobject.GObject):
         self._listen = None
         self._listen_source = None
         self._gc_timer = None
+        self._vmnetfs = None
+        self._vmnetfs_dir = None
         self._shutting_down = False
         self.running = False
 
@@ -427,6 +432,12 @@ class VMNetXServer(gobject.GObject):
         # Prepare environment for local controllers
         LocalController.setup_environment()
 
+        # Start a vmnetfs shared by all instances, so that instances of
+        # the same package share one pristine cache
+        self._vmnetfs_dir = mkdtemp(prefix='vmnetx-server-')
+        self._vmnetfs = LocalController.start_vmnetfs_daemon(
+                os.path.join(self._vmnetfs_dir, 'vmnetfs'))
+
         http_server = HttpServer(self._options, self)
         host = self._options['http_host']
         port = self._options['http_port']
@@ -496,7 +507,7 @@ class VMNetXServer(gobject.GObject):
     def _create_instance(self, package, user_ident):
         # Called from event loop thread
         instance = _Instance(package, self._options['username'],
-                self._options['password'], user_ident)
+                self._options['password'], user_ident, self._vmnetfs)
         self._instances[instance.id] = instance
         instance.connect('destroy', self._destroy_instance_cb)
         return (instance.id, instance.token)
@@ -574,5 +585,11 @@ class VMNetXServer(gobject.GObject):
         if (self._shutting_down and not self._instances
                 and not self._unauthenticated_conns):
             self._shutting_down = False
+            if self._vmnetfs is not None:
+                self._vmnetfs.terminate()
+                self._vmnetfs = None
+            if self._vmnetfs_dir is not None:
+                shutil.rmtree(self._vmnetfs_dir, ignore_errors=True)
+                self._vmnetfs_dir = None
             self.emit('shutdown')
 gobject.type_register(VMNetXServer)